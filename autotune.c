@@ -0,0 +1,213 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "autotune.h"
+#include "depthmap_opencl.h"
+#include "depthmap_opencl_amd.h"
+#include "doubleTime.h"
+#include "synth.h"
+
+/* Runs per configuration, fastest one counts */
+#define TUNE_REPEATS 3
+
+/* Session of the version being tuned and the synthetic pair */
+struct tuneTarget {
+    struct session_opencl_basic *basic;
+    struct session_opencl_amd *amd;
+    struct synthPair pair;
+    unsigned int blockx, blocky, disp_limit, factor;
+    searchMethod_ocl select;
+
+    /* Depthmap with default parameters */
+    unsigned char *reference;
+    size_t resultSize;
+};
+
+/* Generates a depthmap of the synthetic pair with conf. NULL on failure. */
+static void *runConfig(struct tuneTarget *t, const struct tuneConfig *conf) {
+
+    if (t->basic != NULL) {
+        setTuning_opencl_basic(t->basic, conf, 1);
+        return sessionDepthmap_opencl_basic(t->basic,
+                                            t->pair.img0, t->pair.img1,
+                                            AUTOTUNE_WIDTH, AUTOTUNE_HEIGHT,
+                                            t->blockx, t->blocky, t->disp_limit,
+                                            t->select, DISP_GREY8, SUBPIXEL_NONE,
+                                            t->factor);
+    }
+    setTuning_opencl_amd(t->amd, conf, 1);
+    return sessionDepthmap_opencl_amd(t->amd, t->pair.img0, t->pair.img1,
+                                      AUTOTUNE_WIDTH, AUTOTUNE_HEIGHT,
+                                      t->blockx, t->blocky, t->disp_limit,
+                                      t->select, DISP_GREY8, SUBPIXEL_NONE,
+                                      t->factor);
+}
+
+/* Fastest of TUNE_REPEATS runs in ms. Negative if configuration failed or
+ * its depthmap differs from the reference. */
+static double measure(struct tuneTarget *t, const struct tuneConfig *conf,
+                      const char *label) {
+    double time1, time2, best;
+    unsigned char *res;
+    int i;
+
+    best = -1.0;
+    for (i=0; i < TUNE_REPEATS; i++) {
+        time1 = doubleTime();
+        res = runConfig(t, conf);
+        time2 = doubleTime();
+        if (res == NULL) {
+            printf("%-40s failed\n", label);
+            return -1.0;
+        }
+        if (memcmp(res, t->reference, t->resultSize) != 0) {
+            printf("%-40s different depthmap\n", label);
+            free(res);
+            return -1.0;
+        }
+        free(res);
+        if (best < 0.0 || (time2-time1)*1e3 < best)
+            best = (time2-time1)*1e3;
+    }
+    printf("%-40s%6.1f ms.\n", label, best);
+
+    return best;
+}
+
+/* Keeps conf if it was faster than the best so far */
+static void tryConfig(struct tuneTarget *t, const struct tuneConfig *conf,
+                      const char *label, struct tuneConfig *best,
+                      double *bestTime, char *bestLabel) {
+    double time;
+
+    time = measure(t, conf, label);
+    if (time >= 0.0 && time < (*bestTime)) {
+        (*best) = (*conf);
+        (*bestTime) = time;
+        strcpy(bestLabel, label);
+    }
+}
+
+int autotune_opencl(unsigned int version,
+                    unsigned int blockx, unsigned int blocky,
+                    unsigned int disp_limit, searchMethod_ocl select,
+                    unsigned int factor) {
+    /* Work-groups of znccTiled, basic version */
+    const unsigned int tiles[][2] = {{8, 8}, {16, 4}, {16, 8}, {32, 2},
+                                     {32, 4}, {64, 1}, {64, 2}, {128, 1}};
+    /* Work-group widths of zncc without tiles, 0 lets runtime choose */
+    const unsigned int znccLocals[] = {0, 1, 8, 16, 32, 64};
+    /* constructDmaps work-group widths and window bands, Amd version */
+    const unsigned int dmapsLocals[] = {1, 2, 4, 8, 16, 32, 64};
+    const unsigned int bands[] = {1, 2, 4, 8};
+
+    struct tuneTarget t;
+    struct tuneConfig defaults = TUNE_DEFAULTS, conf, best;
+    double bestTime;
+    char label[64], bestLabel[64];
+    unsigned int i, j, maxDisp;
+    int error;
+
+    if (version < 1 || version > 4) {
+        fprintf(stderr, "Autotuning needs an OpenCL version (-a)!\n");
+        return EXIT_FAILURE;
+    }
+
+    memset(&t, 0, sizeof(t));
+    t.blockx = blockx;
+    t.blocky = blocky;
+    t.disp_limit = disp_limit;
+    t.select = select;
+    t.factor = factor;
+    t.resultSize = (AUTOTUNE_WIDTH/factor)*(AUTOTUNE_HEIGHT/factor);
+    /* Disparitys within the limit where the pair allows */
+    maxDisp = (AUTOTUNE_WIDTH/factor - 1)/2;
+    if (disp_limit < maxDisp)
+        maxDisp = (disp_limit < 8) ? 8 : disp_limit;
+    if (synthGenerate(&t.pair, SYNTH_TEXTURE, AUTOTUNE_WIDTH, AUTOTUNE_HEIGHT,
+                      factor, maxDisp, 12345) == EXIT_FAILURE) {
+        fprintf(stderr, "Couldn't generate the synthetic pair!\n");
+        return EXIT_FAILURE;
+    }
+
+    if (version < 3)
+        t.basic = createSession_opencl_basic(version);
+    else
+        t.amd = createSession_opencl_amd(version-2);
+    if (t.basic == NULL && t.amd == NULL) {
+        synthFree(&t.pair);
+        return EXIT_FAILURE;
+    }
+
+    printf("Autotuning on a %ux%u synthetic pair.\n", AUTOTUNE_WIDTH, AUTOTUNE_HEIGHT);
+
+    /* Reference depthmap, also allocates the buffers */
+    t.reference = runConfig(&t, &defaults);
+    if (t.reference == NULL) {
+        fprintf(stderr, "Depthmap with default parameters failed!\n");
+        error = EXIT_FAILURE;
+        goto release;
+    }
+
+    best = defaults;
+    strcpy(bestLabel, "defaults:");
+    bestTime = measure(&t, &defaults, bestLabel);
+    if (bestTime < 0.0) {
+        error = EXIT_FAILURE;
+        goto release;
+    }
+
+    if (t.basic != NULL) {
+        for (i=0; i < sizeof(tiles)/sizeof(tiles[0]); i++) {
+            conf = defaults;
+            conf.tileX = tiles[i][0];
+            conf.tileY = tiles[i][1];
+            snprintf(label, sizeof(label), "zncc tiles %ux%u:", conf.tileX, conf.tileY);
+            tryConfig(&t, &conf, label, &best, &bestTime, bestLabel);
+        }
+        for (i=0; i < sizeof(znccLocals)/sizeof(znccLocals[0]); i++) {
+            conf = defaults;
+            conf.tileX = 0;
+            conf.znccLocal = znccLocals[i];
+            if (conf.znccLocal == 0)
+                snprintf(label, sizeof(label), "zncc without tiles, runtime local:");
+            else
+                snprintf(label, sizeof(label), "zncc without tiles, local %u:",
+                         conf.znccLocal);
+            tryConfig(&t, &conf, label, &best, &bestTime, bestLabel);
+        }
+    }
+    else {
+        for (i=0; i < sizeof(bands)/sizeof(bands[0]); i++) {
+            for (j=0; j < sizeof(dmapsLocals)/sizeof(dmapsLocals[0]); j++) {
+                conf = defaults;
+                conf.bands = bands[i];
+                conf.dmapsLocal = dmapsLocals[j];
+                snprintf(label, sizeof(label), "%u bands, constructDmaps local %u:",
+                         conf.bands, conf.dmapsLocal);
+                tryConfig(&t, &conf, label, &best, &bestTime, bestLabel);
+            }
+        }
+    }
+
+    printf("\nFastest: %s %.1f ms.\n", bestLabel, bestTime);
+    if (t.basic != NULL) {
+        setTuning_opencl_basic(t.basic, &best, 0);
+        error = saveTuning_opencl_basic(t.basic);
+    }
+    else {
+        setTuning_opencl_amd(t.amd, &best, 0);
+        error = saveTuning_opencl_amd(t.amd);
+    }
+    if (error == EXIT_SUCCESS)
+        printf("Saved for the device, later runs load it.\n");
+
+release:
+    releaseSession_opencl_basic(t.basic);
+    releaseSession_opencl_amd(t.amd);
+    free(t.reference);
+    synthFree(&t.pair);
+
+    return error;
+}
@@ -0,0 +1,20 @@
+#ifndef AUTOTUNE_H
+#define AUTOTUNE_H
+
+#include "common_opencl.h"
+
+/* Size of the synthetic stereo-pair used for tuning */
+#define AUTOTUNE_WIDTH 1920
+#define AUTOTUNE_HEIGHT 1080
+
+/* Sweeps launch parameters of an OpenCL version (1-4 as with -a) on a
+ * synthetic pair with given matching parameters. Every configuration has to
+ * produce the same depthmap as the defaults, the fastest of them is saved
+ * for the device and loaded by later sessions.
+ * Returns EXIT_SUCCESS or EXIT_FAILURE. */
+int autotune_opencl(unsigned int version,
+                    unsigned int blockx, unsigned int blocky,
+                    unsigned int disp_limit, searchMethod_ocl select,
+                    unsigned int factor);
+
+#endif
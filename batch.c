@@ -0,0 +1,426 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include "lodepng.h"
+#include "batch.h"
+#include "queue.h"
+#include "doubleTime.h"
+
+/* Items waiting between two stages. Keeps memory bounded to a few pairs. */
+#define STAGE_QUEUE_DEPTH 1
+
+struct threadData {
+    unsigned int error;
+    unsigned char *image;
+    unsigned int w;
+    unsigned int h;
+    char *name;
+};
+
+struct pairList {
+    struct stereoPair **pairs;
+    int count;
+    int allocated;
+};
+
+/* Bookkeeping for one pipeline stage */
+struct stageData {
+    struct pairList *list;
+    struct queue *in;
+    struct queue *out;
+    processFunc process;
+    saveFunc save;
+    void *args;
+
+    double busy;
+    int done;
+    int failed;
+};
+
+void *imageLoader(void *data) {
+    struct threadData *thData;
+
+    thData = (struct threadData *)data;
+    thData->error = lodepng_decode32_file(&thData->image, &thData->w, &thData->h, thData->name);
+    if (thData->error) {
+        fprintf(stderr, "error %u: %s (%s)\n", thData->error,
+                lodepng_error_text(thData->error), thData->name);
+    }
+    return NULL;
+}
+
+int loadPair(struct stereoPair *pair) {
+    struct threadData thread0, thread1;
+    pthread_t helperThread;
+
+    thread0.name = pair->name0;
+    thread1.name = pair->name1;
+    thread0.image = NULL;
+    thread1.image = NULL;
+    /* Launch thread to decode another image */
+    pthread_create(&helperThread, NULL, imageLoader, (void *)&thread1);
+    /* Decode image also in calling thread. */
+    imageLoader((void *)&thread0);
+
+    /* Wait thread to finish before proceeding. */
+    pthread_join(helperThread, NULL);
+    if (thread0.error || thread1.error) {
+        free(thread0.image);
+        free(thread1.image);
+        return EXIT_FAILURE;
+    }
+
+    if ((thread0.w != thread1.w) || (thread0.h != thread1.h)) {
+        fprintf(stderr, "Image dimensions did not match! (%s)\n", pair->name0);
+        free(thread0.image);
+        free(thread1.image);
+        return EXIT_FAILURE;
+    }
+
+    pair->img0 = thread0.image;
+    pair->img1 = thread1.image;
+    pair->w = thread0.w;
+    pair->h = thread0.h;
+
+    return EXIT_SUCCESS;
+}
+
+void freePair(struct stereoPair *pair) {
+    free(pair->name0);
+    free(pair->name1);
+    free(pair->outName);
+    free(pair->img0);
+    free(pair->img1);
+    free(pair->depthmap);
+    free(pair);
+}
+
+/* Returns malloc'd concatenation of a and b. */
+static char *joinStr(const char *a, const char *b) {
+    char *str;
+
+    str = malloc(strlen(a)+strlen(b)+1);
+    if (str == NULL)
+        return NULL;
+    strcpy(str, a);
+    strcat(str, b);
+    return str;
+}
+
+static int addPair(struct pairList *list, const char *name0, const char *name1,
+                   const char *outName) {
+    struct stereoPair *pair, **grown;
+
+    if (list->count == list->allocated) {
+        list->allocated = list->allocated ? list->allocated*2 : 16;
+        grown = realloc(list->pairs, sizeof(struct stereoPair *)*list->allocated);
+        if (grown == NULL)
+            return EXIT_FAILURE;
+        list->pairs = grown;
+    }
+
+    pair = calloc(1, sizeof(struct stereoPair));
+    if (pair == NULL)
+        return EXIT_FAILURE;
+    pair->name0 = strdup(name0);
+    pair->name1 = strdup(name1);
+    pair->outName = strdup(outName);
+    if (pair->name0 == NULL || pair->name1 == NULL || pair->outName == NULL) {
+        freePair(pair);
+        return EXIT_FAILURE;
+    }
+    list->pairs[list->count++] = pair;
+
+    return EXIT_SUCCESS;
+}
+
+/* Reads lines "left right [output]". Empty lines and lines starting with '#'
+ * are skipped. Without output-name, result is saved as <left>_depth<outExt>. */
+static int readPairList(const char *filename, const char *outExt,
+                        struct pairList *list) {
+    FILE *handle;
+    char *line = NULL, *tok[3], *save, *out, *dot, suffix[32];
+    size_t lineSize = 0;
+    int i, lineNum = 0, error = EXIT_SUCCESS;
+
+    handle = fopen(filename, "r");
+    if (handle == NULL) {
+        perror("Couldn't open the pair list");
+        return EXIT_FAILURE;
+    }
+
+    while (error == EXIT_SUCCESS && getline(&line, &lineSize, handle) != -1) {
+        lineNum++;
+        tok[0] = strtok_r(line, " \t\r\n", &save);
+        if (tok[0] == NULL || tok[0][0] == '#')
+            continue;
+        for (i = 1; i < 3; i++)
+            tok[i] = strtok_r(NULL, " \t\r\n", &save);
+        if (tok[1] == NULL) {
+            fprintf(stderr, "%s:%d: expected \"left right [output]\"\n", filename, lineNum);
+            error = EXIT_FAILURE;
+            break;
+        }
+
+        if (tok[2] != NULL) {
+            error = addPair(list, tok[0], tok[1], tok[2]);
+        }
+        else {
+            /* Strip extension of the left image */
+            dot = strrchr(tok[0], '.');
+            if (dot != NULL && strchr(dot, '/') == NULL)
+                (*dot) = '\0';
+            snprintf(suffix, sizeof(suffix), "_depth%s", outExt);
+            out = joinStr(tok[0], suffix);
+            if (out == NULL) {
+                error = EXIT_FAILURE;
+                break;
+            }
+            if (dot != NULL)
+                (*dot) = '.';
+            error = addPair(list, tok[0], tok[1], out);
+            free(out);
+        }
+    }
+    free(line);
+    fclose(handle);
+
+    return error;
+}
+
+static int compareNames(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+/* Collects subdirectories containing im0.png and im1.png. */
+static int scanPairDirectory(const char *dirname, const char *outExt,
+                             struct pairList *list) {
+    DIR *dir;
+    struct dirent *entry;
+    struct stat st;
+    char **names = NULL, **grown, *base, *name0, *name1, *outName, outFile[32];
+    int i, count = 0, allocated = 0, error = EXIT_SUCCESS;
+
+    dir = opendir(dirname);
+    if (dir == NULL) {
+        perror("Couldn't open the pair directory");
+        return EXIT_FAILURE;
+    }
+    while ((entry = readdir(dir)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+        if (count == allocated) {
+            allocated = allocated ? allocated*2 : 16;
+            grown = realloc(names, sizeof(char *)*allocated);
+            if (grown == NULL) {
+                error = EXIT_FAILURE;
+                break;
+            }
+            names = grown;
+        }
+        names[count] = strdup(entry->d_name);
+        if (names[count] == NULL) {
+            error = EXIT_FAILURE;
+            break;
+        }
+        count++;
+    }
+    closedir(dir);
+
+    /* Process scenes in a predictable order */
+    if (error == EXIT_SUCCESS)
+        qsort(names, count, sizeof(char *), compareNames);
+
+    for (i = 0; i < count; i++) {
+        if (error == EXIT_SUCCESS) {
+            base = malloc(strlen(dirname)+strlen(names[i])+2);
+            if (base == NULL) {
+                error = EXIT_FAILURE;
+                free(names[i]);
+                continue;
+            }
+            sprintf(base, "%s/%s", dirname, names[i]);
+            name0 = joinStr(base, "/im0.png");
+            name1 = joinStr(base, "/im1.png");
+            snprintf(outFile, sizeof(outFile), "/depth01p%s", outExt);
+            outName = joinStr(base, outFile);
+            if (name0 == NULL || name1 == NULL || outName == NULL)
+                error = EXIT_FAILURE;
+            else if (stat(base, &st) == 0 && S_ISDIR(st.st_mode)
+                     && stat(name0, &st) == 0 && stat(name1, &st) == 0)
+                error = addPair(list, name0, name1, outName);
+
+            free(base);
+            free(name0);
+            free(name1);
+            free(outName);
+        }
+        free(names[i]);
+    }
+    free(names);
+
+    return error;
+}
+
+/* Stage 1: decode pairs in list order. */
+void *loadStage(void *data) {
+    struct stageData *stage = (struct stageData *)data;
+    struct stereoPair *pair;
+    double time1;
+    int i;
+
+    for (i = 0; i < stage->list->count; i++) {
+        pair = stage->list->pairs[i];
+        stage->list->pairs[i] = NULL;
+
+        time1 = doubleTime();
+        if (loadPair(pair) == EXIT_FAILURE) {
+            stage->failed++;
+            freePair(pair);
+        }
+        else {
+            stage->done++;
+            queuePush(stage->out, pair);
+        }
+        stage->busy += doubleTime()-time1;
+    }
+    queueClose(stage->out);
+
+    return NULL;
+}
+
+/* Stage 2: match pairs. Runs in the calling thread, the worker threads
+ * of the backend are used from here. */
+void matchStage(struct stageData *stage) {
+    struct stereoPair *pair;
+    double time1;
+
+    while ((pair = queuePop(stage->in)) != NULL) {
+        time1 = doubleTime();
+        if (stage->process(pair, stage->args) == EXIT_FAILURE) {
+            fprintf(stderr, "GenerateDepthmap failed! (%s)\n", pair->name0);
+            stage->failed++;
+            freePair(pair);
+        }
+        else {
+            /* Input images are not needed anymore */
+            free(pair->img0);
+            free(pair->img1);
+            pair->img0 = NULL;
+            pair->img1 = NULL;
+            stage->done++;
+            queuePush(stage->out, pair);
+        }
+        stage->busy += doubleTime()-time1;
+    }
+    queueClose(stage->out);
+}
+
+/* Stage 3: encode and save results. */
+void *saveStage(void *data) {
+    struct stageData *stage = (struct stageData *)data;
+    struct stereoPair *pair;
+    double time1;
+
+    while ((pair = queuePop(stage->in)) != NULL) {
+        time1 = doubleTime();
+        if (stage->save(pair, stage->args) == EXIT_FAILURE)
+            stage->failed++;
+        else
+            stage->done++;
+        freePair(pair);
+        stage->busy += doubleTime()-time1;
+    }
+
+    return NULL;
+}
+
+int runBatch(const char *source, const char *outExt,
+             processFunc process, saveFunc save, void *args) {
+    struct pairList list;
+    struct queue loaded, matched;
+    struct stageData load, match, store;
+    struct stat st;
+    pthread_t loadThread, saveThread;
+    double time1, time2, wall;
+    int i, error, failed;
+
+    list.pairs = NULL;
+    list.count = 0;
+    list.allocated = 0;
+
+    if (stat(source, &st) != 0) {
+        perror("Couldn't access batch source");
+        return EXIT_FAILURE;
+    }
+    if (S_ISDIR(st.st_mode))
+        error = scanPairDirectory(source, outExt, &list);
+    else
+        error = readPairList(source, outExt, &list);
+
+    if (error == EXIT_FAILURE || list.count == 0) {
+        fprintf(stderr, "No stereo-pairs to process.\n");
+        for (i = 0; i < list.count; i++)
+            freePair(list.pairs[i]);
+        free(list.pairs);
+        return EXIT_FAILURE;
+    }
+    printf("Batch of %d stereo-pairs.\n", list.count);
+
+    error = queueInit(&loaded, STAGE_QUEUE_DEPTH);
+    if (error == EXIT_SUCCESS) {
+        error = queueInit(&matched, STAGE_QUEUE_DEPTH);
+        if (error == EXIT_FAILURE)
+            queueDestroy(&loaded);
+    }
+    if (error == EXIT_FAILURE) {
+        fprintf(stderr, "Memory allocation failed!\n");
+        for (i = 0; i < list.count; i++)
+            freePair(list.pairs[i]);
+        free(list.pairs);
+        return EXIT_FAILURE;
+    }
+
+    memset(&load, 0, sizeof(struct stageData));
+    memset(&match, 0, sizeof(struct stageData));
+    memset(&store, 0, sizeof(struct stageData));
+    load.list = &list;
+    load.out = &loaded;
+    match.in = &loaded;
+    match.out = &matched;
+    match.process = process;
+    match.args = args;
+    store.in = &matched;
+    store.save = save;
+    store.args = args;
+
+    time1 = doubleTime();
+
+    pthread_create(&loadThread, NULL, loadStage, &load);
+    pthread_create(&saveThread, NULL, saveStage, &store);
+    matchStage(&match);
+    pthread_join(loadThread, NULL);
+    pthread_join(saveThread, NULL);
+
+    time2 = doubleTime();
+    wall = time2-time1;
+
+    queueDestroy(&loaded);
+    queueDestroy(&matched);
+    free(list.pairs);
+
+    failed = load.failed + match.failed + store.failed;
+    printf("\nBatch: %d of %d pairs in %.3lf seconds, %.2lf pairs/s.\n",
+           store.done, list.count, wall, store.done/wall);
+    printf(" Load occupancy:                %5.1lf %%\n", 100.0*load.busy/wall);
+    printf(" Match occupancy:               %5.1lf %%\n", 100.0*match.busy/wall);
+    printf(" Save occupancy:                %5.1lf %%\n", 100.0*store.busy/wall);
+    if (failed > 0)
+        fprintf(stderr, "%d stereo-pairs failed.\n", failed);
+
+    return failed > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,42 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+/* One stereo-pair travelling through the load, match and save stages. */
+struct stereoPair {
+    char *name0;
+    char *name1;
+    char *outName;
+
+    unsigned char *img0;
+    unsigned char *img1;
+    unsigned int w;
+    unsigned int h;
+
+    /* Filled by the matching stage */
+    void *depthmap;
+    unsigned int dw;
+    unsigned int dh;
+};
+
+/* Matching and saving callbacks. Both return EXIT_SUCCESS or EXIT_FAILURE. */
+typedef int (*processFunc)(struct stereoPair *pair, void *args);
+typedef int (*saveFunc)(struct stereoPair *pair, void *args);
+
+/* Decodes both images of a pair, second one in a helper thread.
+ * On failure images are freed and EXIT_FAILURE is returned. */
+int loadPair(struct stereoPair *pair);
+
+/* Frees everything owned by a pair, including the pair itself. */
+void freePair(struct stereoPair *pair);
+
+/* Processes every pair listed in source, which is either a list-file with
+ * lines "left right [output]" or a directory. In a directory every
+ * subdirectory containing im0.png and im1.png is a pair, and the result is
+ * saved as depth01p<outExt> next to them. Without output-name in a list-file,
+ * result is saved as <left>_depth<outExt>.
+ * Loading, matching and saving run as a 3-stage pipeline.
+ * Returns EXIT_FAILURE if any of the pairs failed. */
+int runBatch(const char *source, const char *outExt,
+             processFunc process, saveFunc save, void *args);
+
+#endif
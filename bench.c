@@ -0,0 +1,400 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include "libdepthmap.h"
+#include "synth.h"
+#include "bench_util.h"
+#include "doubleTime.h"
+
+/* Seed of every synthetic pair, so that machines benchmark the same scenes */
+#define BENCH_SEED 2015
+
+#define BENCH_STAGES 8
+
+/* Backends and kernel variants. OpenCL variants use specialised kernels
+ * unless generic, as with DEPTHMAP_CL_GENERIC. */
+struct benchBackend {
+    const char *name;
+    unsigned int opencl;
+    int disableAsm;
+    int generic;
+};
+
+static const struct benchBackend backends[] = {
+    {"c", 0, 1, 0},
+#ifdef __x86_64__
+    {"sse", 0, 0, 0},
+#endif
+    {"basic-cpu", 1, 0, 0},
+    {"basic-cpu-generic", 1, 0, 1},
+    {"basic-gpu", 2, 0, 0},
+    {"basic-gpu-generic", 2, 0, 1},
+    {"amd-cpu", 3, 0, 0},
+    {"amd-cpu-generic", 3, 0, 1},
+    {"amd-gpu", 4, 0, 0},
+    {"amd-gpu-generic", 4, 0, 1}
+};
+
+#define BENCH_BACKENDS (sizeof(backends)/sizeof(backends[0]))
+
+/* Stages of struct depthmapTimings, and wall time of the call */
+static const char *stageNames[BENCH_STAGES] = {
+    "blend", "blend2x2", "zncc_half", "limits", "zncc", "post", "total", "wall"
+};
+
+static void stageTimes(const struct depthmapTimings *t, double wall, double *ms) {
+    ms[0] = t->blend;
+    ms[1] = t->blend2x2;
+    ms[2] = t->znccHalf;
+    ms[3] = t->limits;
+    ms[4] = t->zncc;
+    ms[5] = t->post;
+    ms[6] = t->total;
+    ms[7] = wall;
+}
+
+/* Minimum, median and 99th percentile (nearest rank) of n samples,
+ * which are sorted in place. */
+static void statistics(double *samples, int n, double *min, double *median,
+                       double *p99) {
+    int rank;
+
+    qsort(samples, n, sizeof(double), compareDoubles);
+    (*min) = samples[0];
+    if (n % 2)
+        (*median) = samples[n/2];
+    else
+        (*median) = 0.5*(samples[n/2-1] + samples[n/2]);
+    rank = (int)ceil(0.99*n);
+    (*p99) = samples[(rank > 0) ? rank-1 : 0];
+}
+
+struct benchReport {
+    FILE *out;
+    int json;
+    int rows;
+};
+
+static void reportBegin(struct benchReport *r) {
+    if (r->json)
+        fprintf(r->out, "[");
+    else
+        fprintf(r->out, "pattern,width,height,backend,stage,runs,"
+                        "min_ms,median_ms,p99_ms,bad_pixels\n");
+}
+
+static void reportRow(struct benchReport *r, const struct synthPair *pair,
+                      const char *pattern, const char *backend,
+                      const char *stage, int runs, double min, double median,
+                      double p99, double bad) {
+    if (r->json)
+        fprintf(r->out, "%s\n  {\"pattern\": \"%s\", \"width\": %u, \"height\": %u, "
+                "\"backend\": \"%s\", \"stage\": \"%s\", \"runs\": %d, "
+                "\"min_ms\": %.3lf, \"median_ms\": %.3lf, \"p99_ms\": %.3lf, "
+                "\"bad_pixels\": %.2lf}", (r->rows > 0) ? "," : "", pattern,
+                pair->width, pair->height, backend, stage, runs, min, median,
+                p99, bad);
+    else
+        fprintf(r->out, "%s,%u,%u,%s,%s,%d,%.3lf,%.3lf,%.3lf,%.2lf\n", pattern,
+                pair->width, pair->height, backend, stage, runs, min, median,
+                p99, bad);
+    r->rows++;
+}
+
+static void reportEnd(struct benchReport *r) {
+    if (r->json)
+        fprintf(r->out, "\n]\n");
+    fflush(r->out);
+}
+
+/* warmup untimed and runs timed depthmaps of a pair. Stages not run by the
+ * backend (0 in every run) are left out of the report.
+ * Returns EXIT_SUCCESS or EXIT_FAILURE. */
+static int benchPair(struct depthmap *dm, const struct depthmapConfig *conf,
+                     const struct synthPair *pair, const char *pattern,
+                     const char *backend, int warmup, int runs,
+                     struct benchReport *report) {
+
+    double *samples, ms[BENCH_STAGES], min, median, p99, bad, time1, time2;
+    unsigned short *depthmap;
+    unsigned int border;
+    int i, stage, used;
+
+    samples = malloc(sizeof(double)*BENCH_STAGES*runs);
+    if (samples == NULL)
+        return EXIT_FAILURE;
+
+    bad = 0.0;
+    for (i = -warmup; i < runs; i++) {
+        time1 = doubleTime();
+        depthmap = depthmapGenerate(dm, pair->img0, pair->img1, pair->width,
+                                    pair->height);
+        time2 = doubleTime();
+        if (depthmap == NULL) {
+            fprintf(stderr, "%s failed on %s %ux%u!\n", backend, pattern,
+                    pair->width, pair->height);
+            free(samples);
+            return EXIT_FAILURE;
+        }
+        if (i < 0) {
+            free(depthmap);
+            continue;
+        }
+        stageTimes(depthmapTimings(dm), (time2-time1)*1000, ms);
+        for (stage = 0; stage < BENCH_STAGES; stage++)
+            samples[stage*runs+i] = ms[stage];
+
+        /* Same pair every run, accuracy of the last one */
+        if (i == runs-1) {
+            border = (conf->blockx > conf->blocky) ? conf->blockx : conf->blocky;
+            bad = synthBadPixels(pair, depthmap, 1.0, border);
+        }
+        free(depthmap);
+    }
+
+    for (stage = 0; stage < BENCH_STAGES; stage++) {
+        used = 0;
+        for (i = 0; i < runs; i++)
+            used |= (samples[stage*runs+i] != 0.0);
+        if (!used)
+            continue;
+        statistics(&samples[stage*runs], runs, &min, &median, &p99);
+        reportRow(report, pair, pattern, backend, stageNames[stage], runs,
+                  min, median, p99, bad);
+    }
+
+    free(samples);
+    return EXIT_SUCCESS;
+}
+
+static void usage(const char *name) {
+    unsigned int i;
+
+    printf("Usage: %s [options]\n"
+           "Benchmarks depthmap backends on synthetic stereo-pairs with known disparity.\n"
+           "-x <>, -y <>, -d <>  block size and disparity limit (9, 9, 65)\n"
+           "-b      bruteforce search instead of hierarchic\n"
+           "-t <>   native threads, 0 for one per processor (default)\n"
+           "-r <>   downscale factor 1, 2, 4 (default) or 8\n"
+           "-R <>   comma-separated image sizes <w>x<h>\n"
+           "        (default 640x480,1280x960,1920x1440)\n"
+           "-p <>   comma-separated patterns dots, texture, banded\n"
+           "        (default dots,texture)\n"
+           "-a <>   comma-separated backends, all available by default:\n"
+           "        ", name);
+    for (i = 0; i < BENCH_BACKENDS; i++)
+        printf("%s%s", backends[i].name, (i+1 < BENCH_BACKENDS) ? ", " : "\n");
+    printf("-n <>   timed runs per pair and backend (default 10)\n"
+           "-w <>   untimed warmup runs before them (default 2)\n"
+           "-f <>   report format csv (default) or json\n"
+           "-o <>   report file, - for standard output (default)\n");
+}
+
+int main(int argc, char **argv) {
+
+    struct depthmapConfig conf = DEPTHMAP_CONFIG_DEFAULTS;
+    struct benchSize sizes[BENCH_MAX_SIZES];
+    struct synthPair *pairs;
+    struct benchReport report;
+    struct depthmap *dm;
+    const char *backendList, *patternList, *outName;
+    synthPattern patterns[SYNTH_PATTERNS], pattern;
+    int sizesN, patternsN, pairsN, runs, warmup, ran, error, c, i, j;
+    unsigned int b;
+    char *p, *list;
+
+    sizes[0].width = 640;  sizes[0].height = 480;
+    sizes[1].width = 1280; sizes[1].height = 960;
+    sizes[2].width = 1920; sizes[2].height = 1440;
+    sizesN = 3;
+    backendList = NULL;
+    patternList = "dots,texture";
+    outName = "-";
+    runs = 10;
+    warmup = 2;
+    report.json = 0;
+    report.rows = 0;
+
+    while ((c = getopt(argc, argv, "x:y:d:bt:r:R:p:a:n:w:f:o:")) != -1) {
+        switch (c) {
+        case 'x':
+            conf.blockx = atoi(optarg);
+            break;
+        case 'y':
+            conf.blocky = atoi(optarg);
+            break;
+        case 'd':
+            conf.disp_limit = atoi(optarg);
+            break;
+        case 'b':
+            conf.select = BRUTE;
+            break;
+        case 't':
+            conf.threads = atoi(optarg);
+            break;
+        case 'r':
+            conf.factor = atoi(optarg);
+            if (conf.factor != 1 && conf.factor != 2 && conf.factor != 4
+                    && conf.factor != 8) {
+                fprintf(stderr, "Downscale factor must be 1, 2, 4 or 8!\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'R':
+            sizesN = parseSizes(optarg, sizes);
+            if (sizesN == 0) {
+                fprintf(stderr, "Expected at most %d sizes of <w>x<h>!\n",
+                        BENCH_MAX_SIZES);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'p':
+            patternList = optarg;
+            break;
+        case 'a':
+            backendList = optarg;
+            break;
+        case 'n':
+            runs = atoi(optarg);
+            break;
+        case 'w':
+            warmup = atoi(optarg);
+            break;
+        case 'f':
+            if (strcmp(optarg, "json") == 0)
+                report.json = 1;
+            else if (strcmp(optarg, "csv") != 0) {
+                fprintf(stderr, "Unknown report format!\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'o':
+            outName = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (runs < 1 || warmup < 0 || conf.blockx % 2 == 0 || conf.blocky % 2 == 0
+            || conf.disp_limit < 12 || conf.disp_limit > 255) {
+        fprintf(stderr, "Runs must be positive, blocks odd and disparity "
+                        "limit 12-255!\n");
+        return EXIT_FAILURE;
+    }
+    /* Exact disparitys are compared to the ground truth */
+    conf.format = DISP_FIXED16;
+
+    list = strdup(patternList);
+    if (list == NULL)
+        return EXIT_FAILURE;
+    patternsN = 0;
+    for (p = strtok(list, ","); p != NULL; p = strtok(NULL, ",")) {
+        if (patternsN == SYNTH_PATTERNS || parseSynthPattern(p, &pattern) == EXIT_FAILURE) {
+            fprintf(stderr, "Unknown pattern %s!\n", p);
+            free(list);
+            return EXIT_FAILURE;
+        }
+        patterns[patternsN++] = pattern;
+    }
+    free(list);
+    if (backendList != NULL) {
+        list = strdup(backendList);
+        if (list == NULL)
+            return EXIT_FAILURE;
+        for (p = strtok(list, ","); p != NULL; p = strtok(NULL, ",")) {
+            for (b = 0; b < BENCH_BACKENDS; b++) {
+                if (strcmp(p, backends[b].name) == 0)
+                    break;
+            }
+            if (b == BENCH_BACKENDS) {
+                fprintf(stderr, "Unknown backend %s!\n", p);
+                free(list);
+                return EXIT_FAILURE;
+            }
+        }
+        free(list);
+    }
+
+    /* Generated once, every backend matches the same pairs. Disparitys
+     * stay inside the search range. */
+    pairsN = sizesN*patternsN;
+    pairs = calloc(pairsN, sizeof(struct synthPair));
+    if (pairs == NULL)
+        return EXIT_FAILURE;
+    for (i = 0; i < sizesN; i++) {
+        for (j = 0; j < patternsN; j++) {
+            if (synthGenerate(&pairs[i*patternsN+j], patterns[j],
+                              sizes[i].width, sizes[i].height, conf.factor,
+                              conf.disp_limit*3/4, BENCH_SEED) == EXIT_FAILURE) {
+                for (i = 0; i < pairsN; i++)
+                    synthFree(&pairs[i]);
+                free(pairs);
+                return EXIT_FAILURE;
+            }
+        }
+    }
+
+    /* Backends print their own stage times, keep them out of the report */
+    if (strcmp(outName, "-") == 0) {
+        fflush(stdout);
+        report.out = fdopen(dup(STDOUT_FILENO), "w");
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+    }
+    else
+        report.out = fopen(outName, "w");
+    if (report.out == NULL) {
+        perror(outName);
+        for (i = 0; i < pairsN; i++)
+            synthFree(&pairs[i]);
+        free(pairs);
+        return EXIT_FAILURE;
+    }
+
+    reportBegin(&report);
+    ran = 0;
+    error = EXIT_SUCCESS;
+    for (b = 0; b < BENCH_BACKENDS; b++) {
+        if (backendList != NULL && !inList(backendList, backends[b].name))
+            continue;
+
+        conf.opencl = backends[b].opencl;
+        conf.disableAsm = backends[b].disableAsm;
+        /* Read when the OpenCL session is created */
+        if (backends[b].generic)
+            setenv("DEPTHMAP_CL_GENERIC", "1", 1);
+        else
+            unsetenv("DEPTHMAP_CL_GENERIC");
+        dm = depthmapCreate(&conf);
+        if (dm == NULL) {
+            fprintf(stderr, "Skipping %s, not available.\n", backends[b].name);
+            continue;
+        }
+        ran++;
+
+        for (i = 0; i < pairsN; i++) {
+            if (benchPair(dm, &conf, &pairs[i],
+                          synthPatternName(patterns[i % patternsN]),
+                          backends[b].name, warmup, runs,
+                          &report) == EXIT_FAILURE)
+                error = EXIT_FAILURE;
+        }
+        depthmapDestroy(dm);
+    }
+    reportEnd(&report);
+    fclose(report.out);
+
+    for (i = 0; i < pairsN; i++)
+        synthFree(&pairs[i]);
+    free(pairs);
+
+    if (ran == 0) {
+        fprintf(stderr, "No backend was available!\n");
+        return EXIT_FAILURE;
+    }
+    return error;
+}
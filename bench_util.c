@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "bench_util.h"
+
+int parseSizes(const char *str, struct benchSize *sizes) {
+    const char *p;
+    int n, used;
+
+    n = 0;
+    p = str;
+    while (1) {
+        if (n == BENCH_MAX_SIZES
+                || sscanf(p, "%ux%u%n", &sizes[n].width, &sizes[n].height, &used) != 2)
+            return 0;
+        n++;
+        p += used;
+        if ((*p) == '\0')
+            return n;
+        if ((*p) != ',')
+            return 0;
+        p++;
+    }
+}
+
+int inList(const char *list, const char *name) {
+    size_t len;
+    const char *p;
+
+    len = strlen(name);
+    for (p = list; p != NULL; p = strchr(p, ',')) {
+        if ((*p) == ',')
+            p++;
+        if (strncmp(p, name, len) == 0 && (p[len] == ',' || p[len] == '\0'))
+            return 1;
+    }
+    return 0;
+}
+
+int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
@@ -0,0 +1,24 @@
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+/* Command-line helpers shared by the benchmark and the check */
+
+/* Most sizes accepted by parseSizes */
+#define BENCH_MAX_SIZES 8
+
+struct benchSize {
+    unsigned int width;
+    unsigned int height;
+};
+
+/* Comma-separated list of <w>x<h>, at most BENCH_MAX_SIZES.
+ * Returns count, 0 on failure. */
+int parseSizes(const char *str, struct benchSize *sizes);
+
+/* Returns 1 if name is in the comma-separated list. */
+int inList(const char *list, const char *name);
+
+/* qsort comparison of doubles, ascending */
+int compareDoubles(const void *a, const void *b);
+
+#endif
@@ -0,0 +1,448 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <getopt.h>
+#include <unistd.h>
+
+#include "libdepthmap.h"
+#include "synth.h"
+#include "bench_util.h"
+
+/* Same scenes as depthmap_bench */
+#define CHECK_SEED 2015
+
+/* Tolerances against the reference, the first backend that runs. Blending
+ * sums in a different order on other versions, and zncc of the assembly
+ * and OpenCL versions rounds differently, which can change the best
+ * disparity of nearly flat or repetitive blocks. */
+/* Largest difference of a greyscale pixel (0-255) */
+#define CHECK_GREY_TOLERANCE 0.01
+/* Percentage of pixels whose dmap1, dmap2 or final disparity differs by
+ * more than one */
+#define CHECK_DMAP_TOLERANCE 1.0
+#define CHECK_OUTPUT_TOLERANCE 1.0
+/* Percentage of known ground truth pixels more than one disparity off */
+#define CHECK_BAD_PIXELS 20.0
+
+struct checkTolerance {
+    double grey;
+    /* Disparitys further apart than step differ */
+    int step;
+    double dmap;
+    double output;
+};
+
+static const struct checkTolerance approximate = {
+    CHECK_GREY_TOLERANCE, 1, CHECK_DMAP_TOLERANCE, CHECK_OUTPUT_TOLERANCE
+};
+/* Versions computing in the same order must agree bit for bit */
+static const struct checkTolerance exact = {0.0, 0, 0.0, 0.0};
+
+struct checkBackend {
+    const char *name;
+    unsigned int opencl;
+    unsigned int hybrid;
+    int disableAsm;
+    int generic;
+    /* Same results as the portable C version */
+    int portable;
+};
+
+/* Portable C first, it is the reference when available. Hybrid versions
+ * match full resolution in the order of the portable worker, so they are
+ * compared without assembly and exactly. */
+static const struct checkBackend backends[] = {
+    {"c", 0, 0, 1, 0, 1},
+#ifdef __x86_64__
+    {"sse", 0, 0, 0, 0, 0},
+#endif
+    {"hybrid-cpu", 0, 1, 1, 0, 1},
+    {"hybrid-gpu", 0, 2, 1, 0, 1},
+    {"basic-cpu", 1, 0, 0, 0, 0},
+    {"basic-cpu-generic", 1, 0, 0, 1, 0},
+    {"basic-gpu", 2, 0, 0, 0, 0},
+    {"basic-gpu-generic", 2, 0, 0, 1, 0},
+    {"amd-cpu", 3, 0, 0, 0, 0},
+    {"amd-cpu-generic", 3, 0, 0, 1, 0},
+    {"amd-gpu", 4, 0, 0, 0, 0},
+    {"amd-gpu-generic", 4, 0, 0, 1, 0}
+};
+
+/* Scenes of every size */
+static const synthPattern patterns[] = {SYNTH_DOTS, SYNTH_TEXTURE, SYNTH_BANDED};
+
+#define CHECK_PATTERNS (sizeof(patterns)/sizeof(patterns[0]))
+
+#define CHECK_BACKENDS (sizeof(backends)/sizeof(backends[0]))
+
+/* Depthmap of a pair and its intermediate results */
+struct checkResult {
+    struct depthmapIntermediates inter;
+    unsigned short *depthmap;
+};
+
+static double maxGreyDiff(const float *a, const float *b, size_t pixels) {
+    double diff, max;
+    size_t i;
+
+    max = 0.0;
+    for (i = 0; i < pixels; i++) {
+        diff = fabs((double)a[i] - b[i]);
+        /* NaN is a difference too */
+        if (!(diff <= max))
+            max = diff;
+    }
+    return max;
+}
+
+/* Percentage of pixels inside border whose disparitys differ by more than
+ * step. Edges are not matched the same way by every version. */
+static double dmapDiff(const unsigned char *a, const unsigned char *b,
+                       unsigned int w, unsigned int h, unsigned int border,
+                       int step) {
+    unsigned int x, y, n, differ;
+
+    n = 0;
+    differ = 0;
+    for (y = border; y+border < h; y++) {
+        for (x = border; x+border < w; x++) {
+            n++;
+            differ += (abs(a[y*w+x] - b[y*w+x]) > step);
+        }
+    }
+    return (n > 0) ? 100.0*differ/n : 0.0;
+}
+
+static double outputDiff(const unsigned short *a, const unsigned short *b,
+                         unsigned int w, unsigned int h, unsigned int border,
+                         int step) {
+    unsigned int x, y, n, differ;
+
+    n = 0;
+    differ = 0;
+    for (y = border; y+border < h; y++) {
+        for (x = border; x+border < w; x++) {
+            n++;
+            differ += (abs(a[y*w+x] - b[y*w+x]) > step*DISP_SUBPIXEL_SCALE);
+        }
+    }
+    return (n > 0) ? 100.0*differ/n : 0.0;
+}
+
+static void freeResult(struct checkResult *result) {
+    depthmapIntermediatesFree(&result->inter);
+    free(result->depthmap);
+    result->depthmap = NULL;
+}
+
+/* DISP_GREY8 depthmap as DISP_FIXED16. Rescaling truncated d*255.5/limit,
+ * which is inverted exactly for limits up to 255. NULL on failure. */
+static unsigned short *greyToFixed(const unsigned char *grey, size_t pixels,
+                                   unsigned int dispLimit) {
+    unsigned short *fixed;
+    size_t i;
+
+    fixed = malloc(pixels*sizeof(unsigned short));
+    if (fixed == NULL)
+        return NULL;
+    for (i = 0; i < pixels; i++)
+        fixed[i] = (2*dispLimit*grey[i] + 510)/511*DISP_SUBPIXEL_SCALE;
+    return fixed;
+}
+
+/* Compares result of a backend to ref within tol and to the ground truth,
+ * and prints one line. Without ref the line says why: the backend is the
+ * reference or the reference failed on the pair. Returns EXIT_SUCCESS if
+ * everything is within tolerances. */
+static int compare(FILE *out, const char *backend, const char *pattern,
+                   const struct synthPair *pair, const struct checkResult *result,
+                   const struct checkResult *ref, const struct checkTolerance *tol,
+                   const char *why, unsigned int border) {
+    const struct depthmapIntermediates *a = &result->inter, *b;
+    double grey, grey1, dmap1, dmap2, output, bad;
+    int pass;
+
+    bad = synthBadPixels(pair, result->depthmap, 1.0, border);
+    pass = (bad <= CHECK_BAD_PIXELS);
+    fprintf(out, "%-18s %-8s %4ux%-4u ", backend, pattern, pair->width,
+            pair->height);
+    if (ref == NULL) {
+        fprintf(out, "%-50s", why);
+    }
+    else {
+        b = &ref->inter;
+        grey = maxGreyDiff(a->grey0, b->grey0, (size_t)a->width*a->height);
+        grey1 = maxGreyDiff(a->grey1, b->grey1, (size_t)a->width*a->height);
+        if (!(grey1 <= grey))
+            grey = grey1;
+        dmap1 = dmapDiff(a->dmap1, b->dmap1, a->width, a->height, border,
+                         tol->step);
+        dmap2 = dmapDiff(a->dmap2, b->dmap2, a->width, a->height, border,
+                         tol->step);
+        output = outputDiff(result->depthmap, ref->depthmap, a->width,
+                            a->height, border, tol->step);
+        fprintf(out, "grey %7.4f dmap1 %5.2f%% dmap2 %5.2f%% output %5.2f%% ",
+                grey, dmap1, dmap2, output);
+        pass = pass && grey <= tol->grey && dmap1 <= tol->dmap
+               && dmap2 <= tol->dmap && output <= tol->output;
+    }
+    fprintf(out, "bad %5.2f%%  %s\n", bad, pass ? "ok" : "FAIL");
+
+    return pass ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Depthmap of a pair as DISP_FIXED16 with its intermediate results.
+ * Returns EXIT_SUCCESS or EXIT_FAILURE. */
+static int generate(struct depthmap *dm, const struct depthmapConfig *conf,
+                    const struct synthPair *pair, struct checkResult *result) {
+    void *depthmap;
+    size_t pixels;
+
+    depthmap = depthmapGenerateIntermediates(dm, pair->img0, pair->img1,
+                                             pair->width, pair->height,
+                                             &result->inter);
+    if (depthmap == NULL)
+        return EXIT_FAILURE;
+    if (conf->format == DISP_FIXED16) {
+        result->depthmap = depthmap;
+        return EXIT_SUCCESS;
+    }
+
+    pixels = (size_t)result->inter.width*result->inter.height;
+    result->depthmap = greyToFixed(depthmap, pixels, conf->disp_limit);
+    free(depthmap);
+    if (result->depthmap == NULL) {
+        depthmapIntermediatesFree(&result->inter);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Runs every available backend of the list (NULL for all) with conf on the
+ * pairs and compares them to the first one. Name of the reference goes to
+ * refName. Returns count of comparisons out of tolerance, -1 if no backend
+ * was available. */
+static int checkBackends(FILE *out, struct depthmapConfig *conf,
+                         const char *backendList, const struct synthPair *pairs,
+                         int pairsN, unsigned int border, const char **refName) {
+    struct checkResult *refs, result;
+    struct depthmap *dm;
+    const struct checkBackend *ref;
+    const struct checkTolerance *tol;
+    const char *pattern;
+    unsigned int b;
+    int failed, i;
+
+    refs = calloc(pairsN, sizeof(struct checkResult));
+    if (refs == NULL)
+        return -1;
+
+    ref = NULL;
+    failed = 0;
+    for (b = 0; b < CHECK_BACKENDS; b++) {
+        if (backendList != NULL && !inList(backendList, backends[b].name))
+            continue;
+
+        conf->opencl = backends[b].opencl;
+        conf->hybrid = backends[b].hybrid;
+        conf->disableAsm = backends[b].disableAsm;
+        if (backends[b].generic)
+            setenv("DEPTHMAP_CL_GENERIC", "1", 1);
+        else
+            unsetenv("DEPTHMAP_CL_GENERIC");
+        dm = depthmapCreate(conf);
+        if (dm == NULL) {
+            fprintf(stderr, "Skipping %s, not available.\n", backends[b].name);
+            continue;
+        }
+        if (ref == NULL)
+            ref = &backends[b];
+        tol = (ref->portable && backends[b].portable) ? &exact : &approximate;
+
+        for (i = 0; i < pairsN; i++) {
+            pattern = synthPatternName(patterns[i % CHECK_PATTERNS]);
+            if (generate(dm, conf, &pairs[i], &result) == EXIT_FAILURE) {
+                fprintf(out, "%-18s %-8s %4ux%-4u failed  FAIL\n", backends[b].name,
+                        pattern, pairs[i].width, pairs[i].height);
+                failed++;
+                continue;
+            }
+            if (ref == &backends[b]) {
+                refs[i] = result;
+                if (compare(out, backends[b].name, pattern, &pairs[i], &result,
+                            NULL, tol, "reference", border) == EXIT_FAILURE)
+                    failed++;
+                continue;
+            }
+            if (compare(out, backends[b].name, pattern, &pairs[i], &result,
+                        (refs[i].depthmap != NULL) ? &refs[i] : NULL, tol,
+                        "uncompared, reference failed", border) == EXIT_FAILURE)
+                failed++;
+            freeResult(&result);
+        }
+        depthmapDestroy(dm);
+    }
+
+    for (i = 0; i < pairsN; i++)
+        freeResult(&refs[i]);
+    free(refs);
+
+    if (ref == NULL)
+        return -1;
+    (*refName) = ref->name;
+    return failed;
+}
+
+int main(int argc, char **argv) {
+
+    /* Output formats, sub-pixel refinement only with DISP_FIXED16 */
+    static const struct {
+        dispFormat format;
+        subpixelMethod subpixel;
+        const char *name;
+    } outputs[] = {
+        {DISP_GREY8, SUBPIXEL_NONE, "grey8"},
+        {DISP_FIXED16, SUBPIXEL_NONE, "fixed16"},
+        {DISP_FIXED16, SUBPIXEL_PARABOLA, "fixed16, parabola"},
+        {DISP_FIXED16, SUBPIXEL_EQUIANGULAR, "fixed16, equiangular"}
+    };
+    static const unsigned int factors[] = {1, 2, 4, 8};
+
+    struct depthmapConfig conf = DEPTHMAP_CONFIG_DEFAULTS;
+    struct benchSize sizes[BENCH_MAX_SIZES];
+    struct synthPair *pairs;
+    const char *backendList, *ref, *lastRef;
+    unsigned int f, o, factor, border;
+    int sizesN, pairsN, failed, configFailed, c, i;
+    FILE *out;
+
+    /* Depthmap sizes, images are factor times larger */
+    sizes[0].width = 160; sizes[0].height = 120;
+    sizes[1].width = 320; sizes[1].height = 240;
+    sizesN = 2;
+    backendList = NULL;
+    factor = 0;
+
+    while ((c = getopt(argc, argv, "x:y:d:bt:r:R:a:")) != -1) {
+        switch (c) {
+        case 'x':
+            conf.blockx = atoi(optarg);
+            break;
+        case 'y':
+            conf.blocky = atoi(optarg);
+            break;
+        case 'd':
+            conf.disp_limit = atoi(optarg);
+            break;
+        case 'b':
+            conf.select = BRUTE;
+            break;
+        case 't':
+            conf.threads = atoi(optarg);
+            break;
+        case 'r':
+            factor = atoi(optarg);
+            if (factor != 1 && factor != 2 && factor != 4 && factor != 8) {
+                fprintf(stderr, "Downscale factor must be 1, 2, 4 or 8!\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'R':
+            sizesN = parseSizes(optarg, sizes);
+            if (sizesN == 0) {
+                fprintf(stderr, "Expected at most %d sizes of <w>x<h>!\n",
+                        BENCH_MAX_SIZES);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'a':
+            backendList = optarg;
+            break;
+        default:
+            printf("Usage: %s [options]\n"
+                   "Compares greyscale images, dmaps and depthmaps of every available\n"
+                   "backend to the first one, and depthmaps to the ground truth, on\n"
+                   "synthetic stereo-pairs with every downscale factor, output format\n"
+                   "and sub-pixel method. Fails if any is out of tolerance.\n"
+                   "-x <>, -y <>, -d <>  block size and disparity limit (9, 9, 65)\n"
+                   "-b      bruteforce search instead of hierarchic\n"
+                   "-t <>   native threads, 0 for one per processor (default)\n"
+                   "-r <>   only downscale factor 1, 2, 4 or 8\n"
+                   "-R <>   comma-separated depthmap sizes <w>x<h>, images are factor\n"
+                   "        times larger (default 160x120,320x240)\n"
+                   "-a <>   comma-separated backends, all by default\n",
+                   argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (conf.blockx % 2 == 0 || conf.blocky % 2 == 0 || conf.disp_limit < 12
+            || conf.disp_limit > 255) {
+        fprintf(stderr, "Blocks must be odd and disparity limit 12-255!\n");
+        return EXIT_FAILURE;
+    }
+    border = (conf.blockx > conf.blocky) ? conf.blockx : conf.blocky;
+
+    pairsN = CHECK_PATTERNS*sizesN;
+    pairs = calloc(pairsN, sizeof(struct synthPair));
+    if (pairs == NULL)
+        return EXIT_FAILURE;
+
+    /* OpenCL versions print their stage times, keep them out of the results */
+    fflush(stdout);
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    if (out == NULL)
+        return EXIT_FAILURE;
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+
+    lastRef = NULL;
+    failed = 0;
+    for (f = 0; f < sizeof(factors)/sizeof(factors[0]); f++) {
+        if (factor != 0 && factors[f] != factor)
+            continue;
+        conf.factor = factors[f];
+
+        for (i = 0; i < pairsN; i++) {
+            if (synthGenerate(&pairs[i], patterns[i % CHECK_PATTERNS],
+                              sizes[i/CHECK_PATTERNS].width*conf.factor,
+                              sizes[i/CHECK_PATTERNS].height*conf.factor, conf.factor,
+                              conf.disp_limit*3/4, CHECK_SEED) == EXIT_FAILURE) {
+                failed = -1;
+                break;
+            }
+        }
+
+        for (o = 0; failed >= 0 && o < sizeof(outputs)/sizeof(outputs[0]); o++) {
+            conf.format = outputs[o].format;
+            conf.subpixel = outputs[o].subpixel;
+            fprintf(out, "Factor %u, %s:\n", conf.factor, outputs[o].name);
+            configFailed = checkBackends(out, &conf, backendList, pairs, pairsN,
+                                         border, &ref);
+            if (configFailed < 0) {
+                fprintf(stderr, "No backend was available!\n");
+                failed = -1;
+                break;
+            }
+            failed += configFailed;
+            lastRef = ref;
+        }
+
+        for (i = 0; i < pairsN; i++)
+            synthFree(&pairs[i]);
+        if (failed < 0)
+            break;
+    }
+    free(pairs);
+
+    if (failed < 0) {
+        fclose(out);
+        return EXIT_FAILURE;
+    }
+    if (failed > 0)
+        fprintf(out, "%d comparisons out of tolerance.\n", failed);
+    else
+        fprintf(out, "All backends within tolerances of %s.\n", lastRef);
+    fclose(out);
+
+    return (failed > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
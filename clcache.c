@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <CL/cl.h>
+
+#include "clcache.h"
+
+#define KEY_LEN 1024
+
+/* 64-bit FNV-1a */
+static uint64_t hashBytes(uint64_t hash, const void *data, size_t size) {
+    const unsigned char *bytes = data;
+    size_t i;
+
+    for (i=0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+/* Builds key-line "device|driver|what" and filename of the cache directory
+ * named by hash of the key-line. Key-line is stored in the beginning of the
+ * file, so that a hash collision is not mistaken as a hit. */
+static int deviceKey(cl_device_id device, const char *what, const char *ext,
+                     char *key, char *filename) {
+    char deviceName[256], driver[256];
+    const char *dir;
+    uint64_t hash;
+
+    if (clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(deviceName),
+                        deviceName, NULL) != CL_SUCCESS ||
+        clGetDeviceInfo(device, CL_DRIVER_VERSION, sizeof(driver),
+                        driver, NULL) != CL_SUCCESS)
+        return EXIT_FAILURE;
+
+    snprintf(key, KEY_LEN, "%s|%s|%s\n", deviceName, driver, what);
+
+    dir = getenv("DEPTHMAP_CL_CACHE");
+    if (dir == NULL || dir[0] == '\0')
+        dir = CLCACHE_DEFAULT_DIR;
+
+    hash = hashBytes(0xcbf29ce484222325ULL, key, strlen(key));
+    snprintf(filename, KEY_LEN, "%s/%016llx%s", dir, (unsigned long long)hash, ext);
+
+    return EXIT_SUCCESS;
+}
+
+/* Key of a program binary includes build options and hash of the source */
+static int cacheKey(cl_device_id device, const char *source, size_t sourceSize,
+                    const char *options, char *key, char *filename) {
+    char what[KEY_LEN];
+    uint64_t hash;
+
+    hash = hashBytes(0xcbf29ce484222325ULL, source, sourceSize);
+    snprintf(what, KEY_LEN, "%s|%016llx", options, (unsigned long long)hash);
+
+    return deviceKey(device, what, ".bin", key, filename);
+}
+
+/* Creates directory of a cache file, if missing */
+static void makeCacheDir(const char *filename) {
+    char *dir;
+
+    dir = strdup(filename);
+    if (dir == NULL)
+        return;
+    (*strrchr(dir, '/')) = '\0';
+    mkdir(dir, 0755);
+    free(dir);
+}
+
+int loadCachedProgram(cl_device_id device, cl_context context,
+                      const char *source, size_t sourceSize,
+                      const char *options, cl_program *program) {
+    char key[KEY_LEN], filename[KEY_LEN], storedKey[KEY_LEN];
+    unsigned char *binary;
+    size_t binarySize;
+    long fileSize;
+    cl_int err, status;
+    FILE *handle;
+
+    if (cacheKey(device, source, sourceSize, options, key, filename) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+
+    handle = fopen(filename, "rb");
+    if (handle == NULL)
+        return EXIT_FAILURE;
+
+    if (fgets(storedKey, KEY_LEN, handle) == NULL || strcmp(storedKey, key) != 0) {
+        fclose(handle);
+        return EXIT_FAILURE;
+    }
+
+    fseek(handle, 0, SEEK_END);
+    fileSize = ftell(handle);
+    binarySize = fileSize - strlen(key);
+    fseek(handle, strlen(key), SEEK_SET);
+    binary = malloc(binarySize);
+    if (binary == NULL || binarySize == 0 ||
+        fread(binary, 1, binarySize, handle) != binarySize) {
+        free(binary);
+        fclose(handle);
+        return EXIT_FAILURE;
+    }
+    fclose(handle);
+
+    (*program) = clCreateProgramWithBinary(context, 1, &device, &binarySize,
+                                           (const unsigned char **)&binary,
+                                           &status, &err);
+    free(binary);
+    if (err != CL_SUCCESS)
+        return EXIT_FAILURE;
+    if (status != CL_SUCCESS) {
+        clReleaseProgram((*program));
+        return EXIT_FAILURE;
+    }
+
+    /* Driver may still refuse binary, e.g. after an update */
+    err = clBuildProgram((*program), 1, &device, options, NULL, NULL);
+    if (err != CL_SUCCESS) {
+        clReleaseProgram((*program));
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+void saveCachedProgram(cl_device_id device, cl_program program,
+                       const char *source, size_t sourceSize,
+                       const char *options) {
+    char key[KEY_LEN], filename[KEY_LEN], tmpName[KEY_LEN+32];
+    unsigned char *binary;
+    size_t binarySize;
+    FILE *handle;
+
+    if (cacheKey(device, source, sourceSize, options, key, filename) == EXIT_FAILURE)
+        return;
+
+    /* Program is built for one device only */
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(size_t),
+                         &binarySize, NULL) != CL_SUCCESS || binarySize == 0)
+        return;
+    binary = malloc(binarySize);
+    if (binary == NULL)
+        return;
+    if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(unsigned char *),
+                         &binary, NULL) != CL_SUCCESS) {
+        free(binary);
+        return;
+    }
+
+    makeCacheDir(filename);
+
+    /* Written under a temporary name, so a concurrent run never reads a
+     * partial binary */
+    snprintf(tmpName, sizeof(tmpName), "%s.%d", filename, (int)getpid());
+    handle = fopen(tmpName, "wb");
+    if (handle == NULL) {
+        fprintf(stderr, "Couldn't write program cache %s\n", filename);
+        free(binary);
+        return;
+    }
+    if (fputs(key, handle) == EOF ||
+        fwrite(binary, 1, binarySize, handle) != binarySize ||
+        fclose(handle) != 0 || rename(tmpName, filename) != 0) {
+        fprintf(stderr, "Couldn't write program cache %s\n", filename);
+        remove(tmpName);
+    }
+    free(binary);
+}
+
+/* Tuning file has the key-line followed by lines "name value" */
+#define TUNE_FIELDS 5
+
+int loadTuneConfig(cl_device_id device, const char *sourceFile,
+                   struct tuneConfig *conf) {
+    char key[KEY_LEN], filename[KEY_LEN], storedKey[KEY_LEN], name[32];
+    const char *names[TUNE_FIELDS] = {"tileX", "tileY", "znccLocal",
+                                      "dmapsLocal", "bands"};
+    unsigned int *fields[TUNE_FIELDS] = {&conf->tileX, &conf->tileY, &conf->znccLocal,
+                                         &conf->dmapsLocal, &conf->bands};
+    unsigned int value;
+    int i;
+    FILE *handle;
+
+    if (deviceKey(device, sourceFile, ".tune", key, filename) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+
+    handle = fopen(filename, "r");
+    if (handle == NULL)
+        return EXIT_FAILURE;
+
+    if (fgets(storedKey, KEY_LEN, handle) == NULL || strcmp(storedKey, key) != 0) {
+        fclose(handle);
+        return EXIT_FAILURE;
+    }
+
+    while (fscanf(handle, "%31s %u", name, &value) == 2) {
+        for (i=0; i < TUNE_FIELDS; i++)
+            if (strcmp(name, names[i]) == 0)
+                (*fields[i]) = value;
+    }
+    fclose(handle);
+
+    return EXIT_SUCCESS;
+}
+
+int saveTuneConfig(cl_device_id device, const char *sourceFile,
+                   const struct tuneConfig *conf) {
+    char key[KEY_LEN], filename[KEY_LEN], tmpName[KEY_LEN+32];
+    FILE *handle;
+
+    if (deviceKey(device, sourceFile, ".tune", key, filename) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+
+    makeCacheDir(filename);
+
+    snprintf(tmpName, sizeof(tmpName), "%s.%d", filename, (int)getpid());
+    handle = fopen(tmpName, "w");
+    if (handle == NULL) {
+        fprintf(stderr, "Couldn't write tuning file %s\n", filename);
+        return EXIT_FAILURE;
+    }
+    fputs(key, handle);
+    fprintf(handle, "tileX %u\ntileY %u\nznccLocal %u\ndmapsLocal %u\nbands %u\n",
+            conf->tileX, conf->tileY, conf->znccLocal, conf->dmapsLocal, conf->bands);
+    if (fclose(handle) != 0 || rename(tmpName, filename) != 0) {
+        fprintf(stderr, "Couldn't write tuning file %s\n", filename);
+        remove(tmpName);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,35 @@
+#ifndef CLCACHE_H
+#define CLCACHE_H
+
+#include <CL/cl.h>
+
+#include "common_opencl.h"
+
+/* Directory for cached program binaries, overridden with DEPTHMAP_CL_CACHE. */
+#define CLCACHE_DEFAULT_DIR ".clcache"
+
+/* Builds program from a binary cached for this device, driver, build options
+ * and source. Returns EXIT_FAILURE if there is no usable binary, in which
+ * case program has to be built from source. */
+int loadCachedProgram(cl_device_id device, cl_context context,
+                      const char *source, size_t sourceSize,
+                      const char *options, cl_program *program);
+
+/* Stores binary of a built program. Failures are only reported, cache is
+ * optional. */
+void saveCachedProgram(cl_device_id device, cl_program program,
+                       const char *source, size_t sourceSize,
+                       const char *options);
+
+/* Reads launch parameters tuned for this device and driver from the same
+ * directory. Fields missing from the file are left as they are.
+ * Returns EXIT_FAILURE if nothing has been tuned for the device. */
+int loadTuneConfig(cl_device_id device, const char *sourceFile,
+                   struct tuneConfig *conf);
+
+/* Stores launch parameters for this device and driver.
+ * Returns EXIT_SUCCESS or EXIT_FAILURE. */
+int saveTuneConfig(cl_device_id device, const char *sourceFile,
+                   const struct tuneConfig *conf);
+
+#endif
@@ -0,0 +1,245 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "output.h"
+#include "service.h"
+#include "doubleTime.h"
+
+/* Reads a whole file. NULL on failure. */
+static unsigned char *readFile(const char *filename, uint32_t *size) {
+    FILE *handle;
+    unsigned char *data;
+    long length;
+
+    handle = fopen(filename, "rb");
+    if (handle == NULL) {
+        perror(filename);
+        return NULL;
+    }
+    fseek(handle, 0, SEEK_END);
+    length = ftell(handle);
+    fseek(handle, 0, SEEK_SET);
+    if (length <= 0 || length > SERVICE_MAX_IMAGE) {
+        fprintf(stderr, "%s: unsupported size.\n", filename);
+        fclose(handle);
+        return NULL;
+    }
+    data = malloc(length);
+    if (data == NULL || fread(data, 1, length, handle) != (size_t)length) {
+        fprintf(stderr, "Reading %s failed!\n", filename);
+        free(data);
+        fclose(handle);
+        return NULL;
+    }
+    fclose(handle);
+    (*size) = length;
+
+    return data;
+}
+
+/* Connected socket, -1 on failure. */
+static int connectSocket(const char *path) {
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path is too long!\n");
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("Couldn't create a socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("Couldn't connect to the daemon");
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Sends one request and receives its depthmap (NULL without one).
+ * Returns EXIT_SUCCESS or EXIT_FAILURE. */
+static int exchange(const char *path, const struct serviceRequest *request,
+                    const unsigned char *data0, const unsigned char *data1,
+                    struct serviceResponse *response, unsigned char **depthmap) {
+    int fd, sent;
+
+    (*depthmap) = NULL;
+    fd = connectSocket(path);
+    if (fd < 0)
+        return EXIT_FAILURE;
+
+    sent = serviceWrite(fd, request, sizeof(*request));
+    if (sent == EXIT_SUCCESS && request->kind != REQUEST_SHUTDOWN) {
+        sent = serviceWrite(fd, data0, request->size0);
+        if (sent == EXIT_SUCCESS)
+            sent = serviceWrite(fd, data1, request->size1);
+    }
+    /* A busy daemon answers without reading the images */
+    if (serviceRead(fd, response, sizeof(*response)) == EXIT_FAILURE
+            || response->magic != SERVICE_MAGIC) {
+        fprintf(stderr, "No response from the daemon!\n");
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    if (response->status == STATUS_OK && response->size > 0) {
+        (*depthmap) = malloc(response->size);
+        if ((*depthmap) == NULL
+                || serviceRead(fd, *depthmap, response->size) == EXIT_FAILURE) {
+            fprintf(stderr, "Depthmap was cut short!\n");
+            free(*depthmap);
+            (*depthmap) = NULL;
+            close(fd);
+            return EXIT_FAILURE;
+        }
+    }
+    close(fd);
+    (void)sent;
+
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char *argv[]) {
+    const char *statusNames[] = {"ok", "busy", "bad request", "failed"};
+    struct serviceRequest request;
+    struct serviceResponse response;
+    unsigned char *data0, *data1, *depthmap;
+    char *outName, defaultName[32];
+    outputFormat format;
+    double time1, time2;
+    int c, i, repeats, stop, error;
+
+    memset(&request, 0, sizeof(request));
+    request.magic = SERVICE_MAGIC;
+    request.kind = REQUEST_PNG;
+    format = OUT_PNG8;
+    outName = NULL;
+    repeats = 1;
+    stop = 0;
+
+    /* Write errors are reported by serviceWrite */
+    signal(SIGPIPE, SIG_IGN);
+
+    while ((c = getopt(argc, argv, "x:y:d:bhf:o:R:n:Q")) != -1) {
+        switch (c) {
+        case 'x':
+            request.blockx = atoi(optarg);
+            break;
+        case 'y':
+            request.blocky = atoi(optarg);
+            break;
+        case 'd':
+            request.dispLimit = atoi(optarg);
+            break;
+        case 'b':
+            request.search = SEARCH_BRUTE;
+            break;
+        case 'h':
+            request.search = SEARCH_HIERARCHIC;
+            break;
+        case 'f':
+            if (parseOutputFormat(optarg, &format) == EXIT_FAILURE) {
+                fprintf(stderr, "Unknown output format!\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'o':
+            outName = optarg;
+            break;
+        case 'R':
+            if (sscanf(optarg, "%ux%u", &request.width, &request.height) != 2) {
+                fprintf(stderr, "Expected -R <w>x<h>!\n");
+                return EXIT_FAILURE;
+            }
+            request.kind = REQUEST_RAW;
+            break;
+        case 'n':
+            repeats = atoi(optarg);
+            break;
+        case 'Q':
+            stop = 1;
+            break;
+        default:
+            printf("Usage: %s [options] <socket> <left> <right>\n"
+                   "       %s -Q <socket>\n"
+                   "Sends a stereo-pair to a depthmap daemon (-D) and saves the result.\n"
+                   "-x <>, -y <>, -d <>  block size and disparity limit, daemon's by default\n"
+                   "-b      bruteforce, -h hierarchic search, daemon's by default\n"
+                   "-f <>   output format png8 (default), png16, pfm or raw\n"
+                   "-o <>   output file, - for standard output\n"
+                   "-R <>   images are raw 32-bit pixels of <w>x<h>, not png\n"
+                   "-n <>   send the pair this many times\n"
+                   "-Q      stop the daemon\n", argv[0], argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (stop) {
+        if (optind+1 != argc) {
+            fprintf(stderr, "Expected <socket>!\n");
+            return EXIT_FAILURE;
+        }
+        request.kind = REQUEST_SHUTDOWN;
+        if (exchange(argv[optind], &request, NULL, NULL, &response,
+                     &depthmap) == EXIT_FAILURE)
+            return EXIT_FAILURE;
+        return (response.status == STATUS_OK) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    if (optind+3 != argc) {
+        fprintf(stderr, "Expected <socket> <left> <right>!\n");
+        return EXIT_FAILURE;
+    }
+
+    /* Depthmap data goes to stdout, informative prints to stderr */
+    if (outName != NULL && strcmp(outName, "-") == 0)
+        reserveStdout();
+    if (outName == NULL) {
+        sprintf(defaultName, "depth01p%s", outputExtension(format));
+        outName = defaultName;
+    }
+    request.format = outputDispFormat(format);
+
+    data0 = readFile(argv[optind+1], &request.size0);
+    data1 = readFile(argv[optind+2], &request.size1);
+    if (data0 == NULL || data1 == NULL) {
+        free(data0);
+        free(data1);
+        return EXIT_FAILURE;
+    }
+
+    error = EXIT_SUCCESS;
+    depthmap = NULL;
+    for (i = 0; i < repeats && error == EXIT_SUCCESS; i++) {
+        free(depthmap);
+        time1 = doubleTime();
+        error = exchange(argv[optind], &request, data0, data1, &response, &depthmap);
+        time2 = doubleTime();
+        if (error == EXIT_FAILURE)
+            break;
+        printf("%s: %.1lf ms, queue depth %u, waited %.1lf ms, depthmap %.1lf ms.\n",
+               (response.status <= STATUS_FAILED) ? statusNames[response.status] : "?",
+               (time2-time1)*1000, response.queueDepth, response.waitUs/1000.0,
+               response.processUs/1000.0);
+        if (response.status != STATUS_OK || depthmap == NULL)
+            error = EXIT_FAILURE;
+    }
+    if (error == EXIT_SUCCESS)
+        error = writeDepthmap(outName, depthmap, response.width, response.height, format);
+
+    free(depthmap);
+    free(data0);
+    free(data1);
+
+    return error;
+}
@@ -1,6 +1,11 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <CL/cl.h>
 
+#include "common_opencl.h"
+#include "clcache.h"
+#include "doubleTime.h"
+
 /* Print info required by task2-phase. */
 void printfInfo(cl_device_id device) {
 
@@ -63,13 +68,348 @@ cl_float eventRuntime(cl_event event) {
     return (cl_float)time_executing/1e6f;
 }
 
+int ensureBuffer(cl_context context, struct oclBuffer *buf, size_t size) {
+    cl_int err;
+
+    if (buf->mem != NULL && buf->size >= size)
+        return EXIT_SUCCESS;
+
+    releaseBuffer(buf);
+    buf->mem = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, &err);
+    if (err != CL_SUCCESS) {
+        fprintf(stderr, "Couldn't create a buffer of %zu bytes. Code: %d\n",
+                size, err);
+        buf->mem = NULL;
+        return EXIT_FAILURE;
+    }
+    buf->size = size;
+
+    return EXIT_SUCCESS;
+}
+
+void releaseBuffer(struct oclBuffer *buf) {
+    if (buf->mem != NULL)
+        clReleaseMemObject(buf->mem);
+    buf->mem = NULL;
+    buf->size = 0;
+}
+
+int readBuffer(cl_command_queue queue, const struct oclBuffer *buf,
+               void *host, size_t size) {
+    cl_int err;
+
+    if (buf->mem == NULL || buf->size < size) {
+        fprintf(stderr, "Buffer holds less than %zu bytes!\n", size);
+        return EXIT_FAILURE;
+    }
+    err = clEnqueueReadBuffer(queue, buf->mem, CL_TRUE, 0, size, host,
+                              0, NULL, NULL);
+    if (err != CL_SUCCESS) {
+        fprintf(stderr, "Couldn't read a buffer. Code: %d\n", err);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+int wrapHostMemory(cl_context context, struct oclBuffer *buf,
+                   void *host, size_t size, cl_mem_flags flags) {
+    cl_int err;
+
+    releaseBuffer(buf);
+    buf->mem = clCreateBuffer(context, flags | CL_MEM_USE_HOST_PTR, size, host, &err);
+    if (err != CL_SUCCESS) {
+        fprintf(stderr, "Couldn't wrap %zu bytes of host memory. Code: %d\n",
+                size, err);
+        buf->mem = NULL;
+        return EXIT_FAILURE;
+    }
+    buf->size = size;
+
+    return EXIT_SUCCESS;
+}
+
+int hostUnifiedMemory(cl_device_id device) {
+    cl_bool unified;
+
+    /* Query fails on OpenCL 1.0 devices */
+    if (clGetDeviceInfo(device, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(cl_bool),
+                        &unified, NULL) != CL_SUCCESS)
+        return 0;
+
+    return (unified == CL_TRUE);
+}
+
+void *allocHostPages(size_t size) {
+    void *ptr;
+
+    if (posix_memalign(&ptr, HOST_PAGE_SIZE, size) != 0)
+        return NULL;
+
+    return ptr;
+}
+
+int createKernels(cl_program program, int count, const char *names[],
+                  cl_kernel *kernels[]) {
+    cl_int err;
+    int i;
+
+    for (i=0; i < count; i++) {
+        (*kernels[i]) = clCreateKernel(program, names[i], &err);
+        if (err != CL_SUCCESS) {
+            fprintf(stderr, "Couldn't create kernel %s! Code: %d\n", names[i], err);
+            for (i=i-1; i >= 0; i--)
+                clReleaseKernel((*kernels[i]));
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+void eventLogReset(struct eventLog *log) {
+    int i;
+
+    for (i=0; i < log->count; i++)
+        clReleaseEvent(log->events[i]);
+    log->count = 0;
+    log->stageStart = 0;
+    log->waitStart = 0;
+    log->waitCount = 0;
+    log->lines = 0;
+    log->pending = 0;
+}
+
+int eventLogLine(struct eventLog *log, int parent, const char *label) {
+
+    if (log->lines == EVENTLOG_LINES)
+        return -1;
+
+    snprintf(log->labels[log->lines], sizeof(log->labels[0]), "%s", label);
+    log->parent[log->lines] = parent;
+
+    return log->lines++;
+}
+
+void eventLogStage(struct eventLog *log) {
+
+    /* Empty stage keeps the previous wait list */
+    if (log->count == log->stageStart)
+        return;
+
+    log->waitStart = log->stageStart;
+    log->waitCount = log->count - log->stageStart;
+    log->stageStart = log->count;
+}
+
+const cl_event *eventLogWait(struct eventLog *log) {
+    return (log->waitCount > 0) ? &log->events[log->waitStart] : NULL;
+}
+
+cl_event *eventLogNext(struct eventLog *log, int line) {
+
+    if (log->count == EVENTLOG_EVENTS) {
+        fprintf(stderr, "Event log is full, commands can't wait for each other!\n");
+        log->pending = -1;
+        return NULL;
+    }
+    log->eventLine[log->count] = line;
+    log->names[log->count][0] = '\0';
+    log->dims[log->count] = 0;
+    log->bytes[log->count] = 0;
+    log->pending = 1;
+
+    return &log->events[log->count];
+}
+
+cl_int eventLogCommit(struct eventLog *log, cl_int err, const char *name,
+                      size_t bytes) {
+    int pending;
+
+    pending = log->pending;
+    log->pending = 0;
+    if (err != CL_SUCCESS)
+        return err;
+    /* Command was enqueued without an event, nothing orders it */
+    if (pending != 1)
+        return CL_OUT_OF_RESOURCES;
+
+    snprintf(log->names[log->count], sizeof(log->names[0]), "%s", name);
+    log->bytes[log->count] = bytes;
+    log->count++;
+
+    return CL_SUCCESS;
+}
+
+cl_int eventLogKernel(struct eventLog *log, int line, cl_command_queue queue,
+                      cl_kernel kernel, cl_uint dims, const size_t *offset,
+                      const size_t *global, const size_t *local, size_t bytes) {
+    cl_int err;
+    cl_uint i;
+    int n;
+
+    err = clEnqueueNDRangeKernel(queue, kernel, dims, offset, global, local,
+                                 EVENTLOG_DEPS(log, line));
+    err = eventLogCommit(log, err, "kernel", bytes);
+    if (err != CL_SUCCESS)
+        return err;
+
+    n = log->count-1;
+    clGetKernelInfo(kernel, CL_KERNEL_FUNCTION_NAME, sizeof(log->names[0]),
+                    log->names[n], NULL);
+    log->dims[n] = dims;
+    for (i=0; i < dims && i < 3; i++) {
+        log->global[n][i] = global[i];
+        log->local[n][i] = (local != NULL) ? local[i] : 0;
+    }
+
+    return err;
+}
+
+/* Runtime of a line and its children */
+static float eventLogLineTime(struct eventLog *log, int line) {
+    float time = 0.0f;
+    int i;
+
+    for (i=0; i < log->count; i++)
+        if (log->eventLine[i] == line)
+            time += eventRuntime(log->events[i]);
+    for (i=line+1; i < log->lines; i++)
+        if (log->parent[i] == line)
+            time += eventLogLineTime(log, i);
+
+    return time;
+}
+
+void eventLogPrint(struct eventLog *log) {
+    int i;
+
+    for (i=0; i < log->lines; i++)
+        printf("%-32s%6.1f ms.\n", log->labels[i], eventLogLineTime(log, i));
+}
+
+/* Trace rows: kernels and transfers run on the device, the other two show
+ * how long commands waited on the host and in the runtime. */
+enum {TRACE_KERNELS = 1, TRACE_TRANSFERS, TRACE_QUEUED, TRACE_SUBMITTED};
+
+struct oclTrace *traceOpen(const char *filename) {
+    struct oclTrace *trace;
+    const char *rows[] = {"kernels", "transfers", "queued (host)",
+                          "submitted (runtime)"};
+    int i;
+
+    trace = calloc(1, sizeof(struct oclTrace));
+    if (trace == NULL)
+        return NULL;
+    trace->file = fopen(filename, "w");
+    if (trace->file == NULL) {
+        fprintf(stderr, "Couldn't open trace file %s\n", filename);
+        free(trace);
+        return NULL;
+    }
+
+    fprintf(trace->file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (i=0; i < 4; i++) {
+        fprintf(trace->file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", "
+                "\"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                (trace->events > 0) ? ",\n" : "", TRACE_KERNELS+i, rows[i]);
+        trace->events++;
+    }
+
+    return trace;
+}
+
+void traceClose(struct oclTrace *trace) {
+
+    if (trace == NULL)
+        return;
+    fprintf(trace->file, "\n]}\n");
+    fclose(trace->file);
+    free(trace);
+}
+
+/* Complete event ("X") from t0 to t1 in device ns */
+static void traceSpan(struct oclTrace *trace, int tid, const char *name,
+                      cl_ulong t0, cl_ulong t1) {
+    fprintf(trace->file, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, "
+            "\"tid\": %d, \"ts\": %.3f, \"dur\": %.3f", name, tid,
+            (t0-trace->base)/1e3, (t1 > t0) ? (t1-t0)/1e3 : 0.0);
+    trace->events++;
+}
+
+void eventLogTrace(struct eventLog *log, struct oclTrace *trace) {
+    cl_ulong queued, submit, start, end;
+    cl_command_type type;
+    const char *name;
+    char typeName[32];
+    cl_uint j;
+    int i;
+
+    for (i=0; i < log->count; i++) {
+        if (clGetEventProfilingInfo(log->events[i], CL_PROFILING_COMMAND_QUEUED,
+                                    sizeof(cl_ulong), &queued, NULL) != CL_SUCCESS ||
+            clGetEventProfilingInfo(log->events[i], CL_PROFILING_COMMAND_SUBMIT,
+                                    sizeof(cl_ulong), &submit, NULL) != CL_SUCCESS ||
+            clGetEventProfilingInfo(log->events[i], CL_PROFILING_COMMAND_START,
+                                    sizeof(cl_ulong), &start, NULL) != CL_SUCCESS ||
+            clGetEventProfilingInfo(log->events[i], CL_PROFILING_COMMAND_END,
+                                    sizeof(cl_ulong), &end, NULL) != CL_SUCCESS)
+            continue;
+
+        if (trace->frames == 0 && trace->base == 0)
+            trace->base = queued;
+        if (i == 0) {
+            fprintf(trace->file, ",\n{\"name\": \"frame %d\", \"ph\": \"i\", "
+                    "\"s\": \"g\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f}",
+                    trace->frames, TRACE_KERNELS, (queued-trace->base)/1e3);
+            trace->events++;
+        }
+
+        name = log->names[i];
+        if (name[0] == '\0') {
+            if (clGetEventInfo(log->events[i], CL_EVENT_COMMAND_TYPE,
+                               sizeof(type), &type, NULL) != CL_SUCCESS)
+                type = 0;
+            snprintf(typeName, sizeof(typeName), "command 0x%x", type);
+            name = typeName;
+        }
+
+        traceSpan(trace, TRACE_QUEUED, name, queued, submit);
+        fprintf(trace->file, "}");
+        traceSpan(trace, TRACE_SUBMITTED, name, submit, start);
+        fprintf(trace->file, "}");
+
+        traceSpan(trace, (log->dims[i] > 0) ? TRACE_KERNELS : TRACE_TRANSFERS,
+                  name, start, end);
+        fprintf(trace->file, ", \"args\": {\"frame\": %d, \"line\": \"%s\", "
+                "\"queued_us\": %.3f, \"submit_us\": %.3f, \"start_us\": %.3f, "
+                "\"end_us\": %.3f, \"bytes\": %zu",
+                trace->frames,
+                (log->eventLine[i] >= 0) ? log->labels[log->eventLine[i]] : "",
+                (queued-trace->base)/1e3, (submit-trace->base)/1e3,
+                (start-trace->base)/1e3, (end-trace->base)/1e3, log->bytes[i]);
+        if (log->dims[i] > 0) {
+            fprintf(trace->file, ", \"global\": [");
+            for (j=0; j < log->dims[i]; j++)
+                fprintf(trace->file, "%s%zu", (j > 0) ? ", " : "", log->global[i][j]);
+            fprintf(trace->file, "], \"local\": [");
+            for (j=0; j < log->dims[i]; j++)
+                fprintf(trace->file, "%s%zu", (j > 0) ? ", " : "", log->local[i][j]);
+            fprintf(trace->file, "]");
+        }
+        fprintf(trace->file, "}}");
+    }
+    trace->frames++;
+    fflush(trace->file);
+}
+
 cl_int buildOCLProgram(cl_device_id device, cl_context context,
-                       const char *filename, cl_program *program) {
+                       const char *filename, const char *options,
+                       cl_program *program) {
         /* Build program */
         FILE *handle;
         char *buffer, *log;
         size_t program_size, log_size;
         cl_int err;
+        double hostTime1, hostTime2;
 
         handle = fopen(filename, "r");
         if (handle == NULL) {
@@ -88,29 +428,46 @@ cl_int buildOCLProgram(cl_device_id device, cl_context context,
         }
         fclose(handle);
 
+        hostTime1 = doubleTime();
+
+        if (loadCachedProgram(device, context, buffer, program_size,
+                              options, program) == EXIT_SUCCESS) {
+                free(buffer);
+                hostTime2 = doubleTime();
+                printf("Program build (cached binary):  %6.1lf ms.\n",
+                       (hostTime2-hostTime1)*1e3);
+                return EXIT_SUCCESS;
+        }
+
         (*program) = clCreateProgramWithSource(context, 1, (const char **)&buffer, &program_size, &err);
         if (err < 0) {
                 perror("Couldn't create OpenCL-program");
+                free(buffer);
                 return EXIT_FAILURE;
         }
-        free(buffer);
 
-        err = clBuildProgram((*program), 0, NULL, NULL, NULL, NULL);
+        err = clBuildProgram((*program), 1, &device, options, NULL, NULL);
         if (err < 0) {
                 clGetProgramBuildInfo((*program), device, CL_PROGRAM_BUILD_LOG, 0, NULL, &log_size);
                 log = malloc(log_size+1);
                 clGetProgramBuildInfo((*program), device, CL_PROGRAM_BUILD_LOG, log_size+1, log, NULL);
                 fprintf(stderr, "%s\n", log);
                 free(log);
+                free(buffer);
                 return EXIT_FAILURE;
         }
+        hostTime2 = doubleTime();
+        printf("Program build (source):         %6.1lf ms.\n",
+               (hostTime2-hostTime1)*1e3);
+
+        saveCachedProgram(device, (*program), buffer, program_size, options);
+        free(buffer);
 
         return EXIT_SUCCESS;
 }
 
-int initOpenCL(cl_platform_id *platform, cl_device_id *device,
-               cl_context *context, cl_program *program, cl_device_type devType,
-               const char *sourceFile) {
+int initOpenCLDevice(cl_platform_id *platform, cl_device_id *device,
+                     cl_context *context, cl_device_type devType) {
         int err;
 
         err = clGetPlatformIDs(1, platform, NULL);
@@ -139,9 +496,18 @@ int initOpenCL(cl_platform_id *platform, cl_device_id *device,
                 perror("Couldn't create a context");
                 return EXIT_FAILURE;
         }
+        return EXIT_SUCCESS;
+}
+
+int initOpenCL(cl_platform_id *platform, cl_device_id *device,
+               cl_context *context, cl_program *program, cl_device_type devType,
+               const char *sourceFile) {
+
+        if (initOpenCLDevice(platform, device, context, devType) == EXIT_FAILURE)
+                return EXIT_FAILURE;
 
         /* Build OpenCL source-file */
-        if (buildOCLProgram((*device), (*context), sourceFile, program) == EXIT_FAILURE) {
+        if (buildOCLProgram((*device), (*context), sourceFile, "", program) == EXIT_FAILURE) {
                 fprintf(stderr, "cl-file did not compile.\n");
                 return EXIT_FAILURE;
         }
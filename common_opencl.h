@@ -1,22 +1,178 @@
 #ifndef COMMON_OPENCL_H
 #define COMMON_OPENCL_H
 
+#include <stdio.h>
 #include <CL/cl.h>
 
+#include "disparity.h"
+
 typedef enum {BRUTE_CL, HIERARCHIC_CL} searchMethod_ocl;
 
 typedef enum {CPU = 1, GPU = 2} device_ocl;
 
 
+/* Selects first device of devType and creates a context for it. */
+int initOpenCLDevice(cl_platform_id *platform, cl_device_id *device,
+                     cl_context *context, cl_device_type devType);
+
+/* initOpenCLDevice and a program built from sourceFile. */
 int initOpenCL(cl_platform_id *platform, cl_device_id *device,
                cl_context *context, cl_program *program, cl_device_type devType,
                const char *sourceFile);
 
+/* Builds program from source file with build options, or loads a binary
+ * cached for the same source and options. */
 cl_int buildOCLProgram(cl_device_id device, cl_context context,
-                       const char *filename, cl_program *program);
+                       const char *filename, const char *options,
+                       cl_program *program);
 
 void printfInfo(cl_device_id device);
 
 cl_float eventRuntime(cl_event event);
 
+/* Device buffer that is kept over several stereo-pairs. */
+struct oclBuffer {
+    cl_mem mem;
+    size_t size;
+};
+
+/* Makes sure buffer holds atleast size bytes. Contents are not kept if
+ * buffer has to be reallocated. Returns EXIT_SUCCESS or EXIT_FAILURE. */
+int ensureBuffer(cl_context context, struct oclBuffer *buf, size_t size);
+
+void releaseBuffer(struct oclBuffer *buf);
+
+/* Blocking read of size bytes from the start of a buffer, after all
+ * commands of queue. Fails if the buffer is smaller.
+ * Returns EXIT_SUCCESS or EXIT_FAILURE. */
+int readBuffer(cl_command_queue queue, const struct oclBuffer *buf,
+               void *host, size_t size);
+
+/* OpenCL 1.1, compiled against 1.0 headers */
+#ifndef CL_DEVICE_HOST_UNIFIED_MEMORY
+#define CL_DEVICE_HOST_UNIFIED_MEMORY 0x1035
+#endif
+
+/* Alignment of host memory that devices can use without copying */
+#define HOST_PAGE_SIZE 4096
+
+/* Replaces buffer with one using host memory directly (CL_MEM_USE_HOST_PTR).
+ * Host memory has to stay valid until the buffer is released.
+ * Returns EXIT_SUCCESS or EXIT_FAILURE. */
+int wrapHostMemory(cl_context context, struct oclBuffer *buf,
+                   void *host, size_t size, cl_mem_flags flags);
+
+/* Nonzero if device and host share memory, e.g. a CPU device. */
+int hostUnifiedMemory(cl_device_id device);
+
+/* Page-aligned allocation, freed with free(). NULL on failure. */
+void *allocHostPages(size_t size);
+
+/* Creates count kernels by name. On failure releases already created ones.
+ * Returns EXIT_SUCCESS or EXIT_FAILURE. */
+int createKernels(cl_program program, int count, const char *names[],
+                  cl_kernel *kernels[]);
+
+
+/* Launch parameters of the kernels. Defaults are replaced by a configuration
+ * tuned for the device with -T, when there is one. Fields that an OpenCL
+ * version doesn't use are ignored. */
+struct tuneConfig {
+    /* Basic: work-group of znccTiled, tileX 0 disables tiles */
+    unsigned int tileX, tileY;
+    /* Basic: work-group width of zncc without tiles, 0 lets runtime choose */
+    unsigned int znccLocal;
+    /* Amd: work-group width of constructDmaps */
+    unsigned int dmapsLocal;
+    /* Amd: correlation window is processed in this many bands */
+    unsigned int bands;
+};
+
+#define TUNE_DEFAULTS {16, 4, 1, 4, 4}
+
+/* Enough for the longest path, hierarchic search enqueues about 40 commands */
+#define EVENTLOG_EVENTS 128
+#define EVENTLOG_LINES 32
+
+/* Events of one depthmap. Commands are enqueued in stages, each waiting for
+ * all commands of the previous stage, and events are kept for profiling
+ * until the result has been read. Profiling is reported in lines, a line
+ * with a parent is also summed to the parent. */
+struct eventLog {
+    cl_event events[EVENTLOG_EVENTS];
+    int eventLine[EVENTLOG_EVENTS];
+    int count;
+    int stageStart;
+    int waitStart;
+    cl_uint waitCount;
+    /* 1: eventLogNext handed out a slot, -1: log was full */
+    int pending;
+
+    char labels[EVENTLOG_LINES][40];
+    int parent[EVENTLOG_LINES];
+    int lines;
+
+    /* What each command was, for the trace */
+    char names[EVENTLOG_EVENTS][32];
+    cl_uint dims[EVENTLOG_EVENTS];
+    size_t global[EVENTLOG_EVENTS][3];
+    size_t local[EVENTLOG_EVENTS][3];
+    size_t bytes[EVENTLOG_EVENTS];
+};
+
+/* Releases events of previous depthmap, if any, and empties the log. */
+void eventLogReset(struct eventLog *log);
+
+/* Adds a profiling line and returns its index, -1 for no line. */
+int eventLogLine(struct eventLog *log, int parent, const char *label);
+
+/* Following commands wait for the ones enqueued since previous call. */
+void eventLogStage(struct eventLog *log);
+
+/* Wait list of the current stage. NULL when there is nothing to wait. */
+const cl_event *eventLogWait(struct eventLog *log);
+
+/* Slot for the event of a command belonging to line (-1 for none), kept by
+ * eventLogCommit. NULL when the log is full. */
+cl_event *eventLogNext(struct eventLog *log, int line);
+
+/* Last 3 arguments of clEnqueue*-calls: wait for previous stage and record
+ * the event for line. The result of the call goes to eventLogCommit. */
+#define EVENTLOG_DEPS(log, line) \
+    (log)->waitCount, eventLogWait(log), eventLogNext((log), (line))
+
+/* Keeps the event of a command enqueued with EVENTLOG_DEPS when err is
+ * CL_SUCCESS, with a name and the bytes it moved for the trace. Returns err,
+ * or CL_OUT_OF_RESOURCES when the log was full and the command has no event
+ * for the next stage to wait. */
+cl_int eventLogCommit(struct eventLog *log, cl_int err, const char *name,
+                      size_t bytes);
+
+/* clEnqueueNDRangeKernel in the current stage. Kernel name, sizes and
+ * bytes the kernel reads and writes are kept for the trace. */
+cl_int eventLogKernel(struct eventLog *log, int line, cl_command_queue queue,
+                      cl_kernel kernel, cl_uint dims, const size_t *offset,
+                      const size_t *global, const size_t *local, size_t bytes);
+
+/* Prints runtimes of the lines. Events must have completed. */
+void eventLogPrint(struct eventLog *log);
+
+/* Chrome trace (chrome://tracing, Perfetto) of every command's queued,
+ * submit, start and end time. Frames are appended to one timeline. */
+struct oclTrace {
+    FILE *file;
+    int events;
+    int frames;
+    cl_ulong base;
+};
+
+/* NULL on failure */
+struct oclTrace *traceOpen(const char *filename);
+
+/* Finishes the JSON and closes the file. */
+void traceClose(struct oclTrace *trace);
+
+/* Appends commands of a depthmap to the trace. Events must have completed. */
+void eventLogTrace(struct eventLog *log, struct oclTrace *trace);
+
 #endif
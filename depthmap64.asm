@@ -9,6 +9,8 @@ global scanline_cacheBlkData_sse
 
 global blendWorker_sse2
 
+global blendWorkerN_sse2
+
 global blend_2x2_sse3
 
 extern posix_memalign
@@ -50,7 +52,7 @@ znccWorker_sse3:
     push    r14
     push    r13
     push    r12
-    sub     rsp,    136
+    sub     rsp,    168
 
     mov     [rsp],  rdi
     mov     eax,    [rdi+48]
@@ -94,6 +96,15 @@ znccWorker_sse3:
     mov     [rsp+120],  eax
     mov     [rsp+124],  eax
 
+    ; Constants and parameters for sub-pixel fitting
+    mov     DWORD [rsp+136],    0x3f000000  ; 0.5
+    mov     DWORD [rsp+140],    0xbf000000  ; -0.5
+    mov     DWORD [rsp+144],    0x41800000  ; 16.0 (DISP_SUBPIXEL_SCALE)
+    mov     eax,    [rdi+112]
+    mov     [rsp+148],  eax     ; subpixel method
+    mov     rax,    [rdi+104]
+    mov     [rsp+152],  rax     ; *dmap1Sub
+
 .whileTop:
     mov     r11,    [rsp]
     mov     rdi,    [r11+8]     ; load ptr for mutex
@@ -199,6 +210,15 @@ znccWorker_sse3:
 
             movss   xmm15,  [rsp+112]   ; load FLT_MAX
 
+            ; Correlations around the best d for sub-pixel fitting:
+            ; xmm12 previous, xmm11 left and xmm10 right neighbour.
+            ; r11d is set when the next correlation is the right neighbour.
+            movaps  xmm12,  xmm15
+            movaps  xmm11,  xmm15
+            movaps  xmm10,  xmm15
+            xor     r11d,   r11d
+            xor     r10d,   r10d        ; flat blocks (NaN) get disparity 0
+
             mov     r12d,   [rsp+52]
             imul    r12d,   r14d        ; x*blkStride
             mov     r13d,   r12d
@@ -284,11 +304,21 @@ znccWorker_sse3:
                 haddps  xmm0,   xmm0
                 mulss   xmm0,   xmm7
 
+                test    r11d,   r11d
+                jz .SKIP_RIGHT_NEIGHBOUR
+                movaps  xmm10,  xmm0
+                xor     r11d,   r11d
+                .SKIP_RIGHT_NEIGHBOUR:
+
                 ucomiss xmm0,   xmm15
                 jb .SKIP_SAVE_CURRENT_d_left
                 mov     r10d,   eax
                 movaps  xmm15,  xmm0
+                movaps  xmm11,  xmm12       ; left neighbour
+                movss   xmm10,  [rsp+112]   ; right neighbour not known yet
+                mov     r11d,   1
                 .SKIP_SAVE_CURRENT_d_left:
+                movaps  xmm12,  xmm0
                 mov     r8,     [rsp+24]
                 shl     eax,    2
                 sub     r8,     rax
@@ -314,6 +344,61 @@ znccWorker_sse3:
             add     r8,     r14
             mov     BYTE [r8],  r10b
 
+            ; Sub-pixel disparity, (d+offset)*DISP_SUBPIXEL_SCALE
+            mov     r9,     [rsp+152]
+            test    r9,     r9
+            jz .SKIP_SUBPIXEL
+            sub     r8,     [rsp+8]     ; scanLine*width+x
+            lea     r9,     [r9+r8*2]
+            xorps   xmm6,   xmm6        ; offset
+            movss   xmm7,   [rsp+112]
+            ucomiss xmm11,  xmm7        ; No fitting at the ends of the
+            je .SUBPIXEL_STORE          ; search range
+            ucomiss xmm10,  xmm7
+            je .SUBPIXEL_STORE
+            cmp     DWORD [rsp+148],    2   ; SUBPIXEL_EQUIANGULAR
+            je .EQUIANGULAR
+            ; Parabola: (cL-cR) / (2*(cL-2*cB+cR))
+            movaps  xmm6,   xmm11
+            subss   xmm6,   xmm10
+            movaps  xmm8,   xmm11
+            addss   xmm8,   xmm10
+            subss   xmm8,   xmm15
+            subss   xmm8,   xmm15
+            addss   xmm8,   xmm8
+            divss   xmm6,   xmm8
+            jmp .CLAMP_OFFSET
+            .EQUIANGULAR:
+            ; Equiangular: 0.5*(cR-cL) / (cB-min(cL,cR))
+            movaps  xmm6,   xmm10
+            subss   xmm6,   xmm11
+            mulss   xmm6,   [rsp+136]
+            movaps  xmm8,   xmm11
+            minss   xmm8,   xmm10
+            movaps  xmm9,   xmm15
+            subss   xmm9,   xmm8
+            divss   xmm6,   xmm9
+            .CLAMP_OFFSET:
+            ucomiss xmm6,   xmm6
+            jp .NAN_OFFSET              ; Flat blocks give NaNs
+            minss   xmm6,   [rsp+136]
+            maxss   xmm6,   [rsp+140]
+            jmp .SUBPIXEL_STORE
+            .NAN_OFFSET:
+            xorps   xmm6,   xmm6
+            .SUBPIXEL_STORE:
+            cvtsi2ss    xmm7,   r10d
+            addss   xmm6,   xmm7
+            mulss   xmm6,   [rsp+144]
+            addss   xmm6,   [rsp+136]
+            cvttss2si   r8d,    xmm6
+            test    r8d,    r8d
+            jns .SUBPIXEL_POSITIVE
+            xor     r8d,    r8d
+            .SUBPIXEL_POSITIVE:
+            mov     WORD [r9],  r8w
+            .SKIP_SUBPIXEL:
+
             add     r14d,   1
             cmp     r14d,   [rsp+72]
             jl .xITER
@@ -325,7 +410,7 @@ znccWorker_sse3:
     jmp .whileTop
 
 .End:
-    add     rsp,    136
+    add     rsp,    168
     pop     r12
     pop     r13
     pop     r14
@@ -785,6 +870,157 @@ blendWorker_sse2:
     mov     r15d,   ecx
     jmp .modifiedR15again
 
+;------------------------------------
+;void *blendWorkerN(void *threadData)
+;------------------------------------
+; Generic version of blendWorker_sse2 for factors 1, 2 and 8.
+; Work is divided in output scanlines, same as in c-version.
+; params (rdi)
+; Callee saved: rbx, rbp, r12-r15
+blendWorkerN_sse2:
+
+    push    rbx
+    push    rbp
+    push    r12
+    push    r13
+    push    r14
+    push    r15
+    sub     rsp,    56
+
+    mov     [rsp],  rdi
+    mov     ecx,    [rdi+48]    ; factor
+    mov     [rsp+32],   ecx
+    mov     eax,    [rdi+32]
+    mov     [rsp+8],    eax     ; width
+    xor     edx,    edx
+    div     ecx
+    mov     [rsp+36],   eax     ; width/factor
+    mov     eax,    [rdi+36]
+    xor     edx,    edx
+    div     ecx
+    mov     [rsp+12],   eax     ; height/factor
+    bsf     eax,    ecx
+    shl     eax,    1
+    mov     [rsp+40],   eax     ; shift to divide by factor*factor
+
+    ;    rgbConv weights
+    mov     eax,        0x00000000
+    mov     [rsp+28],   eax
+    mov     eax,        0x3d93dd98
+    mov     [rsp+24],   eax
+    mov     eax,        0x3f371759
+    mov     [rsp+20],   eax
+    mov     eax,        0x3e59b3d0
+    mov     [rsp+16],   eax
+
+.whileTop:
+    mov     r11,    [rsp]
+    mov     rdi,    [r11+8]     ; load ptr for mutex
+    call    pthread_mutex_lock wrt ..plt
+    mov     rdi,    [rsp]
+    mov     r11,    [rdi+16]    ; load ptr for first_available
+    mov     r14d,   [r11]       ; y
+    mov     r15d,   r14d
+    add     r15d,   32          ; lasty
+    mov     r9d,    [rdi]       ; threadsN
+    cmp     r9d,    1
+    jg .moreThreads
+    mov     r15d,   [rsp+12]    ; all scanlines with 1 thread
+.moreThreads:
+    mov     [r11],  r15d        ; update first_available
+    mov     rdi,    [rdi+8]
+    call    pthread_mutex_unlock wrt ..plt
+
+    cmp     r14d,   [rsp+12]
+    jge .End                    ; No scanlines to process, exit the while-loop
+    cmp     r15d,   [rsp+12]
+    jle .lastDidNotGoOver
+    mov     r15d,   [rsp+12]
+.lastDidNotGoOver:
+
+    pxor    xmm7,   xmm7        ; zero vector
+    movd    xmm6,   [rsp+40]    ; shift
+    mov     ebp,    [rsp+8]
+    shl     ebp,    2           ; line-stride
+    mov     r12d,   [rsp+32]    ; factor
+
+    .yTop:
+        mov     rdi,    [rsp]
+        mov     eax,    r14d
+        imul    eax,    r12d
+        imul    rax,    rbp
+        mov     rbx,    [rdi+24]
+        add     rbx,    rax         ; src-pointer for a block-row
+        mov     eax,    r14d
+        imul    eax,    [rsp+36]
+        mov     r13,    [rdi+40]
+        lea     r13,    [r13+rax*4] ; dst-pointer for a line
+        mov     r9d,    [rsp+36]    ; x-counter
+
+        .xTop:
+            pxor    xmm0,   xmm0        ; 16-bit accumulators
+            mov     rsi,    rbx
+            mov     r10d,   r12d        ; rows left in a block
+            .rowTop:
+                cmp     r12d,   1
+                jne .pixelPairs
+                movd        xmm1,   [rsi]   ; single pixel
+                punpcklbw   xmm1,   xmm7
+                paddw       xmm0,   xmm1
+                jmp .rowDone
+                .pixelPairs:
+                xor     r11,    r11
+                mov     r8d,    r12d
+                shl     r8d,    2           ; bytes in a block-row
+                .pairTop:
+                    movq        xmm1,   [rsi+r11]   ; 2 pixels
+                    punpcklbw   xmm1,   xmm7
+                    paddw       xmm0,   xmm1
+                    add     r11,    8
+                    cmp     r11,    r8
+                    jl .pairTop
+                .rowDone:
+                add     rsi,    rbp
+                sub     r10d,   1
+                jnz .rowTop
+
+            pshufd      xmm1,   xmm0,   0xe     ; add pixel-pairs together
+            paddw       xmm0,   xmm1
+            punpcklwd   xmm0,   xmm7
+            psrld       xmm0,   xmm6            ; Divide by factor*factor
+
+            cvtdq2ps    xmm0,   xmm0            ; Convert to floating point
+            mulps       xmm0,   [rsp+16]        ; rgbConv weights
+            movaps      xmm1,   xmm0
+            movaps      xmm2,   xmm0
+            shufps      xmm1,   xmm1,   0x1
+            shufps      xmm2,   xmm2,   0x2
+            addss       xmm0,   xmm1
+            addss       xmm0,   xmm2
+
+            movss   [r13],  xmm0
+
+            add     r13,    4
+            lea     rbx,    [rbx+r12*4]         ; next block
+            sub     r9d,    1
+            jnz .xTop
+
+        add     r14d,   1
+        cmp     r14d,   r15d
+        jl .yTop
+
+    jmp .whileTop
+
+.End:
+    add     rsp,    56
+    pop     r15
+    pop     r14
+    pop     r13
+    pop     r12
+    pop     rbp
+    pop     rbx
+    ret
+
 ;------------------------------------------------------------
 ;float *blend_2x2(float *img, unsigned int w, unsigned int h)
 ;------------------------------------------------------------
@@ -1,29 +1,43 @@
-/* Convert rgba-image to 1/4 dimensions greyscale float-image */
-__kernel void blend4x4_cnvrtToGreyscale(__global uchar *data,
-                                        uint width,
-                                        __global float *converted) {
+/* Built with -DBX=x -DBY=y -DDLIMIT=d, block size and disparity limit
+ * arguments are replaced by constants, so that loops over blocks can be
+ * unrolled. Generic build uses the arguments. */
+#ifdef BX
+#define SPECIALISE_BLOCK(bx, by) (bx) = BX; (by) = BY
+#define SPECIALISE_DLIMIT(dlimit) (dlimit) = DLIMIT
+#else
+#define SPECIALISE_BLOCK(bx, by)
+#define SPECIALISE_DLIMIT(dlimit)
+#endif
+
+/* Convert rgba-image to 1/factor dimensions greyscale float-image.
+ * shift is log2(factor*factor). */
+__kernel void blend_cnvrtToGreyscale(__global uchar *data,
+                                     uint width,
+                                     uint factor,
+                                     uint shift,
+                                     __global float *converted) {
     size_t x, y;
     uint r, g, b, i, j;
 
     x = get_global_id(0);
     y = get_global_id(1);
 
-    if (x < width/4) {
+    if (x < width/factor) {
         r = 0;
         g = 0;
         b = 0;
-        for (j = 0; j < 4; j++) {
-            for (i = 0; i < 4; i++) {
-                r += data[((y*4+j)*width+(x*4+i))*4+0];
-                g += data[((y*4+j)*width+(x*4+i))*4+1];
-                b += data[((y*4+j)*width+(x*4+i))*4+2];
+        for (j = 0; j < factor; j++) {
+            for (i = 0; i < factor; i++) {
+                r += data[((y*factor+j)*width+(x*factor+i))*4+0];
+                g += data[((y*factor+j)*width+(x*factor+i))*4+1];
+                b += data[((y*factor+j)*width+(x*factor+i))*4+2];
             }
         }
-        r = r >> 4;
-        g = g >> 4;
-        b = b >> 4;
+        r = r >> shift;
+        g = g >> shift;
+        b = b >> shift;
 
-        converted[y*(width/4)+x] = 0.2126f*r + 0.7152f*g + 0.0722f*b;
+        converted[y*(width/factor)+x] = 0.2126f*r + 0.7152f*g + 0.0722f*b;
     }
 }
 
@@ -39,6 +53,8 @@ __kernel void cacheBlkData(__global float *image,
     float mean, subtracted, sq_dev;
     uint iteryOffset;
 
+    SPECIALISE_BLOCK(bx, by);
+
     iterx = get_global_id(0);
     itery = get_global_id(1);
     iteryOffset = get_global_offset(1);
@@ -129,6 +145,9 @@ __kernel void zncc_vector(__global float *cache_blk_l,
     uchar d, dlim;
     int interleave, jump, jump2;
 
+    SPECIALISE_BLOCK(bx, by);
+    SPECIALISE_DLIMIT(dlimit);
+
     iterx = get_global_id(0)*8;
     itery = get_global_id(1);
     iteryOffset = get_global_offset(1);
@@ -294,17 +313,43 @@ __kernel void zncc_scalar(__global float *cache_blk_l,
     }
 }
 
+/* Fits a peak to correlations cL, cB and cR of neighbouring disparitys, where
+ * cB is the best one. method is 1 for parabola and 2 for equiangular fitting.
+ * Returns offset to best disparity in range [-0.5, 0.5]. */
+float subpixelOffset(float cL, float cB, float cR, uint method) {
+    float offset;
+
+    if (method == 2) {
+        if (cL < cR)
+            offset = 0.5f*(cR - cL)/(cB - cL);
+        else
+            offset = 0.5f*(cR - cL)/(cB - cR);
+    }
+    else {
+        offset = (cL - cR)/(2.0f*(cL - 2.0f*cB + cR));
+    }
+
+    /* Flat blocks give NaNs */
+    if (isnan(offset))
+        return 0.0f;
+
+    return clamp(offset, -0.5f, 0.5f);
+}
+
 /* zncc2way saves calculated cross correlation values certain way
- * that can be used to calculate depthmaps */
+ * that can be used to calculate depthmaps. If subpixel is nonzero, also saves
+ * sub-pixel offsets of dmap1 to dmap1Offset. */
 __kernel void constructDmaps(__global uchar *dmap1,
                              __global uchar *dmap2,
                              __global float *ccor,
                              uint dlim,
                              uint width,
                              uint bx,
-                             uint by) {
-    uint x, d, dlimit, scanline, scLineOffset, dlimBlock;
-    float val, val2;
+                             uint by,
+                             __global float *dmap1Offset,
+                             uint subpixel) {
+    uint x, d, dlimit, scanline, scLineOffset, dlimBlock, disp, base;
+    float val, val2, ccLeft, ccRight;
 
     /* Scanline for dmap2 is scanline+by/2 */
     x = get_global_id(0);
@@ -340,13 +385,28 @@ __kernel void constructDmaps(__global uchar *dmap1,
             if (dlim+bx/2 > x)
                 dlimit = x-bx/2;
 
+            disp = 0;
             for(d=1; d <= dlimit; d++) {
                 val2 = ccor[((scanline-scLineOffset)*(width-bx+1)+x-bx/2)*(dlimBlock)-d*(dlimBlock)+d];
                 if (val2 > val) {
                     val = val2;
+                    disp = d;
                     dmap1[(scanline+by/2)*width+x] = d;
                 }
             }
+
+            /* Neighbouring correlations are read from the same buffer.
+             * No fitting at the ends of the search range. */
+            if (subpixel != 0) {
+                val2 = 0.0f;
+                if (disp > 0 && disp < dlimit) {
+                    base = ((scanline-scLineOffset)*(width-bx+1)+x-bx/2)*(dlimBlock);
+                    ccLeft = ccor[base-(disp-1)*(dlimBlock)+disp-1];
+                    ccRight = ccor[base-(disp+1)*(dlimBlock)+disp+1];
+                    val2 = subpixelOffset(ccLeft, val, ccRight, subpixel);
+                }
+                dmap1Offset[(scanline+by/2)*width+x] = val2;
+            }
         }
     }
 }
@@ -421,3 +481,79 @@ __kernel void postFill(__global uchar *input,
     }
 
 }
+
+/* Creates crosschecked depthmap with fixed-point disparitys, no rescaling.
+ * If subpixel is nonzero, sub-pixel offsets of dMap1 are added. */
+__kernel void postCrossCorrelation16(__global uchar *dMap1,
+                                     __global uchar *dMap2,
+                                     __global float *dMap1Offset,
+                                     __global ushort *result,
+                                     uint scale,
+                                     uint subpixel) {
+    uint width, x, y;
+    int pixel_l, pixel_r, diff;
+    float val;
+
+    x = get_global_id(0);
+    y = get_global_id(1);
+    width = get_global_size(0);
+
+    pixel_l = dMap1[y*width+x];
+    pixel_r = dMap2[y*width+x-pixel_l];
+
+    diff = abs(pixel_l - pixel_r);
+
+    if (diff > 1) {
+        result[y*width+x] = 0;
+    }
+    /* Offsets are not written where disparity stays 0 */
+    else if (subpixel != 0 && pixel_l > 0) {
+        val = (pixel_l + dMap1Offset[y*width+x])*scale + 0.5f;
+        result[y*width+x] = (val > 0.0f) ? (ushort)val : 0;
+    }
+    else {
+        result[y*width+x] = pixel_l * scale;
+    }
+}
+
+/* postFill for fixed-point disparitys */
+__kernel void postFill16(__global ushort *input,
+                         __global ushort *fill,
+                         uint width) {
+    uint val, val1, val2, val3, val4;
+    uint i, x, y;
+
+    /* Edge pixels would result in overread */
+    x = get_global_id(0)+1;
+    y = get_global_id(1)+1;
+
+    if (input[y*width+x] == 0) {
+        val1 = input[(y-1)*width+x];
+        val2 = input[y*width+x-1];
+        val3 = input[y*width+x+1];
+        val4 = input[(y+1)*width+x];
+        val = 0;
+        i = 0;
+        if (val1 != 0) {
+            val += val1;
+            i++;
+        }
+        if (val2 != 0) {
+            val += val2;
+            i++;
+        }
+        if (val3 != 0) {
+            val += val3;
+            i++;
+        }
+        if (val4 != 0) {
+            val += val4;
+            i++;
+        }
+
+        fill[y*width+x] = (i > 0) ? (ushort)(val/(float)i) : 0;
+    }
+    else {
+        fill[y*width+x] = input[y*width+x];
+    }
+}
@@ -1,28 +1,45 @@
-/* Convert rgba-image to 1/4 dimensions greyscale float-image */
-__kernel void blend4x4_cnvrtToGreyscale(__global uchar *data,
-                                        uint width,
-                                        __global float *converted) {
+/* Built with -DBX=x -DBY=y -DDLIMIT=d, block size and disparity limit
+ * arguments are replaced by constants, so that loops over blocks can be
+ * unrolled. Generic build uses the arguments. */
+#ifdef BX
+#define SPECIALISE_BLOCK(bx, by) (bx) = BX; (by) = BY
+#define SPECIALISE_DLIMIT(dlimit) (dlimit) = DLIMIT
+#else
+#define SPECIALISE_BLOCK(bx, by)
+#define SPECIALISE_DLIMIT(dlimit)
+#endif
+
+/* Convert rgba-image to 1/factor dimensions greyscale float-image.
+ * shift is log2(factor*factor). */
+__kernel void blend_cnvrtToGreyscale(__global uchar *data,
+                                     uint width,
+                                     uint factor,
+                                     uint shift,
+                                     __global float *converted) {
     size_t x, y;
     uint r, g, b, i, j;
 
     x = get_global_id(0);
     y = get_global_id(1);
 
+    if (x >= width/factor)
+        return;
+
     r = 0;
     g = 0;
     b = 0;
-    for (j = 0; j < 4; j++) {
-        for (i = 0; i < 4; i++) {
-            r += data[((y*4+j)*width+(x*4+i))*4+0];
-            g += data[((y*4+j)*width+(x*4+i))*4+1];
-            b += data[((y*4+j)*width+(x*4+i))*4+2];
+    for (j = 0; j < factor; j++) {
+        for (i = 0; i < factor; i++) {
+            r += data[((y*factor+j)*width+(x*factor+i))*4+0];
+            g += data[((y*factor+j)*width+(x*factor+i))*4+1];
+            b += data[((y*factor+j)*width+(x*factor+i))*4+2];
         }
     }
-    r = r >> 4;
-    g = g >> 4;
-    b = b >> 4;
+    r = r >> shift;
+    g = g >> shift;
+    b = b >> shift;
 
-    converted[y*(width/4)+x] = 0.2126f*r + 0.7152f*g + 0.0722f*b;
+    converted[y*(width/factor)+x] = 0.2126f*r + 0.7152f*g + 0.0722f*b;
 }
 
 /* Halve input resolution by blending 4 values together */
@@ -55,6 +72,8 @@ __kernel void cacheBlkData(__global float *image,
     int i, j, ibx, iby;
     float mean, subtracted, sq_dev;
 
+    SPECIALISE_BLOCK(bx, by);
+
     iterx = get_global_id(0);
     itery = get_global_id(1);
 
@@ -130,7 +149,89 @@ __kernel void zero_clMem(__global uchar *data) {
     data[y*w+x] = 0;
 }
 
-/* zero-mean normalized cross-correlation */
+/* Fits a peak to correlations cL, cB and cR of neighbouring disparitys, where
+ * cB is the best one. method is 1 for parabola and 2 for equiangular fitting.
+ * Returns offset to best disparity in range [-0.5, 0.5]. */
+float subpixelOffset(float cL, float cB, float cR, uint method) {
+    float offset;
+
+    if (method == 2) {
+        if (cL < cR)
+            offset = 0.5f*(cR - cL)/(cB - cL);
+        else
+            offset = 0.5f*(cR - cL)/(cB - cR);
+    }
+    else {
+        offset = (cL - cR)/(2.0f*(cL - 2.0f*cB + cR));
+    }
+
+    /* Flat blocks give NaNs */
+    if (isnan(offset))
+        return 0.0f;
+
+    return clamp(offset, -0.5f, 0.5f);
+}
+
+/* Atomic max is core from OpenCL 1.1. Without it dmap2 is constructed from
+ * the whole cost volume, and host notices missing constructDmap2Packed. With
+ * 64-bit atomics the kernel is constructDmap2Packed64 instead, so that host
+ * knows the size of best2 elements. */
+#if defined(cl_khr_int64_base_atomics) && defined(cl_khr_int64_extended_atomics)
+#pragma OPENCL EXTENSION cl_khr_int64_base_atomics : enable
+#pragma OPENCL EXTENSION cl_khr_int64_extended_atomics : enable
+#define PACKED_DMAP2 1
+#define PACKED_64 1
+typedef ulong packed_t;
+
+/* Correlation and disparity as one ulong, that is larger when correlation is
+ * larger, or equal and disparity smaller. Correlation keeps all 32 bits of
+ * its order-preserving representation, so the best one is the same as in
+ * native versions, first one of equal correlations included. */
+ulong packCorrelation(float val, uint d) {
+    uint bits;
+
+    bits = as_uint(val);
+    /* -0 equals 0 */
+    if (bits == 0x80000000u)
+        bits = 0;
+    bits = (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+
+    return ((ulong)bits << 32) | (255u - d);
+}
+
+/* Keeps the larger of *best and packed val */
+void maxCorrelation(__global packed_t *best, float val, uint d) {
+    atom_max(best, packCorrelation(val, d));
+}
+#elif __OPENCL_VERSION__ >= 110
+#define PACKED_DMAP2 1
+typedef uint packed_t;
+
+/* Correlation and disparity as one uint, that is larger when correlation is
+ * larger, or equal and disparity smaller. Correlation keeps 24 upper bits of
+ * its order-preserving representation, so the result is approximate:
+ * correlations differing only in the lowest 8 bits tie, and the smaller
+ * disparity wins where native versions keep the larger correlation. */
+uint packCorrelation(float val, uint d) {
+    uint bits;
+
+    bits = as_uint(val);
+    bits = (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+
+    return (bits & 0xFFFFFF00u) | (255u - d);
+}
+
+void maxCorrelation(__global packed_t *best, float val, uint d) {
+    atomic_max(best, packCorrelation(val, d));
+}
+#else
+/* Type of the unused best2 argument of zncc */
+typedef uint packed_t;
+#endif
+
+/* zero-mean normalized cross-correlation. If subpixel is nonzero, also saves
+ * sub-pixel offsets of dmap1 to dmap1Offset. When best2 is not NULL, best
+ * correlations of right image pixels are collected there instead of ccor. */
 __kernel void zncc(__global float *cache_blk_l,
                    __global float *cache_blk_r,
                    __global ushort *displacements,
@@ -140,10 +241,17 @@ __kernel void zncc(__global float *cache_blk_l,
                    uint height,
                    uint bx,
                    uint by,
-                   uint dlimit) {
-    uint iterx, itery, i, blockStart, devBase;
+                   uint dlimit,
+                   __global float *dmap1Offset,
+                   uint subpixel,
+                   __global packed_t *best2) {
+    uint iterx, itery, i, blockStart, devBase, captureRight;
     uchar d, dlim;
     float deviations_left, deviations_right, temp1, temp2, summed, val, max_val;
+    float prevVal, ccLeft, ccRight;
+
+    SPECIALISE_BLOCK(bx, by);
+    SPECIALISE_DLIMIT(dlimit);
 
     iterx = get_global_id(0);
     itery = get_global_id(1);
@@ -153,6 +261,11 @@ __kernel void zncc(__global float *cache_blk_l,
     if (iterx < width-bx+1) {
 
         max_val = -FLT_MAX;
+        /* Correlations next to the best one for sub-pixel fitting */
+        prevVal = -FLT_MAX;
+        ccLeft = -FLT_MAX;
+        ccRight = -FLT_MAX;
+        captureRight = 0;
 
         d = displacements[(itery+by/2)*width*2+(iterx+bx/2)*2+0];
         dlim = displacements[(itery+by/2)*width*2+(iterx+bx/2)*2+1];
@@ -175,16 +288,209 @@ __kernel void zncc(__global float *cache_blk_l,
             }
             val = summed * (deviations_left * deviations_right);
 
+            if (captureRight) {
+                ccRight = val;
+                captureRight = 0;
+            }
             if (val > max_val) {
                 max_val = val;
                 dmap1[(itery+by/2)*width+iterx+bx/2] = d;
+                ccLeft = prevVal;
+                captureRight = 1;
+                ccRight = -FLT_MAX;
             }
+            prevVal = val;
 
-            ccor[((itery)*(width-bx+1)+iterx)*(dlimit+1)+d] = val;
+#ifdef PACKED_DMAP2
+            if (best2 != 0) {
+                /* Flat blocks give NaNs, which never win in constructDmap2 */
+                if (!isnan(val))
+                    maxCorrelation(&best2[itery*(width-bx+1)+iterx-d], val, d);
+            }
+            else
+#endif
+                ccor[((itery)*(width-bx+1)+iterx)*(dlimit+1)+d] = val;
+        }
+
+        if (subpixel != 0) {
+            /* No fitting at the ends of the search range */
+            val = 0.0f;
+            if (ccLeft != -FLT_MAX && ccRight != -FLT_MAX)
+                val = subpixelOffset(ccLeft, max_val, ccRight, subpixel);
+            dmap1Offset[(itery+by/2)*width+iterx+bx/2] = val;
         }
     }
 }
 
+/* Mean of a bx*by block in a local memory tile */
+float tileMean(__local float *tile, uint tileW, uint x, uint y,
+               uint bx, uint by) {
+    uint i, j;
+    float mean = 0.0f;
+
+    for (j = 0; j < by; j++)
+        for (i = 0; i < bx; i++)
+            mean += tile[(y+j)*tileW+x+i];
+    mean /= bx*by;
+
+    return mean;
+}
+
+/* Reciprocal of a blocks deviation, same as in cacheBlkData */
+float tileInvDeviation(__local float *tile, uint tileW, uint x, uint y,
+                       uint bx, uint by, float mean) {
+    uint i, j;
+    float temp, sq_dev = 0.0f;
+
+    for (j = 0; j < by; j++)
+        for (i = 0; i < bx; i++) {
+            temp = tile[(y+j)*tileW+x+i] - mean;
+            sq_dev += temp*temp;
+        }
+
+    return 1.0f / sqrt(sq_dev);
+}
+
+/* zncc without cacheBlkData. Work-group loads its part of both images with
+ * block halos to local memory, right tile extends dlimit pixels further
+ * left, and block means and deviations are calculated from there.
+ * Local buffers need (lx+bx-1)*(ly+by-1), (lx+dlimit+bx-1)*(ly+by-1),
+ * (lx+dlimit)*ly and (lx+dlimit)*ly floats. Outputs are the same as zncc. */
+__kernel void znccTiled(__global float *image0,
+                        __global float *image1,
+                        __global ushort *displacements,
+                        __global uchar *dmap1,
+                        __global float *ccor,
+                        uint width,
+                        uint height,
+                        uint bx,
+                        uint by,
+                        uint dlimit,
+                        __global float *dmap1Offset,
+                        uint subpixel,
+                        __global packed_t *best2,
+                        __local float *tileL,
+                        __local float *tileR,
+                        __local float *meanR,
+                        __local float *invDevR) {
+    uint lx, ly, gx0, gy0, rx0, offset, iterx, itery, x, y, i, j, pos;
+    uint leftW, rightW, blocksW, tileH, captureRight, found;
+    uchar d, dlim, bestD;
+    float mean_l, deviations_left, summed, val, max_val;
+    float prevVal, ccLeft, ccRight;
+
+    SPECIALISE_BLOCK(bx, by);
+    SPECIALISE_DLIMIT(dlimit);
+
+    lx = get_local_id(0);
+    ly = get_local_id(1);
+    gx0 = get_group_id(0)*get_local_size(0);
+    gy0 = get_group_id(1)*get_local_size(1);
+    iterx = gx0+lx;
+    itery = gy0+ly;
+
+    /* Right tile starts at most dlimit pixels left of the group */
+    rx0 = (gx0 > dlimit) ? gx0-dlimit : 0;
+    offset = gx0-rx0;
+
+    leftW = get_local_size(0)+bx-1;
+    rightW = get_local_size(0)+offset+bx-1;
+    blocksW = get_local_size(0)+offset;
+    tileH = get_local_size(1)+by-1;
+
+    /* Cooperative loads, pixels outside the image are zeros */
+    for (i = ly*get_local_size(0)+lx; i < leftW*tileH;
+         i += get_local_size(0)*get_local_size(1)) {
+        x = gx0 + i%leftW;
+        y = gy0 + i/leftW;
+        tileL[i] = (x < width && y < height) ? image0[y*width+x] : 0.0f;
+    }
+    for (i = ly*get_local_size(0)+lx; i < rightW*tileH;
+         i += get_local_size(0)*get_local_size(1)) {
+        x = rx0 + i%rightW;
+        y = gy0 + i/rightW;
+        tileR[i] = (x < width && y < height) ? image1[y*width+x] : 0.0f;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    /* Every right block is needed by several items, compute them once */
+    for (i = ly*get_local_size(0)+lx; i < blocksW*get_local_size(1);
+         i += get_local_size(0)*get_local_size(1)) {
+        x = i%blocksW;
+        y = i/blocksW;
+        meanR[i] = tileMean(tileR, rightW, x, y, bx, by);
+        invDevR[i] = tileInvDeviation(tileR, rightW, x, y, bx, by, meanR[i]);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    /* Global size is rounded up to local size, items outside only helped
+     * with loading */
+    if (iterx >= width-bx+1 || itery >= height-by+1)
+        return;
+
+    max_val = -FLT_MAX;
+    prevVal = -FLT_MAX;
+    ccLeft = -FLT_MAX;
+    ccRight = -FLT_MAX;
+    captureRight = 0;
+    found = 0;
+    bestD = 0;
+
+    d = displacements[(itery+by/2)*width*2+(iterx+bx/2)*2+0];
+    dlim = displacements[(itery+by/2)*width*2+(iterx+bx/2)*2+1];
+    /* Stay inside the right tile */
+    if (dlim > lx+offset)
+        dlim = lx+offset;
+
+    mean_l = tileMean(tileL, leftW, lx, ly, bx, by);
+    deviations_left = tileInvDeviation(tileL, leftW, lx, ly, bx, by, mean_l);
+
+    for (d=d; d <= dlim; d++) {
+        /* Block position in the right tile */
+        pos = lx+offset-d;
+
+        summed = 0.0f;
+        for (j = 0; j < by; j++)
+            for (i = 0; i < bx; i++)
+                summed += (tileR[(ly+j)*rightW+pos+i] - meanR[ly*blocksW+pos]) *
+                          (tileL[(ly+j)*leftW+lx+i] - mean_l);
+        val = summed * (deviations_left * invDevR[ly*blocksW+pos]);
+
+        if (captureRight) {
+            ccRight = val;
+            captureRight = 0;
+        }
+        if (val > max_val) {
+            max_val = val;
+            bestD = d;
+            found = 1;
+            ccLeft = prevVal;
+            captureRight = 1;
+            ccRight = -FLT_MAX;
+        }
+        prevVal = val;
+
+#ifdef PACKED_DMAP2
+        if (best2 != 0) {
+            if (!isnan(val))
+                maxCorrelation(&best2[itery*(width-bx+1)+iterx-d], val, d);
+        }
+        else
+#endif
+            ccor[((itery)*(width-bx+1)+iterx)*(dlimit+1)+d] = val;
+    }
+
+    if (found)
+        dmap1[(itery+by/2)*width+iterx+bx/2] = bestD;
+
+    if (subpixel != 0) {
+        val = 0.0f;
+        if (ccLeft != -FLT_MAX && ccRight != -FLT_MAX)
+            val = subpixelOffset(ccLeft, max_val, ccRight, subpixel);
+        dmap1Offset[(itery+by/2)*width+iterx+bx/2] = val;
+    }
+}
+
 /* zncc2way saves calculated cross correlation values certain way
  * that can be used to calculate depthmaps */
 __kernel void constructDmap2(__global uchar *dmap2,
@@ -235,6 +541,62 @@ __kernel void constructDmap2(__global uchar *dmap2,
     }
 }
 
+/* Same as constructDmap2, but with one work-item per pixel instead of
+ * per scanline */
+__kernel void constructDmap2Pixel(__global uchar *dmap2,
+                                  __global float *ccor,
+                                  uint dlim,
+                                  uint width,
+                                  uint bx,
+                                  uint by) {
+    uint x, d, dlimit, scanline, best;
+    float val, val2;
+
+    x = get_global_id(0);
+    scanline = get_global_id(1);
+
+    val = ccor[(scanline*(width-bx+1)+x)*(dlim+1)];
+    best = 0;
+
+    dlimit = dlim;
+    /* Do not go over left border */
+    if ((dlim+x) > (width-bx))
+        dlimit = width-bx-x;
+
+    for (d=1; d <= dlimit; d++) {
+        val2 = ccor[(scanline*(width-bx+1)+x)*(dlim+1)+d*(dlim+1)+d];
+        if (val2 > val) {
+            val = val2;
+            best = d;
+        }
+    }
+    dmap2[(scanline+by/2)*width+x+bx/2] = best;
+}
+
+#ifdef PACKED_DMAP2
+/* Unpacks disparitys of best correlations collected by zncc to dmap2.
+ * best2 has to be zeroed before zncc, pixels without any match get 0. */
+#ifdef PACKED_64
+__kernel void constructDmap2Packed64(
+#else
+__kernel void constructDmap2Packed(
+#endif
+                                   __global uchar *dmap2,
+                                   __global packed_t *best2,
+                                   uint width,
+                                   uint bx,
+                                   uint by) {
+    uint x, y;
+    packed_t packed;
+
+    x = get_global_id(0);
+    y = get_global_id(1);
+
+    packed = best2[y*(width-bx+1)+x];
+    dmap2[(y+by/2)*width+x+bx/2] = (packed != 0) ? 255u - (packed & 0xFFu) : 0;
+}
+#endif
+
 /* Creates crosschecked dephmap from 2 dephtmaps */
 __kernel void postCrossCorrelation(__global uchar *dMap1,
                                    __global uchar *dMap2,
@@ -306,6 +668,82 @@ __kernel void postFill(__global uchar *input,
 
 }
 
+/* Creates crosschecked depthmap with fixed-point disparitys, no rescaling.
+ * If subpixel is nonzero, sub-pixel offsets of dMap1 are added. */
+__kernel void postCrossCorrelation16(__global uchar *dMap1,
+                                     __global uchar *dMap2,
+                                     __global float *dMap1Offset,
+                                     __global ushort *result,
+                                     uint scale,
+                                     uint subpixel) {
+    uint width, x, y;
+    int pixel_l, pixel_r, diff;
+    float val;
+
+    x = get_global_id(0);
+    y = get_global_id(1);
+    width = get_global_size(0);
+
+    pixel_l = dMap1[y*width+x];
+    pixel_r = dMap2[y*width+x-pixel_l];
+
+    diff = abs(pixel_l - pixel_r);
+
+    if (diff > 1) {
+        result[y*width+x] = 0;
+    }
+    /* Offsets are not written where disparity stays 0 */
+    else if (subpixel != 0 && pixel_l > 0) {
+        val = (pixel_l + dMap1Offset[y*width+x])*scale + 0.5f;
+        result[y*width+x] = (val > 0.0f) ? (ushort)val : 0;
+    }
+    else {
+        result[y*width+x] = pixel_l * scale;
+    }
+}
+
+/* postFill for fixed-point disparitys */
+__kernel void postFill16(__global ushort *input,
+                         __global ushort *fill,
+                         uint width) {
+    uint val, val1, val2, val3, val4;
+    uint i, x, y;
+
+    /* Edge pixels would result in overread */
+    x = get_global_id(0)+1;
+    y = get_global_id(1)+1;
+
+    if (input[y*width+x] == 0) {
+        val1 = input[(y-1)*width+x];
+        val2 = input[y*width+x-1];
+        val3 = input[y*width+x+1];
+        val4 = input[(y+1)*width+x];
+        val = 0;
+        i = 0;
+        if (val1 != 0) {
+            val += val1;
+            i++;
+        }
+        if (val2 != 0) {
+            val += val2;
+            i++;
+        }
+        if (val3 != 0) {
+            val += val3;
+            i++;
+        }
+        if (val4 != 0) {
+            val += val4;
+            i++;
+        }
+
+        fill[y*width+x] = (i > 0) ? (ushort)(val/(float)i) : 0;
+    }
+    else {
+        fill[y*width+x] = input[y*width+x];
+    }
+}
+
 /* Half-resolution depthmaps, fullsize disparity-buffer,
  * fullsize width, height and disp_limit */
 __kernel void disparityLimits_2x2(__global uchar *dmap1,
@@ -8,10 +8,14 @@
 
 #include "doubleTime.h"
 #include "depthmap_c.h"
+#include "hybrid.h"
+#include "threadpool.h"
 
-#define MAXTHREADS 32
+/* Correlation of consecutive left images below which the previous frame
+ * is not used as a disparity prior */
+#define TEMPORAL_SCENE_CUT 0.8
 
-struct blend4x4Data {
+struct blendData {
     int threadsN;
     pthread_mutex_t *lock_firstAvailable;
     int *firstAvailable;
@@ -21,6 +25,8 @@ struct blend4x4Data {
     unsigned int height;
 
     float *resized;
+    /* Members above are accessed by offset from assembly-code. */
+    unsigned int factor;
 };
 
 struct disparityData {
@@ -36,6 +42,8 @@ struct disparityData {
     unsigned char *dmap1;
     unsigned char *dmap2;
     unsigned short *newLimits;
+    /* Motion margin of temporalWorker */
+    unsigned int margin;
 };
 
 struct znccData {
@@ -55,12 +63,46 @@ struct znccData {
     unsigned short *displacements;
     unsigned char *dmap1;
     unsigned char *dmap2;
+    /* Members above are accessed by offset from assembly-code. Add new ones
+     * only to the end of the struct. */
+    unsigned short *dmap1Sub;
+    subpixelMethod subpixel;
+    /* Shares the scanlines with an OpenCL device when not NULL */
+    struct session_hybrid *hybrid;
 };
 
-/* Defined function-pointers */
-float *(*blend_2x2Ptr)(float *img, unsigned int w, unsigned int h);
-void *(*blendWorkerPtr)(void *threadData);
-void *(*znccWorkerPtr)(void *data);
+typedef void *(*workerFunc)(void *threadData);
+
+/* Kernel choice, threads and zncc caches of one native pipeline */
+struct session_native {
+    struct threadPool pool;
+    int threadsN;
+    int disableAsm;
+    int quiet;
+
+    float *(*blend_2x2)(float *img, unsigned int w, unsigned int h);
+    /* blendWorker4 is used with downscale factor 4 */
+    workerFunc blendWorker;
+    workerFunc blendWorker4;
+    workerFunc znccWorker;
+    int sse3;
+
+    /* Block caches and correlations of each thread, grown on demand */
+    float *cache_blk_l[MAXTHREADS];
+    float *cache_blk_r[MAXTHREADS];
+    float *cache_ccorrelations_dMap2[MAXTHREADS];
+    size_t cacheSize;
+    size_t ccorrelationsSize;
+
+    struct depthmapTimings timings;
+
+    /* Previous frame for the temporal prior, valid when prevWidth != 0 */
+    unsigned int temporalMargin;
+    unsigned int prevWidth, prevHeight, prevBx, prevBy, prevDispLimit;
+    float *prevGreyImage0;
+    unsigned char *prevDmap1;
+    unsigned char *prevDmap2;
+};
 
 #ifdef __x86_64__
 /* Assembly-functions */
@@ -68,6 +110,8 @@ extern float *blend_2x2_sse3(float *img, unsigned int w, unsigned int h);
 
 extern void *blendWorker_sse2(void *threadData);
 
+extern void *blendWorkerN_sse2(void *threadData);
+
 extern void *znccWorker_sse3(void *threadData);
 
 extern int supportSSE3(void);
@@ -75,12 +119,16 @@ extern int supportSSE3(void);
 
 void *blendWorker(void *threadData) {
 
-    int x, y, i, j, w, r, g, b, lasty;
+    int x, y, i, j, w, h, f, shift, r, g, b, lasty;
     int sclines_increment = 32;
 
-    struct blend4x4Data *thData = (struct blend4x4Data *)threadData;
+    struct blendData *thData = (struct blendData *)threadData;
 
-    w = thData->width;
+    f = thData->factor;
+    w = thData->width/f;
+    h = thData->height/f;
+    /* Sums of f*f values are divided by shifting */
+    for (shift = 0; (1 << shift) < f*f; shift++);
 
     while (1) {
         /* Set next work item for the thread. */
@@ -89,77 +137,73 @@ void *blendWorker(void *threadData) {
         lasty = y + sclines_increment;
         /* With one thread, process all the scanlines in one go. */
         if (thData->threadsN == 1)
-            lasty = thData->height/4;
+            lasty = h;
         (*thData->firstAvailable) = lasty;
         pthread_mutex_unlock(thData->lock_firstAvailable);
 
         /* If no scanlines to process, break from loop. */
-        if (y > thData->height/4-1)
+        if (y > h-1)
             break;
         /* Last work item might be smaller than sclines_increment */
-        if (lasty > thData->height/4)
-            lasty = thData->height/4;
+        if (lasty > h)
+            lasty = h;
 
         /* x, y are indices for new resized image */
         for (y = y; y < lasty; y++) {
-            for (x = 0; x < w/4; x++) {
+            for (x = 0; x < w; x++) {
                 r = 0;
                 g = 0;
                 b = 0;
 
-                /* Blend 4x4 pixel-block to 1 pixel */
-                for (j = 0; j < 4; j++) {
-                    for (i = 0; i < 4; i++) {
-                        r += thData->image32Bit[((y*4+j)*w+(x*4+i))*4];
-                        g += thData->image32Bit[((y*4+j)*w+(x*4+i))*4+1];
-                        b += thData->image32Bit[((y*4+j)*w+(x*4+i))*4+2];
+                /* Blend f*f pixel-block to 1 pixel */
+                for (j = 0; j < f; j++) {
+                    for (i = 0; i < f; i++) {
+                        r += thData->image32Bit[((y*f+j)*w*f+(x*f+i))*4];
+                        g += thData->image32Bit[((y*f+j)*w*f+(x*f+i))*4+1];
+                        b += thData->image32Bit[((y*f+j)*w*f+(x*f+i))*4+2];
                     }
                 }
-                /* Divide color-values by 16 */
-                r = r >> 4;
-                g = g >> 4;
-                b = b >> 4;
+                /* Divide color-values by f*f */
+                r = r >> shift;
+                g = g >> shift;
+                b = b >> shift;
 
                 /* Convert to greyscale */
-                thData->resized[y*(w/4)+x] = 0.2126f*r + 0.7152f*g + 0.0722f*b;
+                thData->resized[y*w+x] = 0.2126f*r + 0.7152f*g + 0.0722f*b;
             }
         }
     }
     return NULL;
 }
 
-/* Blends 4x4 block of pixels (32bit, alpha is ignored) together to form 1 pixel,
- * which is converted to greyscale float image.
+/* Blends factor x factor block of pixels (32bit, alpha is ignored) together to
+ * form 1 pixel, which is converted to greyscale float image.
  * Returns:
  *  On success, memory-pointer to greyscale-image.
  *  On failure, returns NULL. */
-float *blend4x4_cnvrtToGreyscale(struct blend4x4Data *data) {
-    int i;
+float *blend_cnvrtToGreyscale(struct session_native *s, struct blendData *data) {
+    workerFunc worker;
 
-    if ((data->width % 4 != 0) || (data->height % 4 != 0)) {
-        fprintf(stderr, "blend4x4 does not currently handle resolutions not "
-                        "divisible by 4!\n");
+    if ((data->width % data->factor != 0) || (data->height % data->factor != 0)) {
+        fprintf(stderr, "blend does not currently handle resolutions not "
+                        "divisible by %u!\n", data->factor);
         return NULL;
     }
 
-    data->resized = malloc(sizeof(float)*data->width*data->height/16);
+    data->resized = malloc(sizeof(float)*(data->width/data->factor)
+                           *(data->height/data->factor));
     if (data->resized == NULL) {
         fprintf(stderr, "Memory allocation failed!");
         return NULL;
     }
 
-    pthread_t threads[MAXTHREADS-1];
-
     (*data->firstAvailable) = 0;
-    for (i=0; i < data->threadsN-1; i++) {
-        pthread_create(&threads[i], NULL, blendWorkerPtr, data);
-    }
-    /* Main thread */
-    blendWorkerPtr(data);
-
-    for (i = 0; i < data->threadsN-1; i++) {
-        pthread_join(threads[i], NULL);
-    }
+    worker = (data->factor == 4) ? s->blendWorker4 : s->blendWorker;
+    /* Single-threaded blends leave the pool to a concurrent stage */
+    if (data->threadsN == 1)
+        worker(data);
+    else
+        threadPoolRun(&s->pool, worker, data, 0);
 
     return data->resized;
 }
@@ -254,12 +298,51 @@ void scanline_cacheBlkData(float *img, unsigned int scanline, float *cacheData,
     }
 }
 
+/* Fits a peak to correlations of neighbouring disparitys cL, cB and cR,
+ * where cB is the best one. Returns offset to best disparity in
+ * range [-0.5, 0.5]. */
+float subpixelOffset(float cL, float cB, float cR, subpixelMethod method) {
+    float offset;
+
+    if (method == SUBPIXEL_EQUIANGULAR) {
+        if (cL < cR)
+            offset = 0.5f*(cR - cL)/(cB - cL);
+        else
+            offset = 0.5f*(cR - cL)/(cB - cR);
+    }
+    else {
+        offset = (cL - cR)/(2.0f*(cL - 2.0f*cB + cR));
+    }
+
+    /* Flat blocks give NaNs */
+    if (offset != offset)
+        return 0.0f;
+    if (offset > 0.5f)
+        offset = 0.5f;
+    if (offset < -0.5f)
+        offset = -0.5f;
+
+    return offset;
+}
+
+/* Fixed-point disparity with sub-pixel offset. */
+unsigned short subpixelDisparity(int disp, float cL, float cB, float cR,
+                                 subpixelMethod method) {
+    float val;
+
+    val = (disp + subpixelOffset(cL, cB, cR, method))*DISP_SUBPIXEL_SCALE + 0.5f;
+    if (val < 0.0f)
+        return 0;
+    return val;
+}
+
 void *znccWorker(void *data) {
 
     struct znccData *thData;
     int scanline, lastscanline, width, bx, by, blkSidex, blkSidey, i, x;
-    int d, dlim, disp, blkStride;
+    int d, dlim, disp, blkStride, captureRight;
     float deviations_left, deviations_right, maxVal, temp1, temp2, val;
+    float prevVal, ccLeft, ccRight;
 
     thData = (struct znccData *)data;
 
@@ -307,10 +390,17 @@ void *znccWorker(void *data) {
                 deviations_left = thData->cache_blk_l[width*blkStride + x];
 
                 maxVal = -FLT_MAX;
+                disp = 0;
                 /* Set disparity-range for a loop. */
                 d = thData->displacements[scanline*width*2+x*2];
                 dlim = thData->displacements[scanline*width*2+x*2+1];
 
+                /* Correlations next to the best one for sub-pixel fitting. */
+                prevVal = -FLT_MAX;
+                ccLeft = -FLT_MAX;
+                ccRight = -FLT_MAX;
+                captureRight = 0;
+
                 for (d=d; d <= dlim; d++) {
                     deviations_right = thData->cache_blk_r[width*blkStride + x-d];
 
@@ -352,11 +442,21 @@ void *znccWorker(void *data) {
 
                     val = summed[0] * (deviations_left * deviations_right);
 
+                    /* Value following the best one is its right neighbour */
+                    if (captureRight) {
+                        ccRight = val;
+                        captureRight = 0;
+                    }
+
                     /* Comparison for a first depthmap. */
                     if (val > maxVal) {
                         maxVal = val;
                         disp = d;
+                        ccLeft = prevVal;
+                        captureRight = 1;
+                        ccRight = -FLT_MAX;
                     }
+                    prevVal = val;
                     /* Second depthmap is constructed using exact same calculations */
                     if (val > thData->cache_ccorrelations_dMap2[x-d]) {
                         thData->cache_ccorrelations_dMap2[x-d] = val;
@@ -364,6 +464,16 @@ void *znccWorker(void *data) {
                     }
                 }
                 thData->dmap1[scanline * width + x] = disp;
+
+                if (thData->dmap1Sub != NULL) {
+                    /* No fitting at the ends of the search range */
+                    if (ccLeft != -FLT_MAX && ccRight != -FLT_MAX)
+                        thData->dmap1Sub[scanline*width + x] =
+                                subpixelDisparity(disp, ccLeft, maxVal, ccRight,
+                                                  thData->subpixel);
+                    else
+                        thData->dmap1Sub[scanline*width + x] = disp*DISP_SUBPIXEL_SCALE;
+                }
             }
         }
     }
@@ -371,14 +481,86 @@ void *znccWorker(void *data) {
     return NULL;
 }
 
-/* Searches best matches in stereo-images using zero-mean normalized cross correlation.
+/* Frees zncc caches of the session's threads. */
+static void freeCaches(struct session_native *s) {
+    int i;
+
+    for (i=0; i < MAXTHREADS; i++) {
+        free(s->cache_blk_l[i]);
+        free(s->cache_blk_r[i]);
+        free(s->cache_ccorrelations_dMap2[i]);
+        s->cache_blk_l[i] = NULL;
+        s->cache_blk_r[i] = NULL;
+        s->cache_ccorrelations_dMap2[i] = NULL;
+    }
+    s->cacheSize = 0;
+    s->ccorrelationsSize = 0;
+}
+
+/* Makes caches of every thread hold cacheSize floats of block values and
+ * ccorrelationsSize correlations. Returns EXIT_SUCCESS or EXIT_FAILURE. */
+static int reserveCaches(struct session_native *s, size_t cacheSize,
+                         size_t ccorrelationsSize) {
+    int i, error;
+
+    if (cacheSize <= s->cacheSize && ccorrelationsSize <= s->ccorrelationsSize)
+        return EXIT_SUCCESS;
+
+    /* Half- and full-resolution passes alternate, keep the larger one */
+    if (cacheSize < s->cacheSize)
+        cacheSize = s->cacheSize;
+    if (ccorrelationsSize < s->ccorrelationsSize)
+        ccorrelationsSize = s->ccorrelationsSize;
+    freeCaches(s);
+
+    error = 0;
+    for (i=0; i < s->threadsN; i++) {
+        error += posix_memalign((void **)&s->cache_blk_l[i], 32,
+                                sizeof(float)*cacheSize);
+        error += posix_memalign((void **)&s->cache_blk_r[i], 32,
+                                sizeof(float)*cacheSize);
+        error += posix_memalign((void **)&s->cache_ccorrelations_dMap2[i], 32,
+                                sizeof(float)*ccorrelationsSize);
+        if (error != 0) {
+            freeCaches(s);
+            return EXIT_FAILURE;
+        }
+    }
+    s->cacheSize = cacheSize;
+    s->ccorrelationsSize = ccorrelationsSize;
+
+    return EXIT_SUCCESS;
+}
+
+/* Matches scanlines [first, last) of data on every thread of the session,
+ * dmaps have been allocated. Workers see the image ending by/2 scanlines
+ * after last. */
+static void znccRows(struct session_native *s, struct znccData *data,
+                     workerFunc worker, unsigned int first, unsigned int last) {
+    struct znccData thData[MAXTHREADS];
+    int i;
+
+    (*data->firstAvailable) = first;
+    for (i=0; i < s->threadsN; i++) {
+        /* Copy struct and add thread-specific stuff. */
+        thData[i] = (*data);
+        thData[i].height = last + data->by/2;
+        thData[i].cache_blk_l = s->cache_blk_l[i];
+        thData[i].cache_blk_r = s->cache_blk_r[i];
+        thData[i].cache_ccorrelations_dMap2 = s->cache_ccorrelations_dMap2[i];
+    }
+    threadPoolRun(&s->pool, worker, thData, sizeof(struct znccData));
+}
+
+/* Searches best matches in stereo-images using zero-mean normalized cross
+ * correlation, worker running in every thread of the session.
  * Returns:
  *  On success: returns 2 depthmap-pointers through a struct.
  *  On failure: returns atleast 1 NULL depthmap-pointer. */
-void zncc2way(struct znccData *data) {
+void zncc2way(struct session_native *s, struct znccData *data, workerFunc worker) {
 
     unsigned int blkSidey;
-    int error, blkStride;
+    int blkStride;
 
     if (posix_memalign((void **)&data->dmap1, 32, data->width*data->height
                        *sizeof(unsigned char)) != 0) {
@@ -390,6 +572,19 @@ void zncc2way(struct znccData *data) {
         data->dmap2 = NULL;
         return;
     }
+    /* Sub-pixel disparitys of the first depthmap, if wanted. */
+    data->dmap1Sub = NULL;
+    if (data->subpixel != SUBPIXEL_NONE) {
+        data->dmap1Sub = malloc(sizeof(unsigned short)*data->width*data->height);
+        if (data->dmap1Sub == NULL) {
+            free(data->dmap1);
+            free(data->dmap2);
+            data->dmap1 = NULL;
+            data->dmap2 = NULL;
+            return;
+        }
+        memset(data->dmap1Sub, 0, sizeof(unsigned short)*data->width*data->height);
+    }
 
     /* Wipe memory */
     memset(data->dmap1, 0, sizeof(unsigned char)*data->width*data->height);
@@ -398,84 +593,73 @@ void zncc2way(struct znccData *data) {
     /* Block distance from block-center to block-edge. */
     blkSidey = data->by/2;
 
-    /* Allocate memory for all block values in one scanline + deviation
-     * values at the end of allocated memory. */
+    /* Memory for all block values in one scanline + deviation values at the
+     * end of allocated memory. */
     blkStride = ((data->bx*data->by+7)/8)*8;  /* Align to 32 byte boundary */
 
-    error = posix_memalign((void **)&data->cache_blk_l, 32,
-                           sizeof(float)*(blkStride*data->width+data->width));
-    error += posix_memalign((void **)&data->cache_blk_r, 32,
-                            sizeof(float)*(blkStride*data->width+data->width));
-
-    /* For comparing correlations for 2nd depthmap. */
-    error += posix_memalign((void **)&data->cache_ccorrelations_dMap2, 32,
-                                                 sizeof(float)*data->width);
-
-    if (error != 0) {
-        free(data->cache_blk_l);
-        free(data->cache_blk_r);
-        free(data->cache_ccorrelations_dMap2);
+    if (reserveCaches(s, blkStride*data->width+data->width,
+                      data->width) == EXIT_FAILURE) {
         free(data->dmap1);
         free(data->dmap2);
+        free(data->dmap1Sub);
         data->dmap1 = NULL;
         data->dmap2 = NULL;
+        data->dmap1Sub = NULL;
         return;
     }
 
-    int i;
-    pthread_t threads[MAXTHREADS];
-    struct znccData thData[MAXTHREADS];
+    unsigned int height, split;
+    pthread_t hybridThread;
+    struct hybridBand band;
+    double time1, time2;
+
+    /* Device matches scanlines from split on in its own thread */
+    height = data->height;
+    split = height-blkSidey;
+    band.error = EXIT_FAILURE;
+    if (data->hybrid != NULL) {
+        split = hybridSplit(data->hybrid, blkSidey, height-blkSidey);
+        band.session = data->hybrid;
+        band.greyImage0 = data->greyImage0;
+        band.greyImage1 = data->greyImage1;
+        band.displacements = data->displacements;
+        band.width = data->width;
+        band.height = height;
+        band.bx = data->bx;
+        band.by = data->by;
+        band.first = split;
+        band.last = height-blkSidey;
+        band.dmap1 = data->dmap1;
+        band.dmap2 = data->dmap2;
+        band.dmap1Sub = data->dmap1Sub;
+        band.subpixel = data->subpixel;
+        if (split >= band.last
+                || pthread_create(&hybridThread, NULL, hybridWorker, &band) != 0)
+            split = height-blkSidey;
+    }
+    time1 = doubleTime();
 
-    /* Reset first available line for processing */
-    (*data->firstAvailable) = blkSidey;
-    /* Children threads */
-    for (i=0; i < data->threadsN-1; i++) {
-        /* Copy struct and add thread-specific stuff. */
-        thData[i] = (*data);
+    znccRows(s, data, worker, blkSidey, split);
 
-        error = posix_memalign((void **)&thData[i].cache_blk_l, 32,
-                               sizeof(float)*(blkStride*data->width+data->width));
-        error += posix_memalign((void **)&thData[i].cache_blk_r, 32,
-                                sizeof(float)*(blkStride*data->width+data->width));
-        error += posix_memalign((void **)&thData[i].cache_ccorrelations_dMap2,
-                                32, sizeof(float)*data->width);
-        /* Check these allocations also for consistency. Untested. */
-        if (error != 0) {
-            free(thData[i].cache_blk_l);
-            free(thData[i].cache_blk_r);
-            free(thData[i].cache_ccorrelations_dMap2);
-            /* Cancel previously launched threads */
-            for(i=i-1; i >= 0; i--) {
-                pthread_cancel(threads[i]);
-                free(thData[i].cache_blk_l);
-                free(thData[i].cache_blk_r);
-                free(thData[i].cache_ccorrelations_dMap2);
-            }
-            free(data->cache_blk_l);
-            free(data->cache_blk_r);
-            free(data->cache_ccorrelations_dMap2);
-            free(data->dmap1);
-            free(data->dmap2);
-            data->dmap1 = NULL;
-            data->dmap2 = NULL;
-            return;
+    if (split != height-blkSidey) {
+        time2 = doubleTime();
+        pthread_join(hybridThread, NULL);
+
+        if (band.error == EXIT_SUCCESS) {
+            if (!s->quiet)
+                printf("Hybrid zncc, native:       %6.1lf ms, %u scanlines.\n"
+                       "Hybrid zncc, device:       %6.1lf ms, %u scanlines.\n",
+                       (time2-time1)*1000, split-blkSidey,
+                       band.ms, band.last-split);
+            hybridBalance(data->hybrid, split-blkSidey, (time2-time1)*1000,
+                          band.last-split, band.ms);
+        }
+        else {
+            /* Rest of the scanlines natively */
+            fprintf(stderr, "Hybrid band failed, matching it natively.\n");
+            znccRows(s, data, worker, split, height-blkSidey);
         }
-
-        pthread_create(&threads[i], NULL, znccWorkerPtr, &thData[i]);
-    }
-    /* Main thread */
-    znccWorkerPtr(data);
-
-    for (i = 0; i < data->threadsN-1; i++) {
-        pthread_join(threads[i], NULL);
-        free(thData[i].cache_blk_l);
-        free(thData[i].cache_blk_r);
-        free(thData[i].cache_ccorrelations_dMap2);
     }
-
-    free(data->cache_blk_l);
-    free(data->cache_blk_r);
-    free(data->cache_ccorrelations_dMap2);
 }
 
 /* Postprocess depthmaps.
@@ -566,6 +750,89 @@ unsigned char *postProcess(unsigned char *dMap1, unsigned char *dMap2,
     return result;
 }
 
+/* Postprocess depthmaps without rescaling. Disparitys are saved as
+ * fixed-point values (disparity*DISP_SUBPIXEL_SCALE). If dMap1Sub is not
+ * NULL, its sub-pixel disparitys are used for consistent pixels.
+ * Returns: One processed image, or NULL in case of allocation failures. */
+unsigned short *postProcess16(unsigned char *dMap1, unsigned char *dMap2,
+                              unsigned short *dMap1Sub,
+                              unsigned int width, unsigned int height) {
+
+    int x, y, pixel_l, pixel_r, diff;
+    unsigned short *result, *fill, *temp;
+
+    result = malloc(sizeof(unsigned short)*width*height);
+    fill = malloc(sizeof(unsigned short)*width*height);
+    if (result == NULL || fill == NULL) {
+        fprintf(stderr, "Allocating memory failed in postProcess16!");
+        free(result);
+        free(fill);
+        return NULL;
+    }
+    memset(fill, 0, sizeof(unsigned short)*width*height);
+
+    for (y=0; y < height; y++) {
+        for (x=0; x < width; x++) {
+            pixel_l = dMap1[y*width+x];
+            pixel_r = dMap2[y*width+x-pixel_l];
+
+            diff = abs(pixel_l - pixel_r);
+
+            if (diff > 1)
+                result[y*width+x] = 0;
+            else if (dMap1Sub != NULL)
+                result[y*width+x] = dMap1Sub[y*width+x];
+            else
+                result[y*width+x] = pixel_l * DISP_SUBPIXEL_SCALE;
+        }
+    }
+
+    int val, val1, val2, val3, val4, i, pass, passes=2;
+
+    /* Same filling as in postProcess, averages keep their fractional part. */
+    for (pass=0; pass < passes; pass++) {
+        for (y=1; y < height-1; y++) {
+            for (x=1; x < width-1; x++) {
+                if (result[y*width+x] == 0) {
+                    val1 = result[(y-1)*width+x];
+                    val2 = result[y*width+x-1];
+                    val3 = result[y*width+x+1];
+                    val4 = result[(y+1)*width+x];
+                    val = 0;
+                    i = 0;
+                    if (val1 != 0) {
+                        val += val1;
+                        i++;
+                    }
+                    if (val2 != 0) {
+                        val += val2;
+                        i++;
+                    }
+                    if (val3 != 0) {
+                        val += val3;
+                        i++;
+                    }
+                    if (val4 != 0) {
+                        val += val4;
+                        i++;
+                    }
+                    fill[y*width+x] = (i > 0) ? val/(float)i : 0;
+                }
+                else {
+                    fill[y*width+x] = result[y*width+x];
+                }
+            }
+        }
+        /* Swap source and destination image for next pass. */
+        temp = result;
+        result = fill;
+        fill = temp;
+    }
+    free(fill);
+
+    return result;
+}
+
 /* Create array of disparity-range of 0-disp_limit for every pixel. */
 unsigned short *initializeDisparity(unsigned int width, unsigned int height,
                                     unsigned int bx, unsigned int by,
@@ -683,142 +950,535 @@ void *disparityWorker(void *data) {
 /* Figure out decent disparity-ranges for a 2x2 times bigger image.
  * Depthmap1 and 2 are meant to be halfsized.
  * Width, height and disp_limit should be full-size. */
-unsigned short *disparityLimits_2x2(struct disparityData *data) {
-
-    int i;
+unsigned short *disparityLimits_2x2(struct session_native *s,
+                                    struct disparityData *data) {
 
     data->newLimits = malloc(sizeof(unsigned short)*data->width*data->height*4*2);
 
     (*data->firstAvailable) = data->by/2;
-
-    pthread_t threads[MAXTHREADS-1];
-
-    /* Launch threads */
-    for (i=0; i < data->threadsN-1; i++) {
-        pthread_create(&threads[i], NULL, &disparityWorker, data);
-    }
-    /* Main thread */
-    disparityWorker(data);
-
-    for (i=0; i < data->threadsN-1; i++) {
-        pthread_join(threads[i], NULL);
-    }
+    threadPoolRun(&s->pool, disparityWorker, data, 0);
 
     return data->newLimits;
 }
 
-/* Generates post-processed depthmap. Takes: 2 32-bit stereo-images, their width
- * and height (mod 4). Wanted blocksize for a search, disparity-limit and search method.
- * On success:
- *  Returns 1/4 by 1/4 image.
- * On failure:
- *  Returns NULL. */
-unsigned char *generateDepthmap(unsigned char *img0, unsigned char *img1,
-                                unsigned int width, unsigned int height,
-                                unsigned int blockx, unsigned int blocky,
-                                unsigned int dispLimit, searchMethod select,
-                                int threads, int disableAsm) {
+struct session_native *createSession_native(int threads, int disableAsm, int quiet) {
 
-    double time1, time2, total1, total2;
-    struct znccData Data;
-    struct blend4x4Data blend;
-    struct disparityData dispData;
+    struct session_native *s;
 
-    if ( (blockx % 2 != 1) || (blocky % 2 != 1) || blockx == 1 || blocky == 1 ) {
-        fprintf(stderr, "Blocksize must be odd in both dimensions and more than 1!\n");
-        return NULL;
-    }
     if (threads == 0)
         threads = sysconf(_SC_NPROCESSORS_ONLN);
     if (threads > MAXTHREADS) {
         fprintf(stderr, "Maximum threads allowed is %d. Adjusting number of threads.\n", MAXTHREADS);
         threads = MAXTHREADS;
     }
-    printf("\n------------------------\n%d threads.\n", threads);
+
+    s = calloc(1, sizeof(struct session_native));
+    if (s == NULL)
+        return NULL;
+
+    if (threadPoolInit(&s->pool, threads) == EXIT_FAILURE) {
+        fprintf(stderr, "Couldn't start %d threads!\n", threads);
+        free(s);
+        return NULL;
+    }
+    s->threadsN = threads;
+    s->disableAsm = disableAsm;
+    s->quiet = quiet;
 
     /* Set function-pointers */
-    blendWorkerPtr = blendWorker;
-    znccWorkerPtr = znccWorker;
-    blend_2x2Ptr = blend_2x2;
+    s->blendWorker = blendWorker;
+    s->blendWorker4 = blendWorker;
+    s->znccWorker = znccWorker;
+    s->blend_2x2 = blend_2x2;
 #ifdef __x86_64__
-    if (disableAsm) {
-        printf("Assembly disabled.\n");
-    }
-    else {
-        blendWorkerPtr = blendWorker_sse2;
+    if (!disableAsm) {
+        /* Hand-tuned version for 4x4 blocks */
+        s->blendWorker4 = blendWorker_sse2;
+        s->blendWorker = blendWorkerN_sse2;
         if (supportSSE3()) {
-            printf("Processor supports SSE3.\n");
-            znccWorkerPtr = znccWorker_sse3;
-            blend_2x2Ptr = blend_2x2_sse3;
+            s->sse3 = 1;
+            s->znccWorker = znccWorker_sse3;
+            s->blend_2x2 = blend_2x2_sse3;
         }
     }
 #endif
-    printf("------------------------\n");
 
-    total1 = doubleTime();
+    return s;
+}
+
+void releaseSession_native(struct session_native *s) {
+
+    if (s == NULL)
+        return;
+
+    threadPoolDestroy(&s->pool);
+    freeCaches(s);
+    free(s->prevGreyImage0);
+    free(s->prevDmap1);
+    free(s->prevDmap2);
+    free(s);
+}
+
+const struct depthmapTimings *sessionTimings_native(struct session_native *s) {
+    return &s->timings;
+}
+
+void *temporalWorker(void *data) {
+
+    int x, y, lasty, w, bxSide, bySide, min, max, margin, dispLimit;
+    int val, i;
+    int sclines_increment = 10;
+    struct disparityData *thData;
+    unsigned char *dmap1;
+
+    thData = (struct disparityData *)data;
+
+    /* Signed, as in disparityWorker */
+    w = thData->width;
+    bxSide = thData->bx/2;
+    bySide = thData->by/2;
+    margin = thData->margin;
+    dispLimit = thData->disp_limit;
+    dmap1 = thData->dmap1;
+
+    while (1) {
+        /* Set next work item for the thread. */
+        pthread_mutex_lock(thData->lock_firstAvailable);
+        y = (*thData->firstAvailable);
+        lasty = y + sclines_increment;
+        /* With one thread, process all the scanlines in one go. */
+        if (thData->threadsN == 1)
+            lasty = thData->height-bySide;
+        (*thData->firstAvailable) = lasty;
+        pthread_mutex_unlock(thData->lock_firstAvailable);
+
+        /* If no scanlines to process, break from loop. */
+        if (y > thData->height-bySide-1)
+            break;
+        /* Last work item might be smaller than sclines_increment */
+        if (lasty > thData->height-bySide)
+            lasty = thData->height-bySide;
+
+        for (y=y; y < lasty; y++) {
+            for (x=bxSide; x < w-bxSide; x++) {
+                val = dmap1[y*w+x];
+
+                /* Unmatched or at infinity, search everything */
+                if (val == 0) {
+                    min = 0;
+                    max = dispLimit;
+                }
+                else {
+                    /* Neighbours cover motion of edges, second depthmap
+                     * occlusions as in disparityWorker */
+                    min = val;
+                    max = val;
+                    int neighbours[5] = {
+                        (x >= 2) ? dmap1[y*w+x-2] : val,
+                        (x+2 < w) ? dmap1[y*w+x+2] : val,
+                        dmap1[(y-1)*w+x],
+                        dmap1[(y+1)*w+x],
+                        thData->dmap2[y*w+x-val]};
+                    for (i=0; i < 5; i++) {
+                        if (neighbours[i] > max) max = neighbours[i];
+                        if (neighbours[i] < min) min = neighbours[i];
+                    }
+                    min -= margin;
+                    max += margin;
+                }
+
+                /* Clip range to honor limit and image borders */
+                if (min < 0)
+                    min = 0;
+                if (max > dispLimit)
+                    max = dispLimit;
+                if (max > x-bxSide)
+                    max = x-bxSide;
+                if (min > max)
+                    min = max;
+                thData->newLimits[y*w*2+x*2] = min;
+                thData->newLimits[y*w*2+x*2+1] = max;
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Disparity-ranges from depthmaps of the previous frame, which are of the
+ * same size. Width, height and disp_limit are full-size. */
+unsigned short *disparityLimits_temporal(struct session_native *s,
+                                         struct disparityData *data) {
 
-    Data.threadsN = threads;
-    blend.threadsN = threads;
-    dispData.threadsN = threads;
+    data->newLimits = malloc(sizeof(unsigned short)*data->width*data->height*2);
+    if (data->newLimits == NULL)
+        return NULL;
+    /* Edges stay unmatched, as with initializeDisparity */
+    memset(data->newLimits, 0, sizeof(unsigned short)*data->width*data->height*2);
+
+    (*data->firstAvailable) = data->by/2;
+    threadPoolRun(&s->pool, temporalWorker, data, 0);
+
+    return data->newLimits;
+}
+
+/* Normalized cross-correlation of two greyscale images, from every 4th
+ * pixel. Flat images give 0. */
+static double frameCorrelation(const float *img0, const float *img1, size_t pixels) {
+    double sum0, sum1, sum00, sum11, sum01, n, cov, var0, var1;
+    size_t i;
+
+    sum0 = sum1 = sum00 = sum11 = sum01 = 0.0;
+    for (i=0; i < pixels; i += 4) {
+        sum0 += img0[i];
+        sum1 += img1[i];
+        sum00 += img0[i]*img0[i];
+        sum11 += img1[i]*img1[i];
+        sum01 += img0[i]*img1[i];
+    }
+    n = (pixels+3)/4;
+    cov = sum01 - sum0*sum1/n;
+    var0 = sum00 - sum0*sum0/n;
+    var1 = sum11 - sum1*sum1/n;
+    if (var0 <= 0.0 || var1 <= 0.0)
+        return 0.0;
+
+    return cov/sqrt(var0*var1);
+}
+
+void setTemporal_native(struct session_native *s, unsigned int margin) {
+    s->temporalMargin = margin;
+    s->prevWidth = 0;
+}
+
+/* Keeps depthmaps and left image of a matched frame as the next prior. */
+static void keepPrior(struct session_native *s, unsigned int width,
+                      unsigned int height, unsigned int bx, unsigned int by,
+                      unsigned int dispLimit, const float *greyImage0,
+                      const unsigned char *dmap1, const unsigned char *dmap2) {
+    size_t pixels = (size_t)width*height;
+
+    if (s->prevWidth*s->prevHeight != pixels || s->prevGreyImage0 == NULL) {
+        free(s->prevGreyImage0);
+        free(s->prevDmap1);
+        free(s->prevDmap2);
+        s->prevGreyImage0 = malloc(sizeof(float)*pixels);
+        s->prevDmap1 = malloc(pixels);
+        s->prevDmap2 = malloc(pixels);
+        if (s->prevGreyImage0 == NULL || s->prevDmap1 == NULL || s->prevDmap2 == NULL) {
+            free(s->prevGreyImage0);
+            free(s->prevDmap1);
+            free(s->prevDmap2);
+            s->prevGreyImage0 = NULL;
+            s->prevDmap1 = NULL;
+            s->prevDmap2 = NULL;
+            s->prevWidth = 0;
+            return;
+        }
+    }
+    memcpy(s->prevGreyImage0, greyImage0, sizeof(float)*pixels);
+    memcpy(s->prevDmap1, dmap1, pixels);
+    memcpy(s->prevDmap2, dmap2, pixels);
+    s->prevWidth = width;
+    s->prevHeight = height;
+    s->prevBx = bx;
+    s->prevBy = by;
+    s->prevDispLimit = dispLimit;
+}
+
+/* Intermediate data of one depthmap between its stages */
+struct frame_native {
+    unsigned int width, height;
+    unsigned int blockx, blocky, dispLimit, factor;
+    searchMethod select;
+    dispFormat format;
+    subpixelMethod subpixel;
+
+    /* Greyscale images, halved ones only with HIERARCHIC */
+    float *greyImage0;
+    float *greyImage1;
+    float *halfImage0;
+    float *halfImage1;
+    unsigned char *dmap1;
+    unsigned char *dmap2;
+    unsigned short *dmap1Sub;
+
+    double start;
+    struct depthmapTimings timings;
+};
+
+void frameIntermediates_native(const struct frame_native *frame,
+                               unsigned int *width, unsigned int *height,
+                               const float **grey0, const float **grey1,
+                               const unsigned char **dmap1,
+                               const unsigned char **dmap2) {
+    (*width) = frame->width;
+    (*height) = frame->height;
+    (*grey0) = frame->greyImage0;
+    (*grey1) = frame->greyImage1;
+    (*dmap1) = frame->dmap1;
+    (*dmap2) = frame->dmap2;
+}
+
+void frameFree_native(struct frame_native *frame) {
+
+    if (frame == NULL)
+        return;
+
+    free(frame->greyImage0);
+    free(frame->greyImage1);
+    free(frame->halfImage0);
+    free(frame->halfImage1);
+    free(frame->dmap1);
+    free(frame->dmap2);
+    free(frame->dmap1Sub);
+    free(frame);
+}
+
+struct frame_native *framePyramid_native(struct session_native *s,
+                                         unsigned char *img0, unsigned char *img1,
+                                         unsigned int width, unsigned int height,
+                                         unsigned int blockx, unsigned int blocky,
+                                         unsigned int dispLimit, searchMethod select,
+                                         dispFormat format, subpixelMethod subpixel,
+                                         unsigned int factor, int pooled) {
+
+    double time1, time2;
+    struct frame_native *frame;
+    struct blendData blend;
     pthread_mutex_t mutex1 = PTHREAD_MUTEX_INITIALIZER;
     int lineAvailable = 0;
-    Data.lock_firstAvailable = &mutex1;
-    Data.firstAvailable = &lineAvailable;
-    /* Can share mutex */
-    blend.lock_firstAvailable = &mutex1;
-    blend.firstAvailable = &lineAvailable;
-    dispData.lock_firstAvailable = &mutex1;
-    dispData.firstAvailable = &lineAvailable;
 
-    /* Convert images to 1/4 greyscale images. */
+    if ( (blockx % 2 != 1) || (blocky % 2 != 1) || blockx == 1 || blocky == 1 ) {
+        fprintf(stderr, "Blocksize must be odd in both dimensions and more than 1!\n");
+        return NULL;
+    }
+    if (dispLimit < 1 || dispLimit > DISP_LIMIT_MAX) {
+        fprintf(stderr, "Disparity-limit must be 1-%d!\n", DISP_LIMIT_MAX);
+        return NULL;
+    }
+    if (factor != 1 && factor != 2 && factor != 4 && factor != 8) {
+        fprintf(stderr, "Downscale factor must be 1, 2, 4 or 8!\n");
+        return NULL;
+    }
+
+    frame = calloc(1, sizeof(struct frame_native));
+    if (frame == NULL)
+        return NULL;
+    frame->width = width/factor;
+    frame->height = height/factor;
+    frame->blockx = blockx;
+    frame->blocky = blocky;
+    frame->dispLimit = dispLimit;
+    frame->select = select;
+    frame->format = format;
+    /* Sub-pixel disparitys can only be stored in fixed-point format. */
+    frame->subpixel = (format == DISP_FIXED16) ? subpixel : SUBPIXEL_NONE;
+    frame->factor = factor;
+    frame->start = doubleTime();
+
+    /* Convert images to 1/factor greyscale images. */
     time1 = doubleTime();
-    Data.width = width/4;
-    Data.height = height/4;
+    blend.threadsN = pooled ? s->threadsN : 1;
+    blend.lock_firstAvailable = &mutex1;
+    blend.firstAvailable = &lineAvailable;
     blend.width = width;
     blend.height = height;
+    blend.factor = factor;
     blend.image32Bit = img0;
 
-    Data.greyImage0 = blend4x4_cnvrtToGreyscale(&blend);
+    frame->greyImage0 = blend_cnvrtToGreyscale(s, &blend);
     blend.image32Bit = img1;
-    Data.greyImage1 = blend4x4_cnvrtToGreyscale(&blend);
+    frame->greyImage1 = blend_cnvrtToGreyscale(s, &blend);
+    pthread_mutex_destroy(&mutex1);
 
-    if (Data.greyImage0 == NULL || Data.greyImage1 == NULL)
+    if (frame->greyImage0 == NULL || frame->greyImage1 == NULL) {
+        frameFree_native(frame);
         return NULL;
+    }
     time2 = doubleTime();
-    printf("\nBlend 4x4 and greyscaling: %6.1lf ms.\n", (time2-time1)*1000);
+    frame->timings.blend = (time2-time1)*1000;
+    if (!s->quiet)
+        printf("\nBlend %ux%u and greyscaling: %6.1lf ms.\n", factor, factor,
+               frame->timings.blend);
 
+    if (select == HIERARCHIC) {
+        time1 = doubleTime();
+        frame->halfImage0 = s->blend_2x2(frame->greyImage0, frame->width, frame->height);
+        frame->halfImage1 = s->blend_2x2(frame->greyImage1, frame->width, frame->height);
 
-    Data.bx = blockx;
-    Data.by = blocky;
+        if (frame->halfImage0 == NULL || frame->halfImage1 == NULL) {
+            frameFree_native(frame);
+            return NULL;
+        }
+        time2 = doubleTime();
+        frame->timings.blend2x2 = (time2-time1)*1000;
+        if (!s->quiet)
+            printf("Blend 2x2:                 %6.1lf ms.\n", frame->timings.blend2x2);
+    }
 
-    if (select == HIERARCHIC) {
+    return frame;
+}
+
+/* Aligned copy of n floats, NULL stays NULL. Returns EXIT_SUCCESS or
+ * EXIT_FAILURE. */
+static int copyImage(const float *img, float **copy, size_t n) {
+    (*copy) = NULL;
+    if (img == NULL)
+        return EXIT_SUCCESS;
+    if (posix_memalign((void **)copy, 32, sizeof(float)*n) != 0) {
+        (*copy) = NULL;
+        return EXIT_FAILURE;
+    }
+    memcpy(*copy, img, sizeof(float)*n);
+
+    return EXIT_SUCCESS;
+}
+
+struct frame_native *frameVariant_native(const struct frame_native *frame,
+                                         unsigned int blockx, unsigned int blocky,
+                                         unsigned int dispLimit) {
+
+    struct frame_native *variant;
+    size_t pixels, halfPixels;
+
+    if ( (blockx % 2 != 1) || (blocky % 2 != 1) || blockx == 1 || blocky == 1 ) {
+        fprintf(stderr, "Blocksize must be odd in both dimensions and more than 1!\n");
+        return NULL;
+    }
+    if (dispLimit < 1 || dispLimit > DISP_LIMIT_MAX) {
+        fprintf(stderr, "Disparity-limit must be 1-%d!\n", DISP_LIMIT_MAX);
+        return NULL;
+    }
+    if (frame->greyImage0 == NULL) {
+        fprintf(stderr, "Frame has already been matched!\n");
+        return NULL;
+    }
+
+    variant = calloc(1, sizeof(struct frame_native));
+    if (variant == NULL)
+        return NULL;
+    variant->width = frame->width;
+    variant->height = frame->height;
+    variant->blockx = blockx;
+    variant->blocky = blocky;
+    variant->dispLimit = dispLimit;
+    variant->factor = frame->factor;
+    variant->select = frame->select;
+    variant->format = frame->format;
+    variant->subpixel = frame->subpixel;
+    variant->start = doubleTime();
+
+    pixels = (size_t)frame->width*frame->height;
+    halfPixels = (size_t)(frame->width/2)*(frame->height/2);
+    if (copyImage(frame->greyImage0, &variant->greyImage0, pixels) == EXIT_FAILURE
+            || copyImage(frame->greyImage1, &variant->greyImage1, pixels) == EXIT_FAILURE
+            || copyImage(frame->halfImage0, &variant->halfImage0, halfPixels) == EXIT_FAILURE
+            || copyImage(frame->halfImage1, &variant->halfImage1, halfPixels) == EXIT_FAILURE) {
+        frameFree_native(variant);
+        return NULL;
+    }
+
+    return variant;
+}
+
+int frameMatch_native(struct session_native *s, struct frame_native *frame,
+                      struct session_hybrid *hybrid) {
+
+    double time1, time2, correlation;
+    unsigned int w, h;
+    struct znccData Data;
+    struct disparityData dispData;
+    pthread_mutex_t mutex1 = PTHREAD_MUTEX_INITIALIZER;
+    int lineAvailable = 0, temporal;
+
+    w = frame->width;
+    h = frame->height;
+
+    Data.threadsN = s->threadsN;
+    dispData.threadsN = s->threadsN;
+    Data.lock_firstAvailable = &mutex1;
+    Data.firstAvailable = &lineAvailable;
+    /* Can share mutex */
+    dispData.lock_firstAvailable = &mutex1;
+    dispData.firstAvailable = &lineAvailable;
+
+    Data.width = w;
+    Data.height = h;
+    Data.greyImage0 = frame->greyImage0;
+    Data.greyImage1 = frame->greyImage1;
+    Data.bx = frame->blockx;
+    Data.by = frame->blocky;
+    Data.subpixel = frame->subpixel;
+    Data.hybrid = NULL;
+
+    /* Previous frame of the same size, and the same scene, replaces the
+     * half-resolution pass */
+    temporal = 0;
+    if (frame->select == HIERARCHIC && s->temporalMargin > 0
+            && s->prevWidth == w && s->prevHeight == h
+            && s->prevBx == frame->blockx && s->prevBy == frame->blocky
+            && s->prevDispLimit == frame->dispLimit) {
+        correlation = frameCorrelation(s->prevGreyImage0, frame->greyImage0,
+                                       (size_t)w*h);
+        temporal = (correlation >= TEMPORAL_SCENE_CUT);
+        if (!temporal && !s->quiet)
+            printf("Scene cut (correlation %.2f), coarse pass.\n", correlation);
+    }
+
+    if (temporal) {
+        time1 = doubleTime();
+        dispData.dmap1 = s->prevDmap1;
+        dispData.dmap2 = s->prevDmap2;
+        dispData.width = w;
+        dispData.height = h;
+        dispData.bx = frame->blockx;
+        dispData.by = frame->blocky;
+        dispData.disp_limit = frame->dispLimit;
+        dispData.margin = s->temporalMargin;
+        Data.displacements = disparityLimits_temporal(s, &dispData);
+        time2 = doubleTime();
+        frame->timings.limits = (time2-time1)*1000;
+        frame->timings.temporal = 1;
+        if (!s->quiet)
+            printf("Disparity-limits (temporal):%5.1lf ms.\n", frame->timings.limits);
+        if (Data.displacements == NULL) {
+            pthread_mutex_destroy(&mutex1);
+            return EXIT_FAILURE;
+        }
+    }
+    else if (frame->select == HIERARCHIC) {
         /* Halve dimensions */
         struct znccData DataHalf;
 
-        time1 = doubleTime();
         DataHalf = Data;
         DataHalf.width = Data.width/2;
         DataHalf.height = Data.height/2;
-
-        DataHalf.greyImage0 = blend_2x2Ptr(Data.greyImage0, width/4, height/4);
-        DataHalf.greyImage1 = blend_2x2Ptr(Data.greyImage1, width/4, height/4);
-
-        if (DataHalf.greyImage0 == NULL || DataHalf.greyImage1 == NULL)
-            return NULL;
-        time2 = doubleTime();
-        printf("Blend 2x2:                 %6.1lf ms.\n", (time2-time1)*1000);
+        DataHalf.subpixel = SUBPIXEL_NONE;
+        DataHalf.greyImage0 = frame->halfImage0;
+        DataHalf.greyImage1 = frame->halfImage1;
 
         /* Disparity-range for every pixel. In this case 0-dispLimit/2. */
-        DataHalf.displacements = initializeDisparity(width/8, height/8, blockx, blocky, dispLimit/2);
+        DataHalf.displacements = initializeDisparity(w/2, h/2, frame->blockx,
+                                                     frame->blocky, frame->dispLimit/2);
 
         time1 = doubleTime();
-        zncc2way(&DataHalf);
+        zncc2way(s, &DataHalf, s->znccWorker);
         time2 = doubleTime();
-        printf("zncc (half-resolution):    %6.1lf ms.\n", (time2-time1)*1000);
+        frame->timings.znccHalf = (time2-time1)*1000;
+        if (!s->quiet)
+            printf("zncc (half-resolution):    %6.1lf ms.\n", frame->timings.znccHalf);
 
         free(DataHalf.displacements);
-        free(DataHalf.greyImage0);
-        free(DataHalf.greyImage1);
+        free(frame->halfImage0);
+        free(frame->halfImage1);
+        frame->halfImage0 = NULL;
+        frame->halfImage1 = NULL;
+        if (DataHalf.dmap1 == NULL || DataHalf.dmap2 == NULL) {
+            free(DataHalf.dmap1);
+            free(DataHalf.dmap2);
+            pthread_mutex_destroy(&mutex1);
+            return EXIT_FAILURE;
+        }
 
         time1 = doubleTime();
         /* Figure out decent disparity-range for 2x2 times bigger image. */
@@ -826,12 +1486,14 @@ unsigned char *generateDepthmap(unsigned char *img0, unsigned char *img1,
         dispData.dmap2 = DataHalf.dmap2;
         dispData.width = Data.width;
         dispData.height = Data.height;
-        dispData.bx = blockx;
-        dispData.by = blocky;
-        dispData.disp_limit = dispLimit;
-        Data.displacements = disparityLimits_2x2(&dispData);
+        dispData.bx = frame->blockx;
+        dispData.by = frame->blocky;
+        dispData.disp_limit = frame->dispLimit;
+        Data.displacements = disparityLimits_2x2(s, &dispData);
         time2 = doubleTime();
-        printf("Disparity-limits:          %6.1lf ms.\n", (time2-time1)*1000);
+        frame->timings.limits = (time2-time1)*1000;
+        if (!s->quiet)
+            printf("Disparity-limits:          %6.1lf ms.\n", frame->timings.limits);
 
 
         /* Free half-resolution depthmaps */
@@ -840,34 +1502,364 @@ unsigned char *generateDepthmap(unsigned char *img0, unsigned char *img1,
     }
     else {
         /* Full disparity-range. */
-        Data.displacements = initializeDisparity(width/4, height/4, blockx, blocky, dispLimit);
+        Data.displacements = initializeDisparity(w, h, frame->blockx, frame->blocky,
+                                                 frame->dispLimit);
     }
 
     time1 = doubleTime();
-    zncc2way(&Data);
+    Data.hybrid = hybrid;
+    /* Device bands follow the portable worker's summation order */
+    zncc2way(s, &Data, (hybrid != NULL) ? znccWorker : s->znccWorker);
     time2 = doubleTime();
-    printf("zncc:                      %6.1lf ms.\n", (time2-time1)*1000);
-
+    frame->timings.zncc = (time2-time1)*1000;
+    if (!s->quiet)
+        printf("zncc:                      %6.1lf ms.\n", frame->timings.zncc);
 
     free(Data.displacements);
-    free(Data.greyImage0);
-    free(Data.greyImage1);
+    pthread_mutex_destroy(&mutex1);
+
+    frame->dmap1 = Data.dmap1;
+    frame->dmap2 = Data.dmap2;
+    frame->dmap1Sub = Data.dmap1Sub;
+    if (Data.dmap1 == NULL || Data.dmap2 == NULL)
+        return EXIT_FAILURE;
+
+    if (s->temporalMargin > 0 && frame->select == HIERARCHIC)
+        keepPrior(s, w, h, frame->blockx, frame->blocky, frame->dispLimit,
+                  frame->greyImage0, Data.dmap1, Data.dmap2);
+    free(frame->greyImage0);
+    free(frame->greyImage1);
+    frame->greyImage0 = NULL;
+    frame->greyImage1 = NULL;
+
+    return EXIT_SUCCESS;
+}
+
+void *framePost_native(struct session_native *s, struct frame_native *frame,
+                       struct depthmapTimings *timings) {
+
+    double time1, time2;
+    void *ppo;
+
+    time1 = doubleTime();
+    if (frame->format == DISP_FIXED16)
+        ppo = postProcess16(frame->dmap1, frame->dmap2, frame->dmap1Sub,
+                            frame->width, frame->height);
+    else
+        ppo = postProcess(frame->dmap1, frame->dmap2, frame->width,
+                          frame->height, frame->dispLimit);
+    time2 = doubleTime();
+    frame->timings.post = (time2-time1)*1000;
+    if (!s->quiet)
+        printf("Post-processing:           %6.1lf ms.\n", frame->timings.post);
+
+    frame->timings.total = (time2-frame->start)*1000;
+    if (!s->quiet)
+        printf("Total time:                %6.1lf ms.\n\n", frame->timings.total);
+    if (timings != NULL)
+        (*timings) = frame->timings;
+
+    frameFree_native(frame);
+
+    return ppo;
+}
+
+void *sessionDepthmap_native(struct session_native *s,
+                             unsigned char *img0, unsigned char *img1,
+                             unsigned int width, unsigned int height,
+                             unsigned int blockx, unsigned int blocky,
+                             unsigned int dispLimit, searchMethod select,
+                             dispFormat format, subpixelMethod subpixel,
+                             unsigned int factor, struct session_hybrid *hybrid) {
+
+    struct frame_native *frame;
+
+    memset(&s->timings, 0, sizeof(struct depthmapTimings));
+
+    if (!s->quiet) {
+        printf("\n------------------------\n%d threads.\n", s->threadsN);
+#ifdef __x86_64__
+        if (s->disableAsm)
+            printf("Assembly disabled.\n");
+        else if (s->sse3)
+            printf("Processor supports SSE3.\n");
+#endif
+        if (hybrid != NULL)
+            printf("Hybrid: full-resolution zncc shared with OpenCL device.\n");
+        printf("------------------------\n");
+    }
+
+    frame = framePyramid_native(s, img0, img1, width, height, blockx, blocky,
+                                dispLimit, select, format, subpixel, factor, 1);
+    if (frame == NULL)
+        return NULL;
+    if (frameMatch_native(s, frame, hybrid) == EXIT_FAILURE) {
+        frameFree_native(frame);
+        return NULL;
+    }
 
+    return framePost_native(s, frame, &s->timings);
+}
+
+/* Post-processed depthmap of the dmaps of a frame, which are kept. */
+static void *postDmaps(struct frame_native *frame) {
+    if (frame->format == DISP_FIXED16)
+        return postProcess16(frame->dmap1, frame->dmap2, frame->dmap1Sub,
+                             frame->width, frame->height);
+    return postProcess(frame->dmap1, frame->dmap2, frame->width, frame->height,
+                       frame->dispLimit);
+}
+
+/* Scales a half-resolution dmap to width x height, disparitys doubled.
+ * Odd last column and scanline repeat their neighbours. */
+static void upsampleDmap(const unsigned char *half, unsigned char *full,
+                         unsigned int width, unsigned int height) {
+    unsigned int x, y, hx, hy, halfWidth, halfHeight;
+
+    halfWidth = width/2;
+    halfHeight = height/2;
+    for (y = 0; y < height; y++) {
+        hy = (y/2 < halfHeight) ? y/2 : halfHeight-1;
+        for (x = 0; x < width; x++) {
+            hx = (x/2 < halfWidth) ? x/2 : halfWidth-1;
+            full[y*width+x] = half[hy*halfWidth+hx]*2;
+        }
+    }
+}
+
+void *sessionAnytime_native(struct session_native *s,
+                            unsigned char *img0, unsigned char *img1,
+                            unsigned int width, unsigned int height,
+                            unsigned int blockx, unsigned int blocky,
+                            unsigned int dispLimit, dispFormat format,
+                            subpixelMethod subpixel, unsigned int factor,
+                            double budget, unsigned int bands,
+                            anytimeFunc progress, void *data,
+                            unsigned char **mask) {
+
+    struct frame_native *frame;
+    struct znccData Data, DataHalf;
+    struct disparityData dispData;
+    pthread_mutex_t mutex1 = PTHREAD_MUTEX_INITIALIZER;
+    int lineAvailable = 0, cancel, stale;
+    unsigned int w, h, blkSidey, band, first, last, refinedBands;
+    size_t pixels, i;
+    double time1, time2, bandMs;
+    unsigned char *refined;
+    void *result, *better;
+
+    memset(&s->timings, 0, sizeof(struct depthmapTimings));
+    if (mask != NULL)
+        (*mask) = NULL;
+    if (bands < 1)
+        bands = 1;
+
+    frame = framePyramid_native(s, img0, img1, width, height, blockx, blocky,
+                                dispLimit, HIERARCHIC, format, subpixel, factor, 1);
+    if (frame == NULL)
+        return NULL;
+    w = frame->width;
+    h = frame->height;
+    pixels = (size_t)w*h;
+    blkSidey = blocky/2;
+    refined = NULL;
+    result = NULL;
+
+    Data.threadsN = s->threadsN;
+    Data.lock_firstAvailable = &mutex1;
+    Data.firstAvailable = &lineAvailable;
+    Data.width = w;
+    Data.height = h;
+    Data.greyImage0 = frame->greyImage0;
+    Data.greyImage1 = frame->greyImage1;
+    Data.bx = blockx;
+    Data.by = blocky;
+    Data.subpixel = frame->subpixel;
+    Data.hybrid = NULL;
+    Data.displacements = NULL;
+    Data.dmap1 = NULL;
+    Data.dmap2 = NULL;
+    Data.dmap1Sub = NULL;
+
+    DataHalf = Data;
+    DataHalf.width = w/2;
+    DataHalf.height = h/2;
+    DataHalf.subpixel = SUBPIXEL_NONE;
+    DataHalf.greyImage0 = frame->halfImage0;
+    DataHalf.greyImage1 = frame->halfImage1;
+    DataHalf.displacements = initializeDisparity(w/2, h/2, blockx, blocky,
+                                                 dispLimit/2);
+
+    time1 = doubleTime();
+    zncc2way(s, &DataHalf, s->znccWorker);
+    time2 = doubleTime();
+    frame->timings.znccHalf = (time2-time1)*1000;
+    if (!s->quiet)
+        printf("zncc (half-resolution):    %6.1lf ms.\n", frame->timings.znccHalf);
+
+    free(DataHalf.displacements);
+    free(frame->halfImage0);
+    free(frame->halfImage1);
+    frame->halfImage0 = NULL;
+    frame->halfImage1 = NULL;
+    if (DataHalf.dmap1 == NULL || DataHalf.dmap2 == NULL)
+        goto failed;
+
+    time1 = doubleTime();
+    dispData.threadsN = s->threadsN;
+    dispData.lock_firstAvailable = &mutex1;
+    dispData.firstAvailable = &lineAvailable;
+    dispData.dmap1 = DataHalf.dmap1;
+    dispData.dmap2 = DataHalf.dmap2;
+    dispData.width = w;
+    dispData.height = h;
+    dispData.bx = blockx;
+    dispData.by = blocky;
+    dispData.disp_limit = dispLimit;
+    Data.displacements = disparityLimits_2x2(s, &dispData);
+    time2 = doubleTime();
+    frame->timings.limits = (time2-time1)*1000;
+    if (!s->quiet)
+        printf("Disparity-limits:          %6.1lf ms.\n", frame->timings.limits);
+
+    /* Upsampled half-resolution dmaps stand in for full-resolution ones
+     * until their band is refined */
+    frame->dmap1 = malloc(pixels);
+    frame->dmap2 = malloc(pixels);
+    if (frame->subpixel != SUBPIXEL_NONE)
+        frame->dmap1Sub = malloc(sizeof(unsigned short)*pixels);
+    refined = calloc(pixels, 1);
+    if (Data.displacements == NULL || frame->dmap1 == NULL || frame->dmap2 == NULL
+            || (frame->subpixel != SUBPIXEL_NONE && frame->dmap1Sub == NULL)
+            || refined == NULL
+            || reserveCaches(s, ((blockx*blocky+7)/8)*8*w+w, w) == EXIT_FAILURE)
+        goto failed;
+    upsampleDmap(DataHalf.dmap1, frame->dmap1, w, h);
+    upsampleDmap(DataHalf.dmap2, frame->dmap2, w, h);
+    if (frame->dmap1Sub != NULL)
+        for (i = 0; i < pixels; i++)
+            frame->dmap1Sub[i] = frame->dmap1[i]*DISP_SUBPIXEL_SCALE;
+    free(DataHalf.dmap1);
+    free(DataHalf.dmap2);
+    DataHalf.dmap1 = NULL;
+    DataHalf.dmap2 = NULL;
 
     time1 = doubleTime();
-    unsigned char *ppo;
-    ppo = postProcess(Data.dmap1, Data.dmap2, width/4, height/4, dispLimit);
+    result = postDmaps(frame);
     time2 = doubleTime();
-    printf("Post-processing:           %6.1lf ms.\n", (time2-time1)*1000);
+    frame->timings.post += (time2-time1)*1000;
+    if (result == NULL)
+        goto failed;
+    if (!s->quiet)
+        printf("Coarse depthmap:           %6.1lf ms.\n", (time2-frame->start)*1000);
+    cancel = (progress != NULL) ? progress(result, refined, w, h, data) : 0;
+
+    Data.dmap1 = frame->dmap1;
+    Data.dmap2 = frame->dmap2;
+    Data.dmap1Sub = frame->dmap1Sub;
+    bandMs = 0.0;
+    stale = 0;
+    refinedBands = 0;
+    for (band = 0; band < bands && !cancel; band++) {
+        time1 = doubleTime();
+        if (budget > 0.0 && (time1-frame->start)*1000 + bandMs > budget)
+            break;
+
+        /* Refined scanlines start from zeros, as in zncc2way */
+        first = band*h/bands;
+        last = (band+1)*h/bands;
+        memset(frame->dmap1 + first*w, 0, (last-first)*w);
+        memset(frame->dmap2 + first*w, 0, (last-first)*w);
+        if (frame->dmap1Sub != NULL)
+            memset(frame->dmap1Sub + first*w, 0,
+                   sizeof(unsigned short)*(last-first)*w);
+        if (first < blkSidey)
+            first = blkSidey;
+        if (last > h-blkSidey)
+            last = h-blkSidey;
+        if (first < last)
+            znccRows(s, &Data, s->znccWorker, first, last);
+        memset(refined + (band*h/bands)*w, 1, ((band+1)*h/bands - band*h/bands)*w);
+        time2 = doubleTime();
+        bandMs = (time2-time1)*1000;
+        frame->timings.zncc += bandMs;
+        refinedBands++;
+        stale = 1;
+
+        if (progress != NULL) {
+            time1 = doubleTime();
+            better = postDmaps(frame);
+            time2 = doubleTime();
+            frame->timings.post += (time2-time1)*1000;
+            if (better == NULL)
+                goto failed;
+            free(result);
+            result = better;
+            stale = 0;
+            cancel = progress(result, refined, w, h, data);
+        }
+    }
+    if (!s->quiet)
+        printf("zncc, %u of %u bands:        %6.1lf ms.\n", refinedBands, bands,
+               frame->timings.zncc);
+
+    if (stale) {
+        time1 = doubleTime();
+        better = postDmaps(frame);
+        time2 = doubleTime();
+        frame->timings.post += (time2-time1)*1000;
+        if (better == NULL)
+            goto failed;
+        free(result);
+        result = better;
+    }
+    if (!s->quiet)
+        printf("Post-processing:           %6.1lf ms.\n", frame->timings.post);
+
+    frame->timings.total = (doubleTime()-frame->start)*1000;
+    if (!s->quiet)
+        printf("Total time:                %6.1lf ms.\n\n", frame->timings.total);
+    s->timings = frame->timings;
 
+    free(Data.displacements);
+    frameFree_native(frame);
+    pthread_mutex_destroy(&mutex1);
+    if (mask != NULL)
+        (*mask) = refined;
+    else
+        free(refined);
 
-    free(Data.dmap1);
-    free(Data.dmap2);
+    return result;
 
+failed:
+    free(Data.displacements);
+    free(DataHalf.dmap1);
+    free(DataHalf.dmap2);
+    free(refined);
+    free(result);
+    frameFree_native(frame);
     pthread_mutex_destroy(&mutex1);
+    return NULL;
+}
 
-    total2 = doubleTime();
-    printf("Total time:                %6.1lf ms.\n\n", (total2-total1)*1000);
+void *generateDepthmap(unsigned char *img0, unsigned char *img1,
+                       unsigned int width, unsigned int height,
+                       unsigned int blockx, unsigned int blocky,
+                       unsigned int dispLimit, searchMethod select,
+                       int threads, int disableAsm, dispFormat format,
+                       subpixelMethod subpixel, unsigned int factor) {
 
-    return ppo;
+    struct session_native *s;
+    void *result;
+
+    s = createSession_native(threads, disableAsm, 0);
+    if (s == NULL)
+        return NULL;
+
+    result = sessionDepthmap_native(s, img0, img1, width, height, blockx, blocky,
+                                    dispLimit, select, format, subpixel, factor,
+                                    NULL);
+    releaseSession_native(s);
+
+    return result;
 }
@@ -1,18 +1,143 @@
 #ifndef DEPTH_C_H
 #define DEPTH_C_H
 
+#include "disparity.h"
+#include "hybrid.h"
+
 typedef enum {BRUTE, HIERARCHIC} searchMethod;
 
+/* Stage times of the last depthmap in ms, 0 for stages that were not run. */
+struct depthmapTimings {
+    double blend;
+    double blend2x2;
+    double znccHalf;
+    double limits;
+    double zncc;
+    double post;
+    double total;
+    /* 1 when disparity-limits came from the previous frame */
+    int temporal;
+};
+
 /* Generates post-processed depthmap. Takes: 2 32-bit stereo-images, their width
- * and height (mod 4). Wanted blocksize for a search, disparity-limit and search method.
+ * and height (mod factor). Wanted blocksize for a search, disparity-limit, search
+ * method, format of the result (unsigned char or unsigned short elements), sub-pixel
+ * refinement, which is used only with DISP_FIXED16, and downscale factor of the
+ * images (1, 2, 4 or 8).
  * On success:
- *  Returns 1/4 by 1/4 image.
+ *  Returns 1/factor by 1/factor image.
  * On failure:
  *  Returns NULL. */
-unsigned char *generateDepthmap(unsigned char *img0, unsigned char *img1,
-                                unsigned int width, unsigned height,
-                                unsigned int blockx, unsigned int blocky,
-                                unsigned int disp_limit, searchMethod select,
-                                int threads, int disableAsm);
+void *generateDepthmap(unsigned char *img0, unsigned char *img1,
+                       unsigned int width, unsigned height,
+                       unsigned int blockx, unsigned int blocky,
+                       unsigned int disp_limit, searchMethod select,
+                       int threads, int disableAsm, dispFormat format,
+                       subpixelMethod subpixel, unsigned int factor);
+
+/* Threads, selected kernels and zncc caches reused for any number of
+ * stereo-pairs. Sessions share nothing, so several can run at once. */
+struct session_native;
+
+/* Starts threads (0 for one per processor) and selects kernels, assembly
+ * unless disableAsm. quiet leaves out prints of depthmaps. NULL on failure. */
+struct session_native *createSession_native(int threads, int disableAsm, int quiet);
+
+/* Same as generateDepthmap, but on an existing session. With a hybrid
+ * session, full-resolution matching is shared with its OpenCL device,
+ * otherwise NULL. */
+void *sessionDepthmap_native(struct session_native *s,
+                             unsigned char *img0, unsigned char *img1,
+                             unsigned int width, unsigned int height,
+                             unsigned int blockx, unsigned int blocky,
+                             unsigned int disp_limit, searchMethod select,
+                             dispFormat format, subpixelMethod subpixel,
+                             unsigned int factor, struct session_hybrid *hybrid);
+
+/* Progress of an anytime depthmap: depthmap so far, of width x height and
+ * format, and mask with 1 for pixels refined at full resolution, 0 for
+ * upsampled half-resolution ones. Both are valid only during the call.
+ * Returning non-zero cancels the remaining refinement. */
+typedef int (*anytimeFunc)(const void *depthmap, const unsigned char *mask,
+                           unsigned int width, unsigned int height, void *data);
+
+/* Anytime HIERARCHIC depthmap: the half-resolution pass is upsampled and
+ * given to progress (unless NULL) at once, then full-resolution matching
+ * refines bands of scanlines from the top, each followed by progress. No
+ * band is started that would end after budget ms from the start, as
+ * predicted by the previous band; 0 has no deadline. Arguments are those
+ * of sessionDepthmap_native, the mask of the result is stored to mask,
+ * freed by the caller, unless it is NULL. With all bands refined the result
+ * is the same as sessionDepthmap_native's. NULL on failure. */
+void *sessionAnytime_native(struct session_native *s,
+                            unsigned char *img0, unsigned char *img1,
+                            unsigned int width, unsigned int height,
+                            unsigned int blockx, unsigned int blocky,
+                            unsigned int disp_limit, dispFormat format,
+                            subpixelMethod subpixel, unsigned int factor,
+                            double budget, unsigned int bands,
+                            anytimeFunc progress, void *data,
+                            unsigned char **mask);
+
+/* Temporal prior for video: with HIERARCHIC search, disparity-ranges of a
+ * depthmap are taken from the previous one of the session, widened by margin
+ * disparitys for motion, instead of a half-resolution pass. Size or
+ * parameter changes and scene cuts, detected by correlation of consecutive
+ * left images, fall back to the half-resolution pass. 0 disables. */
+void setTemporal_native(struct session_native *s, unsigned int margin);
+
+/* Depthmap of sessionDepthmap_native split in stages, so that stages of
+ * consecutive pairs can overlap: framePyramid_native blends images to
+ * greyscale (and halves them for HIERARCHIC), frameMatch_native runs zncc
+ * on the session's threads and framePost_native post-processes. Only
+ * frameMatch_native uses the threads, so it must not run concurrently with
+ * itself or sessionDepthmap_native; the other stages can run in any thread
+ * at the same time. */
+struct frame_native;
+
+/* Takes the arguments of sessionDepthmap_native. pooled uses the session's
+ * threads for blending, otherwise only the calling thread. NULL on failure. */
+struct frame_native *framePyramid_native(struct session_native *s,
+                                         unsigned char *img0, unsigned char *img1,
+                                         unsigned int width, unsigned int height,
+                                         unsigned int blockx, unsigned int blocky,
+                                         unsigned int disp_limit, searchMethod select,
+                                         dispFormat format, subpixelMethod subpixel,
+                                         unsigned int factor, int pooled);
+
+/* Copy of a frame from framePyramid_native, not yet matched, for another
+ * block size and disparity limit. Greyscale images are copied instead of
+ * blended again, so that parameter sweeps share one pyramid. NULL on
+ * failure. */
+struct frame_native *frameVariant_native(const struct frame_native *frame,
+                                         unsigned int blockx, unsigned int blocky,
+                                         unsigned int disp_limit);
+
+/* Returns EXIT_SUCCESS or EXIT_FAILURE, frame is kept in both cases. */
+int frameMatch_native(struct session_native *s, struct frame_native *frame,
+                      struct session_hybrid *hybrid);
+
+/* Returns the depthmap and frees frame. Stage times of the frame are stored
+ * to timings unless it is NULL. */
+void *framePost_native(struct session_native *s, struct frame_native *frame,
+                       struct depthmapTimings *timings);
+
+/* Size of a frame's depthmap and its intermediate results, owned by the
+ * frame: greyscale images, kept until frameMatch_native, and dmaps of the
+ * left (dmap1) and right (dmap2) image from frameMatch_native until
+ * framePost_native. NULL where not kept. */
+void frameIntermediates_native(const struct frame_native *frame,
+                               unsigned int *width, unsigned int *height,
+                               const float **grey0, const float **grey1,
+                               const unsigned char **dmap1,
+                               const unsigned char **dmap2);
+
+/* Frees a frame abandoned before framePost_native. */
+void frameFree_native(struct frame_native *frame);
+
+/* Stage times of the session's last depthmap. */
+const struct depthmapTimings *sessionTimings_native(struct session_native *s);
+
+void releaseSession_native(struct session_native *s);
 
 #endif
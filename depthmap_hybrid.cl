@@ -0,0 +1,221 @@
+/* Scanline bands of the native zncc (znccWorker in depthmap_c.c) for the
+ * hybrid mode. Every operation is done in the same order as on the host, so
+ * that the bands merge into the same depthmaps a native run gives. Needs
+ * correctly rounded division and sqrt, which the host asks for when the
+ * device supports them. */
+#pragma OPENCL FP_CONTRACT OFF
+
+#define DISP_SUBPIXEL_SCALE 16
+#define SUBPIXEL_EQUIANGULAR 2
+
+/* Same as scanline_cacheBlkData */
+void cacheScanline(__global const float *img, uint scanline,
+                   __global float *cacheData, uint width, uint bx, uint by) {
+    float rcp_div_bxby, mean, subtracted, squared_deviations;
+    __global float *blkMean;
+    uint lineTop, lineBot;
+    int x, y, i, bxSide, blkStride;
+
+    blkStride = ((bx*by+7)/8)*8;
+    rcp_div_bxby = 1.0f/(float)(bx*by);
+    lineTop = scanline-by/2;
+    lineBot = scanline+by/2+1;
+    bxSide = bx/2;
+
+    for (x = 0; x < width; x++)
+        cacheData[x] = 0.0f;
+
+    for (y = lineTop; y < lineBot; y++) {
+        for (x = 0; x < width; x++) {
+            cacheData[x] += img[y * width + x];
+        }
+    }
+
+    blkMean = &cacheData[width*blkStride];
+
+    mean = 0.0f;
+    for (i = 0; i < bx; i++) {
+        mean += cacheData[i];
+    }
+    blkMean[bxSide] = mean * rcp_div_bxby;
+
+    for (x = bxSide+1; x < width - bxSide; x++) {
+        mean -= cacheData[x-bxSide-1];
+        mean += cacheData[x+bxSide];
+        blkMean[x] = mean * rcp_div_bxby;
+    }
+
+    for (i=bxSide; i < width - bxSide; i++) {
+        squared_deviations = 0.0f;
+        mean = blkMean[i];
+        for (y=lineTop; y < lineBot; y++) {
+            for (x=0; x < bx; x++) {
+                subtracted = img[y*width+x+i-bxSide] - mean;
+                cacheData[blkStride*i+(y-lineTop)*bx + x] = subtracted;
+                squared_deviations += subtracted*subtracted;
+            }
+        }
+        blkMean[i] = 1.0f / sqrt(squared_deviations);
+    }
+}
+
+/* Same as subpixelOffset */
+float subpixelOffset(float cL, float cB, float cR, uint method) {
+    float offset;
+
+    if (method == SUBPIXEL_EQUIANGULAR) {
+        if (cL < cR)
+            offset = 0.5f*(cR - cL)/(cB - cL);
+        else
+            offset = 0.5f*(cR - cL)/(cB - cR);
+    }
+    else {
+        offset = (cL - cR)/(2.0f*(cL - 2.0f*cB + cR));
+    }
+
+    if (offset != offset)
+        return 0.0f;
+    if (offset > 0.5f)
+        offset = 0.5f;
+    if (offset < -0.5f)
+        offset = -0.5f;
+
+    return offset;
+}
+
+/* Same as subpixelDisparity */
+ushort subpixelDisparity(int disp, float cL, float cB, float cR, uint method) {
+    float val;
+
+    val = (disp + subpixelOffset(cL, cB, cR, method))*DISP_SUBPIXEL_SCALE + 0.5f;
+    if (val < 0.0f)
+        return 0;
+    return (ushort)val;
+}
+
+/* One work-item matches one scanline of [firstLine, lastLine) like
+ * znccWorker does, with its block caches and dmap2 correlations in scratch.
+ * Rows are written whole, also the unmatched edges. dmap1Sub is written
+ * when subpixel is not 0 (SUBPIXEL_NONE). */
+__kernel void znccRows(__global const float *greyImage0,
+                       __global const float *greyImage1,
+                       __global const ushort *displacements,
+                       __global uchar *dmap1,
+                       __global uchar *dmap2,
+                       __global ushort *dmap1Sub,
+                       __global float *scratch,
+                       uint width,
+                       uint bx,
+                       uint by,
+                       uint firstLine,
+                       uint lastLine,
+                       uint subpixel) {
+    __global float *cache_blk_l, *cache_blk_r, *ccor;
+    int scanline, blkSidex, blkStride, i, x;
+    int d, dlim, disp, captureRight;
+    float deviations_left, deviations_right, maxVal, temp1, temp2, val;
+    float prevVal, ccLeft, ccRight;
+    float summed[4];
+    size_t cacheSize;
+
+    scanline = firstLine + get_global_id(0);
+    if (scanline >= lastLine)
+        return;
+
+    blkSidex = bx/2;
+    blkStride = ((bx*by+7)/8)*8;
+    cacheSize = blkStride*width+width;
+    cache_blk_l = &scratch[get_global_id(0)*(2*cacheSize+width)];
+    cache_blk_r = &cache_blk_l[cacheSize];
+    ccor = &cache_blk_r[cacheSize];
+
+    for (x = 0; x < width; x++) {
+        dmap1[scanline*width + x] = 0;
+        dmap2[scanline*width + x] = 0;
+        if (subpixel != 0)
+            dmap1Sub[scanline*width + x] = 0;
+    }
+
+    cacheScanline(greyImage0, scanline, cache_blk_l, width, bx, by);
+    cacheScanline(greyImage1, scanline, cache_blk_r, width, bx, by);
+
+    for (i = 0; i < width; i++) {
+        ccor[i] = -FLT_MAX;
+    }
+
+    for (x = blkSidex; x < width - blkSidex; x++) {
+
+        deviations_left = cache_blk_l[width*blkStride + x];
+
+        /* Reset per pixel as in znccWorker, flat blocks (NaN) get 0 */
+        maxVal = -FLT_MAX;
+        disp = 0;
+        d = displacements[scanline*width*2+x*2];
+        dlim = displacements[scanline*width*2+x*2+1];
+
+        prevVal = -FLT_MAX;
+        ccLeft = -FLT_MAX;
+        ccRight = -FLT_MAX;
+        captureRight = 0;
+
+        for (d=d; d <= dlim; d++) {
+            deviations_right = cache_blk_r[width*blkStride + x-d];
+
+            summed[0]=0.0f;
+            summed[1]=0.0f;
+            summed[2]=0.0f;
+            summed[3]=0.0f;
+            for (i = x*blkStride; i < x*blkStride+(int)(bx*by)-3; i += 4) {
+                temp1 = cache_blk_r[i - d*blkStride];
+                temp2 = cache_blk_l[i];
+                summed[0] += temp1*temp2;
+                temp1 = cache_blk_r[i+1 - d*blkStride];
+                temp2 = cache_blk_l[i+1];
+                summed[1] += temp1*temp2;
+                temp1 = cache_blk_r[i+2 - d*blkStride];
+                temp2 = cache_blk_l[i+2];
+                summed[2] += temp1*temp2;
+                temp1 = cache_blk_r[i+3 - d*blkStride];
+                temp2 = cache_blk_l[i+3];
+                summed[3] += temp1*temp2;
+            }
+            summed[0] += summed[1];
+            summed[2] += summed[3];
+            summed[0] += summed[2];
+            for (i = i; i < x*blkStride+(int)(bx*by); i++) {
+                temp1 = cache_blk_r[i - d*blkStride];
+                temp2 = cache_blk_l[i];
+                summed[0] += temp1*temp2;
+            }
+
+            val = summed[0] * (deviations_left * deviations_right);
+
+            if (captureRight) {
+                ccRight = val;
+                captureRight = 0;
+            }
+
+            if (val > maxVal) {
+                maxVal = val;
+                disp = d;
+                ccLeft = prevVal;
+                captureRight = 1;
+                ccRight = -FLT_MAX;
+            }
+            prevVal = val;
+            if (val > ccor[x-d]) {
+                ccor[x-d] = val;
+                dmap2[scanline*width + x-d] = d;
+            }
+        }
+        dmap1[scanline * width + x] = disp;
+
+        if (subpixel != 0) {
+            if (ccLeft != -FLT_MAX && ccRight != -FLT_MAX)
+                dmap1Sub[scanline*width + x] =
+                        subpixelDisparity(disp, ccLeft, maxVal, ccRight, subpixel);
+            else
+                dmap1Sub[scanline*width + x] = disp*DISP_SUBPIXEL_SCALE;
+        }
+    }
+}
@@ -1,350 +1,437 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <float.h>
+#include <string.h>
 //#include <CL/cl.h>
 
 #include "depthmap_opencl.h"
 #include "common_opencl.h"
+#include "clcache.h"
 #include "doubleTime.h"
 
+/* Everything that stays the same between stereo-pairs. Buffers grow on
+ * demand, so pairs of different size work too, but are slower. */
+struct session_opencl_basic {
+    cl_platform_id platform;
+    cl_device_id device;
+    cl_context context;
+    cl_program program;
+    cl_command_queue queue;
+
+    cl_kernel blendAndGreyscale, blend2x2, initDisparitys, disparityLimits, zero;
+    cl_kernel cacheBlkData, initCcors, zncc, znccTiled, constructDmap2, constructDmap2Pixel;
+    cl_kernel postCross, postFill, postCross16, postFill16;
+    /* NULL when device has no atomic max, then dmap2 is constructed from ccor */
+    cl_kernel constructDmap2Packed;
+    /* Size of packed correlations, 8 bytes with 64-bit atomics */
+    size_t packedSize;
+
+    struct oclBuffer input_img0, input_img1, greyImage0, greyImage1;
+    struct oclBuffer halfImage0, halfImage1, disparitys, disparitysHalf;
+    struct oclBuffer cacheBlks_l, cacheBlks_r, ccor, best2;
+    struct oclBuffer dmap1, dmap2, dmap1Offset;
+    struct oclBuffer dmap1Half, dmap2Half, offsetHalf;
+    struct oclBuffer postpMem1, postpMem2;
+
+    /* Commands of the depthmap being generated */
+    struct eventLog log;
+    /* Largest cost volume not allocated thanks to constructDmap2Packed */
+    size_t ccorSaved;
+
+    /* Set from DEPTHMAP_CL_COMPARE, runs also the per-scanline constructDmap2 */
+    int compareDmap2;
+
+    /* Launch parameters, and limits znccTiled has to fit in */
+    struct tuneConfig tune;
+    size_t tiledGroupMax;
+    cl_ulong localMemSize;
+    /* Set by autotuning, no timing prints */
+    int quiet;
+    /* Commands of every depthmap are appended here, if not NULL */
+    struct oclTrace *trace;
+    /* Device uses host memory directly, images are wrapped instead of copied
+     * and the result is mapped instead of read */
+    int hostUnified;
+
+    /* Block caching and zncc kernels built for the current block size and
+     * disparity limit. NULL before first depthmap, or with generic kernels
+     * (DEPTHMAP_CL_GENERIC set or specialised build failed). */
+    cl_program specProgram;
+    cl_kernel specCacheBlkData, specZncc, specZnccTiled;
+    cl_uint specBx, specBy, specDlimit;
+    int generic;
+};
+
+/* Builds specialised kernels when block size or disparity limit changes.
+ * On failure generic kernels are used for the rest of the session. */
+void specialiseKernels(struct session_opencl_basic *s,
+                       cl_uint bx, cl_uint by, cl_uint disp_limit) {
+    char options[64];
+
+    if (s->generic || (s->specProgram != NULL && s->specBx == bx &&
+                       s->specBy == by && s->specDlimit == disp_limit))
+        return;
+
+    if (s->specProgram != NULL) {
+        clReleaseKernel(s->specCacheBlkData);
+        clReleaseKernel(s->specZncc);
+        clReleaseKernel(s->specZnccTiled);
+        clReleaseProgram(s->specProgram);
+        s->specProgram = NULL;
+    }
+
+    snprintf(options, sizeof(options), "-DBX=%u -DBY=%u -DDLIMIT=%u",
+             bx, by, disp_limit);
+    if (buildOCLProgram(s->device, s->context, "depthmap_basic.cl", options,
+                        &s->specProgram) == EXIT_FAILURE) {
+        fprintf(stderr, "Specialised build failed, using generic kernels.\n");
+        s->specProgram = NULL;
+        s->generic = 1;
+        return;
+    }
+
+    const char *names[] = {"cacheBlkData", "zncc", "znccTiled"};
+    cl_kernel *kernels[] = {&s->specCacheBlkData, &s->specZncc, &s->specZnccTiled};
+    if (createKernels(s->specProgram, 3, names, kernels) == EXIT_FAILURE) {
+        clReleaseProgram(s->specProgram);
+        s->specProgram = NULL;
+        s->generic = 1;
+        return;
+    }
+
+    s->specBx = bx;
+    s->specBy = by;
+    s->specDlimit = disp_limit;
+    printf("Kernels specialised for %ux%u blocks, disparity limit %u.\n",
+           bx, by, disp_limit);
+}
+
 /* OpenCL 1.1 doesn't have clEnqueueFillBuffer */
-/* Fills buffer with width*height zero bytes */
-int zeroMem_kernel(cl_program program, cl_command_queue queue,
+/* Enqueues filling of width*height zero bytes to current stage */
+int zeroMem_kernel(struct session_opencl_basic *s,
                    cl_mem data, cl_uint width, cl_uint height) {
-    cl_kernel kernZero;
     size_t global[2];
     cl_int err;
 
-    kernZero = clCreateKernel(program, "zero_clMem", &err);
-    if (err != CL_SUCCESS) {
-        fprintf(stderr, "Couldn't create a kernel! Code: %d"
-                        "(file %s line %d)\n", err, __FILE__, __LINE__);
-        return EXIT_FAILURE;
-    }
-
     global[0] = width;
     global[1] = height;
-    clSetKernelArg(kernZero, 0, sizeof(cl_mem), &data);
-    err = clEnqueueNDRangeKernel(queue, kernZero, 2, NULL, global, NULL,
-                                 0, NULL, NULL);
+    clSetKernelArg(s->zero, 0, sizeof(cl_mem), &data);
+    err = eventLogKernel(&s->log, -1, s->queue,
+                         s->zero, 2, NULL, global, NULL,
+                         (size_t)width*height);
     if (err != CL_SUCCESS) {
         fprintf(stderr, "Couldn't enqueue the kernel. Code %d. %s line %d\n",
                 err, __FILE__, __LINE__);
         return EXIT_FAILURE;
     }
 
-    clReleaseKernel(kernZero);
-
     return EXIT_SUCCESS;
 }
 
-/* Converts rgba-image to greyscale float-image  with 1/4 resolution on both axis */
-int blend4x4CnvrtToGrey(cl_program program, cl_command_queue queue,
-                        cl_mem *input_img0, cl_mem *input_img1,
-                        cl_mem *greyImage0, cl_mem *greyImage1,
-                        cl_uint width, cl_uint height) {
-    cl_event event[2];
+/* Converts rgba-images in input_img0/1 to greyscale float-images with
+ * 1/factor resolution on both axis */
+int blendCnvrtToGrey(struct session_opencl_basic *s,
+                     cl_uint width, cl_uint height, cl_uint factor) {
     cl_int err, err2;
-    size_t global[2];
-    cl_kernel blendAndGreyscale;
-
-    if ((width % 4 != 0) || (height % 4 != 0)) {
-        fprintf(stderr, "blend4x4 does not currently handle resolutions not "
-                        "divisible by 4!\n");
+    cl_uint shift;
+    size_t global[2], greySize;
+    cl_kernel blendAndGreyscale = s->blendAndGreyscale;
+    char label[40];
+    int line;
+
+    if ((width % factor != 0) || (height % factor != 0)) {
+        fprintf(stderr, "blend does not currently handle resolutions not "
+                        "divisible by %u!\n", factor);
         return EXIT_FAILURE;
     }
+    /* Sums of factor*factor values are divided by shifting */
+    for (shift = 0; (1u << shift) < factor*factor; shift++);
 
-    blendAndGreyscale = clCreateKernel(program, "blend4x4_cnvrtToGreyscale", &err);
-    if (err != CL_SUCCESS) {
-        fprintf(stderr, "Couldn't create a kernel! Code: %d"
-                        "(file %s line %d)\n", err, __FILE__, __LINE__);
+    greySize = (width/factor)*(height/factor)*sizeof(cl_float);
+    if (ensureBuffer(s->context, &s->greyImage0, greySize) == EXIT_FAILURE ||
+        ensureBuffer(s->context, &s->greyImage1, greySize) == EXIT_FAILURE)
         return EXIT_FAILURE;
-    }
 
-    global[0] = width/4;
-    global[1] = height/4;
-    clSetKernelArg(blendAndGreyscale, 0, sizeof(cl_mem), input_img0);
-    clSetKernelArg(blendAndGreyscale, 1, sizeof(cl_uint), &width);
-    clSetKernelArg(blendAndGreyscale, 2, sizeof(cl_mem), greyImage0);
-    err = clEnqueueNDRangeKernel(queue, blendAndGreyscale, 2, NULL, global, NULL,
-                                 0, NULL, &event[0]);
+    snprintf(label, sizeof(label), "Blend %ux%u and greyscaling:", factor, factor);
+    line = eventLogLine(&s->log, -1, label);
+    eventLogStage(&s->log);
 
-    clSetKernelArg(blendAndGreyscale, 0, sizeof(cl_mem), input_img1);
+    global[0] = width/factor;
+    global[1] = height/factor;
+    clSetKernelArg(blendAndGreyscale, 0, sizeof(cl_mem), &s->input_img0.mem);
     clSetKernelArg(blendAndGreyscale, 1, sizeof(cl_uint), &width);
-    clSetKernelArg(blendAndGreyscale, 2, sizeof(cl_mem), greyImage1);
-    err2 = clEnqueueNDRangeKernel(queue, blendAndGreyscale, 2, NULL, global, NULL,
-                                 0, NULL, &event[1]);
+    clSetKernelArg(blendAndGreyscale, 2, sizeof(cl_uint), &factor);
+    clSetKernelArg(blendAndGreyscale, 3, sizeof(cl_uint), &shift);
+    clSetKernelArg(blendAndGreyscale, 4, sizeof(cl_mem), &s->greyImage0.mem);
+    err = eventLogKernel(&s->log, line, s->queue,
+                         blendAndGreyscale, 2, NULL, global, NULL,
+                         width*height*4 + greySize);
+
+    clSetKernelArg(blendAndGreyscale, 0, sizeof(cl_mem), &s->input_img1.mem);
+    clSetKernelArg(blendAndGreyscale, 4, sizeof(cl_mem), &s->greyImage1.mem);
+    err2 = eventLogKernel(&s->log, line, s->queue,
+                          blendAndGreyscale, 2, NULL, global, NULL,
+                          width*height*4 + greySize);
     if (err != CL_SUCCESS || err2 != CL_SUCCESS) {
-        fprintf(stderr, "Couldn't enqueue the kernel. Code %d\n", err);
+        fprintf(stderr, "Couldn't enqueue the kernel. Code %d\n",
+                (err != CL_SUCCESS) ? err : err2);
         return EXIT_FAILURE;
     }
-    clWaitForEvents(2, event);
-
-    float time;
-    time = eventRuntime(event[0]);
-    time += eventRuntime(event[1]);
-    printf("Blend4x4 and greyscaling:       %6.1f ms.\n", time);
-
-    /* Make sure queue is empty before attempting to release resources. */
-    clFinish(queue); // clWaitForEvents makes this redundant
-
-    clReleaseMemObject((*input_img0));
-    clReleaseMemObject((*input_img1));
-    clReleaseKernel(blendAndGreyscale);
 
     return EXIT_SUCCESS;
 }
 
 /* reduce float-image dimensions by half */
-int blend2x2(cl_context context, cl_program program, cl_command_queue queue,
-             cl_mem *greyImage0, cl_mem *greyImage1,
-             cl_mem *halfImage0, cl_mem *halfImage1,
-             cl_uint width, cl_uint height) {
-    cl_kernel blend;
+int blend2x2(struct session_opencl_basic *s, cl_uint width, cl_uint height) {
+    cl_kernel blend = s->blend2x2;
     size_t global[2], imgSize;
-    cl_event event[2];
     cl_int err, err2;
+    int line;
 
-    blend = clCreateKernel(program, "blend2x2", &err);
-    if (err != CL_SUCCESS) {
-        fprintf(stderr, "Couldn't create a kernel! Code: %d"
-                        "(file %s line %d)\n", err, __FILE__, __LINE__);
-        return EXIT_FAILURE;
-    }
-
-    /* Allocate space for half-images */
+    /* Space for half-images */
     imgSize = (width/2)*(height/2)*sizeof(cl_float);
-    (*halfImage0) = clCreateBuffer(context, CL_MEM_READ_WRITE, imgSize, NULL, &err);
-    (*halfImage1) = clCreateBuffer(context, CL_MEM_READ_WRITE, imgSize, NULL, &err2);
-    if (err != CL_SUCCESS || err2 != CL_SUCCESS) {
-        fprintf(stderr, "Couldn't create a buffer. %s line %d\n", __FILE__, __LINE__);
+    if (ensureBuffer(s->context, &s->halfImage0, imgSize) == EXIT_FAILURE ||
+        ensureBuffer(s->context, &s->halfImage1, imgSize) == EXIT_FAILURE)
         return EXIT_FAILURE;
-    }
+
+    line = eventLogLine(&s->log, -1, "Blend2x2:");
+    eventLogStage(&s->log);
 
     global[0] = width/2;
     global[1] = height/2;
-    clSetKernelArg(blend, 0, sizeof(cl_mem), greyImage0);
-    clSetKernelArg(blend, 1, sizeof(cl_uint), &width);
-    clSetKernelArg(blend, 2, sizeof(cl_mem), halfImage0);
-    err = clEnqueueNDRangeKernel(queue, blend, 2, NULL, global, NULL,
-                                 0, NULL, &event[0]);
-
-    clSetKernelArg(blend, 0, sizeof(cl_mem), greyImage1);
+    clSetKernelArg(blend, 0, sizeof(cl_mem), &s->greyImage0.mem);
     clSetKernelArg(blend, 1, sizeof(cl_uint), &width);
-    clSetKernelArg(blend, 2, sizeof(cl_mem), halfImage1);
-    err2 = clEnqueueNDRangeKernel(queue, blend, 2, NULL, global, NULL,
-                                 0, NULL, &event[1]);
+    clSetKernelArg(blend, 2, sizeof(cl_mem), &s->halfImage0.mem);
+    err = eventLogKernel(&s->log, line, s->queue,
+                         blend, 2, NULL, global, NULL,
+                         5*imgSize);
+
+    clSetKernelArg(blend, 0, sizeof(cl_mem), &s->greyImage1.mem);
+    clSetKernelArg(blend, 2, sizeof(cl_mem), &s->halfImage1.mem);
+    err2 = eventLogKernel(&s->log, line, s->queue,
+                          blend, 2, NULL, global, NULL,
+                          5*imgSize);
     if (err != CL_SUCCESS || err2 != CL_SUCCESS) {
-        fprintf(stderr, "Couldn't enqueue the kernel. Code %d\n", err);
+        fprintf(stderr, "Couldn't enqueue the kernel. Code %d\n",
+                (err != CL_SUCCESS) ? err : err2);
         return EXIT_FAILURE;
     }
-    clWaitForEvents(2, event);
-
-    float time;
-    time = eventRuntime(event[0]);
-    time += eventRuntime(event[1]);
-    printf("Blend2x2:                       %6.1f ms.\n", time);
-
-    clReleaseKernel(blend);
 
     return EXIT_SUCCESS;
 }
 
-/* Input is required to be fullsize width and height, halfsize dmaps,
- * function allocates newDisparitys */
-int estimateDisparitys_2x2(cl_context context, cl_program program, cl_command_queue queue,
-                           cl_mem dmap1, cl_mem dmap2, cl_mem *newDisparitys,
+/* Input is required to be fullsize width and height, halfsize dmaps.
+ * Result is written to s->disparitys. */
+int estimateDisparitys_2x2(struct session_opencl_basic *s,
+                           cl_mem dmap1, cl_mem dmap2,
                            cl_uint width, cl_uint height, cl_uint disp_limit,
                            cl_uint bx, cl_uint by) {
-    cl_kernel limits;
+    cl_kernel limits = s->disparityLimits;
     size_t global[2], size;
-    cl_event event;
     cl_int err;
+    int line;
 
-    limits = clCreateKernel(program, "disparityLimits_2x2", &err);
-    if (err != CL_SUCCESS) {
-        fprintf(stderr, "Couldn't create a kernel! Code: %d"
-                        "(file %s line %d)\n", err, __FILE__, __LINE__);
-        return EXIT_FAILURE;
-    }
-
-    /* Allocate space for disparitys */
     size = width*height*2*sizeof(cl_ushort);
-    (*newDisparitys) = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, &err);
-    if (err != CL_SUCCESS) {
-        fprintf(stderr, "Couldn't create a buffer. %s line %d\n", __FILE__, __LINE__);
+    if (ensureBuffer(s->context, &s->disparitys, size) == EXIT_FAILURE)
         return EXIT_FAILURE;
-    }
+
+    line = eventLogLine(&s->log, -1, "Disparity limits:");
 
     /* Abuse kernel to clear whole ushort area with uchar kernel */
-    zeroMem_kernel(program, queue, (*newDisparitys), width*2*sizeof(ushort), height);
+    eventLogStage(&s->log);
+    if (zeroMem_kernel(s, s->disparitys.mem, width*2*sizeof(ushort), height)
+            == EXIT_FAILURE)
+        return EXIT_FAILURE;
 
+    eventLogStage(&s->log);
     global[0] = width-bx+1;
     global[1] = height-by+1;
     clSetKernelArg(limits, 0, sizeof(cl_mem), &dmap1);
     clSetKernelArg(limits, 1, sizeof(cl_mem), &dmap2);
-    clSetKernelArg(limits, 2, sizeof(cl_mem), newDisparitys);
+    clSetKernelArg(limits, 2, sizeof(cl_mem), &s->disparitys.mem);
     clSetKernelArg(limits, 3, sizeof(cl_uint), &width);
     clSetKernelArg(limits, 4, sizeof(cl_uint), &height);
     clSetKernelArg(limits, 5, sizeof(cl_uint), &disp_limit);
     clSetKernelArg(limits, 6, sizeof(cl_uint), &bx);
     clSetKernelArg(limits, 7, sizeof(cl_uint), &by);
-    err = clEnqueueNDRangeKernel(queue, limits, 2, NULL, global, NULL,
-                                 0, NULL, &event);
+    err = eventLogKernel(&s->log, line, s->queue,
+                         limits, 2, NULL, global, NULL,
+                         width*height/2 + size);
     if (err != CL_SUCCESS) {
         fprintf(stderr, "Couldn't enqueue the kernel. Code %d\n", err);
         return EXIT_FAILURE;
     }
-    clWaitForEvents(1, &event);
-
-    float time;
-    time = eventRuntime(event);
-    printf("Disparity limits:               %6.1f ms.\n", time);
-
-    clReleaseKernel(limits);
 
     return EXIT_SUCCESS;
 }
 
 /* Fill disparitys with range 0-disp_limit, except for left edge,
  * in where disp_limit is scaled in order to avoid overread. */
-int initDisparitys(cl_context context, cl_program program, cl_command_queue queue,
+int initDisparitys(struct session_opencl_basic *s,
                    cl_uint width, cl_uint height, cl_uint bx, cl_uint disp_limit,
-                   cl_mem *disparitys) {
-    cl_kernel initDisparitys;
+                   struct oclBuffer *disparitys) {
+    cl_kernel initDisparitys = s->initDisparitys;
     cl_int err;
     size_t global[2], bufSize;
-    cl_event event;
-
-    initDisparitys = clCreateKernel(program, "initDisparitys", &err);
-    if (err != CL_SUCCESS) {
-        fprintf(stderr, "Couldn't create a kernel! Code: %d"
-                        " %s line %d\n", err, __FILE__, __LINE__);
-        return EXIT_FAILURE;
-    }
+    int line;
 
     bufSize = width*height*2*sizeof(cl_ushort);
-    (*disparitys) = clCreateBuffer(context, CL_MEM_READ_WRITE, bufSize, NULL, &err);
-    if (err != CL_SUCCESS) {
-        fprintf(stderr, "Couldn't create a buffer %s line %d\n", __FILE__, __LINE__);
+    if (ensureBuffer(s->context, disparitys, bufSize) == EXIT_FAILURE)
         return EXIT_FAILURE;
-    }
+
+    line = eventLogLine(&s->log, -1, "Init disparitys");
 
     /* Kernel clears uchar elements, so abuse it a bit */
-    zeroMem_kernel(program, queue, (*disparitys), width*2*sizeof(cl_ushort), height);
+    eventLogStage(&s->log);
+    if (zeroMem_kernel(s, disparitys->mem, width*2*sizeof(cl_ushort), height)
+            == EXIT_FAILURE)
+        return EXIT_FAILURE;
 
+    eventLogStage(&s->log);
     global[0] = width;
     global[1] = height;
-    clSetKernelArg(initDisparitys, 0, sizeof(cl_mem), disparitys);
+    clSetKernelArg(initDisparitys, 0, sizeof(cl_mem), &disparitys->mem);
     clSetKernelArg(initDisparitys, 1, sizeof(cl_uint), &width);
     clSetKernelArg(initDisparitys, 2, sizeof(cl_uint), &bx);
     clSetKernelArg(initDisparitys, 3, sizeof(cl_uint), &disp_limit);
-    err = clEnqueueNDRangeKernel(queue, initDisparitys, 2, NULL, global, NULL,
-                                 0, NULL, &event);
+    err = eventLogKernel(&s->log, line, s->queue,
+                         initDisparitys, 2, NULL, global, NULL,
+                         bufSize);
     if (err < 0) {
         fprintf(stderr, "Couldn't enqueue initDisparitys. Code %d\n", err);
         return EXIT_FAILURE;
     }
-    clWaitForEvents(1, &event);
-    float time = eventRuntime(event);
-
-    printf("Init disparitys                 %6.1f ms.\n", time);
-
-    clReleaseKernel(initDisparitys);
 
     return EXIT_SUCCESS;
 }
 
 /* Calculate zero-mean cross-correlations and constructs 2 depthmaps.
- * Allocates buffers for dmaps. */
-int znccFunc(cl_context context, cl_program program, cl_command_queue queue,
+ * Sub-pixel offsets of dmap1 are only calculated when subpixel is not
+ * SUBPIXEL_NONE. If the device has atomic max, zncc keeps only the best
+ * correlation of each right image pixel instead of the whole cost volume.
+ * When tiles fit in local memory, znccTiled reads images directly and
+ * mean-subtracted blocks aren't cached. */
+int znccFunc(struct session_opencl_basic *s,
              cl_mem img0, cl_mem img1, cl_mem disparitys, cl_uint disp_limit,
              cl_uint width, cl_uint height,
-             cl_uint bx, cl_uint by,
-             cl_mem *dmap1, cl_mem *dmap2) {
-
-    cl_event event[2];
-    cl_mem cacheBlks_l, cacheBlks_r, ccor;
-    size_t cacheSize, size, ccSize, global[2], local[2];
-    cl_int err, errs[5], i;
-    cl_kernel cacheBlkData, initCcors, zncc, constructDmap2;
-    float time1, time2, time3, time4;
-
-    cacheBlkData =   clCreateKernel(program, "cacheBlkData", &errs[0]);
-    initCcors =	     clCreateKernel(program, "initccor", &errs[1]);
-    zncc =	         clCreateKernel(program, "zncc", &errs[2]);
-    constructDmap2 = clCreateKernel(program, "constructDmap2", &errs[3]);
-
-    for(i=0; i < 4; i++) {
-        if (errs[i] != CL_SUCCESS) {
-            fprintf(stderr, "Couldn't create a kernel number %d! Code: %d"
-                            " %s line %d\n", i, errs[0], __FILE__, __LINE__);
-            return EXIT_FAILURE;
-        }
+             cl_uint bx, cl_uint by, cl_uint subpixel,
+             struct oclBuffer *dmap1, struct oclBuffer *dmap2,
+             struct oclBuffer *dmap1Offset) {
+
+    size_t cacheSize, size, ccSize, bestSize, global[2], local[2];
+    size_t tileL, tileR, blocksR, znccBytes;
+    cl_int err, errs[3];
+    cl_kernel cacheBlkData = s->cacheBlkData, initCcors = s->initCcors;
+    cl_kernel zncc = s->zncc, znccTiled = s->znccTiled;
+    cl_kernel constructDmap2 = s->constructDmap2;
+    cl_command_queue queue = s->queue;
+    cl_mem noBuffer = NULL, znccIn0, znccIn1;
+    int total, lineCache = -1, lineInit, lineZncc, lineDmap2, lineDmap2Old = -1;
+    int packed, tiled;
+
+    if (s->specProgram != NULL) {
+        cacheBlkData = s->specCacheBlkData;
+        zncc = s->specZncc;
+        znccTiled = s->specZnccTiled;
     }
 
+    /* Local memory of one znccTiled work-group, in floats */
+    tileL = (s->tune.tileX+bx-1)*(s->tune.tileY+by-1);
+    tileR = (s->tune.tileX+disp_limit+bx-1)*(s->tune.tileY+by-1);
+    blocksR = (s->tune.tileX+disp_limit)*s->tune.tileY;
+    tiled = (s->tune.tileX > 0 && s->tune.tileY > 0 &&
+             s->tune.tileX*s->tune.tileY <= s->tiledGroupMax &&
+             (tileL+tileR+2*blocksR)*sizeof(cl_float) <= s->localMemSize);
+
     cacheSize = (bx*by*(width-bx+1)*(height-by+1)
                  +(width-bx+1)*(height-by+1))*sizeof(float);
     size = width*height*sizeof(cl_uchar);
     ccSize = (width)*(height)*(disp_limit+1)*sizeof(cl_float);
-    /* Allocate block caches */
-    cacheBlks_l = clCreateBuffer(context, CL_MEM_READ_WRITE, cacheSize, NULL, &errs[0]);
-    cacheBlks_r = clCreateBuffer(context, CL_MEM_READ_WRITE, cacheSize, NULL, &errs[1]);
-    (*dmap1) = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, &errs[2]);
-    (*dmap2) = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, &errs[3]);
-    ccor = clCreateBuffer(context, CL_MEM_READ_WRITE, ccSize, NULL, &errs[4]);
-
-    /* Check success of creating buffers */
-    for (i=0; i < 5; i++) {
-        if (errs[i] != CL_SUCCESS) {
-            fprintf(stderr, "Couldn't create a buffer %d %s line %d\n"
-                    , i, __FILE__, __LINE__);
+    bestSize = (width-bx+1)*(height-by+1)*s->packedSize;
+    packed = (s->constructDmap2Packed != NULL);
+    if (ensureBuffer(s->context, dmap1, size) == EXIT_FAILURE ||
+        ensureBuffer(s->context, dmap2, size) == EXIT_FAILURE ||
+        ensureBuffer(s->context, dmap1Offset,
+                     width*height*sizeof(cl_float)) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    if (!tiled &&
+        (ensureBuffer(s->context, &s->cacheBlks_l, cacheSize) == EXIT_FAILURE ||
+         ensureBuffer(s->context, &s->cacheBlks_r, cacheSize) == EXIT_FAILURE))
+        return EXIT_FAILURE;
+    if (packed) {
+        if (ensureBuffer(s->context, &s->best2, bestSize) == EXIT_FAILURE)
             return EXIT_FAILURE;
-        }
+        if (ccSize - bestSize > s->ccorSaved)
+            s->ccorSaved = ccSize - bestSize;
     }
-    zeroMem_kernel(program, queue, (*dmap1), width, height);
-    zeroMem_kernel(program, queue, (*dmap2), width, height);
-    clFinish(queue);
-
-    global[0] = width-bx+1;
-    global[1] = height-by+1;
-    clSetKernelArg(cacheBlkData, 0, sizeof(cl_mem), &img0);
-    clSetKernelArg(cacheBlkData, 1, sizeof(cl_mem), &cacheBlks_l);
-    clSetKernelArg(cacheBlkData, 2, sizeof(cl_uint), &width);
-    clSetKernelArg(cacheBlkData, 3, sizeof(cl_uint), &height);
-    clSetKernelArg(cacheBlkData, 4, sizeof(cl_uint), &bx);
-    clSetKernelArg(cacheBlkData, 5, sizeof(cl_uint), &by);
-    errs[0] = clEnqueueNDRangeKernel(queue, cacheBlkData, 2, NULL, global, NULL,
-                                     0, NULL, &event[0]);
-
-    clSetKernelArg(cacheBlkData, 0, sizeof(cl_mem), &img1);
-    clSetKernelArg(cacheBlkData, 1, sizeof(cl_mem), &cacheBlks_r);
-    clSetKernelArg(cacheBlkData, 2, sizeof(cl_uint), &width);
-    clSetKernelArg(cacheBlkData, 3, sizeof(cl_uint), &height);
-    clSetKernelArg(cacheBlkData, 4, sizeof(cl_uint), &bx);
-    clSetKernelArg(cacheBlkData, 5, sizeof(cl_uint), &by);
-    errs[1] = clEnqueueNDRangeKernel(queue, cacheBlkData, 2, NULL, global, NULL,
-                                     0, NULL, &event[1]);
-    if (errs[0] < 0 || errs[1] < 0) {
-        fprintf(stderr, "Couldn't enqueue cacheBlkData! Codes %d %d",
-                errs[0], errs[1]);
+    else if (ensureBuffer(s->context, &s->ccor, ccSize) == EXIT_FAILURE)
         return EXIT_FAILURE;
+
+    total = eventLogLine(&s->log, -1, (s->specProgram != NULL) ? "zncc (specialised):" :
+                                                                 "zncc:");
+    if (!tiled)
+        lineCache = eventLogLine(&s->log, total, " cacheData:");
+    lineInit = eventLogLine(&s->log, total, packed ? " init best correlations:" :
+                                                     " init cross-correlation buffer:");
+    lineZncc = eventLogLine(&s->log, total, tiled ? " zncc (tiled):" : " zncc:");
+    if (!packed && s->compareDmap2) {
+        lineDmap2 = eventLogLine(&s->log, total, " construct dmap2 (per pixel):");
+        lineDmap2Old = eventLogLine(&s->log, total, " construct dmap2 (per scanline):");
     }
-    clWaitForEvents(2, event);
-    time1 = eventRuntime(event[0]);
-    time1 += eventRuntime(event[1]);
+    else
+        lineDmap2 = eventLogLine(&s->log, total, " construct dmap2:");
+
+    /* Clearing dmaps, caching blocks and initializing cross-correlations
+     * touch different buffers, so they form one stage. */
+    eventLogStage(&s->log);
+    if (zeroMem_kernel(s, dmap1->mem, width, height) == EXIT_FAILURE ||
+        zeroMem_kernel(s, dmap2->mem, width, height) == EXIT_FAILURE)
+        return EXIT_FAILURE;
 
+    errs[0] = CL_SUCCESS;
+    errs[1] = CL_SUCCESS;
+    if (!tiled) {
+        global[0] = width-bx+1;
+        global[1] = height-by+1;
+        clSetKernelArg(cacheBlkData, 0, sizeof(cl_mem), &img0);
+        clSetKernelArg(cacheBlkData, 1, sizeof(cl_mem), &s->cacheBlks_l.mem);
+        clSetKernelArg(cacheBlkData, 2, sizeof(cl_uint), &width);
+        clSetKernelArg(cacheBlkData, 3, sizeof(cl_uint), &height);
+        clSetKernelArg(cacheBlkData, 4, sizeof(cl_uint), &bx);
+        clSetKernelArg(cacheBlkData, 5, sizeof(cl_uint), &by);
+        errs[0] = eventLogKernel(&s->log, lineCache, queue,
+                                 cacheBlkData, 2, NULL, global, NULL,
+                                 width*height*sizeof(cl_float) + cacheSize);
+
+        clSetKernelArg(cacheBlkData, 0, sizeof(cl_mem), &img1);
+        clSetKernelArg(cacheBlkData, 1, sizeof(cl_mem), &s->cacheBlks_r.mem);
+        errs[1] = eventLogKernel(&s->log, lineCache, queue,
+                                 cacheBlkData, 2, NULL, global, NULL,
+                                 width*height*sizeof(cl_float) + cacheSize);
+    }
 
-    /* Fill buffer with -FLT_MAX */
-    global[0] = (width)*(height)*(disp_limit+1);
-    clSetKernelArg(initCcors, 0, sizeof(cl_mem), &ccor);
-    err = clEnqueueNDRangeKernel(queue, initCcors, 1, NULL, global, NULL,
-                                 0, NULL, &event[0]);
-    if (err < 0) {
-        fprintf(stderr, "Couldn't enqueue initCcors: code: %d\n", err);
+    if (packed) {
+        /* Zero is less than any packed correlation */
+        global[0] = (width-bx+1)*s->packedSize;
+        global[1] = height-by+1;
+        clSetKernelArg(s->zero, 0, sizeof(cl_mem), &s->best2.mem);
+        errs[2] = eventLogKernel(&s->log, lineInit, queue,
+                                 s->zero, 2, NULL, global, NULL,
+                                 bestSize);
+    }
+    else {
+        /* Fill buffer with -FLT_MAX */
+        global[0] = (width)*(height)*(disp_limit+1);
+        clSetKernelArg(initCcors, 0, sizeof(cl_mem), &s->ccor.mem);
+        errs[2] = eventLogKernel(&s->log, lineInit, queue,
+                                 initCcors, 1, NULL, global, NULL,
+                                 ccSize);
+    }
+    if (errs[0] < 0 || errs[1] < 0 || errs[2] < 0) {
+        fprintf(stderr, "Couldn't enqueue cacheBlkData or initCcors! Codes %d %d %d\n",
+                errs[0], errs[1], errs[2]);
         return EXIT_FAILURE;
     }
-    clWaitForEvents(1, &event[0]);
-    time2 = eventRuntime(event[0]);
 
     /* clEnqueueFillBuffer requires OpenCL 1.2 */
 //	float pattern = -FLT_MAX;
@@ -353,179 +440,219 @@ int znccFunc(cl_context context, cl_program program, cl_command_queue queue,
 //						NULL, NULL);
 
 
+    eventLogStage(&s->log);
     global[0] = width-bx+1;
     global[1] = height-by+1;
-    local[0] = 1;
+    local[0] = s->tune.znccLocal;
     local[1] = 1;
+    if (local[0] > 0)
+        global[0] = (global[0]+local[0]-1)/local[0]*local[0];
+    znccIn0 = s->cacheBlks_l.mem;
+    znccIn1 = s->cacheBlks_r.mem;
+    if (tiled) {
+        zncc = znccTiled;
+        local[0] = s->tune.tileX;
+        local[1] = s->tune.tileY;
+        /* Work-groups have to divide global size */
+        global[0] = (width-bx+1+local[0]-1)/local[0]*local[0];
+        global[1] = (height-by+1+local[1]-1)/local[1]*local[1];
+        znccIn0 = img0;
+        znccIn1 = img1;
+        clSetKernelArg(zncc, 13, tileL*sizeof(cl_float), NULL);
+        clSetKernelArg(zncc, 14, tileR*sizeof(cl_float), NULL);
+        clSetKernelArg(zncc, 15, blocksR*sizeof(cl_float), NULL);
+        clSetKernelArg(zncc, 16, blocksR*sizeof(cl_float), NULL);
+    }
 
-    clSetKernelArg(zncc, 0, sizeof(cl_mem), &cacheBlks_l);
-    clSetKernelArg(zncc, 1, sizeof(cl_mem), &cacheBlks_r);
+    clSetKernelArg(zncc, 0, sizeof(cl_mem), &znccIn0);
+    clSetKernelArg(zncc, 1, sizeof(cl_mem), &znccIn1);
     clSetKernelArg(zncc, 2, sizeof(cl_mem), &disparitys);
-    clSetKernelArg(zncc, 3, sizeof(cl_mem), dmap1);
-    clSetKernelArg(zncc, 4, sizeof(cl_mem), &ccor);
+    clSetKernelArg(zncc, 3, sizeof(cl_mem), &dmap1->mem);
+    clSetKernelArg(zncc, 4, sizeof(cl_mem), packed ? &noBuffer : &s->ccor.mem);
     clSetKernelArg(zncc, 5, sizeof(cl_uint), &width);
     clSetKernelArg(zncc, 6, sizeof(cl_uint), &height);
     clSetKernelArg(zncc, 7, sizeof(cl_uint), &bx);
     clSetKernelArg(zncc, 8, sizeof(cl_uint), &by);
     clSetKernelArg(zncc, 9, sizeof(cl_uint), &disp_limit);
-    err = clEnqueueNDRangeKernel(queue, zncc, 2, NULL, global, local,
-                                 0, NULL, &event[0]);
+    clSetKernelArg(zncc, 10, sizeof(cl_mem), &dmap1Offset->mem);
+    clSetKernelArg(zncc, 11, sizeof(cl_uint), &subpixel);
+    clSetKernelArg(zncc, 12, sizeof(cl_mem), packed ? &s->best2.mem : &noBuffer);
+    /* Inputs, disparity ranges, dmap1 with offsets and correlations */
+    znccBytes = (tiled ? 2*width*height*sizeof(cl_float) : 2*cacheSize)
+                + width*height*(2*sizeof(cl_ushort) + sizeof(cl_uchar) + sizeof(cl_float))
+                + (packed ? bestSize : ccSize);
+    err = eventLogKernel(&s->log, lineZncc, queue,
+                         zncc, 2, NULL, global, (local[0] > 0) ? local : NULL,
+                         znccBytes);
     if (err < 0) {
         fprintf(stderr, "Couldn't enqueue zncc: code: %d\n", err);
         return EXIT_FAILURE;
     }
-    clWaitForEvents(1, event);
-    time3 = eventRuntime(event[0]);
 
-    /* Caches not needed anymore */
-    clReleaseMemObject(cacheBlks_l);
-    clReleaseMemObject(cacheBlks_r);
 
+    eventLogStage(&s->log);
+    if (packed) {
+        constructDmap2 = s->constructDmap2Packed;
+        global[0] = width-bx+1;
+        global[1] = height-by+1;
+        clSetKernelArg(constructDmap2, 0, sizeof(cl_mem), &dmap2->mem);
+        clSetKernelArg(constructDmap2, 1, sizeof(cl_mem), &s->best2.mem);
+        clSetKernelArg(constructDmap2, 2, sizeof(cl_uint), &width);
+        clSetKernelArg(constructDmap2, 3, sizeof(cl_uint), &bx);
+        clSetKernelArg(constructDmap2, 4, sizeof(cl_uint), &by);
+        err = eventLogKernel(&s->log, lineDmap2, queue,
+                             constructDmap2, 2, NULL, global, NULL,
+                             bestSize + size);
+    }
+    else {
+        if (s->compareDmap2) {
+            /* Timing reference only, result is overwritten with the same one */
+            global[0] = height-by+1;
+            clSetKernelArg(constructDmap2, 0, sizeof(cl_mem), &dmap2->mem);
+            clSetKernelArg(constructDmap2, 1, sizeof(cl_mem), &s->ccor.mem);
+            clSetKernelArg(constructDmap2, 2, sizeof(cl_uint), &disp_limit);
+            clSetKernelArg(constructDmap2, 3, sizeof(cl_uint), &width);
+            clSetKernelArg(constructDmap2, 4, sizeof(cl_uint), &bx);
+            clSetKernelArg(constructDmap2, 5, sizeof(cl_uint), &by);
+            err = eventLogKernel(&s->log, lineDmap2Old, queue,
+                                 constructDmap2, 1, NULL, global, NULL,
+                                 ccSize + size);
+            if (err < 0) {
+                fprintf(stderr, "Couldn't enqueue constructDmap2: code: %d\n", err);
+                return EXIT_FAILURE;
+            }
+            eventLogStage(&s->log);
+        }
 
-    global[0] = height-by+1;
-    clSetKernelArg(constructDmap2, 0, sizeof(cl_mem), dmap2);
-    clSetKernelArg(constructDmap2, 1, sizeof(cl_mem), &ccor);
-    clSetKernelArg(constructDmap2, 2, sizeof(cl_uint), &disp_limit);
-    clSetKernelArg(constructDmap2, 3, sizeof(cl_uint), &width);
-    clSetKernelArg(constructDmap2, 4, sizeof(cl_uint), &bx);
-    clSetKernelArg(constructDmap2, 5, sizeof(cl_uint), &by);
-    err = clEnqueueNDRangeKernel(queue, constructDmap2, 1, NULL, global, NULL,
-                                 0, NULL, &event[0]);
+        /* One work-item per pixel, per scanline is too few for most devices */
+        constructDmap2 = s->constructDmap2Pixel;
+        global[0] = width-bx+1;
+        global[1] = height-by+1;
+        clSetKernelArg(constructDmap2, 0, sizeof(cl_mem), &dmap2->mem);
+        clSetKernelArg(constructDmap2, 1, sizeof(cl_mem), &s->ccor.mem);
+        clSetKernelArg(constructDmap2, 2, sizeof(cl_uint), &disp_limit);
+        clSetKernelArg(constructDmap2, 3, sizeof(cl_uint), &width);
+        clSetKernelArg(constructDmap2, 4, sizeof(cl_uint), &bx);
+        clSetKernelArg(constructDmap2, 5, sizeof(cl_uint), &by);
+        err = eventLogKernel(&s->log, lineDmap2, queue,
+                             constructDmap2, 2, NULL, global, NULL,
+                             ccSize + size);
+    }
     if (err < 0) {
         fprintf(stderr, "Couldn't enqueue constructDmap2: code: %d\n", err);
         return EXIT_FAILURE;
     }
-    clWaitForEvents(1, event);
-    time4 = eventRuntime(event[0]);
-
-    clReleaseMemObject(ccor);
-
-    printf("zncc:                           %6.1f ms.\n", time1+time2+time3+time4);
-    printf(" cacheData:                     %6.1f ms.\n", time1);
-    printf(" init cross-correlation buffer: %6.1f ms.\n", time2);
-    printf(" zncc:                          %6.1f ms.\n", time3);
-    printf(" construct dmap2:               %6.1f ms.\n", time4);
-
-    clReleaseKernel(cacheBlkData);
-    clReleaseKernel(initCcors);
-    clReleaseKernel(zncc);
-    clReleaseKernel(constructDmap2);
 
     return EXIT_SUCCESS;
 }
 
-/* Calls kernels to postprocess depthmaps */
-int postProcessDmaps(cl_context context, cl_command_queue queue, cl_program program,
-                     cl_mem dmap1, cl_mem dmap2,
+/* Calls kernels to postprocess depthmaps. Sub-pixel offsets are used only
+ * with 16-bit results. Result is left in s->postpMem1. */
+int postProcessDmaps(struct session_opencl_basic *s,
+                     cl_mem dmap1, cl_mem dmap2, cl_mem dmap1Offset,
                      cl_uint width, cl_uint height, cl_uint disp_limit,
-                     cl_mem *processed) {
+                     dispFormat format, cl_uint subpixel) {
 
     cl_kernel postCross, postFill;
     cl_mem postpMem1, postpMem2;
-    size_t global[2], size;
-    cl_int errs[2], err, i;
-    cl_event event;
-    float time;
+    cl_command_queue queue = s->queue;
+    size_t global[2], size, crossBytes;
+    cl_int err;
+    cl_uint elemSize, scale;
+    int line;
 
-    size = width*height*sizeof(cl_uchar);
-    postpMem1 = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, &errs[0]);
-    postpMem2 = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, &errs[1]);
-    for (i=0; i < 2; i++) {
-        if (errs[i] != CL_SUCCESS) {
-            fprintf(stderr, "Couldn't create a buffer %d in file %s line %d\n"
-                    , i, __FILE__, __LINE__);
-            return EXIT_FAILURE;
-        }
-    }
-    zeroMem_kernel(program, queue, postpMem1, width, height);
-    zeroMem_kernel(program, queue, postpMem2, width, height);
-    clFinish(queue);
+    /* 16-bit results skip rescaling, disparitys are saved in fixed-point */
+    elemSize = (format == DISP_FIXED16) ? sizeof(cl_ushort) : sizeof(cl_uchar);
+    scale = DISP_SUBPIXEL_SCALE;
 
-    postCross = clCreateKernel(program, "postCrossCorrelation", &errs[0]);
-    postFill = clCreateKernel(program, "postFill", &errs[1]);
-    for (i=0; i < 2; i++) {
-        if (errs[i] != CL_SUCCESS) {
-            fprintf(stderr, "Couldn't create a kernel %d: %s line %d\n"
-                    , i, __FILE__, __LINE__);
-            return EXIT_FAILURE;
-        }
+    size = width*height*elemSize;
+    if (ensureBuffer(s->context, &s->postpMem1, size) == EXIT_FAILURE ||
+        ensureBuffer(s->context, &s->postpMem2, size) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    postpMem1 = s->postpMem1.mem;
+    postpMem2 = s->postpMem2.mem;
+
+    line = eventLogLine(&s->log, -1, "Post processing:");
+
+    eventLogStage(&s->log);
+    if (zeroMem_kernel(s, postpMem1, width*elemSize, height) == EXIT_FAILURE ||
+        zeroMem_kernel(s, postpMem2, width*elemSize, height) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+
+    if (format == DISP_FIXED16) {
+        postCross = s->postCross16;
+        postFill = s->postFill16;
+    }
+    else {
+        postCross = s->postCross;
+        postFill = s->postFill;
     }
 
+    eventLogStage(&s->log);
     global[0] = width;
     global[1] = height;
     clSetKernelArg(postCross, 0, sizeof(cl_mem), &dmap1);
     clSetKernelArg(postCross, 1, sizeof(cl_mem), &dmap2);
-    clSetKernelArg(postCross, 2, sizeof(cl_mem), &postpMem1);
-    clSetKernelArg(postCross, 3, sizeof(cl_uint), &disp_limit);
-    err = clEnqueueNDRangeKernel(queue, postCross, 2, NULL, global, NULL,
-                                 0, NULL, &event);
+    if (format == DISP_FIXED16) {
+        clSetKernelArg(postCross, 2, sizeof(cl_mem), &dmap1Offset);
+        clSetKernelArg(postCross, 3, sizeof(cl_mem), &postpMem1);
+        clSetKernelArg(postCross, 4, sizeof(cl_uint), &scale);
+        clSetKernelArg(postCross, 5, sizeof(cl_uint), &subpixel);
+    }
+    else {
+        clSetKernelArg(postCross, 2, sizeof(cl_mem), &postpMem1);
+        clSetKernelArg(postCross, 3, sizeof(cl_uint), &disp_limit);
+    }
+    /* Both dmaps, offsets with 16-bit results, and the result */
+    crossBytes = 2*width*height + size;
+    if (format == DISP_FIXED16)
+        crossBytes += width*height*sizeof(cl_float);
+    err = eventLogKernel(&s->log, line, queue,
+                         postCross, 2, NULL, global, NULL,
+                         crossBytes);
     if (err < 0) {
         fprintf(stderr, "Couldn't enqueue postCrossCorr: code: %d\n", err);
         return EXIT_FAILURE;
     }
-    clWaitForEvents(1, &event);
-    time = eventRuntime(event);
 
     /* Left 1-pixel on all sides to avoid overread.
      * NOTE: Atleast with opensource Clover OpenCL 1.1-driver
      * global offsets seems not to work. */
+    eventLogStage(&s->log);
     global[0] = width-2;
     global[1] = height-2;
     clSetKernelArg(postFill, 0, sizeof(cl_mem), &postpMem1);
     clSetKernelArg(postFill, 1, sizeof(cl_mem), &postpMem2);
     clSetKernelArg(postFill, 2, sizeof(cl_uint), &width);
-    err = clEnqueueNDRangeKernel(queue, postFill, 2, NULL, global, NULL,
-                                 0, NULL, &event);
+    err = eventLogKernel(&s->log, line, queue,
+                         postFill, 2, NULL, global, NULL,
+                         2*size);
     if (err < 0) {
         fprintf(stderr, "Couldn't enqueue postFill: code: %d\n", err);
         return EXIT_FAILURE;
     }
-    clWaitForEvents(1, &event);
-    time += eventRuntime(event);
 
+    eventLogStage(&s->log);
     clSetKernelArg(postFill, 0, sizeof(cl_mem), &postpMem2);
     clSetKernelArg(postFill, 1, sizeof(cl_mem), &postpMem1);
-    err = clEnqueueNDRangeKernel(queue, postFill, 2, NULL, global, NULL,
-                                 0, NULL, &event);
+    err = eventLogKernel(&s->log, line, queue,
+                         postFill, 2, NULL, global, NULL,
+                         2*size);
     if (err < 0) {
         fprintf(stderr, "Couldn't enqueue postFill: code: %d\n", err);
         return EXIT_FAILURE;
     }
-    clWaitForEvents(1, &event);
-    time += eventRuntime(event);
-
-    clReleaseMemObject(postpMem2);
-
-    (*processed) = postpMem1;
-
-    printf("Post processing:                %6.1f ms.\n", time);
-
-    clReleaseKernel(postCross);
-    clReleaseKernel(postFill);
 
     return EXIT_SUCCESS;
 }
 
-unsigned char *generateDepthmap_opencl_basic(unsigned char *img0, unsigned char *img1,
-                                             unsigned int width, unsigned height,
-                                             unsigned int blockx, unsigned int blocky,
-                                             unsigned int disp_limit, searchMethod_ocl select,
-                                             device_ocl dev) {
+struct session_opencl_basic *createSession_opencl_basic(device_ocl dev) {
 
-    cl_platform_id platform;
+    struct session_opencl_basic *s;
     cl_device_type device_type;
-    cl_device_id device;
-    cl_context context;
-    cl_program program;
-    cl_command_queue queue;
-    cl_int err, errs[16], i;
+    cl_int err;
     double hostTime1, hostTime2;
 
-    if ( (blockx % 2 != 1) || (blocky % 2 != 1) || blockx == 1 || blocky == 1 ) {
-        fprintf(stderr, "Blocksize must be odd in both dimensions and more than 1!\n");
-        return NULL;
-    }
-
     if (dev == CPU) device_type = CL_DEVICE_TYPE_CPU;
     else if (dev == GPU) device_type = CL_DEVICE_TYPE_GPU;
     else {
@@ -533,129 +660,378 @@ unsigned char *generateDepthmap_opencl_basic(unsigned char *img0, unsigned char
         return NULL;
     }
 
-    if (initOpenCL(&platform, &device, &context, &program, device_type, "depthmap_basic.cl")
-            == EXIT_FAILURE) {
+    s = calloc(1, sizeof(struct session_opencl_basic));
+    if (s == NULL)
         return NULL;
-    }
 
     hostTime1 = doubleTime();
 
-    cl_mem input_img0, input_img1, greyImage0, greyImage1, disparitys;
-
-    input_img0 = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                width*height*4*sizeof(unsigned char), img0, &errs[0]);
-    greyImage0 = clCreateBuffer(context, CL_MEM_READ_WRITE,
-                                (width/4)*(height/4)*sizeof(float), NULL, &errs[1]);
-    input_img1 = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                width*height*4*sizeof(unsigned char), img1, &errs[2]);
-    greyImage1 = clCreateBuffer(context, CL_MEM_READ_WRITE,
-                                (width/4)*(height/4)*sizeof(float), NULL, &errs[3]);
-
-    /* Check success of creating buffers */
-    for (i=0; i < 4; i++) {
-        if (errs[i] != CL_SUCCESS) {
-            fprintf(stderr, "Couldn't create a buffer %d in file %s line %d\n"
-                    , i, __FILE__, __LINE__);
-            return NULL;
-        }
+    if (initOpenCL(&s->platform, &s->device, &s->context, &s->program,
+                   device_type, "depthmap_basic.cl") == EXIT_FAILURE) {
+        free(s);
+        return NULL;
     }
 
-    queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err);
+    /* Commands are ordered by events, so runtime may overlap independent ones */
+    s->queue = clCreateCommandQueue(s->context, s->device,
+                                    CL_QUEUE_PROFILING_ENABLE |
+                                    CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, &err);
+    if (err != CL_SUCCESS)
+        s->queue = clCreateCommandQueue(s->context, s->device,
+                                        CL_QUEUE_PROFILING_ENABLE, &err);
     if (err != CL_SUCCESS) {
         fprintf(stderr, "Couldn't create a command queue\n");
+        clReleaseProgram(s->program);
+        clReleaseContext(s->context);
+        free(s);
         return NULL;
     }
 
-    if (blend4x4CnvrtToGrey(program, queue, &input_img0, &input_img1,
-                            &greyImage0, &greyImage1, width, height) == EXIT_FAILURE) {
-        fprintf(stderr, "Image converting kernel failed!\n");
+    const char *names[] = {"blend_cnvrtToGreyscale", "blend2x2", "initDisparitys",
+                           "disparityLimits_2x2", "zero_clMem", "cacheBlkData",
+                           "initccor", "zncc", "znccTiled", "constructDmap2",
+                           "constructDmap2Pixel",
+                           "postCrossCorrelation", "postFill",
+                           "postCrossCorrelation16", "postFill16"};
+    cl_kernel *kernels[] = {&s->blendAndGreyscale, &s->blend2x2, &s->initDisparitys,
+                            &s->disparityLimits, &s->zero, &s->cacheBlkData,
+                            &s->initCcors, &s->zncc, &s->znccTiled, &s->constructDmap2,
+                            &s->constructDmap2Pixel,
+                            &s->postCross, &s->postFill,
+                            &s->postCross16, &s->postFill16};
+
+    if (createKernels(s->program, sizeof(names)/sizeof(names[0]),
+                      names, kernels) == EXIT_FAILURE) {
+        clReleaseCommandQueue(s->queue);
+        clReleaseProgram(s->program);
+        clReleaseContext(s->context);
+        free(s);
         return NULL;
     }
 
-    cl_uint greyImgWidth = width/4;
-    cl_uint greyImgHeight = height/4;
-    cl_mem dmap1, dmap2;
+    /* Only in programs built for OpenCL 1.1 or newer, or with 64-bit atomics,
+     * which keep whole correlations */
+    s->packedSize = sizeof(cl_ulong);
+    s->constructDmap2Packed = clCreateKernel(s->program, "constructDmap2Packed64", &err);
+    if (err != CL_SUCCESS) {
+        s->packedSize = sizeof(cl_uint);
+        s->constructDmap2Packed = clCreateKernel(s->program, "constructDmap2Packed", &err);
+        if (err == CL_SUCCESS)
+            printf("No 64-bit atomics, dmap2 keeps 24 bits of correlations.\n");
+    }
+    if (err != CL_SUCCESS) {
+        s->constructDmap2Packed = NULL;
+        printf("No atomic max, dmap2 is constructed from the whole cost volume.\n");
+    }
+
+    s->compareDmap2 = (getenv("DEPTHMAP_CL_COMPARE") != NULL);
+    s->hostUnified = hostUnifiedMemory(s->device);
+    if (s->hostUnified)
+        printf("Device shares host memory, images are not copied.\n");
+    s->generic = (getenv("DEPTHMAP_CL_GENERIC") != NULL);
+
+    /* znccTiled is used when its tiles fit in local memory */
+    struct tuneConfig defaults = TUNE_DEFAULTS;
+    s->tune = defaults;
+    if (loadTuneConfig(s->device, "depthmap_basic.cl", &s->tune) == EXIT_SUCCESS)
+        printf("Launch parameters tuned for the device loaded.\n");
+    if (clGetDeviceInfo(s->device, CL_DEVICE_LOCAL_MEM_SIZE, sizeof(cl_ulong),
+                        &s->localMemSize, NULL) != CL_SUCCESS)
+        s->localMemSize = 0;
+    if (clGetKernelWorkGroupInfo(s->znccTiled, s->device, CL_KERNEL_WORK_GROUP_SIZE,
+                                 sizeof(size_t), &s->tiledGroupMax, NULL) != CL_SUCCESS)
+        s->tiledGroupMax = 0;
+
+    hostTime2 = doubleTime();
+    printf("OpenCL setup (host):            %6.1lf ms.\n\n",
+           (hostTime2-hostTime1)*1e3);
+
+    return s;
+}
+
+/* Buffers wrapping memory of the caller must not outlive one depthmap */
+void releaseHostWrappers(struct session_opencl_basic *s) {
+    if (s->hostUnified) {
+        releaseBuffer(&s->input_img0);
+        releaseBuffer(&s->input_img1);
+        releaseBuffer(&s->postpMem1);
+    }
+}
+
+void *sessionDepthmap_opencl_basic(struct session_opencl_basic *s,
+                                   unsigned char *img0, unsigned char *img1,
+                                   unsigned int width, unsigned height,
+                                   unsigned int blockx, unsigned int blocky,
+                                   unsigned int disp_limit, searchMethod_ocl select,
+                                   dispFormat format, subpixelMethod subpixel,
+                                   unsigned int factor) {
+
+    cl_int err, err2;
+    size_t inputSize, resSize;
+    double hostTime1, hostTime2;
+    void *res = NULL, *mapped;
+
+    if ( (blockx % 2 != 1) || (blocky % 2 != 1) || blockx == 1 || blocky == 1 ) {
+        fprintf(stderr, "Blocksize must be odd in both dimensions and more than 1!\n");
+        return NULL;
+    }
+    if (disp_limit < 1 || disp_limit > DISP_LIMIT_MAX) {
+        fprintf(stderr, "Disparity-limit must be 1-%d!\n", DISP_LIMIT_MAX);
+        return NULL;
+    }
+    if (factor != 1 && factor != 2 && factor != 4 && factor != 8) {
+        fprintf(stderr, "Downscale factor must be 1, 2, 4 or 8!\n");
+        return NULL;
+    }
+
+    hostTime1 = doubleTime();
+    eventLogReset(&s->log);
+    specialiseKernels(s, blockx, blocky, disp_limit);
+
+    inputSize = width*height*4*sizeof(unsigned char);
+    if (s->hostUnified) {
+        /* Kernels read the images where they are */
+        if (wrapHostMemory(s->context, &s->input_img0, img0, inputSize,
+                           CL_MEM_READ_ONLY) == EXIT_FAILURE ||
+            wrapHostMemory(s->context, &s->input_img1, img1, inputSize,
+                           CL_MEM_READ_ONLY) == EXIT_FAILURE)
+            goto failed;
+    }
+    else {
+        if (ensureBuffer(s->context, &s->input_img0, inputSize) == EXIT_FAILURE ||
+            ensureBuffer(s->context, &s->input_img1, inputSize) == EXIT_FAILURE)
+            goto failed;
+
+        /* Images are not touched by host before the final read has completed */
+        err = clEnqueueWriteBuffer(s->queue, s->input_img0.mem, CL_FALSE, 0, inputSize,
+                                   img0, EVENTLOG_DEPS(&s->log, -1));
+        err = eventLogCommit(&s->log, err, "write img0", inputSize);
+        err2 = clEnqueueWriteBuffer(s->queue, s->input_img1.mem, CL_FALSE, 0, inputSize,
+                                    img1, EVENTLOG_DEPS(&s->log, -1));
+        err2 = eventLogCommit(&s->log, err2, "write img1", inputSize);
+        if (err != CL_SUCCESS || err2 != CL_SUCCESS) {
+            fprintf(stderr, "Couldn't write images to device. Code %d\n",
+                    (err != CL_SUCCESS) ? err : err2);
+            goto failed;
+        }
+    }
+
+    if (blendCnvrtToGrey(s, width, height, factor) == EXIT_FAILURE) {
+        fprintf(stderr, "Image converting kernel failed!\n");
+        goto failed;
+    }
+
+    cl_uint greyImgWidth = width/factor;
+    cl_uint greyImgHeight = height/factor;
+
+    /* Sub-pixel disparitys can only be stored in fixed-point format. */
+    if (format != DISP_FIXED16)
+        subpixel = SUBPIXEL_NONE;
 
     if (select == HIERARCHIC_CL) {
         /* Estimate search ranges from half-resolution depthmaps */
         cl_uint widthH, heightH;
-        cl_mem hImg0, hImg1;
 
         widthH = greyImgWidth/2;
         heightH = greyImgHeight/2;
-        if (initDisparitys(context, program, queue,
-                           widthH, heightH, blockx, disp_limit/2,
-                           &disparitys) == EXIT_FAILURE) {
-            return NULL;
+        if (initDisparitys(s, widthH, heightH, blockx, disp_limit/2,
+                           &s->disparitysHalf) == EXIT_FAILURE) {
+            goto failed;
         }
-        if (blend2x2(context, program, queue, &greyImage0, &greyImage1,
-                     &hImg0, &hImg1, greyImgWidth, greyImgHeight) == EXIT_FAILURE) {
-            return NULL;
+        if (blend2x2(s, greyImgWidth, greyImgHeight) == EXIT_FAILURE) {
+            goto failed;
         }
-        if (znccFunc(context, program, queue,
-                     hImg0, hImg1, disparitys, disp_limit,
-                     widthH, heightH, blockx, blocky,
-                     &dmap1, &dmap2) == EXIT_FAILURE) {
-            return NULL;
+        if (znccFunc(s, s->halfImage0.mem, s->halfImage1.mem,
+                     s->disparitysHalf.mem, disp_limit,
+                     widthH, heightH, blockx, blocky, SUBPIXEL_NONE,
+                     &s->dmap1Half, &s->dmap2Half, &s->offsetHalf) == EXIT_FAILURE) {
+            goto failed;
         }
-        /* Release memory because next function allocates new memory for the variable */
-        clReleaseMemObject(disparitys);
-        if (estimateDisparitys_2x2(context, program, queue, dmap1, dmap2,
-                                   &disparitys, greyImgWidth, greyImgHeight,
+        if (estimateDisparitys_2x2(s, s->dmap1Half.mem, s->dmap2Half.mem,
+                                   greyImgWidth, greyImgHeight,
                                    disp_limit, blockx, blocky) == EXIT_FAILURE) {
-            return NULL;
+            goto failed;
         }
-        /* Not needed anymore */
-        clReleaseMemObject(dmap1);
-        clReleaseMemObject(dmap2);
     }
     else {
         /* If brute is selected, don't do fancy things to limit search ranges. */
-        if (initDisparitys(context, program, queue,
-                           greyImgWidth, greyImgHeight, blockx, disp_limit,
-                           &disparitys) == EXIT_FAILURE) {
-            return NULL;
+        if (initDisparitys(s, greyImgWidth, greyImgHeight, blockx, disp_limit,
+                           &s->disparitys) == EXIT_FAILURE) {
+            goto failed;
         }
     }
-    cl_mem postResult;
 
-    if (znccFunc(context, program, queue,
-                 greyImage0, greyImage1, disparitys, disp_limit,
-                 greyImgWidth, greyImgHeight, blockx, blocky,
-                 &dmap1, &dmap2) == EXIT_FAILURE) {
-        return NULL;
-    }
-    if (postProcessDmaps(context, queue, program, dmap1, dmap2, greyImgWidth,
-                         greyImgHeight, disp_limit, &postResult) == EXIT_FAILURE) {
-        return NULL;
+    if (znccFunc(s, s->greyImage0.mem, s->greyImage1.mem, s->disparitys.mem,
+                 disp_limit, greyImgWidth, greyImgHeight, blockx, blocky, subpixel,
+                 &s->dmap1, &s->dmap2, &s->dmap1Offset) == EXIT_FAILURE) {
+        goto failed;
     }
 
-    /* Allocate host memory and read the resulting image from OpenCL device */
-    unsigned char *res;
-    res = malloc(sizeof(unsigned char)*(width/4)*(height/4));
+    /* Allocate host memory for the resulting image. Device with host memory
+     * post-processes directly into it. */
+    resSize = greyImgWidth*greyImgHeight;
+    if (format == DISP_FIXED16)
+        resSize *= sizeof(cl_ushort);
+    res = s->hostUnified ? allocHostPages(resSize) : malloc(resSize);
+    if (res == NULL)
+        goto failed;
+    if (s->hostUnified &&
+        wrapHostMemory(s->context, &s->postpMem1, res, resSize,
+                       CL_MEM_READ_WRITE) == EXIT_FAILURE)
+        goto failed;
+
+    if (postProcessDmaps(s, s->dmap1.mem, s->dmap2.mem, s->dmap1Offset.mem,
+                         greyImgWidth, greyImgHeight, disp_limit, format,
+                         subpixel) == EXIT_FAILURE) {
+        goto failed;
+    }
 
-    err = clEnqueueReadBuffer(queue, postResult, CL_TRUE, 0,
-                              sizeof(cl_uchar)*(width/4)*(height/4),
-                              res, 0, NULL, NULL);
+    /* Only blocking call, waits for the whole chain */
+    eventLogStage(&s->log);
+    if (s->hostUnified) {
+        mapped = clEnqueueMapBuffer(s->queue, s->postpMem1.mem, CL_TRUE, CL_MAP_READ,
+                                    0, resSize, EVENTLOG_DEPS(&s->log, -1), &err);
+        err = eventLogCommit(&s->log, err, "map result", resSize);
+        if (err == CL_SUCCESS) {
+            /* Runtime may still have used a copy of its own */
+            if (mapped != res)
+                memcpy(res, mapped, resSize);
+            clEnqueueUnmapMemObject(s->queue, s->postpMem1.mem, mapped, 0, NULL, NULL);
+            clFinish(s->queue);
+            releaseHostWrappers(s);
+        }
+        else if (mapped != NULL) {
+            clEnqueueUnmapMemObject(s->queue, s->postpMem1.mem, mapped, 0, NULL, NULL);
+        }
+    }
+    else {
+        err = clEnqueueReadBuffer(s->queue, s->postpMem1.mem, CL_TRUE, 0, resSize,
+                                  res, EVENTLOG_DEPS(&s->log, -1));
+        err = eventLogCommit(&s->log, err, "read result", resSize);
+    }
     if (err != CL_SUCCESS) {
         fprintf(stderr, "Couldn't read postprocessed image from buffer.\n");
-        return NULL;
+        goto failed;
     }
 
-    clReleaseMemObject(greyImage0);
-    clReleaseMemObject(greyImage1);
-    clReleaseMemObject(dmap1);
-    clReleaseMemObject(dmap2);
-    clReleaseMemObject(postResult);
+    /* Profiling info of retained events */
+    if (!s->quiet)
+        eventLogPrint(&s->log);
+    if (s->trace != NULL)
+        eventLogTrace(&s->log, s->trace);
+    eventLogReset(&s->log);
+    if (s->ccorSaved > 0 && !s->quiet)
+        printf("Cost volume not allocated:      %6.1f MiB.\n",
+               s->ccorSaved/1048576.0);
+
+    hostTime2 = doubleTime();
+    if (!s->quiet)
+        printf("Total time (host):              %6.1lf ms.\n\n",
+               (hostTime2-hostTime1)*1e3);
+
+    return res;
+
+failed:
+    /* Enqueued commands may still use host images */
+    clFinish(s->queue);
+    eventLogReset(&s->log);
+    releaseHostWrappers(s);
+    free(res);
+    return NULL;
+}
 
-    clReleaseCommandQueue(queue);
-    clReleaseProgram(program);
-    clReleaseContext(context);
+void setTuning_opencl_basic(struct session_opencl_basic *s,
+                            const struct tuneConfig *conf, int quiet) {
+    s->tune = (*conf);
+    s->quiet = quiet;
+}
+
+int readIntermediates_opencl_basic(struct session_opencl_basic *s,
+                                   unsigned int width, unsigned int height,
+                                   float *grey0, float *grey1,
+                                   unsigned char *dmap1, unsigned char *dmap2) {
+    size_t pixels = (size_t)width*height;
+
+    if (readBuffer(s->queue, &s->greyImage0, grey0, pixels*sizeof(cl_float)) == EXIT_FAILURE ||
+        readBuffer(s->queue, &s->greyImage1, grey1, pixels*sizeof(cl_float)) == EXIT_FAILURE ||
+        readBuffer(s->queue, &s->dmap1, dmap1, pixels*sizeof(cl_uchar)) == EXIT_FAILURE ||
+        readBuffer(s->queue, &s->dmap2, dmap2, pixels*sizeof(cl_uchar)) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+void setTrace_opencl_basic(struct session_opencl_basic *s,
+                           struct oclTrace *trace) {
+    s->trace = trace;
+}
+
+int saveTuning_opencl_basic(struct session_opencl_basic *s) {
+    return saveTuneConfig(s->device, "depthmap_basic.cl", &s->tune);
+}
+
+void releaseSession_opencl_basic(struct session_opencl_basic *s) {
+
+    if (s == NULL)
+        return;
+
+    /* Make sure queue is empty before attempting to release resources. */
+    clFinish(s->queue);
+    eventLogReset(&s->log);
+
+    struct oclBuffer *buffers[] = {&s->input_img0, &s->input_img1,
+                                   &s->greyImage0, &s->greyImage1,
+                                   &s->halfImage0, &s->halfImage1,
+                                   &s->disparitys, &s->disparitysHalf,
+                                   &s->cacheBlks_l, &s->cacheBlks_r, &s->ccor, &s->best2,
+                                   &s->dmap1, &s->dmap2, &s->dmap1Offset,
+                                   &s->dmap1Half, &s->dmap2Half, &s->offsetHalf,
+                                   &s->postpMem1, &s->postpMem2};
+    cl_kernel kernels[] = {s->blendAndGreyscale, s->blend2x2, s->initDisparitys,
+                           s->disparityLimits, s->zero, s->cacheBlkData,
+                           s->initCcors, s->zncc, s->znccTiled, s->constructDmap2,
+                           s->constructDmap2Pixel,
+                           s->postCross, s->postFill, s->postCross16, s->postFill16};
+    unsigned int i;
+
+    for (i=0; i < sizeof(buffers)/sizeof(buffers[0]); i++)
+        releaseBuffer(buffers[i]);
+    for (i=0; i < sizeof(kernels)/sizeof(kernels[0]); i++)
+        clReleaseKernel(kernels[i]);
+    if (s->constructDmap2Packed != NULL)
+        clReleaseKernel(s->constructDmap2Packed);
+    if (s->specProgram != NULL) {
+        clReleaseKernel(s->specCacheBlkData);
+        clReleaseKernel(s->specZncc);
+        clReleaseKernel(s->specZnccTiled);
+        clReleaseProgram(s->specProgram);
+    }
+
+    clReleaseCommandQueue(s->queue);
+    clReleaseProgram(s->program);
+    clReleaseContext(s->context);
     //clReleaseDevice(device); // OpenCl 1.2
 
-    hostTime2 = doubleTime();
-    printf("Total time (host):              %6.1lf ms.\n\n",
-           (hostTime2-hostTime1)*1e3);
+    free(s);
+}
+
+void *generateDepthmap_opencl_basic(unsigned char *img0, unsigned char *img1,
+                                    unsigned int width, unsigned height,
+                                    unsigned int blockx, unsigned int blocky,
+                                    unsigned int disp_limit, searchMethod_ocl select,
+                                    device_ocl dev, dispFormat format,
+                                    subpixelMethod subpixel, unsigned int factor) {
+    struct session_opencl_basic *s;
+    void *res;
+
+    s = createSession_opencl_basic(dev);
+    if (s == NULL)
+        return NULL;
+
+    res = sessionDepthmap_opencl_basic(s, img0, img1, width, height, blockx, blocky,
+                                       disp_limit, select, format, subpixel, factor);
+
+    releaseSession_opencl_basic(s);
 
     return res;
 }
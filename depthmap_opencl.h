@@ -4,15 +4,60 @@
 #include "common_opencl.h"
 
 /* Generates post-processed depthmap. Takes: 2 32-bit stereo-images, their width
- * and height (mod 4). Wanted blocksize for a search, disparity-limit and search method.
- * Also selects either cpu or gpu depending on value in variable dev.
+ * and height (mod factor). Wanted blocksize for a search, disparity-limit and search
+ * method. Also selects either cpu or gpu depending on value in variable dev, format
+ * of the result (unsigned char or unsigned short elements), sub-pixel refinement,
+ * which is used only with DISP_FIXED16, and downscale factor of the images
+ * (1, 2, 4 or 8).
  * On success:
- *  Returns 1/4 by 1/4 image.
+ *  Returns 1/factor by 1/factor image.
  * On failure:
  *  Returns NULL. */
-unsigned char *generateDepthmap_opencl_basic(unsigned char *img0, unsigned char *img1,
-                                             unsigned int width, unsigned height,
-                                             unsigned int blockx, unsigned int blocky,
-                                             unsigned int disp_limit, searchMethod_ocl select,
-                                             device_ocl dev);
+void *generateDepthmap_opencl_basic(unsigned char *img0, unsigned char *img1,
+                                    unsigned int width, unsigned height,
+                                    unsigned int blockx, unsigned int blocky,
+                                    unsigned int disp_limit, searchMethod_ocl select,
+                                    device_ocl dev, dispFormat format,
+                                    subpixelMethod subpixel, unsigned int factor);
+
+/* Platform, context, queue, program, kernels and device buffers that are
+ * reused for any number of stereo-pairs. */
+struct session_opencl_basic;
+
+/* Builds the program and kernels once. Returns NULL on failure. */
+struct session_opencl_basic *createSession_opencl_basic(device_ocl dev);
+
+/* Same as generateDepthmap_opencl_basic, but on an existing session. Buffers
+ * are allocated on first use and kept while following pairs fit in them. */
+void *sessionDepthmap_opencl_basic(struct session_opencl_basic *s,
+                                   unsigned char *img0, unsigned char *img1,
+                                   unsigned int width, unsigned height,
+                                   unsigned int blockx, unsigned int blocky,
+                                   unsigned int disp_limit, searchMethod_ocl select,
+                                   dispFormat format, subpixelMethod subpixel,
+                                   unsigned int factor);
+
+/* Replaces launch parameters of the session. quiet leaves out timing prints
+ * of following depthmaps. */
+void setTuning_opencl_basic(struct session_opencl_basic *s,
+                            const struct tuneConfig *conf, int quiet);
+
+/* Saves launch parameters of the session for its device, later sessions
+ * load them. Returns EXIT_SUCCESS or EXIT_FAILURE. */
+int saveTuning_opencl_basic(struct session_opencl_basic *s);
+
+/* Greyscale images and dmaps of the left (dmap1) and right (dmap2) image
+ * before post-processing, of the session's last depthmap of width x height,
+ * read from the device for comparing versions.
+ * Returns EXIT_SUCCESS or EXIT_FAILURE. */
+int readIntermediates_opencl_basic(struct session_opencl_basic *s,
+                                   unsigned int width, unsigned int height,
+                                   float *grey0, float *grey1,
+                                   unsigned char *dmap1, unsigned char *dmap2);
+
+/* Commands of following depthmaps are appended to trace, NULL stops. */
+void setTrace_opencl_basic(struct session_opencl_basic *s,
+                           struct oclTrace *trace);
+
+void releaseSession_opencl_basic(struct session_opencl_basic *s);
 #endif
@@ -1,182 +1,233 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <float.h>
+#include <string.h>
 //#include <CL/cl.h>
 
 #include "depthmap_opencl_amd.h"
 #include "common_opencl.h"
+#include "clcache.h"
 #include "doubleTime.h"
 
+/* Everything that stays the same between stereo-pairs. Buffers grow on
+ * demand, so pairs of different size work too, but are slower. */
+struct session_opencl_amd {
+    cl_platform_id platform;
+    cl_device_id device;
+    cl_context context;
+    cl_program program;
+    cl_command_queue queue;
+
+    cl_kernel blendAndGreyscale, initDisparitys, zero;
+    cl_kernel cacheBlkData, zncc, constructDmaps;
+    cl_kernel postCross, postFill, postCross16, postFill16;
+
+    struct oclBuffer input_img0, input_img1, greyImage0, greyImage1, disparitys;
+    struct oclBuffer cacheBlks_l, cacheBlks_r, ccor;
+    struct oclBuffer dmap1, dmap2, dmap1Offset;
+    struct oclBuffer postpMem1, postpMem2;
+
+    /* Commands of the depthmap being generated */
+    struct eventLog log;
+
+    /* Launch parameters */
+    struct tuneConfig tune;
+    /* Set by autotuning, no timing prints */
+    int quiet;
+    /* Commands of every depthmap are appended here, if not NULL */
+    struct oclTrace *trace;
+    /* Device uses host memory directly, images are wrapped instead of copied
+     * and the result is mapped instead of read */
+    int hostUnified;
+
+    /* Block caching and zncc kernels built for the current block size and
+     * disparity limit. NULL before first depthmap, or with generic kernels
+     * (DEPTHMAP_CL_GENERIC set or specialised build failed). */
+    cl_program specProgram;
+    cl_kernel specCacheBlkData, specZncc;
+    cl_uint specBx, specBy, specDlimit;
+    int generic;
+};
+
+/* Builds specialised kernels when block size or disparity limit changes.
+ * On failure generic kernels are used for the rest of the session. */
+void specialiseKernels_amd(struct session_opencl_amd *s,
+                           cl_uint bx, cl_uint by, cl_uint disp_limit) {
+    char options[64];
+
+    if (s->generic || (s->specProgram != NULL && s->specBx == bx &&
+                       s->specBy == by && s->specDlimit == disp_limit))
+        return;
+
+    if (s->specProgram != NULL) {
+        clReleaseKernel(s->specCacheBlkData);
+        clReleaseKernel(s->specZncc);
+        clReleaseProgram(s->specProgram);
+        s->specProgram = NULL;
+    }
+
+    snprintf(options, sizeof(options), "-DBX=%u -DBY=%u -DDLIMIT=%u",
+             bx, by, disp_limit);
+    if (buildOCLProgram(s->device, s->context, "depthmap_amd.cl", options,
+                        &s->specProgram) == EXIT_FAILURE) {
+        fprintf(stderr, "Specialised build failed, using generic kernels.\n");
+        s->specProgram = NULL;
+        s->generic = 1;
+        return;
+    }
+
+    const char *names[] = {"cacheBlkData", "zncc_vector"};
+    cl_kernel *kernels[] = {&s->specCacheBlkData, &s->specZncc};
+    if (createKernels(s->specProgram, 2, names, kernels) == EXIT_FAILURE) {
+        clReleaseProgram(s->specProgram);
+        s->specProgram = NULL;
+        s->generic = 1;
+        return;
+    }
+
+    s->specBx = bx;
+    s->specBy = by;
+    s->specDlimit = disp_limit;
+    printf("Kernels specialised for %ux%u blocks, disparity limit %u.\n",
+           bx, by, disp_limit);
+}
+
 /* OpenCL 1.1 doesn't have clEnqueueFillBuffer */
-/* Fills buffer with width*height zero bytes */
-int zeroMem_kernel_amd(cl_program program, cl_command_queue queue,
-                   cl_mem data, cl_uint width, cl_uint height) {
-    cl_kernel kernZero;
+/* Enqueues filling of width*height zero bytes to current stage */
+int zeroMem_kernel_amd(struct session_opencl_amd *s,
+                       cl_mem data, cl_uint width, cl_uint height, int line) {
     size_t global[2];
     cl_int err;
 
-    kernZero = clCreateKernel(program, "zero_clMem", &err);
-    if (err != CL_SUCCESS) {
-        fprintf(stderr, "Couldn't create a kernel! Code: %d"
-                        "(file %s line %d)\n", err, __FILE__, __LINE__);
-        return EXIT_FAILURE;
-    }
-
     global[0] = width;
     global[1] = height;
-    clSetKernelArg(kernZero, 0, sizeof(cl_mem), &data);
-    err = clEnqueueNDRangeKernel(queue, kernZero, 2, NULL, global, NULL,
-                                 0, NULL, NULL);
+    clSetKernelArg(s->zero, 0, sizeof(cl_mem), &data);
+    err = eventLogKernel(&s->log, line, s->queue,
+                         s->zero, 2, NULL, global, NULL,
+                         (size_t)width*height);
     if (err != CL_SUCCESS) {
         fprintf(stderr, "Couldn't enqueue the kernel. Code %d. %s line %d\n",
                 err, __FILE__, __LINE__);
         return EXIT_FAILURE;
     }
 
-    clReleaseKernel(kernZero);
-
     return EXIT_SUCCESS;
 }
 
-/* Converts rgba-image to greyscale float-image  with 1/4 resolution on both axis.
- * Releases input_img0 and input_img1. */
-int blend4x4CnvrtToGrey_amd(cl_program program, cl_command_queue queue,
-                        cl_mem *input_img0, cl_mem *input_img1,
-                        cl_mem *greyImage0, cl_mem *greyImage1,
-                        cl_uint width, cl_uint height) {
-    cl_event event[2];
+/* Converts rgba-images in input_img0/1 to greyscale float-images with
+ * 1/factor resolution on both axis. */
+int blendCnvrtToGrey_amd(struct session_opencl_amd *s,
+                         cl_uint width, cl_uint height, cl_uint factor) {
     cl_int err, err2;
-    size_t global[2], local[2];
-    cl_kernel blendAndGreyscale;
-
-    if ((width % 4 != 0) || (height % 4 != 0)) {
-        fprintf(stderr, "blend4x4 does not currently handle resolutions not "
-                        "divisible by 4!\n");
+    cl_uint shift;
+    size_t global[2], local[2], greySize;
+    cl_kernel blendAndGreyscale = s->blendAndGreyscale;
+    char label[40];
+    int line;
+
+    if ((width % factor != 0) || (height % factor != 0)) {
+        fprintf(stderr, "blend does not currently handle resolutions not "
+                        "divisible by %u!\n", factor);
         return EXIT_FAILURE;
     }
+    /* Sums of factor*factor values are divided by shifting */
+    for (shift = 0; (1u << shift) < factor*factor; shift++);
 
-    blendAndGreyscale = clCreateKernel(program, "blend4x4_cnvrtToGreyscale", &err);
-    if (err != CL_SUCCESS) {
-        fprintf(stderr, "Couldn't create a kernel! Code: %d"
-                        "(file %s line %d)\n", err, __FILE__, __LINE__);
+    greySize = (width/factor)*(height/factor)*sizeof(cl_float);
+    if (ensureBuffer(s->context, &s->greyImage0, greySize) == EXIT_FAILURE ||
+        ensureBuffer(s->context, &s->greyImage1, greySize) == EXIT_FAILURE)
         return EXIT_FAILURE;
-    }
 
-    global[0] = ((width/4+31)/32)*32;
-    global[1] = height/4;
+    snprintf(label, sizeof(label), "Blend %ux%u and greyscaling:", factor, factor);
+    line = eventLogLine(&s->log, -1, label);
+    eventLogStage(&s->log);
+
+    /* Rounded up to whole work-groups, kernel skips the extra columns */
+    global[0] = ((width/factor+31)/32)*32;
+    global[1] = height/factor;
     local[0] = 32;
     local[1] = 1;
-    clSetKernelArg(blendAndGreyscale, 0, sizeof(cl_mem), input_img0);
-    clSetKernelArg(blendAndGreyscale, 1, sizeof(cl_uint), &width);
-    clSetKernelArg(blendAndGreyscale, 2, sizeof(cl_mem), greyImage0);
-    err = clEnqueueNDRangeKernel(queue, blendAndGreyscale, 2, NULL, global, local,
-                                 0, NULL, &event[0]);
-
-    clSetKernelArg(blendAndGreyscale, 0, sizeof(cl_mem), input_img1);
+    clSetKernelArg(blendAndGreyscale, 0, sizeof(cl_mem), &s->input_img0.mem);
     clSetKernelArg(blendAndGreyscale, 1, sizeof(cl_uint), &width);
-    clSetKernelArg(blendAndGreyscale, 2, sizeof(cl_mem), greyImage1);
-    err2 = clEnqueueNDRangeKernel(queue, blendAndGreyscale, 2, NULL, global, NULL,
-                                 0, NULL, &event[1]);
+    clSetKernelArg(blendAndGreyscale, 2, sizeof(cl_uint), &factor);
+    clSetKernelArg(blendAndGreyscale, 3, sizeof(cl_uint), &shift);
+    clSetKernelArg(blendAndGreyscale, 4, sizeof(cl_mem), &s->greyImage0.mem);
+    err = eventLogKernel(&s->log, line, s->queue,
+                         blendAndGreyscale, 2, NULL, global, local,
+                         width*height*4 + greySize);
+
+    clSetKernelArg(blendAndGreyscale, 0, sizeof(cl_mem), &s->input_img1.mem);
+    clSetKernelArg(blendAndGreyscale, 4, sizeof(cl_mem), &s->greyImage1.mem);
+    err2 = eventLogKernel(&s->log, line, s->queue,
+                          blendAndGreyscale, 2, NULL, global, NULL,
+                          width*height*4 + greySize);
     if (err != CL_SUCCESS || err2 != CL_SUCCESS) {
-        fprintf(stderr, "Couldn't enqueue the kernel. Code %d\n", err);
+        fprintf(stderr, "Couldn't enqueue the kernel. Code %d\n",
+                (err != CL_SUCCESS) ? err : err2);
         return EXIT_FAILURE;
     }
-    clWaitForEvents(2, event);
-
-    float time;
-    time = eventRuntime(event[0]);
-    time += eventRuntime(event[1]);
-    printf("Blend4x4 and greyscaling:       %6.1f ms.\n", time);
-
-    /* Make sure queue is empty before attempting to release resources. */
-    clFinish(queue); // clWaitForEvents makes this redundant
-
-    clReleaseMemObject((*input_img0));
-    clReleaseMemObject((*input_img1));
-    clReleaseKernel(blendAndGreyscale);
 
     return EXIT_SUCCESS;
 }
 
 /* Fill disparitys with range 0-disp_limit, except for left edge,
  * in where disp_limit is scaled in order to avoid overread. */
-int initDisparitys_amd(cl_context context, cl_program program, cl_command_queue queue,
-                       cl_uint width, cl_uint height, cl_uint bx, cl_uint disp_limit,
-                       cl_mem *disparitys) {
-    cl_kernel initDisparitys;
+int initDisparitys_amd(struct session_opencl_amd *s,
+                       cl_uint width, cl_uint height, cl_uint bx, cl_uint disp_limit) {
+    cl_kernel initDisparitys = s->initDisparitys;
     cl_int err;
     size_t global[2], bufSize;
-    cl_event event;
-
-    initDisparitys = clCreateKernel(program, "initDisparitys", &err);
-    if (err != CL_SUCCESS) {
-        fprintf(stderr, "Couldn't create a kernel! Code: %d"
-                        " %s line %d\n", err, __FILE__, __LINE__);
-        return EXIT_FAILURE;
-    }
+    int line;
 
     bufSize = width*height*2*sizeof(cl_ushort);
-    (*disparitys) = clCreateBuffer(context, CL_MEM_READ_WRITE, bufSize, NULL, &err);
-    if (err != CL_SUCCESS) {
-        fprintf(stderr, "Couldn't create a buffer %s line %d\n", __FILE__, __LINE__);
+    if (ensureBuffer(s->context, &s->disparitys, bufSize) == EXIT_FAILURE)
         return EXIT_FAILURE;
-    }
+
+    line = eventLogLine(&s->log, -1, "Init disparitys");
 
     /* Kernel clears uchar elements, so abuse it a bit */
-    zeroMem_kernel_amd(program, queue, (*disparitys), width*2*sizeof(cl_ushort), height);
+    eventLogStage(&s->log);
+    if (zeroMem_kernel_amd(s, s->disparitys.mem, width*2*sizeof(cl_ushort), height,
+                           -1) == EXIT_FAILURE)
+        return EXIT_FAILURE;
 
+    eventLogStage(&s->log);
     global[0] = width;
     global[1] = height;
-    clSetKernelArg(initDisparitys, 0, sizeof(cl_mem), disparitys);
+    clSetKernelArg(initDisparitys, 0, sizeof(cl_mem), &s->disparitys.mem);
     clSetKernelArg(initDisparitys, 1, sizeof(cl_uint), &width);
     clSetKernelArg(initDisparitys, 2, sizeof(cl_uint), &bx);
     clSetKernelArg(initDisparitys, 3, sizeof(cl_uint), &disp_limit);
-    err = clEnqueueNDRangeKernel(queue, initDisparitys, 2, NULL, global, NULL,
-                                 0, NULL, &event);
+    err = eventLogKernel(&s->log, line, s->queue,
+                         initDisparitys, 2, NULL, global, NULL,
+                         bufSize);
     if (err < 0) {
         fprintf(stderr, "Couldn't enqueue initDisparitys. Code %d\n", err);
         return EXIT_FAILURE;
     }
-    clWaitForEvents(1, &event);
-    float time = eventRuntime(event);
-
-    printf("Init disparitys                 %6.1f ms.\n", time);
-
-    clReleaseKernel(initDisparitys);
 
     return EXIT_SUCCESS;
 }
 
 /* Calculate zero-mean cross-correlations and constructs 2 depthmaps.
- * Allocates buffers for dmaps. */
-int znccFunc_amd(cl_context context, cl_program program, cl_command_queue queue,
+ * Sub-pixel offsets of dmap1 are only calculated when subpixel is not
+ * SUBPIXEL_NONE. */
+int znccFunc_amd(struct session_opencl_amd *s,
                  cl_mem img0, cl_mem img1, cl_mem disparitys, cl_uint disp_limit,
                  cl_uint width, cl_uint height,
-                 cl_uint bx, cl_uint by,
-                 cl_mem *dmap1, cl_mem *dmap2) {
+                 cl_uint bx, cl_uint by, cl_uint subpixel) {
 
-    cl_event event[2];
-    cl_mem cacheBlks_l, cacheBlks_r, ccor;
     size_t cacheSize, size, ccSize, global[2], local[2], globalOffset[2];
-    cl_int err, errs[5], i;
-    cl_kernel cacheBlkData, zncc, constructDmaps;
+    cl_int err, errs[2];
+    cl_kernel cacheBlkData = s->cacheBlkData, zncc = s->zncc;
+    cl_kernel constructDmaps = s->constructDmaps;
+    cl_command_queue queue = s->queue;
     cl_uint blkStride, lineStride;
-    float time1=0.0f, time2=0.0f, time3=0.0f;
+    int lineZero, total, lineCache, lineZncc, lineDmaps;
 
-    cacheBlkData =   clCreateKernel(program, "cacheBlkData", &errs[0]);
-    zncc =	         clCreateKernel(program, "zncc_vector", &errs[1]);
-    constructDmaps = clCreateKernel(program, "constructDmaps", &errs[2]);
-
-    for(i=0; i < 3; i++) {
-        if (errs[i] != CL_SUCCESS) {
-            fprintf(stderr, "Couldn't create a kernel number %d! Code: %d"
-                            " %s line %d\n", i, errs[i], __FILE__, __LINE__);
-            return EXIT_FAILURE;
-        }
-    }
-
-    /* Divide window to 4 parts. add 1 to make sure all scanlines are processed
-     * even in a case of height not been divisible by 4. */
-    cl_uint heightDiv4 = (height-by+1)/4 + 1;
+    /* Divide window to bands (4 by default). add 1 to make sure all scanlines
+     * are processed even in a case of height not been divisible by bands. */
+    cl_uint bandHeight = (height-by+1)/s->tune.bands + 1;
 
     /* Number of elements in a group of 64 blocks */
     blkStride = (64*bx*by+63)/64 * 64;
@@ -184,257 +235,242 @@ int znccFunc_amd(cl_context context, cl_program program, cl_command_queue queue,
     lineStride = (width-bx+1+63)/64 * blkStride + blkStride;
     /* Pad deviations also somewhat (64). Zncc_vector-kernel is not too exact
      * with limits. */
-    cacheSize = (lineStride*heightDiv4
-                 +(width-bx+1)*heightDiv4+64)*sizeof(float);
+    cacheSize = (lineStride*bandHeight
+                 +(width-bx+1)*bandHeight+64)*sizeof(float);
     size = width*height*sizeof(cl_uchar);
     // Buffers disp_limit+1 blocks are extended to be divisible by 8
-    ccSize = (width)*(heightDiv4)*(((disp_limit+1)+7)/8) * 8 *sizeof(cl_float);
-    /* Allocate block caches */
-    cacheBlks_l = clCreateBuffer(context, CL_MEM_READ_WRITE, cacheSize, NULL, &errs[0]);
-    cacheBlks_r = clCreateBuffer(context, CL_MEM_READ_WRITE, cacheSize, NULL, &errs[1]);
-    (*dmap1) = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, &errs[2]);
-    (*dmap2) = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, &errs[3]);
-    ccor = clCreateBuffer(context, CL_MEM_READ_WRITE, ccSize, NULL, &errs[4]);
-
-    /* Check success of creating buffers */
-    for (i=0; i < 5; i++) {
-        if (errs[i] != CL_SUCCESS) {
-            fprintf(stderr, "Couldn't create a buffer %d %s line %d\n"
-                    , i, __FILE__, __LINE__);
-            return EXIT_FAILURE;
-        }
+    ccSize = (width)*(bandHeight)*(((disp_limit+1)+7)/8) * 8 *sizeof(cl_float);
+    if (ensureBuffer(s->context, &s->cacheBlks_l, cacheSize) == EXIT_FAILURE ||
+        ensureBuffer(s->context, &s->cacheBlks_r, cacheSize) == EXIT_FAILURE ||
+        ensureBuffer(s->context, &s->dmap1, size) == EXIT_FAILURE ||
+        ensureBuffer(s->context, &s->dmap2, size) == EXIT_FAILURE ||
+        ensureBuffer(s->context, &s->ccor, ccSize) == EXIT_FAILURE ||
+        ensureBuffer(s->context, &s->dmap1Offset,
+                     width*height*sizeof(cl_float)) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+
+    lineZero = eventLogLine(&s->log, -1, "zeroMem:");
+    if (s->specProgram != NULL) {
+        cacheBlkData = s->specCacheBlkData;
+        zncc = s->specZncc;
     }
-    double t1 = doubleTime();
-    zeroMem_kernel_amd(program, queue, cacheBlks_l, lineStride*4, heightDiv4);
-    zeroMem_kernel_amd(program, queue, cacheBlks_r, lineStride*4, heightDiv4);
-    zeroMem_kernel_amd(program, queue, (*dmap1), width, height);
-    zeroMem_kernel_amd(program, queue, (*dmap2), width, height);
-    clFinish(queue);
-    double t2 = doubleTime();
-    printf("zeroMem (host):                 %6.1lf ms.\n", (t2-t1)*1000.0);
+
+    total = eventLogLine(&s->log, -1, (s->specProgram != NULL) ? "zncc (specialised):" :
+                                                                 "zncc:");
+    lineCache = eventLogLine(&s->log, total, " cacheData:");
+    lineZncc = eventLogLine(&s->log, total, " zncc:");
+    lineDmaps = eventLogLine(&s->log, total, " construct dmaps:");
+
+    eventLogStage(&s->log);
+    if (zeroMem_kernel_amd(s, s->cacheBlks_l.mem, lineStride*4, bandHeight,
+                           lineZero) == EXIT_FAILURE ||
+        zeroMem_kernel_amd(s, s->cacheBlks_r.mem, lineStride*4, bandHeight,
+                           lineZero) == EXIT_FAILURE ||
+        zeroMem_kernel_amd(s, s->dmap1.mem, width, height, lineZero) == EXIT_FAILURE ||
+        zeroMem_kernel_amd(s, s->dmap2.mem, width, height, lineZero) == EXIT_FAILURE)
+        return EXIT_FAILURE;
 
 
     globalOffset[0] = 0;
     globalOffset[1] = 0;
-    /* Iterate 1/4th of the window in one pass */
-    global[1] = heightDiv4;
+    /* Iterate one band of the window in one pass */
+    global[1] = bandHeight;
 
     /* Iterate until whole window is done */
     while (globalOffset[1] < (height-by+1)) {
 
+        eventLogStage(&s->log);
         global[0] = (((width-bx+1)+63)/64) * 64;
         local[0] = 64;
         local[1] = 1;
         clSetKernelArg(cacheBlkData, 0, sizeof(cl_mem), &img0);
-        clSetKernelArg(cacheBlkData, 1, sizeof(cl_mem), &cacheBlks_l);
+        clSetKernelArg(cacheBlkData, 1, sizeof(cl_mem), &s->cacheBlks_l.mem);
         clSetKernelArg(cacheBlkData, 2, sizeof(cl_uint), &width);
         clSetKernelArg(cacheBlkData, 3, sizeof(cl_uint), &height);
         clSetKernelArg(cacheBlkData, 4, sizeof(cl_uint), &bx);
         clSetKernelArg(cacheBlkData, 5, sizeof(cl_uint), &by);
-        errs[0] = clEnqueueNDRangeKernel(queue, cacheBlkData, 2, globalOffset, global, local,
-                                         0, NULL, &event[0]);
+        errs[0] = eventLogKernel(&s->log, lineCache, queue,
+                                 cacheBlkData, 2, globalOffset, global, local,
+                                 width*(global[1]+by-1)*sizeof(cl_float) + cacheSize);
 
         clSetKernelArg(cacheBlkData, 0, sizeof(cl_mem), &img1);
-        clSetKernelArg(cacheBlkData, 1, sizeof(cl_mem), &cacheBlks_r);
-        clSetKernelArg(cacheBlkData, 2, sizeof(cl_uint), &width);
-        clSetKernelArg(cacheBlkData, 3, sizeof(cl_uint), &height);
-        clSetKernelArg(cacheBlkData, 4, sizeof(cl_uint), &bx);
-        clSetKernelArg(cacheBlkData, 5, sizeof(cl_uint), &by);
-        errs[1] = clEnqueueNDRangeKernel(queue, cacheBlkData, 2, globalOffset, global, local,
-                                         0, NULL, &event[1]);
+        clSetKernelArg(cacheBlkData, 1, sizeof(cl_mem), &s->cacheBlks_r.mem);
+        errs[1] = eventLogKernel(&s->log, lineCache, queue,
+                                 cacheBlkData, 2, globalOffset, global, local,
+                                 width*(global[1]+by-1)*sizeof(cl_float) + cacheSize);
         if (errs[0] < 0 || errs[1] < 0) {
             fprintf(stderr, "Couldn't enqueue cacheBlkData! Codes %d %d",
                     errs[0], errs[1]);
             return EXIT_FAILURE;
         }
-        clWaitForEvents(2, event);
-        time1 += eventRuntime(event[0]);
-        time1 += eventRuntime(event[1]);
 
         /* scalar zncc */
 //        global[0] = (((width-bx+1)+63)/64) * 64;
 //        local[0] = 64;
         /* vector zncc */
+        eventLogStage(&s->log);
         global[0] = (((width-bx+1)+63)/64) * 64 / 8;
         local[0] = 8;
         local[1] = 1;
 
-        clSetKernelArg(zncc, 0, sizeof(cl_mem), &cacheBlks_l);
-        clSetKernelArg(zncc, 1, sizeof(cl_mem), &cacheBlks_r);
+        clSetKernelArg(zncc, 0, sizeof(cl_mem), &s->cacheBlks_l.mem);
+        clSetKernelArg(zncc, 1, sizeof(cl_mem), &s->cacheBlks_r.mem);
         clSetKernelArg(zncc, 2, sizeof(cl_mem), &disparitys);
-        clSetKernelArg(zncc, 3, sizeof(cl_mem), dmap2);
-        clSetKernelArg(zncc, 4, sizeof(cl_mem), &ccor);
+        clSetKernelArg(zncc, 3, sizeof(cl_mem), &s->dmap2.mem);
+        clSetKernelArg(zncc, 4, sizeof(cl_mem), &s->ccor.mem);
         clSetKernelArg(zncc, 5, sizeof(cl_uint), &width);
         clSetKernelArg(zncc, 6, sizeof(cl_uint), &height);
         clSetKernelArg(zncc, 7, sizeof(cl_uint), &bx);
         clSetKernelArg(zncc, 8, sizeof(cl_uint), &by);
         clSetKernelArg(zncc, 9, sizeof(cl_uint), &disp_limit);
-        err = clEnqueueNDRangeKernel(queue, zncc, 2, globalOffset, global, local,
-                                     0, NULL, &event[0]);
+        err = eventLogKernel(&s->log, lineZncc, queue,
+                             zncc, 2, globalOffset, global, local,
+                             2*cacheSize + ccSize + width*global[1]*2*sizeof(cl_ushort));
         if (err < 0) {
             fprintf(stderr, "Couldn't enqueue zncc: code: %d\n", err);
             return EXIT_FAILURE;
         }
-        clWaitForEvents(1, event);
-        time2 += eventRuntime(event[0]);
 
 
-        global[0] = ((width+3)/4)*4;
-        local[0] = 4;
+        eventLogStage(&s->log);
+        local[0] = s->tune.dmapsLocal;
         local[1] = 1;
-        clSetKernelArg(constructDmaps, 0, sizeof(cl_mem), dmap1);
-        clSetKernelArg(constructDmaps, 1, sizeof(cl_mem), dmap2);
-        clSetKernelArg(constructDmaps, 2, sizeof(cl_mem), &ccor);
+        global[0] = ((width+local[0]-1)/local[0])*local[0];
+        clSetKernelArg(constructDmaps, 0, sizeof(cl_mem), &s->dmap1.mem);
+        clSetKernelArg(constructDmaps, 1, sizeof(cl_mem), &s->dmap2.mem);
+        clSetKernelArg(constructDmaps, 2, sizeof(cl_mem), &s->ccor.mem);
         clSetKernelArg(constructDmaps, 3, sizeof(cl_uint), &disp_limit);
         clSetKernelArg(constructDmaps, 4, sizeof(cl_uint), &width);
         clSetKernelArg(constructDmaps, 5, sizeof(cl_uint), &bx);
         clSetKernelArg(constructDmaps, 6, sizeof(cl_uint), &by);
-        err = clEnqueueNDRangeKernel(queue, constructDmaps, 2, globalOffset, global, local,
-                                     0, NULL, &event[0]);
+        clSetKernelArg(constructDmaps, 7, sizeof(cl_mem), &s->dmap1Offset.mem);
+        clSetKernelArg(constructDmaps, 8, sizeof(cl_uint), &subpixel);
+        err = eventLogKernel(&s->log, lineDmaps, queue,
+                             constructDmaps, 2, globalOffset, global, local,
+                             ccSize + width*global[1]*(2*sizeof(cl_uchar) + sizeof(cl_float)));
         if (err < 0) {
             fprintf(stderr, "Couldn't enqueue constructDmaps: code: %d\n", err);
             return EXIT_FAILURE;
         }
-        clWaitForEvents(1, event);
-        time3 += eventRuntime(event[0]);
 
         /* Update globalOffset, and global in case it reaches edge. */
-        globalOffset[1] += heightDiv4;
+        globalOffset[1] += bandHeight;
 
         if ((global[1] + globalOffset[1]) > (height-by+1) ) {
             global[1] = (height-by+1) - globalOffset[1];
         }
     } /* while */
 
-    /* Caches not needed anymore */
-    clReleaseMemObject(cacheBlks_l);
-    clReleaseMemObject(cacheBlks_r);
-    clReleaseMemObject(ccor);
-
-    printf("zncc:                           %6.1f ms.\n", time1+time2+time3);
-    printf(" cacheData:                     %6.1f ms.\n", time1);
-    printf(" zncc:                          %6.1f ms.\n", time2);
-    printf(" construct dmaps:               %6.1f ms.\n", time3);
-
-    clReleaseKernel(cacheBlkData);
-    clReleaseKernel(zncc);
-    clReleaseKernel(constructDmaps);
-
     return EXIT_SUCCESS;
 }
 
-/* Calls kernels to postprocess depthmaps */
-int postProcessDmaps_amd(cl_context context, cl_command_queue queue, cl_program program,
-                         cl_mem dmap1, cl_mem dmap2,
+/* Calls kernels to postprocess depthmaps. Sub-pixel offsets are used only
+ * with 16-bit results. Result is left in s->postpMem1. */
+int postProcessDmaps_amd(struct session_opencl_amd *s,
+                         cl_mem dmap1, cl_mem dmap2, cl_mem dmap1Offset,
                          cl_uint width, cl_uint height, cl_uint disp_limit,
-                         cl_mem *processed) {
+                         dispFormat format, cl_uint subpixel) {
 
     cl_kernel postCross, postFill;
     cl_mem postpMem1, postpMem2;
-    size_t global[2], size;
-    cl_int errs[2], err, i;
-    cl_event event;
-    float time;
+    cl_command_queue queue = s->queue;
+    size_t global[2], size, crossBytes;
+    cl_int err;
+    cl_uint elemSize, scale;
+    int line;
 
-    size = width*height*sizeof(cl_uchar);
-    postpMem1 = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, &errs[0]);
-    postpMem2 = clCreateBuffer(context, CL_MEM_READ_WRITE, size, NULL, &errs[1]);
-    for (i=0; i < 2; i++) {
-        if (errs[i] != CL_SUCCESS) {
-            fprintf(stderr, "Couldn't create a buffer %d in file %s line %d\n"
-                    , i, __FILE__, __LINE__);
-            return EXIT_FAILURE;
-        }
-    }
-    zeroMem_kernel_amd(program, queue, postpMem1, width, height);
-    zeroMem_kernel_amd(program, queue, postpMem2, width, height);
-    clFinish(queue);
+    /* 16-bit results skip rescaling, disparitys are saved in fixed-point */
+    elemSize = (format == DISP_FIXED16) ? sizeof(cl_ushort) : sizeof(cl_uchar);
+    scale = DISP_SUBPIXEL_SCALE;
 
-    postCross = clCreateKernel(program, "postCrossCorrelation", &errs[0]);
-    postFill = clCreateKernel(program, "postFill", &errs[1]);
-    for (i=0; i < 2; i++) {
-        if (errs[i] != CL_SUCCESS) {
-            fprintf(stderr, "Couldn't create a kernel %d: %s line %d\n"
-                    , i, __FILE__, __LINE__);
-            return EXIT_FAILURE;
-        }
+    size = width*height*elemSize;
+    if (ensureBuffer(s->context, &s->postpMem1, size) == EXIT_FAILURE ||
+        ensureBuffer(s->context, &s->postpMem2, size) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+    postpMem1 = s->postpMem1.mem;
+    postpMem2 = s->postpMem2.mem;
+
+    line = eventLogLine(&s->log, -1, "Post processing:");
+
+    eventLogStage(&s->log);
+    if (zeroMem_kernel_amd(s, postpMem1, width*elemSize, height, -1) == EXIT_FAILURE ||
+        zeroMem_kernel_amd(s, postpMem2, width*elemSize, height, -1) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+
+    if (format == DISP_FIXED16) {
+        postCross = s->postCross16;
+        postFill = s->postFill16;
+    }
+    else {
+        postCross = s->postCross;
+        postFill = s->postFill;
     }
 
+    eventLogStage(&s->log);
     global[0] = width;
     global[1] = height;
     clSetKernelArg(postCross, 0, sizeof(cl_mem), &dmap1);
     clSetKernelArg(postCross, 1, sizeof(cl_mem), &dmap2);
-    clSetKernelArg(postCross, 2, sizeof(cl_mem), &postpMem1);
-    clSetKernelArg(postCross, 3, sizeof(cl_uint), &disp_limit);
-    err = clEnqueueNDRangeKernel(queue, postCross, 2, NULL, global, NULL,
-                                 0, NULL, &event);
+    if (format == DISP_FIXED16) {
+        clSetKernelArg(postCross, 2, sizeof(cl_mem), &dmap1Offset);
+        clSetKernelArg(postCross, 3, sizeof(cl_mem), &postpMem1);
+        clSetKernelArg(postCross, 4, sizeof(cl_uint), &scale);
+        clSetKernelArg(postCross, 5, sizeof(cl_uint), &subpixel);
+    }
+    else {
+        clSetKernelArg(postCross, 2, sizeof(cl_mem), &postpMem1);
+        clSetKernelArg(postCross, 3, sizeof(cl_uint), &disp_limit);
+    }
+    /* Both dmaps, offsets with 16-bit results, and the result */
+    crossBytes = 2*width*height + size;
+    if (format == DISP_FIXED16)
+        crossBytes += width*height*sizeof(cl_float);
+    err = eventLogKernel(&s->log, line, queue,
+                         postCross, 2, NULL, global, NULL,
+                         crossBytes);
     if (err < 0) {
         fprintf(stderr, "Couldn't enqueue postCrossCorr: code: %d\n", err);
         return EXIT_FAILURE;
     }
-    clWaitForEvents(1, &event);
-    time = eventRuntime(event);
 
     /* Left 1-pixel on all sides to avoid overread.
      * NOTE: Atleast with opensource Clover OpenCL 1.1-driver
      * global offsets seems not to work. */
+    eventLogStage(&s->log);
     global[0] = width-2;
     global[1] = height-2;
     clSetKernelArg(postFill, 0, sizeof(cl_mem), &postpMem1);
     clSetKernelArg(postFill, 1, sizeof(cl_mem), &postpMem2);
     clSetKernelArg(postFill, 2, sizeof(cl_uint), &width);
-    err = clEnqueueNDRangeKernel(queue, postFill, 2, NULL, global, NULL,
-                                 0, NULL, &event);
+    err = eventLogKernel(&s->log, line, queue,
+                         postFill, 2, NULL, global, NULL,
+                         2*size);
     if (err < 0) {
         fprintf(stderr, "Couldn't enqueue postFill: code: %d\n", err);
         return EXIT_FAILURE;
     }
-    clWaitForEvents(1, &event);
-    time += eventRuntime(event);
 
+    eventLogStage(&s->log);
     clSetKernelArg(postFill, 0, sizeof(cl_mem), &postpMem2);
     clSetKernelArg(postFill, 1, sizeof(cl_mem), &postpMem1);
-    err = clEnqueueNDRangeKernel(queue, postFill, 2, NULL, global, NULL,
-                                 0, NULL, &event);
+    err = eventLogKernel(&s->log, line, queue,
+                         postFill, 2, NULL, global, NULL,
+                         2*size);
     if (err < 0) {
         fprintf(stderr, "Couldn't enqueue postFill: code: %d\n", err);
         return EXIT_FAILURE;
     }
-    clWaitForEvents(1, &event);
-    time += eventRuntime(event);
-
-    clReleaseMemObject(postpMem2);
-
-    (*processed) = postpMem1;
-
-    printf("Post processing:                %6.1f ms.\n", time);
-
-    clReleaseKernel(postCross);
-    clReleaseKernel(postFill);
 
     return EXIT_SUCCESS;
 }
 
-unsigned char *generateDepthmap_opencl_amd(unsigned char *img0, unsigned char *img1,
-                                           unsigned int width, unsigned height,
-                                           unsigned int blockx, unsigned int blocky,
-                                           unsigned int disp_limit, searchMethod_ocl select,
-                                           device_ocl dev) {
+struct session_opencl_amd *createSession_opencl_amd(device_ocl dev) {
 
-    cl_platform_id platform;
+    struct session_opencl_amd *s;
     cl_device_type device_type;
-    cl_device_id device;
-    cl_context context;
-    cl_program program;
-    cl_command_queue queue;
-    cl_int err, errs[16], i;
+    cl_int err;
     double hostTime1, hostTime2;
 
-    if ( (blockx % 2 != 1) || (blocky % 2 != 1) || blockx == 1 || blocky == 1 ) {
-        fprintf(stderr, "Blocksize must be odd in both dimensions and more than 1!\n");
-        return NULL;
-    }
-
     if (dev == CPU) device_type = CL_DEVICE_TYPE_CPU;
     else if (dev == GPU) device_type = CL_DEVICE_TYPE_GPU;
     else {
@@ -442,99 +478,322 @@ unsigned char *generateDepthmap_opencl_amd(unsigned char *img0, unsigned char *i
         return NULL;
     }
 
-    if (initOpenCL(&platform, &device, &context, &program, device_type, "depthmap_amd.cl")
-            == EXIT_FAILURE) {
+    s = calloc(1, sizeof(struct session_opencl_amd));
+    if (s == NULL)
         return NULL;
-    }
 
     hostTime1 = doubleTime();
 
-    cl_mem input_img0, input_img1, greyImage0, greyImage1, disparitys;
-
-    input_img0 = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                width*height*4*sizeof(unsigned char), img0, &errs[0]);
-    greyImage0 = clCreateBuffer(context, CL_MEM_READ_WRITE,
-                                (width/4)*(height/4)*sizeof(float), NULL, &errs[1]);
-    input_img1 = clCreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-                                width*height*4*sizeof(unsigned char), img1, &errs[2]);
-    greyImage1 = clCreateBuffer(context, CL_MEM_READ_WRITE,
-                                (width/4)*(height/4)*sizeof(float), NULL, &errs[3]);
-
-    /* Check success of creating buffers */
-    for (i=0; i < 4; i++) {
-        if (errs[i] != CL_SUCCESS) {
-            fprintf(stderr, "Couldn't create a buffer %d in file %s line %d\n"
-                    , i, __FILE__, __LINE__);
-            return NULL;
-        }
+    if (initOpenCL(&s->platform, &s->device, &s->context, &s->program,
+                   device_type, "depthmap_amd.cl") == EXIT_FAILURE) {
+        free(s);
+        return NULL;
     }
 
-    queue = clCreateCommandQueue(context, device, CL_QUEUE_PROFILING_ENABLE, &err);
+    /* Commands are ordered by events, so runtime may overlap independent ones */
+    s->queue = clCreateCommandQueue(s->context, s->device,
+                                    CL_QUEUE_PROFILING_ENABLE |
+                                    CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE, &err);
+    if (err != CL_SUCCESS)
+        s->queue = clCreateCommandQueue(s->context, s->device,
+                                        CL_QUEUE_PROFILING_ENABLE, &err);
     if (err != CL_SUCCESS) {
         fprintf(stderr, "Couldn't create a command queue\n");
+        clReleaseProgram(s->program);
+        clReleaseContext(s->context);
+        free(s);
         return NULL;
     }
 
-    if (blend4x4CnvrtToGrey_amd(program, queue, &input_img0, &input_img1,
-                            &greyImage0, &greyImage1, width, height) == EXIT_FAILURE) {
-        fprintf(stderr, "Image converting kernel failed!\n");
+    const char *names[] = {"blend_cnvrtToGreyscale", "initDisparitys", "zero_clMem",
+                           "cacheBlkData", "zncc_vector", "constructDmaps",
+                           "postCrossCorrelation", "postFill",
+                           "postCrossCorrelation16", "postFill16"};
+    cl_kernel *kernels[] = {&s->blendAndGreyscale, &s->initDisparitys, &s->zero,
+                            &s->cacheBlkData, &s->zncc, &s->constructDmaps,
+                            &s->postCross, &s->postFill,
+                            &s->postCross16, &s->postFill16};
+
+    if (createKernels(s->program, sizeof(names)/sizeof(names[0]),
+                      names, kernels) == EXIT_FAILURE) {
+        clReleaseCommandQueue(s->queue);
+        clReleaseProgram(s->program);
+        clReleaseContext(s->context);
+        free(s);
         return NULL;
     }
 
-    cl_uint greyImgWidth = width/4;
-    cl_uint greyImgHeight = height/4;
-    cl_mem dmap1, dmap2;
+    s->generic = (getenv("DEPTHMAP_CL_GENERIC") != NULL);
+    s->hostUnified = hostUnifiedMemory(s->device);
+    if (s->hostUnified)
+        printf("Device shares host memory, images are not copied.\n");
+
+    struct tuneConfig defaults = TUNE_DEFAULTS;
+    s->tune = defaults;
+    if (loadTuneConfig(s->device, "depthmap_amd.cl", &s->tune) == EXIT_SUCCESS)
+        printf("Launch parameters tuned for the device loaded.\n");
+    /* A hand-edited file must not divide by zero */
+    if (s->tune.bands == 0)
+        s->tune.bands = defaults.bands;
+    if (s->tune.dmapsLocal == 0)
+        s->tune.dmapsLocal = defaults.dmapsLocal;
 
-    if (select == HIERARCHIC_CL) {
-        printf("Does not support search range estimation! Does full search!\n");
-    }
+    hostTime2 = doubleTime();
+    printf("OpenCL setup (host):            %6.1lf ms.\n\n",
+           (hostTime2-hostTime1)*1e3);
 
-    /* Set search ranges */
-    if (initDisparitys_amd(context, program, queue,
-                           greyImgWidth, greyImgHeight, blockx, disp_limit,
-                           &disparitys) == EXIT_FAILURE) {
-        return NULL;
+    return s;
+}
+
+/* Buffers wrapping memory of the caller must not outlive one depthmap */
+void releaseHostWrappers_amd(struct session_opencl_amd *s) {
+    if (s->hostUnified) {
+        releaseBuffer(&s->input_img0);
+        releaseBuffer(&s->input_img1);
+        releaseBuffer(&s->postpMem1);
     }
+}
+
+void *sessionDepthmap_opencl_amd(struct session_opencl_amd *s,
+                                 unsigned char *img0, unsigned char *img1,
+                                 unsigned int width, unsigned height,
+                                 unsigned int blockx, unsigned int blocky,
+                                 unsigned int disp_limit, searchMethod_ocl select,
+                                 dispFormat format, subpixelMethod subpixel,
+                                 unsigned int factor) {
 
-    cl_mem postResult;
+    cl_int err, err2;
+    size_t inputSize, resSize;
+    double hostTime1, hostTime2;
+    void *res = NULL, *mapped;
 
-    if (znccFunc_amd(context, program, queue,
-                 greyImage0, greyImage1, disparitys, disp_limit,
-                 greyImgWidth, greyImgHeight, blockx, blocky,
-                 &dmap1, &dmap2) == EXIT_FAILURE) {
+    if ( (blockx % 2 != 1) || (blocky % 2 != 1) || blockx == 1 || blocky == 1 ) {
+        fprintf(stderr, "Blocksize must be odd in both dimensions and more than 1!\n");
+        return NULL;
+    }
+    if (disp_limit < 1 || disp_limit > DISP_LIMIT_MAX) {
+        fprintf(stderr, "Disparity-limit must be 1-%d!\n", DISP_LIMIT_MAX);
         return NULL;
     }
-    if (postProcessDmaps_amd(context, queue, program, dmap1, dmap2, greyImgWidth,
-                         greyImgHeight, disp_limit, &postResult) == EXIT_FAILURE) {
+    if (factor != 1 && factor != 2 && factor != 4 && factor != 8) {
+        fprintf(stderr, "Downscale factor must be 1, 2, 4 or 8!\n");
         return NULL;
     }
 
-    /* Allocate host memory and read the resulting image from OpenCL device */
-    unsigned char *res;
-    res = malloc(sizeof(unsigned char)*(width/4)*(height/4));
+    hostTime1 = doubleTime();
+    eventLogReset(&s->log);
+    specialiseKernels_amd(s, blockx, blocky, disp_limit);
+
+    inputSize = width*height*4*sizeof(unsigned char);
+    if (s->hostUnified) {
+        /* Kernels read the images where they are */
+        if (wrapHostMemory(s->context, &s->input_img0, img0, inputSize,
+                           CL_MEM_READ_ONLY) == EXIT_FAILURE ||
+            wrapHostMemory(s->context, &s->input_img1, img1, inputSize,
+                           CL_MEM_READ_ONLY) == EXIT_FAILURE)
+            goto failed;
+    }
+    else {
+        if (ensureBuffer(s->context, &s->input_img0, inputSize) == EXIT_FAILURE ||
+            ensureBuffer(s->context, &s->input_img1, inputSize) == EXIT_FAILURE)
+            goto failed;
+
+        /* Images are not touched by host before the final read has completed */
+        err = clEnqueueWriteBuffer(s->queue, s->input_img0.mem, CL_FALSE, 0, inputSize,
+                                   img0, EVENTLOG_DEPS(&s->log, -1));
+        err = eventLogCommit(&s->log, err, "write img0", inputSize);
+        err2 = clEnqueueWriteBuffer(s->queue, s->input_img1.mem, CL_FALSE, 0, inputSize,
+                                    img1, EVENTLOG_DEPS(&s->log, -1));
+        err2 = eventLogCommit(&s->log, err2, "write img1", inputSize);
+        if (err != CL_SUCCESS || err2 != CL_SUCCESS) {
+            fprintf(stderr, "Couldn't write images to device. Code %d\n",
+                    (err != CL_SUCCESS) ? err : err2);
+            goto failed;
+        }
+    }
+
+    if (blendCnvrtToGrey_amd(s, width, height, factor) == EXIT_FAILURE) {
+        fprintf(stderr, "Image converting kernel failed!\n");
+        goto failed;
+    }
+
+    cl_uint greyImgWidth = width/factor;
+    cl_uint greyImgHeight = height/factor;
+
+    /* Sub-pixel disparitys can only be stored in fixed-point format. */
+    if (format != DISP_FIXED16)
+        subpixel = SUBPIXEL_NONE;
+
+    if (select == HIERARCHIC_CL) {
+        printf("Does not support search range estimation! Does full search!\n");
+    }
+
+    /* Set search ranges */
+    if (initDisparitys_amd(s, greyImgWidth, greyImgHeight, blockx,
+                           disp_limit) == EXIT_FAILURE) {
+        goto failed;
+    }
+
+    if (znccFunc_amd(s, s->greyImage0.mem, s->greyImage1.mem, s->disparitys.mem,
+                     disp_limit, greyImgWidth, greyImgHeight, blockx, blocky,
+                     subpixel) == EXIT_FAILURE) {
+        goto failed;
+    }
+
+    /* Allocate host memory for the resulting image. Device with host memory
+     * post-processes directly into it. */
+    resSize = greyImgWidth*greyImgHeight;
+    if (format == DISP_FIXED16)
+        resSize *= sizeof(cl_ushort);
+    res = s->hostUnified ? allocHostPages(resSize) : malloc(resSize);
+    if (res == NULL)
+        goto failed;
+    if (s->hostUnified &&
+        wrapHostMemory(s->context, &s->postpMem1, res, resSize,
+                       CL_MEM_READ_WRITE) == EXIT_FAILURE)
+        goto failed;
+
+    if (postProcessDmaps_amd(s, s->dmap1.mem, s->dmap2.mem, s->dmap1Offset.mem,
+                             greyImgWidth, greyImgHeight, disp_limit, format,
+                             subpixel) == EXIT_FAILURE) {
+        goto failed;
+    }
 
-    err = clEnqueueReadBuffer(queue, postResult, CL_TRUE, 0,
-                              sizeof(cl_uchar)*(width/4)*(height/4),
-                              res, 0, NULL, NULL);
+    /* Only blocking call, waits for the whole chain */
+    eventLogStage(&s->log);
+    if (s->hostUnified) {
+        mapped = clEnqueueMapBuffer(s->queue, s->postpMem1.mem, CL_TRUE, CL_MAP_READ,
+                                    0, resSize, EVENTLOG_DEPS(&s->log, -1), &err);
+        err = eventLogCommit(&s->log, err, "map result", resSize);
+        if (err == CL_SUCCESS) {
+            /* Runtime may still have used a copy of its own */
+            if (mapped != res)
+                memcpy(res, mapped, resSize);
+            clEnqueueUnmapMemObject(s->queue, s->postpMem1.mem, mapped, 0, NULL, NULL);
+            clFinish(s->queue);
+            releaseHostWrappers_amd(s);
+        }
+        else if (mapped != NULL) {
+            clEnqueueUnmapMemObject(s->queue, s->postpMem1.mem, mapped, 0, NULL, NULL);
+        }
+    }
+    else {
+        err = clEnqueueReadBuffer(s->queue, s->postpMem1.mem, CL_TRUE, 0, resSize,
+                                  res, EVENTLOG_DEPS(&s->log, -1));
+        err = eventLogCommit(&s->log, err, "read result", resSize);
+    }
     if (err != CL_SUCCESS) {
         fprintf(stderr, "Couldn't read postprocessed image from buffer.\n");
-        return NULL;
+        goto failed;
     }
 
-    clReleaseMemObject(greyImage0);
-    clReleaseMemObject(greyImage1);
-    clReleaseMemObject(dmap1);
-    clReleaseMemObject(dmap2);
-    clReleaseMemObject(postResult);
+    /* Profiling info of retained events */
+    if (!s->quiet)
+        eventLogPrint(&s->log);
+    if (s->trace != NULL)
+        eventLogTrace(&s->log, s->trace);
+    eventLogReset(&s->log);
+
+    hostTime2 = doubleTime();
+    if (!s->quiet)
+        printf("Total time (host):              %6.1lf ms.\n\n",
+               (hostTime2-hostTime1)*1e3);
+
+    return res;
+
+failed:
+    /* Enqueued commands may still use host images */
+    clFinish(s->queue);
+    eventLogReset(&s->log);
+    releaseHostWrappers_amd(s);
+    free(res);
+    return NULL;
+}
+
+void setTuning_opencl_amd(struct session_opencl_amd *s,
+                          const struct tuneConfig *conf, int quiet) {
+    s->tune = (*conf);
+    s->quiet = quiet;
+}
+
+int readIntermediates_opencl_amd(struct session_opencl_amd *s,
+                                 unsigned int width, unsigned int height,
+                                 float *grey0, float *grey1,
+                                 unsigned char *dmap1, unsigned char *dmap2) {
+    size_t pixels = (size_t)width*height;
 
-    clReleaseCommandQueue(queue);
-    clReleaseProgram(program);
-    clReleaseContext(context);
+    if (readBuffer(s->queue, &s->greyImage0, grey0, pixels*sizeof(cl_float)) == EXIT_FAILURE ||
+        readBuffer(s->queue, &s->greyImage1, grey1, pixels*sizeof(cl_float)) == EXIT_FAILURE ||
+        readBuffer(s->queue, &s->dmap1, dmap1, pixels*sizeof(cl_uchar)) == EXIT_FAILURE ||
+        readBuffer(s->queue, &s->dmap2, dmap2, pixels*sizeof(cl_uchar)) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+void setTrace_opencl_amd(struct session_opencl_amd *s,
+                         struct oclTrace *trace) {
+    s->trace = trace;
+}
+
+int saveTuning_opencl_amd(struct session_opencl_amd *s) {
+    return saveTuneConfig(s->device, "depthmap_amd.cl", &s->tune);
+}
+
+void releaseSession_opencl_amd(struct session_opencl_amd *s) {
+
+    if (s == NULL)
+        return;
+
+    /* Make sure queue is empty before attempting to release resources. */
+    clFinish(s->queue);
+    eventLogReset(&s->log);
+
+    struct oclBuffer *buffers[] = {&s->input_img0, &s->input_img1,
+                                   &s->greyImage0, &s->greyImage1, &s->disparitys,
+                                   &s->cacheBlks_l, &s->cacheBlks_r, &s->ccor,
+                                   &s->dmap1, &s->dmap2, &s->dmap1Offset,
+                                   &s->postpMem1, &s->postpMem2};
+    cl_kernel kernels[] = {s->blendAndGreyscale, s->initDisparitys, s->zero,
+                           s->cacheBlkData, s->zncc, s->constructDmaps,
+                           s->postCross, s->postFill, s->postCross16, s->postFill16};
+    unsigned int i;
+
+    for (i=0; i < sizeof(buffers)/sizeof(buffers[0]); i++)
+        releaseBuffer(buffers[i]);
+    for (i=0; i < sizeof(kernels)/sizeof(kernels[0]); i++)
+        clReleaseKernel(kernels[i]);
+    if (s->specProgram != NULL) {
+        clReleaseKernel(s->specCacheBlkData);
+        clReleaseKernel(s->specZncc);
+        clReleaseProgram(s->specProgram);
+    }
+
+    clReleaseCommandQueue(s->queue);
+    clReleaseProgram(s->program);
+    clReleaseContext(s->context);
     //clReleaseDevice(device); // OpenCl 1.2
 
-    hostTime2 = doubleTime();
-    printf("Total time (host):              %6.1lf ms.\n\n",
-           (hostTime2-hostTime1)*1e3);
+    free(s);
+}
+
+void *generateDepthmap_opencl_amd(unsigned char *img0, unsigned char *img1,
+                                  unsigned int width, unsigned height,
+                                  unsigned int blockx, unsigned int blocky,
+                                  unsigned int disp_limit, searchMethod_ocl select,
+                                  device_ocl dev, dispFormat format,
+                                  subpixelMethod subpixel, unsigned int factor) {
+    struct session_opencl_amd *s;
+    void *res;
+
+    s = createSession_opencl_amd(dev);
+    if (s == NULL)
+        return NULL;
+
+    res = sessionDepthmap_opencl_amd(s, img0, img1, width, height, blockx, blocky,
+                                     disp_limit, select, format, subpixel, factor);
+
+    releaseSession_opencl_amd(s);
 
     return res;
 }
@@ -7,15 +7,59 @@
 //typedef enum {ACPU = 1, AGPU = 3} device_ocl_amd;
 
 /* Generates post-processed depthmap. Takes: 2 32-bit stereo-images, their width
- * and height (mod 4). Wanted blocksize for a search, disparity-limit and search method.
- * Also selects either cpu or gpu depending on value in variable dev.
+ * and height (mod factor). Wanted blocksize for a search, disparity-limit and search
+ * method. Also selects either cpu or gpu depending on value in variable dev, format
+ * of the result (unsigned char or unsigned short elements), sub-pixel refinement,
+ * which is used only with DISP_FIXED16, and downscale factor of the images
+ * (1, 2, 4 or 8).
  * On success:
- *  Returns 1/4 by 1/4 image.
+ *  Returns 1/factor by 1/factor image.
  * On failure:
  *  Returns NULL. */
-unsigned char *generateDepthmap_opencl_amd(unsigned char *img0, unsigned char *img1,
-                                             unsigned int width, unsigned height,
-                                             unsigned int blockx, unsigned int blocky,
-                                             unsigned int disp_limit, searchMethod_ocl select,
-                                             device_ocl dev);
+void *generateDepthmap_opencl_amd(unsigned char *img0, unsigned char *img1,
+                                  unsigned int width, unsigned height,
+                                  unsigned int blockx, unsigned int blocky,
+                                  unsigned int disp_limit, searchMethod_ocl select,
+                                  device_ocl dev, dispFormat format,
+                                  subpixelMethod subpixel, unsigned int factor);
+
+/* Platform, context, queue, program, kernels and device buffers that are
+ * reused for any number of stereo-pairs. */
+struct session_opencl_amd;
+
+/* Builds the program and kernels once. Returns NULL on failure. */
+struct session_opencl_amd *createSession_opencl_amd(device_ocl dev);
+
+/* Same as generateDepthmap_opencl_amd, but on an existing session. */
+void *sessionDepthmap_opencl_amd(struct session_opencl_amd *s,
+                                 unsigned char *img0, unsigned char *img1,
+                                 unsigned int width, unsigned height,
+                                 unsigned int blockx, unsigned int blocky,
+                                 unsigned int disp_limit, searchMethod_ocl select,
+                                 dispFormat format, subpixelMethod subpixel,
+                                 unsigned int factor);
+
+/* Replaces launch parameters of the session. quiet leaves out timing prints
+ * of following depthmaps. */
+void setTuning_opencl_amd(struct session_opencl_amd *s,
+                          const struct tuneConfig *conf, int quiet);
+
+/* Saves launch parameters of the session for its device, later sessions
+ * load them. Returns EXIT_SUCCESS or EXIT_FAILURE. */
+int saveTuning_opencl_amd(struct session_opencl_amd *s);
+
+/* Greyscale images and dmaps of the left (dmap1) and right (dmap2) image
+ * before post-processing, of the session's last depthmap of width x height,
+ * read from the device for comparing versions.
+ * Returns EXIT_SUCCESS or EXIT_FAILURE. */
+int readIntermediates_opencl_amd(struct session_opencl_amd *s,
+                                 unsigned int width, unsigned int height,
+                                 float *grey0, float *grey1,
+                                 unsigned char *dmap1, unsigned char *dmap2);
+
+/* Commands of following depthmaps are appended to trace, NULL stops. */
+void setTrace_opencl_amd(struct session_opencl_amd *s,
+                         struct oclTrace *trace);
+
+void releaseSession_opencl_amd(struct session_opencl_amd *s);
 #endif
@@ -0,0 +1,20 @@
+#ifndef DISPARITY_H
+#define DISPARITY_H
+
+/* Element format of a generated depthmap.
+ *  DISP_GREY8:   8-bit greyscale, disparitys rescaled to range 0-255.
+ *  DISP_FIXED16: 16-bit disparitys in fixed-point, multiplied by
+ *                DISP_SUBPIXEL_SCALE. Value 0 marks unknown disparity. */
+typedef enum {DISP_GREY8, DISP_FIXED16} dispFormat;
+
+#define DISP_SUBPIXEL_SCALE 16
+
+/* Largest disparity-limit, dmaps have unsigned char elements */
+#define DISP_LIMIT_MAX 255
+
+/* Sub-pixel refinement of matched disparitys, only with DISP_FIXED16.
+ *  SUBPIXEL_PARABOLA:    parabola fitted to three correlations around the peak.
+ *  SUBPIXEL_EQUIANGULAR: symmetric V-shape fitted to the same correlations. */
+typedef enum {SUBPIXEL_NONE, SUBPIXEL_PARABOLA, SUBPIXEL_EQUIANGULAR} subpixelMethod;
+
+#endif
@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "hybrid.h"
+#include "common_opencl.h"
+#include "doubleTime.h"
+
+/* OpenCL 1.2, compiled against 1.0 headers */
+#ifndef CL_FP_CORRECTLY_ROUNDED_DIVIDE_SQRT
+#define CL_FP_CORRECTLY_ROUNDED_DIVIDE_SQRT (1 << 7)
+#endif
+
+/* Upper limit for block caches of scanlines matched in one launch */
+#define HYBRID_SCRATCH (64*1024*1024)
+
+/* Share of the device at first pair, and weight of the newest measurement */
+#define HYBRID_INITIAL_SHARE 0.5
+#define HYBRID_SMOOTHING 0.5
+
+struct session_hybrid {
+    cl_platform_id platform;
+    cl_device_id device;
+    cl_context context;
+    cl_program program;
+    cl_command_queue queue;
+    cl_kernel znccRows;
+
+    struct oclBuffer greyImage0, greyImage1, displacements;
+    struct oclBuffer dmap1, dmap2, dmap1Sub, scratch;
+
+    /* Fraction of the scanlines matched on the device */
+    double share;
+};
+
+/* Build options giving the same division and sqrt as on the host. Only
+ * OpenCL 1.2 devices accept the option, and only if they support it. */
+static const char *exactMathOptions(cl_device_id device) {
+    char version[128];
+    int major, minor;
+    cl_device_fp_config fpConfig;
+
+    if (clGetDeviceInfo(device, CL_DEVICE_VERSION, sizeof(version), version,
+                        NULL) != CL_SUCCESS
+            || sscanf(version, "OpenCL %d.%d", &major, &minor) != 2)
+        return "";
+    if (major == 1 && minor < 2)
+        return "";
+    if (clGetDeviceInfo(device, CL_DEVICE_SINGLE_FP_CONFIG, sizeof(fpConfig),
+                        &fpConfig, NULL) != CL_SUCCESS
+            || (fpConfig & CL_FP_CORRECTLY_ROUNDED_DIVIDE_SQRT) == 0)
+        return "";
+
+    return "-cl-fp32-correctly-rounded-divide-sqrt";
+}
+
+struct session_hybrid *createSession_hybrid(int dev) {
+
+    struct session_hybrid *s;
+    cl_device_type device_type;
+    const char *options;
+    cl_int err;
+
+    if (dev == CPU) device_type = CL_DEVICE_TYPE_CPU;
+    else if (dev == GPU) device_type = CL_DEVICE_TYPE_GPU;
+    else {
+        fprintf(stderr, "Wrong opencl device\n");
+        return NULL;
+    }
+
+    s = calloc(1, sizeof(struct session_hybrid));
+    if (s == NULL)
+        return NULL;
+
+    if (initOpenCLDevice(&s->platform, &s->device, &s->context,
+                         device_type) == EXIT_FAILURE) {
+        free(s);
+        return NULL;
+    }
+
+    options = exactMathOptions(s->device);
+    if (options[0] == '\0')
+        printf("Device has no correctly rounded sqrt, hybrid depthmaps may "
+               "differ slightly from native ones.\n");
+    if (buildOCLProgram(s->device, s->context, "depthmap_hybrid.cl", options,
+                        &s->program) == EXIT_FAILURE) {
+        fprintf(stderr, "cl-file did not compile.\n");
+        clReleaseContext(s->context);
+        free(s);
+        return NULL;
+    }
+
+    s->queue = clCreateCommandQueue(s->context, s->device, 0, &err);
+    if (err != CL_SUCCESS) {
+        fprintf(stderr, "Couldn't create a command queue\n");
+        clReleaseProgram(s->program);
+        clReleaseContext(s->context);
+        free(s);
+        return NULL;
+    }
+
+    s->znccRows = clCreateKernel(s->program, "znccRows", &err);
+    if (err != CL_SUCCESS) {
+        fprintf(stderr, "Couldn't create kernel znccRows\n");
+        clReleaseCommandQueue(s->queue);
+        clReleaseProgram(s->program);
+        clReleaseContext(s->context);
+        free(s);
+        return NULL;
+    }
+
+    s->share = HYBRID_INITIAL_SHARE;
+
+    return s;
+}
+
+void releaseSession_hybrid(struct session_hybrid *s) {
+
+    if (s == NULL)
+        return;
+
+    clFinish(s->queue);
+
+    struct oclBuffer *buffers[] = {&s->greyImage0, &s->greyImage1,
+                                   &s->displacements, &s->dmap1, &s->dmap2,
+                                   &s->dmap1Sub, &s->scratch};
+    unsigned int i;
+
+    for (i=0; i < sizeof(buffers)/sizeof(buffers[0]); i++)
+        releaseBuffer(buffers[i]);
+
+    clReleaseKernel(s->znccRows);
+    clReleaseCommandQueue(s->queue);
+    clReleaseProgram(s->program);
+    clReleaseContext(s->context);
+
+    free(s);
+}
+
+unsigned int hybridSplit(struct session_hybrid *s,
+                         unsigned int first, unsigned int last) {
+    unsigned int lines, device;
+
+    if (last < first+2)
+        return last;
+
+    lines = last-first;
+    device = (unsigned int)(s->share*lines + 0.5);
+    if (device < 1)
+        device = 1;
+    if (device > lines-1)
+        device = lines-1;
+
+    return last-device;
+}
+
+void hybridBalance(struct session_hybrid *s,
+                   unsigned int linesNative, double msNative,
+                   unsigned int linesDevice, double msDevice) {
+    double rateNative, rateDevice;
+
+    if (linesNative == 0 || linesDevice == 0 || msNative <= 0.0 || msDevice <= 0.0)
+        return;
+
+    /* Scanlines per ms. Bands of equal time split the scanlines in the
+     * ratio of the rates. */
+    rateNative = linesNative/msNative;
+    rateDevice = linesDevice/msDevice;
+    s->share = (1.0-HYBRID_SMOOTHING)*s->share
+             + HYBRID_SMOOTHING*rateDevice/(rateNative+rateDevice);
+}
+
+/* Writes rows [first, last) of a host image with rowSize bytes per row */
+static cl_int writeRows(cl_command_queue queue, cl_mem mem, const void *host,
+                        size_t rowSize, unsigned int first, unsigned int last) {
+    return clEnqueueWriteBuffer(queue, mem, CL_FALSE, first*rowSize,
+                                (last-first)*rowSize,
+                                (const char *)host + first*rowSize, 0, NULL, NULL);
+}
+
+static cl_int readRows(cl_command_queue queue, cl_mem mem, void *host,
+                       size_t rowSize, unsigned int first, unsigned int last) {
+    return clEnqueueReadBuffer(queue, mem, CL_FALSE, first*rowSize,
+                               (last-first)*rowSize,
+                               (char *)host + first*rowSize, 0, NULL, NULL);
+}
+
+/* Keeps the first failure of a sequence of calls in err */
+static void keepError(cl_int *err, cl_int code) {
+    if ((*err) == CL_SUCCESS)
+        (*err) = code;
+}
+
+void *hybridWorker(void *data) {
+
+    struct hybridBand *band;
+    struct session_hybrid *s;
+    cl_context context;
+    cl_int err;
+    cl_uint width, bx, by, firstLine, lastLine, subpixel, chunk;
+    size_t pixels, lineScratch, global;
+    unsigned int blkSidey, blkStride;
+    double time1, time2;
+
+    band = (struct hybridBand *)data;
+    s = band->session;
+    context = s->context;
+    band->error = EXIT_FAILURE;
+    band->ms = 0.0;
+
+    time1 = doubleTime();
+
+    width = band->width;
+    bx = band->bx;
+    by = band->by;
+    blkSidey = by/2;
+    blkStride = ((bx*by+7)/8)*8;
+    pixels = (size_t)band->width*band->height;
+    subpixel = (band->dmap1Sub != NULL) ? band->subpixel : SUBPIXEL_NONE;
+
+    /* Block caches and dmap2 correlations of one scanline */
+    lineScratch = sizeof(cl_float)*(2*(blkStride*width+width) + width);
+    chunk = HYBRID_SCRATCH/lineScratch;
+    if (chunk < 1)
+        chunk = 1;
+    if (chunk > band->last-band->first)
+        chunk = band->last-band->first;
+
+    if (ensureBuffer(context, &s->greyImage0, sizeof(cl_float)*pixels) == EXIT_FAILURE
+            || ensureBuffer(context, &s->greyImage1, sizeof(cl_float)*pixels) == EXIT_FAILURE
+            || ensureBuffer(context, &s->displacements, sizeof(cl_ushort)*2*pixels) == EXIT_FAILURE
+            || ensureBuffer(context, &s->dmap1, sizeof(cl_uchar)*pixels) == EXIT_FAILURE
+            || ensureBuffer(context, &s->dmap2, sizeof(cl_uchar)*pixels) == EXIT_FAILURE
+            || ensureBuffer(context, &s->scratch, lineScratch*chunk) == EXIT_FAILURE
+            || (band->dmap1Sub != NULL
+                && ensureBuffer(context, &s->dmap1Sub, sizeof(cl_ushort)*pixels) == EXIT_FAILURE)) {
+        fprintf(stderr, "Couldn't allocate hybrid buffers\n");
+        return NULL;
+    }
+
+    /* Only rows the band's blocks reach */
+    err = writeRows(s->queue, s->greyImage0.mem, band->greyImage0,
+                    sizeof(cl_float)*width, band->first-blkSidey, band->last+blkSidey);
+    keepError(&err, writeRows(s->queue, s->greyImage1.mem, band->greyImage1,
+                              sizeof(cl_float)*width,
+                              band->first-blkSidey, band->last+blkSidey));
+    keepError(&err, writeRows(s->queue, s->displacements.mem, band->displacements,
+                              sizeof(cl_ushort)*2*width, band->first, band->last));
+    if (err != CL_SUCCESS) {
+        fprintf(stderr, "Couldn't write hybrid band: code: %d\n", err);
+        goto failed;
+    }
+
+    err = clSetKernelArg(s->znccRows, 0, sizeof(cl_mem), &s->greyImage0.mem);
+    keepError(&err, clSetKernelArg(s->znccRows, 1, sizeof(cl_mem), &s->greyImage1.mem));
+    keepError(&err, clSetKernelArg(s->znccRows, 2, sizeof(cl_mem), &s->displacements.mem));
+    keepError(&err, clSetKernelArg(s->znccRows, 3, sizeof(cl_mem), &s->dmap1.mem));
+    keepError(&err, clSetKernelArg(s->znccRows, 4, sizeof(cl_mem), &s->dmap2.mem));
+    keepError(&err, clSetKernelArg(s->znccRows, 5, sizeof(cl_mem), &s->dmap1Sub.mem));
+    keepError(&err, clSetKernelArg(s->znccRows, 6, sizeof(cl_mem), &s->scratch.mem));
+    keepError(&err, clSetKernelArg(s->znccRows, 7, sizeof(cl_uint), &width));
+    keepError(&err, clSetKernelArg(s->znccRows, 8, sizeof(cl_uint), &bx));
+    keepError(&err, clSetKernelArg(s->znccRows, 9, sizeof(cl_uint), &by));
+    keepError(&err, clSetKernelArg(s->znccRows, 12, sizeof(cl_uint), &subpixel));
+    if (err != CL_SUCCESS) {
+        fprintf(stderr, "Couldn't set znccRows arguments: code: %d\n", err);
+        goto failed;
+    }
+
+    /* In-order queue, launches reuse scratch one after another */
+    for (firstLine = band->first; firstLine < band->last; firstLine += chunk) {
+        lastLine = firstLine + chunk;
+        if (lastLine > band->last)
+            lastLine = band->last;
+        global = lastLine-firstLine;
+
+        err = clSetKernelArg(s->znccRows, 10, sizeof(cl_uint), &firstLine);
+        keepError(&err, clSetKernelArg(s->znccRows, 11, sizeof(cl_uint), &lastLine));
+        keepError(&err, clEnqueueNDRangeKernel(s->queue, s->znccRows, 1, NULL, &global,
+                                               NULL, 0, NULL, NULL));
+        if (err != CL_SUCCESS) {
+            fprintf(stderr, "Couldn't enqueue znccRows: code: %d\n", err);
+            goto failed;
+        }
+    }
+
+    err = readRows(s->queue, s->dmap1.mem, band->dmap1,
+                   sizeof(cl_uchar)*width, band->first, band->last);
+    keepError(&err, readRows(s->queue, s->dmap2.mem, band->dmap2,
+                             sizeof(cl_uchar)*width, band->first, band->last));
+    if (band->dmap1Sub != NULL)
+        keepError(&err, readRows(s->queue, s->dmap1Sub.mem, band->dmap1Sub,
+                                 sizeof(cl_ushort)*width, band->first, band->last));
+    keepError(&err, clFinish(s->queue));
+    if (err != CL_SUCCESS) {
+        fprintf(stderr, "Couldn't read hybrid band: code: %d\n", err);
+        goto failed;
+    }
+
+    time2 = doubleTime();
+    band->ms = (time2-time1)*1e3;
+    band->error = EXIT_SUCCESS;
+
+    return NULL;
+
+failed:
+    /* Nothing may touch host memory after the band is given back */
+    clFinish(s->queue);
+    return NULL;
+}
@@ -0,0 +1,51 @@
+#ifndef HYBRID_H
+#define HYBRID_H
+
+#include "disparity.h"
+
+/* OpenCL device sharing the full-resolution zncc of the native version:
+ * native threads match the upper scanlines and the device the lower ones.
+ * The split follows throughput measured on previous pairs. */
+struct session_hybrid;
+
+/* dev is 1 for cpu and 2 for gpu, as in device_ocl. NULL on failure. */
+struct session_hybrid *createSession_hybrid(int dev);
+
+void releaseSession_hybrid(struct session_hybrid *s);
+
+/* First scanline of the device's band, when scanlines [first, last) are
+ * matched. Device gets atleast one scanline and native threads too. */
+unsigned int hybridSplit(struct session_hybrid *s,
+                         unsigned int first, unsigned int last);
+
+/* Moves the split towards equal finishing times, from the scanlines each
+ * side matched and the time it took (ms). */
+void hybridBalance(struct session_hybrid *s,
+                   unsigned int linesNative, double msNative,
+                   unsigned int linesDevice, double msDevice);
+
+/* Scanlines [first, last) of a full-resolution zncc for the device.
+ * Images, displacements and dmaps are those of the whole depthmap, only the
+ * rows of the band are written. dmap1Sub may be NULL. */
+struct hybridBand {
+    struct session_hybrid *session;
+    const float *greyImage0;
+    const float *greyImage1;
+    const unsigned short *displacements;
+    unsigned int width, height, bx, by;
+    unsigned int first, last;
+    unsigned char *dmap1;
+    unsigned char *dmap2;
+    unsigned short *dmap1Sub;
+    subpixelMethod subpixel;
+
+    /* Set by hybridWorker */
+    int error;
+    double ms;
+};
+
+/* Thread function matching a struct hybridBand on the device. Sets error
+ * to EXIT_SUCCESS or EXIT_FAILURE and ms to the time taken. */
+void *hybridWorker(void *band);
+
+#endif
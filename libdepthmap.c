@@ -0,0 +1,763 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libdepthmap.h"
+#include "depthmap_opencl.h"
+#include "depthmap_opencl_amd.h"
+#include "hybrid.h"
+#include "doubleTime.h"
+
+struct depthmap {
+    struct depthmapConfig conf;
+
+    /* Only sessions of the selected version are created */
+    struct session_native *native;
+    struct session_hybrid *hybrid;
+    struct session_opencl_basic *basic;
+    struct session_opencl_amd *amd;
+    struct oclTrace *trace;
+
+    struct depthmapTimings timings;
+};
+
+struct depthmapFrame {
+    /* Native frame, or images and result of OpenCL versions */
+    struct frame_native *native;
+    unsigned char *img0;
+    unsigned char *img1;
+    unsigned int width;
+    unsigned int height;
+    void *result;
+    double ms;
+    /* Matching parameters of OpenCL versions */
+    unsigned int blockx;
+    unsigned int blocky;
+    unsigned int disp_limit;
+};
+
+struct depthmap *depthmapCreate(const struct depthmapConfig *conf) {
+
+    struct depthmap *dm;
+
+    if (conf->opencl > 4 || conf->hybrid > 2) {
+        fprintf(stderr, "Unknown OpenCL version or device!\n");
+        return NULL;
+    }
+    if (conf->hybrid != 0 && conf->opencl != 0) {
+        fprintf(stderr, "Hybrid mode shares the native version, not OpenCL!\n");
+        return NULL;
+    }
+
+    dm = calloc(1, sizeof(struct depthmap));
+    if (dm == NULL)
+        return NULL;
+    dm->conf = (*conf);
+    /* Name belongs to the caller */
+    dm->conf.traceName = NULL;
+
+    if (conf->opencl == 0) {
+        dm->native = createSession_native(conf->threads, conf->disableAsm,
+                                          !conf->verbose);
+        if (dm->native == NULL)
+            goto failed;
+        setTemporal_native(dm->native, conf->temporal);
+        if (conf->hybrid != 0) {
+            dm->hybrid = createSession_hybrid(conf->hybrid);
+            if (dm->hybrid == NULL)
+                goto failed;
+        }
+        return dm;
+    }
+
+    if (conf->traceName != NULL) {
+        dm->trace = traceOpen(conf->traceName);
+        if (dm->trace == NULL)
+            goto failed;
+    }
+    if (conf->opencl < 3) {
+        dm->basic = createSession_opencl_basic(conf->opencl);
+        if (dm->basic == NULL)
+            goto failed;
+        setTrace_opencl_basic(dm->basic, dm->trace);
+    }
+    else {
+        dm->amd = createSession_opencl_amd(conf->opencl-2);
+        if (dm->amd == NULL)
+            goto failed;
+        setTrace_opencl_amd(dm->amd, dm->trace);
+    }
+
+    return dm;
+
+failed:
+    depthmapDestroy(dm);
+    return NULL;
+}
+
+void *depthmapGenerate(struct depthmap *dm, unsigned char *img0,
+                       unsigned char *img1, unsigned int width,
+                       unsigned int height) {
+    return depthmapGenerateWith(dm, img0, img1, width, height, &dm->conf);
+}
+
+void *depthmapGenerateWith(struct depthmap *dm, unsigned char *img0,
+                           unsigned char *img1, unsigned int width,
+                           unsigned int height,
+                           const struct depthmapConfig *params) {
+
+    double time1, time2;
+    void *result;
+
+    if (dm->native != NULL) {
+        result = sessionDepthmap_native(dm->native, img0, img1, width, height,
+                                        params->blockx, params->blocky,
+                                        params->disp_limit, params->select,
+                                        params->format, params->subpixel,
+                                        params->factor, dm->hybrid);
+        dm->timings = (*sessionTimings_native(dm->native));
+        return result;
+    }
+
+    memset(&dm->timings, 0, sizeof(struct depthmapTimings));
+    time1 = doubleTime();
+    if (dm->basic != NULL)
+        result = sessionDepthmap_opencl_basic(dm->basic, img0, img1, width, height,
+                                              params->blockx, params->blocky,
+                                              params->disp_limit,
+                                              (searchMethod_ocl)params->select,
+                                              params->format, params->subpixel,
+                                              params->factor);
+    else
+        result = sessionDepthmap_opencl_amd(dm->amd, img0, img1, width, height,
+                                            params->blockx, params->blocky,
+                                            params->disp_limit,
+                                            (searchMethod_ocl)params->select,
+                                            params->format, params->subpixel,
+                                            params->factor);
+    time2 = doubleTime();
+    dm->timings.total = (time2-time1)*1000;
+
+    return result;
+}
+
+/* Window of the depthmap matched for rectangle roi, even-aligned like
+ * strips, so that the half-resolution pass of HIERARCHIC stays aligned with
+ * the whole depthmap. dw and dh are the depthmap's size. */
+static void roiWindow(const struct depthmapConfig *conf,
+                      const struct depthmapROI *roi, unsigned int dw,
+                      unsigned int dh, struct depthmapROI *window) {
+    unsigned int left, right, vertical, x0, y0, x1, y1;
+
+    /* Left-right check reaches the disparity limit both ways. With
+     * HIERARCHIC, ranges of those pixels come from half-resolution
+     * depthmaps, which reach another limit to the right, and up to the limit
+     * in half-resolution pixels to the left when a pixel had no match. */
+    left = conf->disp_limit + conf->blockx + 6;
+    right = conf->disp_limit + conf->blockx + 6;
+    if (conf->select == HIERARCHIC) {
+        left += 2*conf->disp_limit;
+        right += conf->disp_limit;
+    }
+    vertical = conf->blocky + 4;
+
+    x0 = (roi->x > left) ? roi->x - left : 0;
+    y0 = (roi->y > vertical) ? roi->y - vertical : 0;
+    x1 = roi->x + roi->width + right;
+    y1 = roi->y + roi->height + vertical;
+    x0 -= x0 % 2;
+    y0 -= y0 % 2;
+    x1 += x1 % 2;
+    y1 += y1 % 2;
+    if (x1 > dw)
+        x1 = dw;
+    if (y1 > dh)
+        y1 = dh;
+
+    window->x = x0;
+    window->y = y0;
+    window->width = x1-x0;
+    window->height = y1-y0;
+}
+
+/* Whether windows a and b share a pixel */
+static int windowsOverlap(const struct depthmapROI *a,
+                          const struct depthmapROI *b) {
+    return a->x < b->x + b->width && b->x < a->x + a->width
+           && a->y < b->y + b->height && b->y < a->y + a->height;
+}
+
+/* Windows of rois, stored to windows, with overlapping ones merged into
+ * their union and region i matched in windows[group[i]]. A union holds the
+ * windows of all its rectangles, so their depthmaps don't change. When the
+ * windows together are no smaller than the depthmap, the depthmap is matched
+ * whole once. Returns the number of windows. */
+static unsigned int roiWindows(const struct depthmapConfig *conf,
+                               const struct depthmapROI *rois,
+                               unsigned int roisN, unsigned int dw,
+                               unsigned int dh, struct depthmapROI *windows,
+                               unsigned int *group) {
+    struct depthmapROI *a, *b;
+    unsigned int windowsN, i, j, k, x1, y1;
+    size_t area;
+    int merged;
+
+    for (i = 0; i < roisN; i++) {
+        roiWindow(conf, &rois[i], dw, dh, &windows[i]);
+        group[i] = i;
+    }
+    windowsN = roisN;
+
+    /* A union may reach windows its parts didn't, so merge until none
+     * overlap */
+    do {
+        merged = 0;
+        for (i = 0; i < windowsN; i++) {
+            for (j = i+1; j < windowsN; j++) {
+                a = &windows[i];
+                b = &windows[j];
+                if (!windowsOverlap(a, b))
+                    continue;
+                x1 = (a->x + a->width > b->x + b->width) ? a->x + a->width
+                                                         : b->x + b->width;
+                y1 = (a->y + a->height > b->y + b->height) ? a->y + a->height
+                                                           : b->y + b->height;
+                a->x = (a->x < b->x) ? a->x : b->x;
+                a->y = (a->y < b->y) ? a->y : b->y;
+                a->width = x1 - a->x;
+                a->height = y1 - a->y;
+                /* The last window takes the place of j */
+                windowsN--;
+                windows[j] = windows[windowsN];
+                for (k = 0; k < roisN; k++) {
+                    if (group[k] == j)
+                        group[k] = i;
+                    else if (group[k] == windowsN)
+                        group[k] = j;
+                }
+                merged = 1;
+                j--;
+            }
+        }
+    } while (merged);
+
+    area = 0;
+    for (i = 0; i < windowsN; i++)
+        area += (size_t)windows[i].width*windows[i].height;
+    if (windowsN > 1 && area >= (size_t)dw*dh) {
+        windows[0].x = 0;
+        windows[0].y = 0;
+        windows[0].width = dw;
+        windows[0].height = dh;
+        for (k = 0; k < roisN; k++)
+            group[k] = 0;
+        windowsN = 1;
+    }
+
+    return windowsN;
+}
+
+/* Copies a window of a 32-bit image, in depthmap pixels, to a new image. */
+static unsigned char *cropImage(const unsigned char *img, unsigned int width,
+                                const struct depthmapROI *window,
+                                unsigned int factor) {
+    unsigned char *cropped;
+    size_t lineSize, cropSize;
+    unsigned int y;
+
+    lineSize = (size_t)width*4;
+    cropSize = (size_t)window->width*factor*4;
+    cropped = malloc(cropSize*window->height*factor);
+    if (cropped == NULL)
+        return NULL;
+
+    for (y = 0; y < window->height*factor; y++)
+        memcpy(cropped + y*cropSize,
+               img + (window->y*factor + y)*lineSize + window->x*factor*4,
+               cropSize);
+
+    return cropped;
+}
+
+/* Adds stage times of one window to the times of a depthmap */
+static void addTimings(struct depthmapTimings *sum,
+                       const struct depthmapTimings *t) {
+    sum->blend += t->blend;
+    sum->blend2x2 += t->blend2x2;
+    sum->znccHalf += t->znccHalf;
+    sum->limits += t->limits;
+    sum->zncc += t->zncc;
+    sum->post += t->post;
+    sum->total += t->total;
+    sum->temporal |= t->temporal;
+}
+
+void *depthmapGenerateROI(struct depthmap *dm, unsigned char *img0,
+                          unsigned char *img1, unsigned int width,
+                          unsigned int height, const struct depthmapROI *rois,
+                          unsigned int roisN, int crop,
+                          struct depthmapROI *bounds) {
+
+    const struct depthmapConfig *conf = &dm->conf;
+    struct depthmapTimings timings;
+    struct depthmapROI *windows, *window;
+    unsigned char *crop0, *crop1, *result, *part;
+    unsigned int dw, dh, i, w, windowsN, y, x1, y1, *group;
+    size_t elemSize;
+
+    dw = width/conf->factor;
+    dh = height/conf->factor;
+    if (roisN == 0 || width % conf->factor != 0 || height % conf->factor != 0) {
+        fprintf(stderr, "Regions of interest need a region and images "
+                        "divisible by %u!\n", conf->factor);
+        return NULL;
+    }
+
+    bounds->x = dw;
+    bounds->y = dh;
+    x1 = 0;
+    y1 = 0;
+    for (i = 0; i < roisN; i++) {
+        if (rois[i].width == 0 || rois[i].height == 0
+                || rois[i].x + rois[i].width > dw || rois[i].y + rois[i].height > dh) {
+            fprintf(stderr, "Region %u,%u %ux%u is outside of the %ux%u depthmap!\n",
+                    rois[i].x, rois[i].y, rois[i].width, rois[i].height, dw, dh);
+            return NULL;
+        }
+        if (rois[i].x < bounds->x)
+            bounds->x = rois[i].x;
+        if (rois[i].y < bounds->y)
+            bounds->y = rois[i].y;
+        if (rois[i].x + rois[i].width > x1)
+            x1 = rois[i].x + rois[i].width;
+        if (rois[i].y + rois[i].height > y1)
+            y1 = rois[i].y + rois[i].height;
+    }
+    if (!crop) {
+        bounds->x = 0;
+        bounds->y = 0;
+        x1 = dw;
+        y1 = dh;
+    }
+    bounds->width = x1 - bounds->x;
+    bounds->height = y1 - bounds->y;
+
+    elemSize = (conf->format == DISP_FIXED16) ? sizeof(unsigned short)
+                                              : sizeof(unsigned char);
+    result = calloc((size_t)bounds->width*bounds->height, elemSize);
+    windows = malloc(roisN*sizeof(struct depthmapROI));
+    group = malloc(roisN*sizeof(unsigned int));
+    if (result == NULL || windows == NULL || group == NULL) {
+        free(result);
+        free(windows);
+        free(group);
+        return NULL;
+    }
+    windowsN = roiWindows(conf, rois, roisN, dw, dh, windows, group);
+
+    /* Different windows are no consecutive frames */
+    if (windowsN > 1 && dm->native != NULL)
+        setTemporal_native(dm->native, 0);
+
+    memset(&timings, 0, sizeof(struct depthmapTimings));
+    for (w = 0; w < windowsN; w++) {
+        window = &windows[w];
+        if (conf->verbose) {
+            printf("Window %u,%u %ux%u matches region", window->x, window->y,
+                   window->width, window->height);
+            for (i = 0; i < roisN; i++)
+                if (group[i] == w)
+                    printf(" %u,%u %ux%u", rois[i].x, rois[i].y,
+                           rois[i].width, rois[i].height);
+            printf(".\n");
+        }
+
+        crop0 = cropImage(img0, width, window, conf->factor);
+        crop1 = cropImage(img1, width, window, conf->factor);
+        part = NULL;
+        if (crop0 != NULL && crop1 != NULL)
+            part = depthmapGenerateWith(dm, crop0, crop1, window->width*conf->factor,
+                                        window->height*conf->factor, conf);
+        free(crop0);
+        free(crop1);
+        if (part == NULL) {
+            free(result);
+            result = NULL;
+            break;
+        }
+        addTimings(&timings, &dm->timings);
+        /* Only the rectangles of the window's depthmap */
+        for (i = 0; i < roisN; i++) {
+            if (group[i] != w)
+                continue;
+            for (y = 0; y < rois[i].height; y++)
+                memcpy(result + ((rois[i].y - bounds->y + y)*bounds->width
+                                 + rois[i].x - bounds->x)*elemSize,
+                       part + ((rois[i].y - window->y + y)*window->width
+                               + rois[i].x - window->x)*elemSize,
+                       rois[i].width*elemSize);
+        }
+        free(part);
+    }
+    dm->timings = timings;
+
+    if (windowsN > 1 && dm->native != NULL)
+        setTemporal_native(dm->native, conf->temporal);
+
+    free(windows);
+    free(group);
+    return result;
+}
+
+/* Anytime depthmap of OpenCL versions from whole depthmaps of the session. */
+static void *anytimeOpenCL(struct depthmap *dm, unsigned char *img0,
+                           unsigned char *img1, unsigned int width,
+                           unsigned int height, double budget,
+                           unsigned int bands, anytimeFunc progress,
+                           void *data, unsigned char **mask) {
+
+    struct depthmapConfig params;
+    unsigned int dw, dh, x, y, hx, hy, halo, band, first, last, wFirst, wLast;
+    unsigned char *result, *refined, *coarse, *part;
+    size_t elemSize, lineSize;
+    double start, time1, time2, bandMs;
+    int cancel;
+
+    start = doubleTime();
+    params = dm->conf;
+    params.select = HIERARCHIC;
+    dw = width/params.factor;
+    dh = height/params.factor;
+    elemSize = (params.format == DISP_FIXED16) ? sizeof(unsigned short)
+                                               : sizeof(unsigned char);
+    lineSize = (size_t)width*4;
+    result = calloc((size_t)dw*dh, elemSize);
+    refined = calloc((size_t)dw*dh, 1);
+    if (result == NULL || refined == NULL)
+        goto failed;
+
+    /* Half the limit at half the resolution. 8-bit disparitys are rescaled
+     * by the limit, so only 16-bit ones are doubled. */
+    if (params.factor < 8) {
+        params.factor *= 2;
+        params.disp_limit /= 2;
+        coarse = depthmapGenerateWith(dm, img0, img1, width, height, &params);
+        params.factor /= 2;
+        params.disp_limit = dm->conf.disp_limit;
+    }
+    else
+        coarse = NULL;
+    /* Without a coarse depthmap bands are refined from zeros */
+    if (coarse != NULL) {
+        for (y = 0; y < dh; y++) {
+            hy = (y/2 < dh/2) ? y/2 : dh/2-1;
+            for (x = 0; x < dw; x++) {
+                hx = (x/2 < dw/2) ? x/2 : dw/2-1;
+                if (elemSize == 1)
+                    result[y*dw+x] = coarse[hy*(dw/2)+hx];
+                else
+                    ((unsigned short *)result)[y*dw+x] =
+                            ((unsigned short *)coarse)[hy*(dw/2)+hx]*2;
+            }
+        }
+        free(coarse);
+    }
+    cancel = (progress != NULL) ? progress(result, refined, dw, dh, data) : 0;
+
+    /* Same halos and even boundaries as strips */
+    halo = params.blocky + 4;
+    halo += halo % 2;
+    if (bands < 1)
+        bands = 1;
+    bandMs = 0.0;
+    for (band = 0; band < bands && !cancel; band++) {
+        time1 = doubleTime();
+        if (budget > 0.0 && (time1-start)*1000 + bandMs > budget)
+            break;
+
+        first = band*dh/bands;
+        first -= first % 2;
+        last = (band == bands-1) ? dh : (band+1)*dh/bands;
+        last -= last % 2;
+        if (band == bands-1)
+            last = dh;
+        if (first >= last)
+            continue;
+        wFirst = (first > halo) ? first - halo : 0;
+        wLast = (last + halo < dh) ? last + halo : dh;
+
+        part = depthmapGenerateWith(dm, img0 + wFirst*params.factor*lineSize,
+                                    img1 + wFirst*params.factor*lineSize, width,
+                                    (wLast-wFirst)*params.factor, &params);
+        if (part == NULL)
+            goto failed;
+        memcpy(result + first*dw*elemSize, part + (first-wFirst)*dw*elemSize,
+               (last-first)*dw*elemSize);
+        memset(refined + first*dw, 1, (last-first)*dw);
+        free(part);
+        time2 = doubleTime();
+        bandMs = (time2-time1)*1000;
+
+        if (progress != NULL)
+            cancel = progress(result, refined, dw, dh, data);
+    }
+
+    memset(&dm->timings, 0, sizeof(struct depthmapTimings));
+    dm->timings.total = (doubleTime()-start)*1000;
+    if (mask != NULL)
+        (*mask) = refined;
+    else
+        free(refined);
+
+    return result;
+
+failed:
+    free(result);
+    free(refined);
+    return NULL;
+}
+
+void *depthmapGenerateAnytime(struct depthmap *dm, unsigned char *img0,
+                              unsigned char *img1, unsigned int width,
+                              unsigned int height, double budget,
+                              unsigned int bands, anytimeFunc progress,
+                              void *data, unsigned char **mask) {
+
+    const struct depthmapConfig *conf = &dm->conf;
+    void *result;
+
+    if (dm->native == NULL)
+        return anytimeOpenCL(dm, img0, img1, width, height, budget, bands,
+                             progress, data, mask);
+
+    result = sessionAnytime_native(dm->native, img0, img1, width, height,
+                                   conf->blockx, conf->blocky, conf->disp_limit,
+                                   conf->format, conf->subpixel, conf->factor,
+                                   budget, bands, progress, data, mask);
+    dm->timings = (*sessionTimings_native(dm->native));
+
+    return result;
+}
+
+struct depthmapFrame *depthmapPrepare(struct depthmap *dm, unsigned char *img0,
+                                      unsigned char *img1, unsigned int width,
+                                      unsigned int height) {
+
+    const struct depthmapConfig *conf = &dm->conf;
+    struct depthmapFrame *frame;
+
+    frame = calloc(1, sizeof(struct depthmapFrame));
+    if (frame == NULL)
+        return NULL;
+
+    if (dm->native != NULL) {
+        /* Blending in the calling thread, matching of the previous frame
+         * has the instance's threads */
+        frame->native = framePyramid_native(dm->native, img0, img1, width, height,
+                                            conf->blockx, conf->blocky,
+                                            conf->disp_limit, conf->select,
+                                            conf->format, conf->subpixel,
+                                            conf->factor, 0);
+        if (frame->native == NULL) {
+            free(frame);
+            return NULL;
+        }
+        return frame;
+    }
+
+    frame->img0 = img0;
+    frame->img1 = img1;
+    frame->width = width;
+    frame->height = height;
+    frame->blockx = conf->blockx;
+    frame->blocky = conf->blocky;
+    frame->disp_limit = conf->disp_limit;
+
+    return frame;
+}
+
+struct depthmapFrame *depthmapFrameVariant(struct depthmap *dm,
+                                           const struct depthmapFrame *frame,
+                                           const struct depthmapConfig *params) {
+
+    struct depthmapFrame *variant;
+
+    variant = calloc(1, sizeof(struct depthmapFrame));
+    if (variant == NULL)
+        return NULL;
+
+    if (frame->native != NULL) {
+        variant->native = frameVariant_native(frame->native, params->blockx,
+                                              params->blocky, params->disp_limit);
+        if (variant->native == NULL) {
+            free(variant);
+            return NULL;
+        }
+        return variant;
+    }
+
+    variant->img0 = frame->img0;
+    variant->img1 = frame->img1;
+    variant->width = frame->width;
+    variant->height = frame->height;
+    variant->blockx = params->blockx;
+    variant->blocky = params->blocky;
+    variant->disp_limit = params->disp_limit;
+    (void)dm;
+
+    return variant;
+}
+
+int depthmapMatch(struct depthmap *dm, struct depthmapFrame *frame) {
+
+    const struct depthmapConfig *conf = &dm->conf;
+    double time1, time2;
+
+    if (dm->native != NULL)
+        return frameMatch_native(dm->native, frame->native, dm->hybrid);
+
+    time1 = doubleTime();
+    if (dm->basic != NULL)
+        frame->result = sessionDepthmap_opencl_basic(dm->basic, frame->img0,
+                                                      frame->img1, frame->width,
+                                                      frame->height, frame->blockx,
+                                                      frame->blocky, frame->disp_limit,
+                                                      (searchMethod_ocl)conf->select,
+                                                      conf->format, conf->subpixel,
+                                                      conf->factor);
+    else
+        frame->result = sessionDepthmap_opencl_amd(dm->amd, frame->img0,
+                                                   frame->img1, frame->width,
+                                                   frame->height, frame->blockx,
+                                                   frame->blocky, frame->disp_limit,
+                                                   (searchMethod_ocl)conf->select,
+                                                   conf->format, conf->subpixel,
+                                                   conf->factor);
+    time2 = doubleTime();
+    frame->ms = (time2-time1)*1000;
+
+    return (frame->result != NULL) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+void *depthmapFinish(struct depthmap *dm, struct depthmapFrame *frame) {
+
+    void *result;
+
+    if (frame->native != NULL) {
+        result = framePost_native(dm->native, frame->native, &dm->timings);
+        free(frame);
+        return result;
+    }
+
+    memset(&dm->timings, 0, sizeof(struct depthmapTimings));
+    dm->timings.total = frame->ms;
+    result = frame->result;
+    free(frame);
+
+    return result;
+}
+
+void depthmapFrameFree(struct depthmapFrame *frame) {
+
+    if (frame == NULL)
+        return;
+
+    frameFree_native(frame->native);
+    free(frame->result);
+    free(frame);
+}
+
+void *depthmapGenerateIntermediates(struct depthmap *dm, unsigned char *img0,
+                                    unsigned char *img1, unsigned int width,
+                                    unsigned int height,
+                                    struct depthmapIntermediates *inter) {
+
+    struct depthmapFrame *frame;
+    const float *grey0, *grey1;
+    const unsigned char *dmap1, *dmap2;
+    unsigned int w, h;
+    size_t pixels;
+    int error;
+
+    memset(inter, 0, sizeof(struct depthmapIntermediates));
+    inter->width = width/dm->conf.factor;
+    inter->height = height/dm->conf.factor;
+    pixels = (size_t)inter->width*inter->height;
+    inter->grey0 = malloc(sizeof(float)*pixels);
+    inter->grey1 = malloc(sizeof(float)*pixels);
+    inter->dmap1 = malloc(pixels);
+    inter->dmap2 = malloc(pixels);
+    frame = NULL;
+    if (inter->grey0 == NULL || inter->grey1 == NULL
+            || inter->dmap1 == NULL || inter->dmap2 == NULL)
+        goto failed;
+
+    frame = depthmapPrepare(dm, img0, img1, width, height);
+    if (frame == NULL)
+        goto failed;
+    /* Native greyscale images are freed by matching */
+    if (frame->native != NULL) {
+        frameIntermediates_native(frame->native, &w, &h, &grey0, &grey1,
+                                  &dmap1, &dmap2);
+        memcpy(inter->grey0, grey0, sizeof(float)*pixels);
+        memcpy(inter->grey1, grey1, sizeof(float)*pixels);
+    }
+    if (depthmapMatch(dm, frame) == EXIT_FAILURE)
+        goto failed;
+
+    if (frame->native != NULL) {
+        frameIntermediates_native(frame->native, &w, &h, &grey0, &grey1,
+                                  &dmap1, &dmap2);
+        memcpy(inter->dmap1, dmap1, pixels);
+        memcpy(inter->dmap2, dmap2, pixels);
+        error = EXIT_SUCCESS;
+    }
+    else if (dm->basic != NULL)
+        error = readIntermediates_opencl_basic(dm->basic, inter->width,
+                                               inter->height, inter->grey0,
+                                               inter->grey1, inter->dmap1,
+                                               inter->dmap2);
+    else
+        error = readIntermediates_opencl_amd(dm->amd, inter->width,
+                                             inter->height, inter->grey0,
+                                             inter->grey1, inter->dmap1,
+                                             inter->dmap2);
+    if (error == EXIT_FAILURE)
+        goto failed;
+
+    return depthmapFinish(dm, frame);
+
+failed:
+    depthmapFrameFree(frame);
+    depthmapIntermediatesFree(inter);
+    return NULL;
+}
+
+void depthmapIntermediatesFree(struct depthmapIntermediates *inter) {
+    free(inter->grey0);
+    free(inter->grey1);
+    free(inter->dmap1);
+    free(inter->dmap2);
+    inter->grey0 = NULL;
+    inter->grey1 = NULL;
+    inter->dmap1 = NULL;
+    inter->dmap2 = NULL;
+}
+
+const struct depthmapTimings *depthmapTimings(struct depthmap *dm) {
+    return &dm->timings;
+}
+
+void depthmapDestroy(struct depthmap *dm) {
+
+    if (dm == NULL)
+        return;
+
+    releaseSession_native(dm->native);
+    releaseSession_hybrid(dm->hybrid);
+    releaseSession_opencl_basic(dm->basic);
+    releaseSession_opencl_amd(dm->amd);
+    traceClose(dm->trace);
+
+    free(dm);
+}
@@ -0,0 +1,163 @@
+#ifndef LIBDEPTHMAP_H
+#define LIBDEPTHMAP_H
+
+#include "depthmap_c.h"
+
+/* Selections of a depthmap instance, fixed for its lifetime. */
+struct depthmapConfig {
+    unsigned int blockx;
+    unsigned int blocky;
+    unsigned int disp_limit;
+    searchMethod select;
+    dispFormat format;
+    subpixelMethod subpixel;
+    unsigned int factor;
+    /* OpenCL version as in -a (1-4), 0 for native */
+    unsigned int opencl;
+    /* OpenCL device sharing native matching (1 cpu, 2 gpu), 0 for none */
+    unsigned int hybrid;
+    /* Native threads, 0 for one per processor */
+    int threads;
+    int disableAsm;
+    /* Prints stage times of every native depthmap. OpenCL versions print
+     * theirs as before. */
+    int verbose;
+    /* Chrome trace of OpenCL commands, NULL for none */
+    const char *traceName;
+    /* Motion margin of the native temporal prior for video, 0 for none */
+    unsigned int temporal;
+};
+
+#define DEPTHMAP_CONFIG_DEFAULTS {9, 9, 65, HIERARCHIC, DISP_GREY8, \
+                                  SUBPIXEL_NONE, 4, 0, 0, 0, 0, 0, NULL, 0}
+
+/* Native or OpenCL pipeline with its own threads, kernels, buffers and
+ * timings. Instances share nothing: any number of them can generate
+ * depthmaps at the same time, each from one thread at a time. */
+struct depthmap;
+
+/* Starts threads or builds OpenCL programs of conf. NULL on failure. */
+struct depthmap *depthmapCreate(const struct depthmapConfig *conf);
+
+/* Depthmap of 2 32-bit stereo-images of width and height (mod factor).
+ * On success:
+ *  Returns 1/factor by 1/factor image of format, freed by the caller.
+ * On failure:
+ *  Returns NULL. */
+void *depthmapGenerate(struct depthmap *dm, unsigned char *img0,
+                       unsigned char *img1, unsigned int width,
+                       unsigned int height);
+
+/* Same as depthmapGenerate with matching parameters of params (blockx,
+ * blocky, disp_limit, select, format, subpixel and factor) instead of the
+ * instance's. Threads, devices and buffers of the instance are reused. */
+void *depthmapGenerateWith(struct depthmap *dm, unsigned char *img0,
+                           unsigned char *img1, unsigned int width,
+                           unsigned int height,
+                           const struct depthmapConfig *params);
+
+/* Rectangle of a depthmap, in its pixels (1/factor of the images) */
+struct depthmapROI {
+    unsigned int x;
+    unsigned int y;
+    unsigned int width;
+    unsigned int height;
+};
+
+/* Depthmap of only roisN rectangles of rois. Every rectangle is blended,
+ * cached and matched in a window of the images extended by halos, so that
+ * its depthmap is the same as in a whole depthmap: blocks, the
+ * half-resolution pass and post-processing reach by+4 scanlines up and
+ * down, and matching and the left-right check bx+6 pixels and the
+ * disparity limit sideways, with HIERARCHIC 3 limits to the left and 2 to
+ * the right.
+ * Overlapping windows are merged into their union, and when the windows
+ * together are no smaller than the depthmap, it's matched whole once, so
+ * work is proportional to the area of the windows, at most the depthmap's.
+ * With crop, the result covers the bounding box of the rectangles,
+ * otherwise the whole depthmap; pixels outside the rectangles are 0.
+ * Position and size of the result are stored to bounds. The temporal prior
+ * is kept only for a single window.
+ * Returns NULL on failure. */
+void *depthmapGenerateROI(struct depthmap *dm, unsigned char *img0,
+                          unsigned char *img1, unsigned int width,
+                          unsigned int height, const struct depthmapROI *rois,
+                          unsigned int roisN, int crop,
+                          struct depthmapROI *bounds);
+
+/* Anytime depthmap for deadlines, see sessionAnytime_native: a coarse
+ * depthmap is given to progress at once, then bands of scanlines are
+ * refined until all are done, progress cancels or the next band would end
+ * after budget ms (0 for no deadline). Native versions upsample the
+ * half-resolution pass of hierarchic search. OpenCL versions upsample a
+ * depthmap of twice the downscale factor (none with factor 8) and refine
+ * bands as strips with halos, so their commands can't be cancelled within
+ * a band. The mask of refined pixels is stored to mask unless it is NULL.
+ * Always uses hierarchic search, hybrid devices are not used. */
+void *depthmapGenerateAnytime(struct depthmap *dm, unsigned char *img0,
+                              unsigned char *img1, unsigned int width,
+                              unsigned int height, double budget,
+                              unsigned int bands, anytimeFunc progress,
+                              void *data, unsigned char **mask);
+
+/* depthmapGenerate in three stages, so that stages of consecutive pairs can
+ * overlap: depthmapPrepare blends images to greyscale pyramids,
+ * depthmapMatch matches them and depthmapFinish post-processes.
+ * depthmapMatch runs on the instance's threads one frame at a time; the
+ * other stages can run in other threads at the same time. OpenCL versions
+ * do all the work in depthmapMatch, so images must stay valid until it
+ * returns. */
+struct depthmapFrame;
+
+/* NULL on failure. */
+struct depthmapFrame *depthmapPrepare(struct depthmap *dm, unsigned char *img0,
+                                      unsigned char *img1, unsigned int width,
+                                      unsigned int height);
+
+/* Copy of a frame from depthmapPrepare, not yet matched, for blockx,
+ * blocky and disp_limit of params, so that a parameter sweep prepares the
+ * pair once. Native versions copy the greyscale pyramid; OpenCL versions
+ * share the images of frame, which must outlive the copy, and blend them
+ * again in depthmapMatch. NULL on failure. */
+struct depthmapFrame *depthmapFrameVariant(struct depthmap *dm,
+                                           const struct depthmapFrame *frame,
+                                           const struct depthmapConfig *params);
+
+/* Returns EXIT_SUCCESS or EXIT_FAILURE, frame is kept in both cases. */
+int depthmapMatch(struct depthmap *dm, struct depthmapFrame *frame);
+
+/* Returns the depthmap as depthmapGenerate does and frees frame. */
+void *depthmapFinish(struct depthmap *dm, struct depthmapFrame *frame);
+
+/* Frees a frame abandoned before depthmapFinish. */
+void depthmapFrameFree(struct depthmapFrame *frame);
+
+/* Intermediate results of a depthmap, for comparing versions: greyscale
+ * images and dmaps of the left (dmap1) and right (dmap2) image before
+ * post-processing, all width x height of the depthmap. */
+struct depthmapIntermediates {
+    unsigned int width;
+    unsigned int height;
+    float *grey0;
+    float *grey1;
+    unsigned char *dmap1;
+    unsigned char *dmap2;
+};
+
+/* Same as depthmapGenerate, and copies intermediate results to inter.
+ * OpenCL versions read them back from the device after the depthmap, with
+ * hierarchic search dmaps are those of the full-resolution pass. inter is
+ * freed with depthmapIntermediatesFree, on failure already freed. */
+void *depthmapGenerateIntermediates(struct depthmap *dm, unsigned char *img0,
+                                    unsigned char *img1, unsigned int width,
+                                    unsigned int height,
+                                    struct depthmapIntermediates *inter);
+
+void depthmapIntermediatesFree(struct depthmapIntermediates *inter);
+
+/* Times of the last depthmap. OpenCL versions set only the total. */
+const struct depthmapTimings *depthmapTimings(struct depthmap *dm);
+
+void depthmapDestroy(struct depthmap *dm);
+
+#endif
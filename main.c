@@ -1,24 +1,42 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
 #include <errno.h>
-#include <pthread.h>
 
 #include "lodepng.h"
-#include "depthmap_c.h"
-#include "depthmap_opencl.h"
-#include "depthmap_opencl_amd.h"
+#include "libdepthmap.h"
+#include "batch.h"
+#include "strip.h"
+#include "video.h"
+#include "server.h"
+#include "sweep.h"
+#include "output.h"
+#include "autotune.h"
 #include "doubleTime.h"
 
 #define DEF_THREADS 0
 #define DEF_DISABLE_ASM 0
+/* Upper limit for -R rectangles */
+#define MAX_ROIS 16
+/* Scanline bands refined by -A */
+#define ANYTIME_BANDS 8
 
-struct threadData {
-    unsigned int error;
-    unsigned char *image;
-    unsigned int w;
-    unsigned int h;
-    char *name;
+/* Command line selections passed to pair-processing callbacks */
+struct depthmapArgs {
+    struct depthmapConfig conf;
+    outputFormat outFormat;
+
+    /* Regions of interest, whole depthmap when roisN is 0 */
+    struct depthmapROI rois[MAX_ROIS];
+    unsigned int roisN;
+    int crop;
+
+    /* Anytime depthmaps within this many ms when > 0 */
+    double budget;
+
+    /* Created on first pair and reused for the rest */
+    struct depthmap *dm;
 };
 
 /* integer conversion with error checking */
@@ -37,15 +55,103 @@ int parse_int( const char *str, int *d_error ) {
     return i;
 }
 
-void *imageLoader(void *data) {
-    struct threadData *thData;
+/* Sub-pixel method by name. Returns EXIT_SUCCESS or EXIT_FAILURE. */
+int parse_subpixel(const char *str, subpixelMethod *method) {
+
+    if (strcmp(str, "none") == 0)
+        (*method) = SUBPIXEL_NONE;
+    else if (strcmp(str, "parabola") == 0)
+        (*method) = SUBPIXEL_PARABOLA;
+    else if (strcmp(str, "equiangular") == 0)
+        (*method) = SUBPIXEL_EQUIANGULAR;
+    else
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+/* Rectangle "x,y,w,h". Returns EXIT_SUCCESS or EXIT_FAILURE. */
+int parse_roi(const char *str, struct depthmapROI *roi) {
+    char tail;
+
+    if (sscanf(str, "%u,%u,%u,%u%c", &roi->x, &roi->y, &roi->width,
+               &roi->height, &tail) != 4)
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+/* Prints progress of an anytime depthmap, data is its start time. */
+int anytimeProgress(const void *depthmap, const unsigned char *mask,
+                    unsigned int width, unsigned int height, void *data) {
+    size_t i, refined;
+
+    refined = 0;
+    for (i = 0; i < (size_t)width*height; i++)
+        refined += mask[i];
+    printf("Anytime depthmap, %5.1f %% refined: %6.1lf ms.\n",
+           100.0*refined/((size_t)width*height),
+           (doubleTime()-(*(double *)data))*1000);
+    (void)depthmap;
+
+    return 0;
+}
+
+/* Generates depthmap for a decoded pair with selected backend. */
+int processPair(struct stereoPair *pair, void *data) {
+    struct depthmapArgs *args = (struct depthmapArgs *)data;
+
+    if (args->dm == NULL) {
+        args->conf.format = outputDispFormat(args->outFormat);
+        args->dm = depthmapCreate(&args->conf);
+        if (args->dm == NULL)
+            return EXIT_FAILURE;
+    }
+    if (args->budget > 0.0) {
+        double start = doubleTime();
 
-    thData = (struct threadData *)data;
-    thData->error = lodepng_decode32_file(&thData->image, &thData->w, &thData->h, thData->name);
-    if (thData->error) {
-        fprintf(stderr, "error %u: %s\n", thData->error, lodepng_error_text(thData->error));
+        pair->depthmap = depthmapGenerateAnytime(args->dm, pair->img0, pair->img1,
+                                                 pair->w, pair->h, args->budget,
+                                                 ANYTIME_BANDS, anytimeProgress,
+                                                 &start, NULL);
+        pair->dw = pair->w/args->conf.factor;
+        pair->dh = pair->h/args->conf.factor;
+        return (pair->depthmap != NULL) ? EXIT_SUCCESS : EXIT_FAILURE;
     }
-    return NULL;
+    if (args->roisN > 0) {
+        struct depthmapROI bounds;
+
+        pair->depthmap = depthmapGenerateROI(args->dm, pair->img0, pair->img1,
+                                             pair->w, pair->h, args->rois,
+                                             args->roisN, args->crop, &bounds);
+        pair->dw = bounds.width;
+        pair->dh = bounds.height;
+        return (pair->depthmap != NULL) ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+    pair->depthmap = depthmapGenerate(args->dm, pair->img0, pair->img1,
+                                      pair->w, pair->h);
+
+    if (pair->depthmap == NULL)
+        return EXIT_FAILURE;
+
+    pair->dw = pair->w/args->conf.factor;
+    pair->dh = pair->h/args->conf.factor;
+
+    return EXIT_SUCCESS;
+}
+
+/* Releases the depthmap instance created by processPair. */
+void releaseSessions(struct depthmapArgs *args) {
+    depthmapDestroy(args->dm);
+    args->dm = NULL;
+}
+
+/* Encodes depthmap of a pair to its output file. */
+int savePair(struct stereoPair *pair, void *data) {
+    struct depthmapArgs *args = (struct depthmapArgs *)data;
+
+    return writeDepthmap(pair->outName, pair->depthmap,
+                         pair->dw, pair->dh, args->outFormat);
 }
 
 int main(int argc, char *argv[])
@@ -53,71 +159,182 @@ int main(int argc, char *argv[])
     int error;
     double time1, time2, timeTotal1, timeTotal2;
     char c;
-    int blockx, blocky, disp_limit, threads, disableAsm;
-    unsigned int setOpencl;
-    searchMethod select;
+    char *batchSource, *videoSource, *socketPath, *stripSource, *outName;
+    char defaultName[32];
+    int stripRows, autotune, margin, workers;
+    struct depthmapArgs args;
+    struct depthmapConfig defaults = DEPTHMAP_CONFIG_DEFAULTS;
+    struct sweepList sweepX, sweepY, sweepD;
+    int sweep, i;
 
     /* defaults */
-    threads = DEF_THREADS;
-    disableAsm = DEF_DISABLE_ASM;
-    blockx = 9;
-    blocky = 9;
-    disp_limit = 65;
-    select = HIERARCHIC;
-    setOpencl = 0;
+    args.conf = defaults;
+    args.conf.threads = DEF_THREADS;
+    args.conf.disableAsm = DEF_DISABLE_ASM;
+    args.conf.verbose = 1;
+    args.outFormat = OUT_PNG8;
+    args.roisN = 0;
+    args.crop = 0;
+    args.budget = 0.0;
+    args.dm = NULL;
+    batchSource = NULL;
+    videoSource = NULL;
+    socketPath = NULL;
+    stripSource = NULL;
+    workers = 1;
+    outName = NULL;
+    stripRows = 0;
+    autotune = 0;
+
+    sweepX.n = 0;
+    sweepY.n = 0;
+    sweepD.n = 0;
 
     /* Parse command line */
     while (1) {
-        c = getopt(argc, argv, "x:y:d:bt:sa:");
+        c = getopt(argc, argv, "x:y:d:bt:sa:B:o:f:u:r:S:I:TH:P:V:M:D:j:R:cA:");
         if (c == -1)
             break;
         switch (c) {
         case 'x':
-            blockx = parse_int(optarg, &error);
-            if (error == EXIT_FAILURE) {
+            if (parseSweepList(optarg, &sweepX) == EXIT_FAILURE) {
                 fprintf(stderr, "Error parsing x!\n");
                 return EXIT_FAILURE;
             }
+            args.conf.blockx = sweepX.values[0];
             break;
         case 'y':
-            blocky = parse_int(optarg, &error);
-            if (error == EXIT_FAILURE) {
+            if (parseSweepList(optarg, &sweepY) == EXIT_FAILURE) {
                 fprintf(stderr, "Error parsing y!\n");
                 return EXIT_FAILURE;
             }
+            args.conf.blocky = sweepY.values[0];
             break;
         case 'd':
-            disp_limit = parse_int(optarg, &error);
-            if (error == EXIT_FAILURE) {
+            if (parseSweepList(optarg, &sweepD) == EXIT_FAILURE) {
                 fprintf(stderr, "Error parsing disparity limit!\n");
                 return EXIT_FAILURE;
             }
+            args.conf.disp_limit = sweepD.values[0];
             break;
         case 'b':
-            select = BRUTE;
+            args.conf.select = BRUTE;
             break;
         case 't':
-            threads = parse_int(optarg, &error);
+            args.conf.threads = parse_int(optarg, &error);
             if (error == EXIT_FAILURE) {
                 fprintf(stderr, "Error parsing number of threads!\n");
                 return EXIT_FAILURE;
             }
             break;
         case 's':
-            disableAsm = 1;
+            args.conf.disableAsm = 1;
             break;
         case 'a':
-            setOpencl = parse_int(optarg, &error);
-            if (error == EXIT_FAILURE || setOpencl > 4) {
+            args.conf.opencl = parse_int(optarg, &error);
+            if (error == EXIT_FAILURE || args.conf.opencl > 4) {
                 fprintf(stderr, "Error parsing OpenCL argument!\n");
                 return EXIT_FAILURE;
             }
             break;
+        case 'B':
+            batchSource = optarg;
+            break;
+        case 'o':
+            outName = optarg;
+            break;
+        case 'f':
+            if (parseOutputFormat(optarg, &args.outFormat) == EXIT_FAILURE) {
+                fprintf(stderr, "Unknown output format!\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'u':
+            if (parse_subpixel(optarg, &args.conf.subpixel) == EXIT_FAILURE) {
+                fprintf(stderr, "Unknown sub-pixel method!\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'r':
+            args.conf.factor = parse_int(optarg, &error);
+            if (error == EXIT_FAILURE
+                    || (args.conf.factor != 1 && args.conf.factor != 2
+                        && args.conf.factor != 4 && args.conf.factor != 8)) {
+                fprintf(stderr, "Downscale factor must be 1, 2, 4 or 8!\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'S':
+            stripRows = parse_int(optarg, &error);
+            if (error == EXIT_FAILURE || stripRows < 1) {
+                fprintf(stderr, "Error parsing strip height!\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'I':
+            stripSource = optarg;
+            break;
+        case 'T':
+            autotune = 1;
+            break;
+        case 'H':
+            args.conf.hybrid = parse_int(optarg, &error);
+            if (error == EXIT_FAILURE || args.conf.hybrid < 1 || args.conf.hybrid > 2) {
+                fprintf(stderr, "Error parsing hybrid device!\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'P':
+            args.conf.traceName = optarg;
+            break;
+        case 'V':
+            videoSource = optarg;
+            break;
+        case 'M':
+            margin = parse_int(optarg, &error);
+            if (error == EXIT_FAILURE || margin < 1) {
+                fprintf(stderr, "Error parsing motion margin!\n");
+                return EXIT_FAILURE;
+            }
+            args.conf.temporal = margin;
+            break;
+        case 'D':
+            socketPath = optarg;
+            break;
+        case 'j':
+            workers = parse_int(optarg, &error);
+            if (error == EXIT_FAILURE || workers < 1 || workers > SERVER_MAX_WORKERS) {
+                fprintf(stderr, "Workers must be 1-%d!\n", SERVER_MAX_WORKERS);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'R':
+            if (args.roisN == MAX_ROIS
+                    || parse_roi(optarg, &args.rois[args.roisN]) == EXIT_FAILURE) {
+                fprintf(stderr, "Expected at most %d regions of <x>,<y>,<w>,<h>!\n",
+                        MAX_ROIS);
+                return EXIT_FAILURE;
+            }
+            args.roisN++;
+            break;
+        case 'c':
+            args.crop = 1;
+            break;
+        case 'A':
+            args.budget = parse_int(optarg, &error);
+            if (error == EXIT_FAILURE || args.budget < 1) {
+                fprintf(stderr, "Error parsing time budget!\n");
+                return EXIT_FAILURE;
+            }
+            break;
         default:
             printf("Options:\n"
                    "-x <>   set blocksize in x-direction\n"
                    "-y <>   set blocksize in y-direction\n"
                    "-d <>   set maximum distance to search matches\n"
+                   "        comma-separated lists of -x, -y and -d sweep every\n"
+                   "        combination, saving <output>_x<>_y<>_d<> and timings\n"
+                   "        to <output>_sweep.csv\n"
                    "-b      toggle bruteforcing depthmaps\n"
                    "-t <>   set number of threads\n"
                    "-s      toggle to disable assembly-code\n"
@@ -125,75 +342,206 @@ int main(int argc, char *argv[])
                    "        1: basic cpu\n"
                    "        2: basic gpu\n"
                    "        3: Amd optimized (cpu as a device)\n"
-                   "        4: Amd optimized\n");
+                   "        4: Amd optimized\n"
+                   "-B <>   batch mode, process pairs from a list-file or directory\n"
+                   "        list-file lines: left right [output]\n"
+                   "        directory: subdirectories with im0.png and im1.png\n"
+                   "-o <>   output file, - for standard output\n"
+                   "-f <>   output format\n"
+                   "        png8:  8-bit png, rescaled disparitys (default)\n"
+                   "        png16: 16-bit png, disparity*%d\n"
+                   "        pfm:   float disparitys\n"
+                   "        raw:   16-bit values as in png16, no header\n"
+                   "-u <>   sub-pixel refinement, with png16, pfm and raw\n"
+                   "        none, parabola or equiangular\n"
+                   "-r <>   downscale factor of input images, 1, 2, 4 (default) or 8\n"
+                   "-S <>   process in strips of given height (depthmap scanlines)\n"
+                   "-I <>   raw:<w>x<h>:<file>: 32-bit left and right image for -S,\n"
+                   "        read strip by strip instead of decoding im0.png and im1.png\n"
+                   "-T      autotune launch parameters of the -a version on this device\n"
+                   "-H <>   share native matching with an opencl device\n"
+                   "        1: cpu, 2: gpu\n"
+                   "-P <>   write a chrome trace (json) of -a version's commands\n"
+                   "-V <>   video mode, pipelined over consecutive frame pairs\n"
+                   "        left_%%05d.png,right_%%05d.png: numbered png files\n"
+                   "        raw:<w>x<h>:<file>: 32-bit left and right frames, - for stdin\n"
+                   "        -o takes a pattern with the frame number, - for stdout\n"
+                   "-M <>   temporal prior: disparity-ranges from the previous frame,\n"
+                   "        widened by given margin, instead of the half-resolution pass\n"
+                   "-D <>   daemon mode, serve depthmap_client requests on a unix socket\n"
+                   "-j <>   concurrent requests of the daemon, default 1\n"
+                   "-R <>   match only region x,y,w,h of the depthmap (its pixels),\n"
+                   "        can be given %d times, rest of the depthmap is 0\n"
+                   "-c      save only the bounding box of the -R regions\n"
+                   "-A <>   anytime depthmap within given ms: upsampled half-resolution\n"
+                   "        depthmap, refined in %d bands of scanlines while time is left\n",
+                   DISP_SUBPIXEL_SCALE, MAX_ROIS, ANYTIME_BANDS);
             return EXIT_FAILURE;
             break;
         }
     }
-    if ((DEF_DISABLE_ASM != disableAsm || DEF_THREADS != threads) && setOpencl > 0)
+    if ((DEF_DISABLE_ASM != args.conf.disableAsm || DEF_THREADS != args.conf.threads)
+            && args.conf.opencl > 0)
         printf("Arguments used, that have no effect with OpenCL.\n");
+    if (args.conf.temporal > 0
+            && (args.conf.opencl > 0 || args.conf.select != HIERARCHIC))
+        printf("Temporal prior has effect only with native hierarchic search.\n");
+    if (args.conf.traceName != NULL && args.conf.opencl == 0)
+        printf("Tracing has no effect without OpenCL.\n");
+    if (args.conf.hybrid != 0 && args.conf.opencl > 0) {
+        fprintf(stderr, "Hybrid mode shares the native version, not -a!\n");
+        return EXIT_FAILURE;
+    }
+    if (args.conf.subpixel != SUBPIXEL_NONE
+            && outputDispFormat(args.outFormat) != DISP_FIXED16)
+        printf("Sub-pixel refinement has no effect with 8-bit output.\n");
+
+    /* Parameters not listed are swept over their single value */
+    sweep = (sweepX.n > 1 || sweepY.n > 1 || sweepD.n > 1);
+    sweepX.values[0] = args.conf.blockx;
+    sweepY.values[0] = args.conf.blocky;
+    sweepD.values[0] = args.conf.disp_limit;
+    sweepX.n += (sweepX.n == 0);
+    sweepY.n += (sweepY.n == 0);
+    sweepD.n += (sweepD.n == 0);
+    if (sweep && (batchSource != NULL || videoSource != NULL || socketPath != NULL
+                  || stripRows > 0 || args.roisN > 0 || args.budget > 0.0 || autotune
+                  || (outName != NULL && strcmp(outName, "-") == 0))) {
+        fprintf(stderr, "Parameter sweeps are for single pairs saved to files!\n");
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < sweepD.n; i++) {
+        if (sweepD.values[i] > DISP_LIMIT_MAX) {
+            fprintf(stderr, "Disparity-limit must be 1-%d!\n", DISP_LIMIT_MAX);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (args.budget > 0.0) {
+        if (args.roisN > 0 || videoSource != NULL || socketPath != NULL || stripRows > 0) {
+            fprintf(stderr, "Anytime depthmaps are for single pairs and batches!\n");
+            return EXIT_FAILURE;
+        }
+        if (args.conf.select != HIERARCHIC || args.conf.hybrid != 0)
+            printf("Anytime depthmaps use hierarchic search without hybrid device.\n");
+    }
+    if (stripSource != NULL && stripRows == 0) {
+        fprintf(stderr, "Raw input pair is read strip by strip, it needs -S!\n");
+        return EXIT_FAILURE;
+    }
+    if (args.crop && args.roisN == 0)
+        printf("Cropping has no effect without regions of interest.\n");
+    if (args.roisN > 0 && (videoSource != NULL || socketPath != NULL || stripRows > 0)) {
+        fprintf(stderr, "Regions of interest are for single pairs and batches!\n");
+        return EXIT_FAILURE;
+    }
+
+    if (autotune)
+        return autotune_opencl(args.conf.opencl, args.conf.blockx,
+                               args.conf.blocky, args.conf.disp_limit,
+                               (searchMethod_ocl)args.conf.select, args.conf.factor);
+
+    if (socketPath != NULL) {
+        if (batchSource != NULL || videoSource != NULL || stripRows > 0) {
+            fprintf(stderr, "Daemon mode does not combine with batches, video or strips!\n");
+            return EXIT_FAILURE;
+        }
+        args.conf.format = outputDispFormat(args.outFormat);
+        return runServer(socketPath, &args.conf, workers);
+    }
+
+    /* Depthmap data goes to stdout, informative prints to stderr */
+    if (outName != NULL && strcmp(outName, "-") == 0)
+        reserveStdout();
 
     timeTotal1 = doubleTime();
 
+    if (videoSource != NULL) {
+        if (batchSource != NULL || stripRows > 0) {
+            fprintf(stderr, "Video mode does not combine with batches or strips!\n");
+            return EXIT_FAILURE;
+        }
+        error = runVideo(videoSource, outName, args.outFormat, &args.conf);
+
+        timeTotal2 = doubleTime();
+        printf("Program total time: %.3lf seconds.\n", timeTotal2-timeTotal1);
+        return error;
+    }
+
+    if (batchSource != NULL) {
+        if (stripRows > 0) {
+            fprintf(stderr, "Strips are not supported in batch mode!\n");
+            return EXIT_FAILURE;
+        }
+        error = runBatch(batchSource, outputExtension(args.outFormat),
+                         processPair, savePair, &args);
+        releaseSessions(&args);
+
+        timeTotal2 = doubleTime();
+        printf("Program total time: %.3lf seconds.\n", timeTotal2-timeTotal1);
+        return error;
+    }
+
+    if (stripSource != NULL) {
+        sprintf(defaultName, "depth01p%s", outputExtension(args.outFormat));
+        error = runStripsRaw(stripSource, (outName != NULL) ? outName : defaultName,
+                             stripRows, args.conf.blocky+4, args.conf.factor,
+                             args.outFormat, processPair, &args);
+        releaseSessions(&args);
+
+        timeTotal2 = doubleTime();
+        printf("Program total time: %.3lf seconds.\n", timeTotal2-timeTotal1);
+        return error;
+    }
+
     time1 = doubleTime();
 
     /* Load images */
-    struct threadData thread0, thread1;
-    pthread_t helperThread;
-
-    thread0.name = "im0.png";
-    thread1.name = "im1.png";
-    /* Launch thread to decode another image */
-    pthread_create(&helperThread, NULL, imageLoader, (void *)&thread1);
-    /* Decode image also in mainthread. */
-    imageLoader((void *)&thread0);
-
-    /* Wait thread to finish before proceeding. */
-    pthread_join(helperThread, NULL);
-    if (thread0.error || thread1.error)
-        return EXIT_FAILURE;
+    struct stereoPair pair;
 
-    if ((thread0.w != thread1.w) || (thread0.h != thread1.h)) {
-        fprintf(stderr, "Image dimensions did not match!\n");
-        free(thread0.image);
-        free(thread1.image);
+    pair.name0 = "im0.png";
+    pair.name1 = "im1.png";
+    sprintf(defaultName, "depth01p%s", outputExtension(args.outFormat));
+    pair.outName = (outName != NULL) ? outName : defaultName;
+    if (loadPair(&pair) == EXIT_FAILURE)
         return EXIT_FAILURE;
-    }
+
     time2 = doubleTime();
     printf("Image decoding time: %.3lf seconds.\n", time2-time1);
 
-    unsigned char *finalDepthmap;
-    if (setOpencl != 0) {
-        if (setOpencl < 3)
-            finalDepthmap = generateDepthmap_opencl_basic(thread0.image, thread1.image,
-                                                      thread0.w, thread0.h,
-                                                      blockx, blocky,
-                                                      disp_limit, select, setOpencl);
-        else
-            finalDepthmap = generateDepthmap_opencl_amd(thread0.image, thread1.image,
-                                                      thread0.w, thread0.h,
-                                                      blockx, blocky,
-                                                      disp_limit, select, setOpencl-2);
+    if (sweep) {
+        error = runSweep(&pair, &sweepX, &sweepY, &sweepD, pair.outName,
+                         args.outFormat, &args.conf);
+
+        timeTotal2 = doubleTime();
+        printf("Program total time: %.3lf seconds.\n", timeTotal2-timeTotal1);
+        return error;
     }
-    else
-        finalDepthmap = generateDepthmap(thread0.image, thread1.image,
-                                         thread0.w, thread0.h,
-                                         blockx, blocky,
-                                         disp_limit, select, threads, disableAsm);
 
-    if (finalDepthmap == NULL) {
+    if (stripRows > 0) {
+        /* Block-matching leaves by/2 edge scanlines unmatched, half-resolution
+         * pass of hierarchic search twice that, and 2 filling passes of
+         * post-processing reach 2 scanlines further. */
+        error = runStrips(&pair, stripRows, args.conf.blocky+4, args.conf.factor,
+                          args.outFormat, processPair, &args);
+        releaseSessions(&args);
+
+        timeTotal2 = doubleTime();
+        printf("Program total time: %.3lf seconds.\n", timeTotal2-timeTotal1);
+        return error;
+    }
+
+    error = processPair(&pair, &args);
+    releaseSessions(&args);
+    if (error == EXIT_FAILURE) {
         fprintf(stderr, "GenerateDepthmap failed!\n");
         return EXIT_FAILURE;
     }
-    error = lodepng_encode_file("depth01p.png", finalDepthmap,
-                                thread0.w/4, thread0.h/4, LCT_GREY, 8);
-    if (error) {
-        fprintf(stderr, "error %u: %s\n", error, lodepng_error_text(error));
-    }
+    error = savePair(&pair, &args);
 
     timeTotal2 = doubleTime();
 
     printf("Program total time: %.3lf seconds.\n", timeTotal2-timeTotal1);
 
-    return EXIT_SUCCESS;
+    return error;
 }
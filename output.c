@@ -0,0 +1,279 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "lodepng.h"
+#include "output.h"
+
+/* Where depthmaps named "-" are written */
+static int dataFd = STDOUT_FILENO;
+
+int parseOutputFormat(const char *str, outputFormat *format) {
+
+    if (strcmp(str, "png8") == 0)
+        (*format) = OUT_PNG8;
+    else if (strcmp(str, "png16") == 0)
+        (*format) = OUT_PNG16;
+    else if (strcmp(str, "pfm") == 0)
+        (*format) = OUT_PFM;
+    else if (strcmp(str, "raw") == 0)
+        (*format) = OUT_RAW;
+    else
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+const char *outputExtension(outputFormat format) {
+    switch (format) {
+    case OUT_PFM:
+        return ".pfm";
+    case OUT_RAW:
+        return ".raw";
+    default:
+        return ".png";
+    }
+}
+
+dispFormat outputDispFormat(outputFormat format) {
+    return (format == OUT_PNG8) ? DISP_GREY8 : DISP_FIXED16;
+}
+
+void reserveStdout(void) {
+    fflush(stdout);
+    dataFd = dup(STDOUT_FILENO);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+}
+
+/* Writes whole buffer to a file descriptor. */
+static int writeFd(int fd, const unsigned char *data, size_t size) {
+
+    while (size > 0) {
+        ssize_t ret = write(fd, data, size);
+        if (ret <= 0) {
+            perror("Couldn't write depthmap");
+            return EXIT_FAILURE;
+        }
+        data += ret;
+        size -= ret;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Writes a buffer to a file or to reserved standard output. */
+static int writeData(const char *filename, const unsigned char *data, size_t size) {
+    FILE *handle;
+    size_t written;
+
+    if (strcmp(filename, "-") == 0)
+        return writeFd(dataFd, data, size);
+
+    handle = fopen(filename, "wb");
+    if (handle == NULL) {
+        perror("Couldn't open output file");
+        return EXIT_FAILURE;
+    }
+    written = fwrite(data, 1, size, handle);
+    fclose(handle);
+    if (written != size) {
+        fprintf(stderr, "Writing %s failed!\n", filename);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+/* Pfm-header to buffer. Returns its length. */
+static size_t pfmHeader(char *header, unsigned int w, unsigned int h) {
+    const unsigned int one = 1;
+
+    return sprintf(header, "Pf\n%u %u\n%s\n", w, h,
+                   (*(const unsigned char *)&one == 1) ? "-1.0" : "1.0");
+}
+
+/* Converts one scanline of fixed-point disparitys to pfm floats. */
+static void pfmRow(float *row, const unsigned short *disp, unsigned int w) {
+    unsigned int x;
+
+    for (x = 0; x < w; x++) {
+        if (disp[x] == 0)
+            row[x] = INFINITY;
+        else
+            row[x] = disp[x] / (float)DISP_SUBPIXEL_SCALE;
+    }
+}
+
+/* Portable float map. Scanlines go from bottom to top, negative scale marks
+ * little-endian data. */
+static int writePfm(const char *filename, unsigned short *disp,
+                    unsigned int w, unsigned int h) {
+    char header[64];
+    unsigned char *data;
+    size_t headerSize, size;
+    unsigned int y;
+    int error;
+
+    headerSize = pfmHeader(header, w, h);
+    size = headerSize + sizeof(float)*w*h;
+    data = malloc(size);
+    if (data == NULL) {
+        fprintf(stderr, "Memory allocation failed!\n");
+        return EXIT_FAILURE;
+    }
+    memcpy(data, header, headerSize);
+
+    for (y = 0; y < h; y++)
+        pfmRow((float *)(data + headerSize) + (h-1-y)*w, disp + y*w, w);
+    error = writeData(filename, data, size);
+    free(data);
+
+    return error;
+}
+
+int writeDepthmap(const char *filename, void *depthmap,
+                  unsigned int w, unsigned int h, outputFormat format) {
+    unsigned char *png, *bigEndian;
+    unsigned short *disp;
+    size_t pngSize;
+    unsigned int error, i;
+
+    switch (format) {
+    case OUT_PFM:
+        return writePfm(filename, depthmap, w, h);
+    case OUT_RAW:
+        return writeData(filename, depthmap, sizeof(unsigned short)*w*h);
+    case OUT_PNG16:
+        /* Png stores 16-bit samples in big-endian order */
+        disp = (unsigned short *)depthmap;
+        bigEndian = malloc(sizeof(unsigned short)*w*h);
+        if (bigEndian == NULL) {
+            fprintf(stderr, "Memory allocation failed!\n");
+            return EXIT_FAILURE;
+        }
+        for (i = 0; i < w*h; i++) {
+            bigEndian[2*i] = disp[i] >> 8;
+            bigEndian[2*i+1] = disp[i] & 0xff;
+        }
+        error = lodepng_encode_memory(&png, &pngSize, bigEndian, w, h, LCT_GREY, 16);
+        free(bigEndian);
+        break;
+    default:
+        error = lodepng_encode_memory(&png, &pngSize, depthmap, w, h, LCT_GREY, 8);
+        break;
+    }
+    if (error) {
+        fprintf(stderr, "error %u: %s\n", error, lodepng_error_text(error));
+        return EXIT_FAILURE;
+    }
+    error = writeData(filename, png, pngSize);
+    free(png);
+
+    return error;
+}
+
+int depthmapWriterBottomUp(outputFormat format) {
+    return format == OUT_PFM;
+}
+
+int depthmapWriterOpen(struct depthmapWriter *writer, const char *filename,
+                       unsigned int w, unsigned int h, outputFormat format) {
+    char header[64];
+    size_t size;
+
+    writer->filename = filename;
+    writer->format = format;
+    writer->w = w;
+    writer->h = h;
+    writer->rows = 0;
+    writer->fd = -1;
+    writer->image = NULL;
+    writer->elemSize = (outputDispFormat(format) == DISP_FIXED16) ?
+                       sizeof(unsigned short) : sizeof(unsigned char);
+
+    /* Png-encoder needs the whole image */
+    if (format == OUT_PNG8 || format == OUT_PNG16) {
+        writer->image = malloc(writer->elemSize*w*h);
+        if (writer->image == NULL) {
+            fprintf(stderr, "Memory allocation failed!\n");
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (strcmp(filename, "-") == 0) {
+        writer->fd = dataFd;
+    }
+    else {
+        writer->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (writer->fd < 0) {
+            perror("Couldn't open output file");
+            return EXIT_FAILURE;
+        }
+    }
+    if (format == OUT_PFM) {
+        size = pfmHeader(header, w, h);
+        return writeFd(writer->fd, (unsigned char *)header, size);
+    }
+    return EXIT_SUCCESS;
+}
+
+int depthmapWriterRows(struct depthmapWriter *writer, void *rows, unsigned int n) {
+    unsigned int y;
+    float *converted;
+    int error;
+
+    if (writer->rows + n > writer->h) {
+        fprintf(stderr, "Too many rows written to %s!\n", writer->filename);
+        return EXIT_FAILURE;
+    }
+
+    if (writer->image != NULL) {
+        memcpy(writer->image + (size_t)writer->rows*writer->w*writer->elemSize,
+               rows, (size_t)n*writer->w*writer->elemSize);
+        writer->rows += n;
+        return EXIT_SUCCESS;
+    }
+    writer->rows += n;
+
+    if (writer->format != OUT_PFM)
+        return writeFd(writer->fd, rows, (size_t)n*writer->w*writer->elemSize);
+
+    /* Strips arrive bottom first, scanlines of a strip are reversed here. */
+    converted = malloc(sizeof(float)*writer->w);
+    if (converted == NULL) {
+        fprintf(stderr, "Memory allocation failed!\n");
+        return EXIT_FAILURE;
+    }
+    error = EXIT_SUCCESS;
+    for (y = n; y > 0 && error == EXIT_SUCCESS; y--) {
+        pfmRow(converted, (unsigned short *)rows + (size_t)(y-1)*writer->w, writer->w);
+        error = writeFd(writer->fd, (unsigned char *)converted,
+                        sizeof(float)*writer->w);
+    }
+    free(converted);
+
+    return error;
+}
+
+int depthmapWriterClose(struct depthmapWriter *writer) {
+    int error = EXIT_SUCCESS;
+
+    if (writer->image != NULL) {
+        if (writer->rows == writer->h)
+            error = writeDepthmap(writer->filename, writer->image,
+                                  writer->w, writer->h, writer->format);
+        free(writer->image);
+        writer->image = NULL;
+    }
+    if (writer->fd >= 0 && writer->fd != dataFd)
+        close(writer->fd);
+    writer->fd = -1;
+
+    if (writer->rows != writer->h) {
+        fprintf(stderr, "Depthmap %s is incomplete!\n", writer->filename);
+        error = EXIT_FAILURE;
+    }
+    return error;
+}
@@ -0,0 +1,61 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include "disparity.h"
+
+/* File formats for depthmaps.
+ *  OUT_PNG8:  8-bit greyscale png, rescaled disparitys
+ *  OUT_PNG16: 16-bit greyscale png, disparity*DISP_SUBPIXEL_SCALE
+ *  OUT_PFM:   portable float map, disparitys in pixels, unknown as infinity
+ *  OUT_RAW:   headerless 16-bit values in host byte-order, same scaling as
+ *             OUT_PNG16. Meant for piping. */
+typedef enum {OUT_PNG8, OUT_PNG16, OUT_PFM, OUT_RAW} outputFormat;
+
+/* Accepts "png8", "png16", "pfm" and "raw".
+ * Returns EXIT_SUCCESS or EXIT_FAILURE for unknown format. */
+int parseOutputFormat(const char *str, outputFormat *format);
+
+/* File extension including the dot. */
+const char *outputExtension(outputFormat format);
+
+/* Depthmap element format the backends need to produce. */
+dispFormat outputDispFormat(outputFormat format);
+
+/* Moves printf-output to stderr, so that writing to file "-" produces
+ * only depthmap data to standard output. */
+void reserveStdout(void);
+
+/* Writes depthmap of size w*h. Filename "-" writes to standard output.
+ * Returns EXIT_SUCCESS or EXIT_FAILURE. */
+int writeDepthmap(const char *filename, void *depthmap,
+                  unsigned int w, unsigned int h, outputFormat format);
+
+/* Writes a depthmap a few scanlines at a time. Raw and pfm data go
+ * directly to the file, png formats are collected and encoded on close,
+ * because the encoder needs the whole image. */
+struct depthmapWriter {
+    const char *filename;
+    outputFormat format;
+    unsigned int w;
+    unsigned int h;
+    unsigned int rows;
+    unsigned int elemSize;
+    int fd;
+    unsigned char *image;
+};
+
+/* Returns 1 if scanlines must be given from bottom to top (pfm). */
+int depthmapWriterBottomUp(outputFormat format);
+
+/* Returns EXIT_SUCCESS or EXIT_FAILURE. */
+int depthmapWriterOpen(struct depthmapWriter *writer, const char *filename,
+                       unsigned int w, unsigned int h, outputFormat format);
+
+/* Appends n scanlines, which are always ordered top to bottom inside rows.
+ * Returns EXIT_SUCCESS or EXIT_FAILURE. */
+int depthmapWriterRows(struct depthmapWriter *writer, void *rows, unsigned int n);
+
+/* Finishes the file. Fails if fewer than h scanlines were written. */
+int depthmapWriterClose(struct depthmapWriter *writer);
+
+#endif
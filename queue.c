@@ -0,0 +1,98 @@
+#include <stdlib.h>
+
+#include "queue.h"
+
+int queueInit(struct queue *q, int capacity) {
+
+    q->items = malloc(sizeof(void *)*capacity);
+    if (q->items == NULL)
+        return EXIT_FAILURE;
+
+    q->capacity = capacity;
+    q->head = 0;
+    q->count = 0;
+    q->closed = 0;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->notEmpty, NULL);
+    pthread_cond_init(&q->notFull, NULL);
+
+    return EXIT_SUCCESS;
+}
+
+void queueDestroy(struct queue *q) {
+    free(q->items);
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->notEmpty);
+    pthread_cond_destroy(&q->notFull);
+}
+
+void queuePush(struct queue *q, void *item) {
+
+    pthread_mutex_lock(&q->lock);
+    while (q->count == q->capacity)
+        pthread_cond_wait(&q->notFull, &q->lock);
+
+    q->items[(q->head+q->count) % q->capacity] = item;
+    q->count++;
+
+    pthread_cond_signal(&q->notEmpty);
+    pthread_mutex_unlock(&q->lock);
+}
+
+int queueTryPush(struct queue *q, void *item) {
+
+    pthread_mutex_lock(&q->lock);
+    if (q->count == q->capacity) {
+        pthread_mutex_unlock(&q->lock);
+        return EXIT_FAILURE;
+    }
+
+    q->items[(q->head+q->count) % q->capacity] = item;
+    q->count++;
+
+    pthread_cond_signal(&q->notEmpty);
+    pthread_mutex_unlock(&q->lock);
+
+    return EXIT_SUCCESS;
+}
+
+int queueDepth(struct queue *q) {
+    int count;
+
+    pthread_mutex_lock(&q->lock);
+    count = q->count;
+    pthread_mutex_unlock(&q->lock);
+
+    return count;
+}
+
+void *queuePop(struct queue *q) {
+    void *item;
+
+    pthread_mutex_lock(&q->lock);
+    while (q->count == 0 && !q->closed)
+        pthread_cond_wait(&q->notEmpty, &q->lock);
+
+    /* Closed and drained */
+    if (q->count == 0) {
+        pthread_mutex_unlock(&q->lock);
+        return NULL;
+    }
+
+    item = q->items[q->head];
+    q->head = (q->head+1) % q->capacity;
+    q->count--;
+
+    pthread_cond_signal(&q->notFull);
+    pthread_mutex_unlock(&q->lock);
+
+    return item;
+}
+
+void queueClose(struct queue *q) {
+
+    pthread_mutex_lock(&q->lock);
+    q->closed = 1;
+    pthread_cond_broadcast(&q->notEmpty);
+    pthread_mutex_unlock(&q->lock);
+}
@@ -0,0 +1,40 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <pthread.h>
+
+/* Bounded blocking FIFO of pointers, used to connect pipeline stages. */
+struct queue {
+    void **items;
+    int capacity;
+    int head;
+    int count;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+};
+
+/* Returns EXIT_SUCCESS or EXIT_FAILURE if allocation failed. */
+int queueInit(struct queue *q, int capacity);
+
+void queueDestroy(struct queue *q);
+
+/* Blocks while queue is full. */
+void queuePush(struct queue *q, void *item);
+
+/* Same as queuePush without blocking.
+ * Returns EXIT_FAILURE if queue is full. */
+int queueTryPush(struct queue *q, void *item);
+
+/* Items currently waiting. */
+int queueDepth(struct queue *q);
+
+/* Blocks while queue is empty.
+ * Returns NULL when queue has been closed and drained. */
+void *queuePop(struct queue *q);
+
+/* Wakes up consumers, no more items are pushed after this. */
+void queueClose(struct queue *q);
+
+#endif
@@ -0,0 +1,426 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "lodepng.h"
+#include "server.h"
+#include "service.h"
+#include "queue.h"
+#include "doubleTime.h"
+
+/* Accepted connection waiting for a worker */
+struct connection {
+    int fd;
+    int id;
+    int queueDepth;
+    double accepted;
+};
+
+struct server {
+    int listenFd;
+    struct depthmapConfig conf;
+    struct queue pending;
+
+    /* Totals, under lock */
+    pthread_mutex_t lock;
+    int served;
+    int failed;
+    int rejected;
+    int maxDepth;
+    double waitTotal;
+};
+
+struct serverWorker {
+    struct server *server;
+    struct depthmap *dm;
+    pthread_t thread;
+};
+
+/* Set by signal handlers, interrupts accept */
+static volatile sig_atomic_t stopRequested = 0;
+
+static void stopHandler(int sig) {
+    (void)sig;
+    stopRequested = 1;
+}
+
+static void respond(int fd, responseStatus status, const struct connection *conn,
+                    const void *data, uint32_t w, uint32_t h, uint32_t format,
+                    uint32_t size, double waitMs, double processMs) {
+    struct serviceResponse response;
+
+    memset(&response, 0, sizeof(response));
+    response.magic = SERVICE_MAGIC;
+    response.status = status;
+    response.width = w;
+    response.height = h;
+    response.format = format;
+    response.size = size;
+    response.queueDepth = conn->queueDepth;
+    response.waitUs = waitMs*1000;
+    response.processUs = processMs*1000;
+
+    if (serviceWrite(fd, &response, sizeof(response)) == EXIT_FAILURE
+            || (size > 0 && serviceWrite(fd, data, size) == EXIT_FAILURE))
+        fprintf(stderr, "Request %d: client went away.\n", conn->id);
+}
+
+/* 1 if image sizes of a request are acceptable */
+static int validSizes(const struct serviceRequest *request) {
+    if (request->kind == REQUEST_SHUTDOWN)
+        return 1;
+    if (request->size0 == 0 || request->size1 == 0
+            || request->size0 > SERVICE_MAX_IMAGE || request->size1 > SERVICE_MAX_IMAGE)
+        return 0;
+    if (request->kind == REQUEST_RAW
+            && ((uint64_t)request->width*request->height*4 != request->size0
+                || request->size0 != request->size1))
+        return 0;
+    return 1;
+}
+
+/* 1 if matching parameters fit the decoded images of width x height:
+ * blocks odd, atleast 3 and inside the depthmap (its half with HIERARCHIC),
+ * disparity-limit 1-255 and narrower than the depthmap. Values from
+ * clients would otherwise overflow cache sizes or the dmaps. */
+static int validParams(const struct depthmapConfig *params,
+                       unsigned int w, unsigned int h) {
+    unsigned int dw, dh;
+
+    if (w % params->factor != 0 || h % params->factor != 0)
+        return 0;
+    dw = w/params->factor;
+    dh = h/params->factor;
+    if (params->select == HIERARCHIC) {
+        dw /= 2;
+        dh /= 2;
+    }
+    if (params->blockx % 2 != 1 || params->blocky % 2 != 1
+            || params->blockx < 3 || params->blocky < 3
+            || params->blockx > dw || params->blocky > dh)
+        return 0;
+    if (params->disp_limit < 1 || params->disp_limit > DISP_LIMIT_MAX
+            || params->disp_limit >= w/params->factor)
+        return 0;
+    return 1;
+}
+
+/* Reads images of a request and decodes them to 32-bit pixels.
+ * Returns EXIT_SUCCESS or EXIT_FAILURE. */
+static int receivePair(int fd, const struct serviceRequest *request,
+                       unsigned char **img0, unsigned char **img1,
+                       unsigned int *w, unsigned int *h) {
+    unsigned char *data0, *data1;
+    unsigned int w1, h1, error;
+
+    (*img0) = NULL;
+    (*img1) = NULL;
+    data0 = malloc(request->size0);
+    data1 = malloc(request->size1);
+    if (data0 == NULL || data1 == NULL
+            || serviceRead(fd, data0, request->size0) == EXIT_FAILURE
+            || serviceRead(fd, data1, request->size1) == EXIT_FAILURE) {
+        free(data0);
+        free(data1);
+        return EXIT_FAILURE;
+    }
+
+    if (request->kind == REQUEST_RAW) {
+        (*img0) = data0;
+        (*img1) = data1;
+        (*w) = request->width;
+        (*h) = request->height;
+        return EXIT_SUCCESS;
+    }
+
+    error = lodepng_decode32(img0, w, h, data0, request->size0);
+    if (error == 0)
+        error = lodepng_decode32(img1, &w1, &h1, data1, request->size1);
+    free(data0);
+    free(data1);
+    if (error != 0) {
+        fprintf(stderr, "error %u: %s\n", error, lodepng_error_text(error));
+        free(*img0);
+        free(*img1);
+        return EXIT_FAILURE;
+    }
+    if (w1 != (*w) || h1 != (*h)) {
+        free(*img0);
+        free(*img1);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+static void handleConnection(struct server *server, struct depthmap *dm,
+                             struct connection *conn) {
+    struct serviceRequest request;
+    struct depthmapConfig params;
+    unsigned char *img0, *img1;
+    unsigned int w, h, dw, dh, elemSize;
+    double start, time1, time2, waitMs;
+    void *depthmap;
+
+    start = doubleTime();
+    waitMs = (start-conn->accepted)*1000;
+
+    if (serviceRead(conn->fd, &request, sizeof(request)) == EXIT_FAILURE
+            || request.magic != SERVICE_MAGIC || request.kind > REQUEST_SHUTDOWN
+            || request.search > SEARCH_HIERARCHIC || request.format > DISP_FIXED16
+            || !validSizes(&request)) {
+        fprintf(stderr, "Request %d: malformed.\n", conn->id);
+        respond(conn->fd, STATUS_BAD_REQUEST, conn, NULL, 0, 0, 0, 0, waitMs, 0.0);
+        pthread_mutex_lock(&server->lock);
+        server->failed++;
+        pthread_mutex_unlock(&server->lock);
+        return;
+    }
+
+    if (request.kind == REQUEST_SHUTDOWN) {
+        printf("Request %d: shutdown.\n", conn->id);
+        stopRequested = 1;
+        /* Wakes up accept */
+        shutdown(server->listenFd, SHUT_RDWR);
+        respond(conn->fd, STATUS_OK, conn, NULL, 0, 0, 0, 0, waitMs, 0.0);
+        return;
+    }
+
+    params = server->conf;
+    if (request.blockx != 0)
+        params.blockx = request.blockx;
+    if (request.blocky != 0)
+        params.blocky = request.blocky;
+    if (request.dispLimit != 0)
+        params.disp_limit = request.dispLimit;
+    if (request.search == SEARCH_BRUTE)
+        params.select = BRUTE;
+    else if (request.search == SEARCH_HIERARCHIC)
+        params.select = HIERARCHIC;
+    params.format = request.format;
+
+    time1 = doubleTime();
+    depthmap = NULL;
+    if (receivePair(conn->fd, &request, &img0, &img1, &w, &h) == EXIT_SUCCESS) {
+        if (!validParams(&params, w, h)) {
+            free(img0);
+            free(img1);
+            fprintf(stderr, "Request %d: unusable parameters for %ux%u.\n",
+                    conn->id, w, h);
+            respond(conn->fd, STATUS_BAD_REQUEST, conn, NULL, 0, 0, 0, 0,
+                    waitMs, 0.0);
+            pthread_mutex_lock(&server->lock);
+            server->failed++;
+            pthread_mutex_unlock(&server->lock);
+            return;
+        }
+        depthmap = depthmapGenerateWith(dm, img0, img1, w, h, &params);
+        free(img0);
+        free(img1);
+    }
+    time2 = doubleTime();
+
+    if (depthmap == NULL) {
+        printf("Request %d: failed.\n", conn->id);
+        respond(conn->fd, STATUS_FAILED, conn, NULL, 0, 0, 0, 0,
+                waitMs, (time2-time1)*1000);
+        pthread_mutex_lock(&server->lock);
+        server->failed++;
+        pthread_mutex_unlock(&server->lock);
+        return;
+    }
+
+    dw = w/params.factor;
+    dh = h/params.factor;
+    elemSize = (params.format == DISP_FIXED16) ? 2 : 1;
+    printf("Request %d: %ux%u, %ux%u blocks, limit %u, queue depth %d, "
+           "waited %.1lf ms, depthmap %.1lf ms.\n", conn->id, w, h,
+           params.blockx, params.blocky, params.disp_limit, conn->queueDepth,
+           waitMs, (time2-time1)*1000);
+    respond(conn->fd, STATUS_OK, conn, depthmap, dw, dh, params.format,
+            dw*dh*elemSize, waitMs, (time2-time1)*1000);
+    free(depthmap);
+
+    pthread_mutex_lock(&server->lock);
+    server->served++;
+    server->waitTotal += waitMs;
+    pthread_mutex_unlock(&server->lock);
+}
+
+void *serverWorkerMain(void *data) {
+    struct serverWorker *worker = (struct serverWorker *)data;
+    struct connection *conn;
+
+    while ((conn = queuePop(&worker->server->pending)) != NULL) {
+        handleConnection(worker->server, worker->dm, conn);
+        close(conn->fd);
+        free(conn);
+    }
+
+    return NULL;
+}
+
+/* Listening socket at path, replacing a stale socket file. -1 on failure. */
+static int listenSocket(const char *path) {
+    struct sockaddr_un addr;
+    struct stat st;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path is too long!\n");
+        return -1;
+    }
+    if (stat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("Couldn't create a socket");
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0
+            || listen(fd, SERVER_QUEUE_DEPTH) != 0) {
+        perror("Couldn't listen on the socket");
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+int runServer(const char *path, const struct depthmapConfig *conf, int workers) {
+    struct server server;
+    struct serverWorker worker[SERVER_MAX_WORKERS];
+    struct connection *conn;
+    struct sigaction action;
+    sigset_t stopSignals, oldMask;
+    int i, started, fd, id, error;
+
+    if (workers < 1 || workers > SERVER_MAX_WORKERS) {
+        fprintf(stderr, "Workers must be 1-%d!\n", SERVER_MAX_WORKERS);
+        return EXIT_FAILURE;
+    }
+
+    memset(&server, 0, sizeof(server));
+    server.conf = (*conf);
+    /* Prints of concurrent requests would interleave */
+    server.conf.verbose = 0;
+
+    /* Instances are created before listening, so that the first request
+     * finds them warm */
+    for (i=0; i < workers; i++) {
+        worker[i].server = &server;
+        worker[i].dm = depthmapCreate(&server.conf);
+        if (worker[i].dm == NULL) {
+            while (i-- > 0)
+                depthmapDestroy(worker[i].dm);
+            return EXIT_FAILURE;
+        }
+    }
+
+    error = EXIT_FAILURE;
+    server.listenFd = listenSocket(path);
+    if (server.listenFd < 0 || queueInit(&server.pending, SERVER_QUEUE_DEPTH) == EXIT_FAILURE)
+        goto release;
+    pthread_mutex_init(&server.lock, NULL);
+
+    /* Interrupted accept checks stopRequested */
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = stopHandler;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    /* Clients leaving early must not end the daemon */
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Workers inherit the mask, so that the signals reach the main thread
+     * and interrupt accept */
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGINT);
+    sigaddset(&stopSignals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, &oldMask);
+    for (started=0; started < workers; started++) {
+        if (pthread_create(&worker[started].thread, NULL, serverWorkerMain,
+                           &worker[started]) != 0)
+            break;
+    }
+    pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+    if (started < workers) {
+        fprintf(stderr, "Couldn't start server workers!\n");
+        queueClose(&server.pending);
+        for (i=0; i < started; i++)
+            pthread_join(worker[i].thread, NULL);
+        queueDestroy(&server.pending);
+        pthread_mutex_destroy(&server.lock);
+        goto release;
+    }
+    printf("Serving depthmaps on %s with %d workers.\n", path, workers);
+    fflush(stdout);
+
+    id = 0;
+    while (!stopRequested) {
+        fd = accept(server.listenFd, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR || stopRequested)
+                continue;
+            perror("accept");
+            break;
+        }
+        conn = malloc(sizeof(struct connection));
+        if (conn == NULL) {
+            close(fd);
+            continue;
+        }
+        conn->fd = fd;
+        conn->id = ++id;
+        conn->accepted = doubleTime();
+        conn->queueDepth = queueDepth(&server.pending);
+        if (conn->queueDepth > server.maxDepth)
+            server.maxDepth = conn->queueDepth;
+
+        if (queueTryPush(&server.pending, conn) == EXIT_FAILURE) {
+            /* Request is left unread */
+            printf("Request %d: busy, queue depth %d.\n", conn->id, conn->queueDepth);
+            respond(fd, STATUS_BUSY, conn, NULL, 0, 0, 0, 0, 0.0, 0.0);
+            close(fd);
+            free(conn);
+            pthread_mutex_lock(&server.lock);
+            server.rejected++;
+            pthread_mutex_unlock(&server.lock);
+        }
+    }
+
+    /* Queued requests are still served */
+    queueClose(&server.pending);
+    for (i=0; i < workers; i++)
+        pthread_join(worker[i].thread, NULL);
+    queueDestroy(&server.pending);
+    pthread_mutex_destroy(&server.lock);
+    error = EXIT_SUCCESS;
+
+    printf("\nServed %d requests, %d failed, %d rejected as busy.\n",
+           server.served, server.failed, server.rejected);
+    printf(" Maximum queue depth:           %d\n", server.maxDepth);
+    if (server.served > 0)
+        printf(" Mean wait in queue:            %6.1lf ms\n",
+               server.waitTotal/server.served);
+
+release:
+    if (server.listenFd >= 0) {
+        close(server.listenFd);
+        unlink(path);
+    }
+    for (i=0; i < workers; i++)
+        depthmapDestroy(worker[i].dm);
+
+    return error;
+}
@@ -0,0 +1,19 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "libdepthmap.h"
+
+/* Connections waiting for a worker */
+#define SERVER_QUEUE_DEPTH 8
+#define SERVER_MAX_WORKERS 16
+
+/* Serves depthmap requests (service.h) on a Unix domain socket at path until
+ * a shutdown request or SIGINT/SIGTERM. workers threads each keep a warm
+ * instance of conf, so at most workers depthmaps are generated at once.
+ * Connections waiting for a worker are queued up to SERVER_QUEUE_DEPTH,
+ * later ones are answered busy. Every request prints its queue depth and
+ * times, and totals are printed at the end.
+ * Returns EXIT_SUCCESS or EXIT_FAILURE. */
+int runServer(const char *path, const struct depthmapConfig *conf, int workers);
+
+#endif
@@ -0,0 +1,37 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "service.h"
+
+int serviceRead(int fd, void *data, size_t size) {
+    unsigned char *bytes = (unsigned char *)data;
+    ssize_t ret;
+
+    while (size > 0) {
+        ret = read(fd, bytes, size);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return EXIT_FAILURE;
+        bytes += ret;
+        size -= ret;
+    }
+    return EXIT_SUCCESS;
+}
+
+int serviceWrite(int fd, const void *data, size_t size) {
+    const unsigned char *bytes = (const unsigned char *)data;
+    ssize_t ret;
+
+    while (size > 0) {
+        ret = write(fd, bytes, size);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return EXIT_FAILURE;
+        bytes += ret;
+        size -= ret;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,59 @@
+#ifndef SERVICE_H
+#define SERVICE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Messages between the depthmap daemon (-D) and depthmap_client over a Unix
+ * domain socket. One request and its response per connection, fields in
+ * host byte-order. */
+#define SERVICE_MAGIC 0x50414d44
+
+/* Upper limit for one image of a request in bytes */
+#define SERVICE_MAX_IMAGE (256*1024*1024)
+
+typedef enum {REQUEST_PNG, REQUEST_RAW, REQUEST_SHUTDOWN} requestKind;
+
+typedef enum {SEARCH_DEFAULT, SEARCH_BRUTE, SEARCH_HIERARCHIC} requestSearch;
+
+typedef enum {STATUS_OK, STATUS_BUSY, STATUS_BAD_REQUEST, STATUS_FAILED} responseStatus;
+
+/* Followed by size0 bytes of left and size1 bytes of right image: png files,
+ * or 32-bit pixels of width x height with REQUEST_RAW. Parameters that are 0
+ * take the daemon's value. format is a dispFormat. */
+struct serviceRequest {
+    uint32_t magic;
+    uint32_t kind;
+    uint32_t blockx;
+    uint32_t blocky;
+    uint32_t dispLimit;
+    uint32_t search;
+    uint32_t format;
+    uint32_t width;
+    uint32_t height;
+    uint32_t size0;
+    uint32_t size1;
+};
+
+/* Followed by size bytes of depthmap, width x height elements of 1 byte
+ * (DISP_GREY8) or 2 bytes (DISP_FIXED16). */
+struct serviceResponse {
+    uint32_t magic;
+    uint32_t status;
+    uint32_t width;
+    uint32_t height;
+    uint32_t format;
+    uint32_t size;
+    /* Requests waiting in the daemon when this one arrived */
+    uint32_t queueDepth;
+    /* Time in the queue and generating the depthmap, microseconds */
+    uint32_t waitUs;
+    uint32_t processUs;
+};
+
+/* Reads or writes all of size bytes, retrying short transfers.
+ * Returns EXIT_SUCCESS or EXIT_FAILURE. */
+int serviceRead(int fd, void *data, size_t size);
+int serviceWrite(int fd, const void *data, size_t size);
+
+#endif
@@ -0,0 +1,167 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "strip.h"
+#include "doubleTime.h"
+
+/* Reads scanlines first..last-1 of both images of a raw pair, the left
+ * frame followed by the right one, to img0 and img1.
+ * Returns EXIT_SUCCESS or EXIT_FAILURE. */
+static int readRows(FILE *raw, unsigned int w, unsigned int h,
+                    unsigned int first, unsigned int last,
+                    unsigned char *img0, unsigned char *img1) {
+    size_t lineSize, size;
+
+    lineSize = (size_t)w*4;
+    size = (last-first)*lineSize;
+    if (fseeko(raw, (off_t)first*lineSize, SEEK_SET) != 0
+            || fread(img0, 1, size, raw) != size
+            || fseeko(raw, (off_t)(h+first)*lineSize, SEEK_SET) != 0
+            || fread(img1, 1, size, raw) != size) {
+        fprintf(stderr, "Scanlines %u-%u of the raw pair couldn't be read!\n",
+                first, last);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/* Strips of a pair, which is decoded whole, or read strip by strip from raw
+ * when it isn't NULL. */
+static int stripLoop(struct stereoPair *pair, FILE *raw,
+                     unsigned int stripRows, unsigned int halo,
+                     unsigned int factor, outputFormat format,
+                     processFunc process, void *args) {
+    struct stereoPair strip;
+    struct depthmapWriter writer;
+    unsigned int dw, dh, strips, i, y, lasty, first, last;
+    unsigned char *buf0, *buf1;
+    size_t elemSize, lineSize, bufSize;
+    int error, bottomUp;
+    double time1, time2;
+
+    dw = pair->w/factor;
+    dh = pair->h/factor;
+
+    /* Even strip-boundaries keep half-resolution search of hierarchic
+     * method aligned with the whole image. */
+    stripRows += stripRows % 2;
+    halo += halo % 2;
+    strips = (dh + stripRows-1)/stripRows;
+
+    lineSize = (size_t)pair->w*4;
+    buf0 = NULL;
+    buf1 = NULL;
+    if (raw != NULL) {
+        /* Images of the tallest strip, halos included */
+        bufSize = (size_t)((stripRows + 2*halo < dh) ? stripRows + 2*halo : dh)
+                  *factor*lineSize;
+        buf0 = malloc(bufSize);
+        buf1 = malloc(bufSize);
+        if (buf0 == NULL || buf1 == NULL) {
+            free(buf0);
+            free(buf1);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (depthmapWriterOpen(&writer, pair->outName, dw, dh, format) == EXIT_FAILURE) {
+        free(buf0);
+        free(buf1);
+        return EXIT_FAILURE;
+    }
+    bottomUp = depthmapWriterBottomUp(format);
+    elemSize = (outputDispFormat(format) == DISP_FIXED16) ?
+               sizeof(unsigned short) : sizeof(unsigned char);
+
+    time1 = doubleTime();
+    error = EXIT_SUCCESS;
+    for (i = 0; i < strips && error == EXIT_SUCCESS; i++) {
+        y = (bottomUp ? strips-1-i : i) * stripRows;
+        lasty = (y + stripRows < dh) ? y + stripRows : dh;
+        first = (y > halo) ? y - halo : 0;
+        last = (lasty + halo < dh) ? lasty + halo : dh;
+
+        strip = (*pair);
+        strip.h = (last-first)*factor;
+        strip.depthmap = NULL;
+        if (raw != NULL) {
+            if (readRows(raw, pair->w, pair->h, first*factor, last*factor,
+                         buf0, buf1) == EXIT_FAILURE) {
+                error = EXIT_FAILURE;
+                break;
+            }
+            strip.img0 = buf0;
+            strip.img1 = buf1;
+        }
+        else {
+            /* Strip refers to scanlines of the decoded images, nothing is
+             * copied */
+            strip.img0 = pair->img0 + first*factor*lineSize;
+            strip.img1 = pair->img1 + first*factor*lineSize;
+        }
+
+        if (process(&strip, args) == EXIT_FAILURE) {
+            fprintf(stderr, "Strip %u-%u failed!\n", y, lasty);
+            error = EXIT_FAILURE;
+            break;
+        }
+        error = depthmapWriterRows(&writer, (unsigned char *)strip.depthmap
+                                   + (y-first)*dw*elemSize, lasty-y);
+        free(strip.depthmap);
+    }
+    if (depthmapWriterClose(&writer) == EXIT_FAILURE)
+        error = EXIT_FAILURE;
+    time2 = doubleTime();
+    free(buf0);
+    free(buf1);
+
+    printf("%u strips of %u scanlines, %u halo scanlines: %.3lf seconds.\n",
+           strips, stripRows, halo, time2-time1);
+
+    return error;
+}
+
+int runStrips(struct stereoPair *pair, unsigned int stripRows,
+              unsigned int halo, unsigned int factor, outputFormat format,
+              processFunc process, void *args) {
+    return stripLoop(pair, NULL, stripRows, halo, factor, format, process, args);
+}
+
+int runStripsRaw(const char *source, char *outName, unsigned int stripRows,
+                 unsigned int halo, unsigned int factor, outputFormat format,
+                 processFunc process, void *args) {
+    struct stereoPair pair;
+    const char *name;
+    FILE *raw;
+    int n, error;
+
+    memset(&pair, 0, sizeof(struct stereoPair));
+    if (strncmp(source, "raw:", 4) != 0
+            || sscanf(source+4, "%ux%u:%n", &pair.w, &pair.h, &n) != 2
+            || pair.w == 0 || pair.h == 0 || source[4+n] == '\0') {
+        fprintf(stderr, "Expected raw:<w>x<h>:<file>!\n");
+        return EXIT_FAILURE;
+    }
+    name = source+4+n;
+    /* Strips seek to their scanlines, a pipe won't do */
+    raw = fopen(name, "rb");
+    if (raw == NULL) {
+        perror("Couldn't open the raw pair");
+        return EXIT_FAILURE;
+    }
+    if (fseeko(raw, 0, SEEK_END) != 0
+            || ftello(raw) != (off_t)pair.w*pair.h*4*2) {
+        fprintf(stderr, "%s is no pair of %ux%u 32-bit images!\n", name,
+                pair.w, pair.h);
+        fclose(raw);
+        return EXIT_FAILURE;
+    }
+    pair.outName = outName;
+
+    error = stripLoop(&pair, raw, stripRows, halo, factor, format, process, args);
+    fclose(raw);
+
+    return error;
+}
@@ -0,0 +1,28 @@
+#ifndef STRIP_H
+#define STRIP_H
+
+#include "batch.h"
+#include "output.h"
+
+/* Processes a decoded pair in horizontal strips of stripRows output
+ * scanlines. Every strip is extended by halo scanlines above and below, so
+ * that block-matching and post-processing see the same neighbourhood as
+ * with the whole image. Only the strip's own scanlines are written to
+ * pair->outName as soon as they are ready. Scanline counts are in pixels of
+ * the 1/factor depthmap.
+ * Returns EXIT_SUCCESS or EXIT_FAILURE. */
+int runStrips(struct stereoPair *pair, unsigned int stripRows,
+              unsigned int halo, unsigned int factor, outputFormat format,
+              processFunc process, void *args);
+
+/* As runStrips, for a pair read from source, "raw:<w>x<h>:<file>" as in
+ * video mode: a 32-bit left image followed by the right one. Only the
+ * scanlines of one strip and its halos are read and held at a time, so with
+ * raw and pfm output no buffer is sized by the whole pair; png output is
+ * still collected whole before encoding. The depthmap is saved to outName.
+ * Returns EXIT_SUCCESS or EXIT_FAILURE. */
+int runStripsRaw(const char *source, char *outName, unsigned int stripRows,
+                 unsigned int halo, unsigned int factor, outputFormat format,
+                 processFunc process, void *args);
+
+#endif
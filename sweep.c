@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "sweep.h"
+#include "doubleTime.h"
+
+int parseSweepList(const char *str, struct sweepList *list) {
+    const char *p;
+    char *end;
+    long value;
+
+    list->n = 0;
+    p = str;
+    while (1) {
+        errno = 0;
+        value = strtol(p, &end, 10);
+        if (end == p || errno != 0 || value < 1 || list->n == SWEEP_MAX)
+            return EXIT_FAILURE;
+        list->values[list->n++] = value;
+        if ((*end) == '\0')
+            return EXIT_SUCCESS;
+        if ((*end) != ',')
+            return EXIT_FAILURE;
+        p = end+1;
+    }
+}
+
+int runSweep(struct stereoPair *pair, const struct sweepList *bx,
+             const struct sweepList *by, const struct sweepList *d,
+             const char *outName, outputFormat format,
+             const struct depthmapConfig *conf) {
+
+    struct depthmapConfig params;
+    struct depthmap *dm;
+    struct depthmapFrame *pyramid, *frame;
+    const struct depthmapTimings *timings;
+    const char *ext;
+    char *base, *name, *csvName;
+    FILE *csv;
+    int i, j, k, error, done;
+    double time1, time2, pyramidMs;
+    void *depthmap;
+
+    ext = outputExtension(format);
+    base = strdup(outName);
+    name = malloc(strlen(outName) + strlen(ext) + 64);
+    csvName = malloc(strlen(outName) + 16);
+    if (base == NULL || name == NULL || csvName == NULL) {
+        free(base);
+        free(name);
+        free(csvName);
+        return EXIT_FAILURE;
+    }
+    if (strrchr(base, '.') != NULL && strrchr(base, '.') > strrchr(base, '/'))
+        (*strrchr(base, '.')) = '\0';
+    sprintf(csvName, "%s_sweep.csv", base);
+
+    params = (*conf);
+    params.format = outputDispFormat(format);
+    params.blockx = bx->values[0];
+    params.blocky = by->values[0];
+    params.disp_limit = d->values[0];
+    dm = depthmapCreate(&params);
+    csv = fopen(csvName, "w");
+    if (dm == NULL || csv == NULL) {
+        if (csv == NULL)
+            perror(csvName);
+        else
+            fclose(csv);
+        depthmapDestroy(dm);
+        free(base);
+        free(name);
+        free(csvName);
+        return EXIT_FAILURE;
+    }
+
+    /* Decoded once by the caller, blended once here */
+    time1 = doubleTime();
+    pyramid = depthmapPrepare(dm, pair->img0, pair->img1, pair->w, pair->h);
+    time2 = doubleTime();
+    pyramidMs = (time2-time1)*1000;
+    if (pyramid == NULL) {
+        fclose(csv);
+        depthmapDestroy(dm);
+        free(base);
+        free(name);
+        free(csvName);
+        return EXIT_FAILURE;
+    }
+    printf("Pyramid, shared by %d combinations: %.1lf ms.\n",
+           bx->n*by->n*d->n, pyramidMs);
+
+    fprintf(csv, "blockx,blocky,disp_limit,pyramid_ms,zncc_half_ms,limits_ms,"
+                 "zncc_ms,post_ms,total_ms,output\n");
+    error = EXIT_SUCCESS;
+    done = 0;
+    for (i = 0; i < bx->n; i++) {
+        for (j = 0; j < by->n; j++) {
+            for (k = 0; k < d->n; k++) {
+                params.blockx = bx->values[i];
+                params.blocky = by->values[j];
+                params.disp_limit = d->values[k];
+                sprintf(name, "%s_x%u_y%u_d%u%s", base, params.blockx,
+                        params.blocky, params.disp_limit, ext);
+
+                time1 = doubleTime();
+                depthmap = NULL;
+                frame = depthmapFrameVariant(dm, pyramid, &params);
+                if (frame != NULL && depthmapMatch(dm, frame) == EXIT_SUCCESS) {
+                    depthmap = depthmapFinish(dm, frame);
+                    frame = NULL;
+                }
+                depthmapFrameFree(frame);
+                time2 = doubleTime();
+
+                if (depthmap == NULL
+                        || writeDepthmap(name, depthmap, pair->w/params.factor,
+                                         pair->h/params.factor, format) == EXIT_FAILURE) {
+                    fprintf(stderr, "Combination x %u, y %u, d %u failed!\n",
+                            params.blockx, params.blocky, params.disp_limit);
+                    free(depthmap);
+                    error = EXIT_FAILURE;
+                    continue;
+                }
+                free(depthmap);
+                done++;
+
+                timings = depthmapTimings(dm);
+                fprintf(csv, "%u,%u,%u,%.3f,%.3f,%.3f,%.3f,%.3f,%.3f,%s\n",
+                        params.blockx, params.blocky, params.disp_limit, pyramidMs,
+                        timings->znccHalf, timings->limits, timings->zncc,
+                        timings->post, (time2-time1)*1000, name);
+                printf("x %2u, y %2u, d %3u: %8.1lf ms, %s\n", params.blockx,
+                       params.blocky, params.disp_limit, (time2-time1)*1000, name);
+            }
+        }
+    }
+    printf("%d of %d combinations, timings in %s.\n", done,
+           bx->n*by->n*d->n, csvName);
+
+    if (fclose(csv) != 0) {
+        perror(csvName);
+        error = EXIT_FAILURE;
+    }
+    depthmapFrameFree(pyramid);
+    depthmapDestroy(dm);
+    free(base);
+    free(name);
+    free(csvName);
+
+    return error;
+}
@@ -0,0 +1,31 @@
+#ifndef SWEEP_H
+#define SWEEP_H
+
+#include "batch.h"
+#include "libdepthmap.h"
+#include "output.h"
+
+/* Upper limit for values of one swept parameter */
+#define SWEEP_MAX 16
+
+struct sweepList {
+    unsigned int values[SWEEP_MAX];
+    int n;
+};
+
+/* Comma-separated list of positive integers, e.g. "5,7,9".
+ * Returns EXIT_SUCCESS or EXIT_FAILURE. */
+int parseSweepList(const char *str, struct sweepList *list);
+
+/* Generates depthmaps of a decoded pair for every combination of block
+ * widths bx, heights by and disparity limits d, with the rest of conf.
+ * The pyramid is built once and copied for each combination. Depthmaps are
+ * saved as <base>_x<bx>_y<by>_d<d><ext>, where base is outName without its
+ * extension, and stage times of every combination to <base>_sweep.csv.
+ * Returns EXIT_FAILURE if any of the combinations failed. */
+int runSweep(struct stereoPair *pair, const struct sweepList *bx,
+             const struct sweepList *by, const struct sweepList *d,
+             const char *outName, outputFormat format,
+             const struct depthmapConfig *conf);
+
+#endif
@@ -0,0 +1,252 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "synth.h"
+#include "disparity.h"
+
+/* Rectangles in front of the background */
+#define SYNTH_RECTS 3
+
+/* Keeps texture coordinates of the right image positive, multiple of 8 */
+#define SYNTH_ORIGIN (1 << 20)
+
+/* Layers of a scene in depthmap pixels. Layer 0 is the background, layer
+ * i the rectangle i-1; later rectangles are nearer. */
+struct synthScene {
+    unsigned int width, height, factor, seed;
+    /* Background disparity at the top and bottom scanlines */
+    unsigned int backTop, backBottom;
+    unsigned int rx[SYNTH_RECTS], ry[SYNTH_RECTS];
+    unsigned int rw[SYNTH_RECTS], rh[SYNTH_RECTS];
+    unsigned int rd[SYNTH_RECTS];
+};
+
+/* Integer hash, same on every machine unlike rand(). */
+static unsigned int hash32(unsigned int x) {
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+}
+
+static unsigned int latticeHash(unsigned int seed, unsigned int layer,
+                                unsigned int ix, unsigned int iy) {
+    return hash32(seed ^ hash32(layer*0x9e3779b9U ^ hash32(ix ^ hash32(iy))));
+}
+
+static unsigned int layerDisparity(const struct synthScene *sc,
+                                   unsigned int layer, unsigned int cy) {
+    if (layer == 0)
+        return sc->backTop + (sc->backBottom - sc->backTop)*cy/(sc->height-1);
+    return sc->rd[layer-1];
+}
+
+/* Nearest layer at a depthmap pixel of the left image */
+static unsigned int leftLayer(const struct synthScene *sc,
+                              unsigned int cx, unsigned int cy) {
+    int i;
+
+    for (i = SYNTH_RECTS-1; i >= 0; i--) {
+        if (cx >= sc->rx[i] && cx < sc->rx[i]+sc->rw[i]
+                && cy >= sc->ry[i] && cy < sc->ry[i]+sc->rh[i])
+            return i+1;
+    }
+    return 0;
+}
+
+/* Nearest layer at a depthmap pixel of the right image, where rectangles
+ * are shifted left by their disparity */
+static unsigned int rightLayer(const struct synthScene *sc,
+                               unsigned int cx, unsigned int cy) {
+    int i;
+
+    for (i = SYNTH_RECTS-1; i >= 0; i--) {
+        if (cx+sc->rd[i] >= sc->rx[i] && cx+sc->rd[i] < sc->rx[i]+sc->rw[i]
+                && cy >= sc->ry[i] && cy < sc->ry[i]+sc->rh[i])
+            return i+1;
+    }
+    return 0;
+}
+
+/* Bilinear value noise with lattice spacing of scale pixels, 0-255 */
+static unsigned int valueNoise(const struct synthScene *sc, unsigned int layer,
+                               unsigned int u, unsigned int y, unsigned int scale) {
+    unsigned int ix, iy, fx, fy, v00, v10, v01, v11;
+
+    ix = u/scale;
+    iy = y/scale;
+    fx = u%scale;
+    fy = y%scale;
+    v00 = latticeHash(sc->seed, layer, ix, iy) & 255;
+    v10 = latticeHash(sc->seed, layer, ix+1, iy) & 255;
+    v01 = latticeHash(sc->seed, layer, ix, iy+1) & 255;
+    v11 = latticeHash(sc->seed, layer, ix+1, iy+1) & 255;
+
+    return ((v00*(scale-fx) + v10*fx)*(scale-fy)
+            + (v01*(scale-fx) + v11*fx)*fy) / (scale*scale);
+}
+
+/* Intensity of a layer at texture coordinate u (right image x plus
+ * SYNTH_ORIGIN) and scanline y of the images. */
+static unsigned char texel(const struct synthScene *sc, synthPattern pattern,
+                           unsigned int layer, unsigned int u, unsigned int y) {
+    if (pattern == SYNTH_DOTS)
+        return (latticeHash(sc->seed, layer, u/sc->factor, y/sc->factor) & 1) ? 255 : 0;
+
+    return (3*valueNoise(sc, layer, u, y, 4*sc->factor)
+            + valueNoise(sc, layer, u, y, sc->factor)) / 4;
+}
+
+/* Flat area of SYNTH_BANDED at a depthmap pixel of either image. It starts
+ * mid-scanline, so that flat blocks follow matched ones. */
+static int flatPixel(const struct synthScene *sc, synthPattern pattern,
+                     unsigned int cx, unsigned int cy) {
+    return pattern == SYNTH_BANDED && cx >= sc->width/2
+           && cy >= 2*sc->height/5 && cy < 3*sc->height/5;
+}
+
+static void setPixel(unsigned char *img, unsigned int i, unsigned char v) {
+    img[4*i] = v;
+    img[4*i+1] = v;
+    img[4*i+2] = v;
+    img[4*i+3] = 255;
+}
+
+int parseSynthPattern(const char *str, synthPattern *pattern) {
+    if (strcmp(str, "dots") == 0)
+        (*pattern) = SYNTH_DOTS;
+    else if (strcmp(str, "texture") == 0)
+        (*pattern) = SYNTH_TEXTURE;
+    else if (strcmp(str, "banded") == 0)
+        (*pattern) = SYNTH_BANDED;
+    else
+        return EXIT_FAILURE;
+    return EXIT_SUCCESS;
+}
+
+const char *synthPatternName(synthPattern pattern) {
+    if (pattern == SYNTH_DOTS)
+        return "dots";
+    return (pattern == SYNTH_TEXTURE) ? "texture" : "banded";
+}
+
+int synthGenerate(struct synthPair *pair, synthPattern pattern,
+                  unsigned int width, unsigned int height,
+                  unsigned int factor, unsigned int maxDisp, unsigned int seed) {
+
+    struct synthScene sc;
+    unsigned int i, x, y, cx, cy, layer, d, state;
+
+    memset(pair, 0, sizeof(struct synthPair));
+
+    if (factor == 0 || width % factor != 0 || height % factor != 0
+            || maxDisp < 8 || maxDisp > 255 || width/factor <= 2*maxDisp
+            || height/factor < 8) {
+        fprintf(stderr, "Synthetic pair of %ux%u can't have disparitys up to %u!\n",
+                width, height, maxDisp);
+        return EXIT_FAILURE;
+    }
+
+    sc.width = width/factor;
+    sc.height = height/factor;
+    sc.factor = factor;
+    sc.seed = hash32(seed);
+    /* Receding towards the top, behind every rectangle */
+    sc.backTop = maxDisp/8;
+    sc.backBottom = maxDisp/2 - 1;
+
+    state = sc.seed;
+    for (i = 0; i < SYNTH_RECTS; i++) {
+        sc.rw[i] = sc.width/6 + (state = hash32(state+1)) % (sc.width/6+1);
+        sc.rh[i] = sc.height/6 + (state = hash32(state+1)) % (sc.height/6+1);
+        /* Whole rectangle is visible in the right image */
+        sc.rx[i] = maxDisp + (state = hash32(state+1)) % (sc.width - sc.rw[i] - maxDisp);
+        sc.ry[i] = (state = hash32(state+1)) % (sc.height - sc.rh[i] + 1);
+        sc.rd[i] = maxDisp/2 + (i+1)*(maxDisp - maxDisp/2)/SYNTH_RECTS;
+    }
+
+    pair->img0 = malloc(4*(size_t)width*height);
+    pair->img1 = malloc(4*(size_t)width*height);
+    pair->truth = malloc((size_t)sc.width*sc.height);
+    if (pair->img0 == NULL || pair->img1 == NULL || pair->truth == NULL) {
+        fprintf(stderr, "Allocating memory failed in synthGenerate!\n");
+        synthFree(pair);
+        return EXIT_FAILURE;
+    }
+    pair->width = width;
+    pair->height = height;
+    pair->factor = factor;
+
+    /* A layer is seen in the left image at x+d*factor of the right one */
+    for (y = 0; y < height; y++) {
+        cy = y/factor;
+        for (x = 0; x < width; x++) {
+            cx = x/factor;
+            if (flatPixel(&sc, pattern, cx, cy)) {
+                setPixel(pair->img0, y*width+x, 128);
+                setPixel(pair->img1, y*width+x, 128);
+                continue;
+            }
+            layer = leftLayer(&sc, cx, cy);
+            d = layerDisparity(&sc, layer, cy)*factor;
+            setPixel(pair->img0, y*width+x,
+                     texel(&sc, pattern, layer, SYNTH_ORIGIN + x - d, y));
+            layer = rightLayer(&sc, cx, cy);
+            setPixel(pair->img1, y*width+x,
+                     texel(&sc, pattern, layer, SYNTH_ORIGIN + x, y));
+        }
+    }
+
+    for (cy = 0; cy < sc.height; cy++) {
+        for (cx = 0; cx < sc.width; cx++) {
+            layer = leftLayer(&sc, cx, cy);
+            d = layerDisparity(&sc, layer, cy);
+            if (cx < d || rightLayer(&sc, cx-d, cy) != layer)
+                d = 0;
+            if (flatPixel(&sc, pattern, cx, cy)
+                    || (d > 0 && flatPixel(&sc, pattern, cx-d, cy)))
+                d = 0;
+            pair->truth[cy*sc.width+cx] = d;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+void synthFree(struct synthPair *pair) {
+    free(pair->img0);
+    free(pair->img1);
+    free(pair->truth);
+    pair->img0 = NULL;
+    pair->img1 = NULL;
+    pair->truth = NULL;
+}
+
+double synthBadPixels(const struct synthPair *pair,
+                      const unsigned short *depthmap, double threshold,
+                      unsigned int border) {
+    unsigned int x, y, w, h, known, bad, truth, value;
+
+    w = pair->width/pair->factor;
+    h = pair->height/pair->factor;
+    known = 0;
+    bad = 0;
+    for (y = border; y+border < h; y++) {
+        for (x = border; x+border < w; x++) {
+            truth = pair->truth[y*w+x];
+            if (truth == 0)
+                continue;
+            known++;
+            value = depthmap[y*w+x];
+            if (value == 0
+                    || fabs((double)value/DISP_SUBPIXEL_SCALE - truth) > threshold)
+                bad++;
+        }
+    }
+
+    return (known > 0) ? 100.0*bad/known : 0.0;
+}
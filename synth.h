@@ -0,0 +1,54 @@
+#ifndef SYNTH_H
+#define SYNTH_H
+
+/* Deterministic synthetic stereo-pairs with known disparity, for
+ * benchmarks and comparisons without image files. A scene is a slanted
+ * background plane with fronto-parallel rectangles in front of it. Layers
+ * and disparitys are whole depthmap pixels, so that blending to the
+ * depthmap resolution keeps the ground truth exact. The same pattern,
+ * size and seed give the same pair on every machine.
+ *  SYNTH_DOTS:    random black and white dots of one depthmap pixel.
+ *  SYNTH_TEXTURE: smooth value noise of two scales, more like photos.
+ *  SYNTH_BANDED:  texture with a flat grey band in the right half of the
+ *                 middle fifth of the scanlines, where blocks can't be
+ *                 matched. */
+typedef enum {SYNTH_DOTS, SYNTH_TEXTURE, SYNTH_BANDED} synthPattern;
+
+#define SYNTH_PATTERNS 3
+
+struct synthPair {
+    /* 32-bit stereo-images of width x height */
+    unsigned char *img0;
+    unsigned char *img1;
+    unsigned int width;
+    unsigned int height;
+    unsigned int factor;
+    /* Disparitys of the left depthmap, (width/factor) x (height/factor) in
+     * depthmap pixels. 0 where unknown: occluded in the right image,
+     * outside it or flat. */
+    unsigned char *truth;
+};
+
+/* Accepts "dots", "texture" and "banded".
+ * Returns EXIT_SUCCESS or EXIT_FAILURE for unknown pattern. */
+int parseSynthPattern(const char *str, synthPattern *pattern);
+
+const char *synthPatternName(synthPattern pattern);
+
+/* Generates a pair of width x height (mod factor) with disparitys up to
+ * maxDisp depthmap pixels. The depthmap must be wider than 2*maxDisp and
+ * maxDisp atleast 8. Returns EXIT_SUCCESS or EXIT_FAILURE. */
+int synthGenerate(struct synthPair *pair, synthPattern pattern,
+                  unsigned int width, unsigned int height,
+                  unsigned int factor, unsigned int maxDisp, unsigned int seed);
+
+void synthFree(struct synthPair *pair);
+
+/* Percentage of known ground truth pixels whose disparity in a DISP_FIXED16
+ * depthmap of the pair is off by more than threshold pixels, unknown (0)
+ * included. Pixels closer than border to the edges are left out. */
+double synthBadPixels(const struct synthPair *pair,
+                      const unsigned short *depthmap, double threshold,
+                      unsigned int border);
+
+#endif
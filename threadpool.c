@@ -0,0 +1,96 @@
+#include <stdlib.h>
+
+#include "threadpool.h"
+
+static void *poolMain(void *data) {
+    struct poolThread *member = (struct poolThread *)data;
+    struct threadPool *pool = member->pool;
+    unsigned int seen = 0;
+    void *(*func)(void *);
+    void *args;
+
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->generation == seen && !pool->quit)
+            pthread_cond_wait(&pool->start, &pool->lock);
+        if (pool->quit)
+            break;
+        seen = pool->generation;
+        func = pool->func;
+        args = pool->args + member->index*pool->argSize;
+        pthread_mutex_unlock(&pool->lock);
+
+        func(args);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->running--;
+        if (pool->running == 0)
+            pthread_cond_signal(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+int threadPoolInit(struct threadPool *pool, int threadsN) {
+    int i;
+
+    if (threadsN < 1 || threadsN > MAXTHREADS)
+        return EXIT_FAILURE;
+
+    pool->threadsN = 1;
+    pool->generation = 0;
+    pool->running = 0;
+    pool->quit = 0;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->start, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (i=1; i < threadsN; i++) {
+        pool->members[i].pool = pool;
+        pool->members[i].index = i;
+        if (pthread_create(&pool->threads[i], NULL, poolMain, &pool->members[i]) != 0) {
+            threadPoolDestroy(pool);
+            return EXIT_FAILURE;
+        }
+        pool->threadsN++;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+void threadPoolDestroy(struct threadPool *pool) {
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (i=1; i < pool->threadsN; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->done);
+}
+
+void threadPoolRun(struct threadPool *pool, void *(*func)(void *),
+                   void *args, size_t argSize) {
+
+    pthread_mutex_lock(&pool->lock);
+    pool->func = func;
+    pool->args = (char *)args;
+    pool->argSize = argSize;
+    pool->running = pool->threadsN-1;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+
+    func(args);
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->running > 0)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
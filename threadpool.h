@@ -0,0 +1,45 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <pthread.h>
+
+#define MAXTHREADS 32
+
+struct threadPool;
+
+/* One of the pool's threads, knows its index for threadPoolRun. */
+struct poolThread {
+    struct threadPool *pool;
+    int index;
+};
+
+/* Threads kept alive between depthmaps. Work is run on all of them at once,
+ * calling thread included, like a pthread_create/pthread_join pair would. */
+struct threadPool {
+    int threadsN;
+    pthread_t threads[MAXTHREADS];
+    struct poolThread members[MAXTHREADS];
+
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    pthread_cond_t done;
+    void *(*func)(void *);
+    char *args;
+    size_t argSize;
+    unsigned int generation;
+    int running;
+    int quit;
+};
+
+/* threadsN counts the calling thread, threadsN-1 threads are started.
+ * Returns EXIT_SUCCESS or EXIT_FAILURE. */
+int threadPoolInit(struct threadPool *pool, int threadsN);
+
+void threadPoolDestroy(struct threadPool *pool);
+
+/* Calls func(args + i*argSize) in thread i, calling thread being 0, and
+ * returns when all have returned. With argSize 0 every thread gets args. */
+void threadPoolRun(struct threadPool *pool, void *(*func)(void *),
+                   void *args, size_t argSize);
+
+#endif
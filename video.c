@@ -0,0 +1,444 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "video.h"
+#include "batch.h"
+#include "queue.h"
+#include "doubleTime.h"
+
+/* Frames waiting between two stages */
+#define VIDEO_QUEUE_DEPTH 2
+
+/* One stereo frame travelling through the stages */
+struct videoFrame {
+    int index;
+    struct stereoPair *pair;
+    struct depthmapFrame *work;
+    double start;
+};
+
+/* Where frames come from */
+struct videoSource {
+    /* Patterns of numbered files, or a raw stream */
+    char *left;
+    char *right;
+    FILE *raw;
+    unsigned int w;
+    unsigned int h;
+    int next;
+};
+
+/* Bookkeeping for one pipeline stage */
+struct videoStage {
+    struct queue *in;
+    struct queue *out;
+    int (*run)(struct videoStage *stage, struct videoFrame *frame);
+    struct depthmap *dm;
+    struct videoSource *source;
+    const char *outPattern;
+    outputFormat format;
+    unsigned int factor;
+
+    double busy;
+    int done;
+    int failed;
+    /* Frames matched without the half-resolution pass */
+    int temporal;
+
+    /* Latencies of saved frames (ms), only the last stage */
+    double *latencies;
+    int allocated;
+};
+
+static void freeFrame(struct videoFrame *frame) {
+    depthmapFrameFree(frame->work);
+    freePair(frame->pair);
+    free(frame);
+}
+
+/* Splits "<left>,<right>" or opens "raw:<w>x<h>:<file>".
+ * Returns EXIT_SUCCESS or EXIT_FAILURE. */
+static int openSource(struct videoSource *src, const char *spec) {
+    const char *comma, *name;
+    struct stat st;
+    char *first;
+    int n;
+
+    memset(src, 0, sizeof(struct videoSource));
+
+    if (strncmp(spec, "raw:", 4) == 0) {
+        if (sscanf(spec+4, "%ux%u:%n", &src->w, &src->h, &n) != 2
+                || src->w == 0 || src->h == 0 || spec[4+n] == '\0') {
+            fprintf(stderr, "Expected raw:<w>x<h>:<file>!\n");
+            return EXIT_FAILURE;
+        }
+        name = spec+4+n;
+        if (strcmp(name, "-") == 0)
+            src->raw = stdin;
+        else
+            src->raw = fopen(name, "rb");
+        if (src->raw == NULL) {
+            perror("Couldn't open the frame stream");
+            return EXIT_FAILURE;
+        }
+        return EXIT_SUCCESS;
+    }
+
+    comma = strchr(spec, ',');
+    if (comma == NULL || strchr(spec, '%') == NULL) {
+        fprintf(stderr, "Expected <left pattern>,<right pattern> or raw:<w>x<h>:<file>!\n");
+        return EXIT_FAILURE;
+    }
+    src->left = strndup(spec, comma-spec);
+    src->right = strdup(comma+1);
+    if (src->left == NULL || src->right == NULL) {
+        free(src->left);
+        free(src->right);
+        return EXIT_FAILURE;
+    }
+
+    /* Numbering starts from 0 or 1 */
+    first = malloc(strlen(src->left)+32);
+    if (first == NULL) {
+        free(src->left);
+        free(src->right);
+        return EXIT_FAILURE;
+    }
+    sprintf(first, src->left, 0);
+    src->next = (stat(first, &st) == 0) ? 0 : 1;
+    free(first);
+
+    return EXIT_SUCCESS;
+}
+
+static void closeSource(struct videoSource *src) {
+    if (src->raw != NULL && src->raw != stdin)
+        fclose(src->raw);
+    free(src->left);
+    free(src->right);
+}
+
+/* Next frame of the source, decoded. Returns NULL at the end and on errors,
+ * error is set to EXIT_FAILURE for the latter. */
+static struct videoFrame *readFrame(struct videoSource *src, int *error) {
+    struct videoFrame *frame;
+    struct stereoPair *pair;
+    struct stat st;
+    size_t size, got;
+
+    (*error) = EXIT_SUCCESS;
+
+    frame = calloc(1, sizeof(struct videoFrame));
+    pair = calloc(1, sizeof(struct stereoPair));
+    if (frame == NULL || pair == NULL) {
+        free(frame);
+        free(pair);
+        (*error) = EXIT_FAILURE;
+        return NULL;
+    }
+    frame->pair = pair;
+    frame->index = src->next++;
+    frame->start = doubleTime();
+
+    if (src->raw != NULL) {
+        size = (size_t)src->w*src->h*4;
+        pair->img0 = malloc(size);
+        pair->img1 = malloc(size);
+        if (pair->img0 == NULL || pair->img1 == NULL) {
+            (*error) = EXIT_FAILURE;
+            freeFrame(frame);
+            return NULL;
+        }
+        got = fread(pair->img0, 1, size, src->raw);
+        /* Stream may only end between frames */
+        if (got == 0 && feof(src->raw)) {
+            freeFrame(frame);
+            return NULL;
+        }
+        if (got != size || fread(pair->img1, 1, size, src->raw) != size) {
+            fprintf(stderr, "Frame %d of the stream is incomplete!\n", frame->index);
+            (*error) = EXIT_FAILURE;
+            freeFrame(frame);
+            return NULL;
+        }
+        pair->w = src->w;
+        pair->h = src->h;
+        return frame;
+    }
+
+    pair->name0 = malloc(strlen(src->left)+32);
+    pair->name1 = malloc(strlen(src->right)+32);
+    if (pair->name0 == NULL || pair->name1 == NULL) {
+        (*error) = EXIT_FAILURE;
+        freeFrame(frame);
+        return NULL;
+    }
+    sprintf(pair->name0, src->left, frame->index);
+    sprintf(pair->name1, src->right, frame->index);
+    /* First missing frame ends the sequence */
+    if (stat(pair->name0, &st) != 0) {
+        freeFrame(frame);
+        return NULL;
+    }
+    if (loadPair(pair) == EXIT_FAILURE) {
+        (*error) = EXIT_FAILURE;
+        freeFrame(frame);
+        return NULL;
+    }
+
+    return frame;
+}
+
+/* Stage 1: decode frames in order. A frame failing to decode ends the
+ * sequence, because later ones could not be told apart from missing. */
+void *decodeStage(void *data) {
+    struct videoStage *stage = (struct videoStage *)data;
+    struct videoFrame *frame;
+    double time1;
+    int error;
+
+    while (1) {
+        time1 = doubleTime();
+        frame = readFrame(stage->source, &error);
+        stage->busy += doubleTime()-time1;
+        if (frame == NULL) {
+            if (error == EXIT_FAILURE)
+                stage->failed++;
+            break;
+        }
+        stage->done++;
+        queuePush(stage->out, frame);
+    }
+    queueClose(stage->out);
+
+    return NULL;
+}
+
+/* Stage 2: greyscale pyramids. */
+static int pyramidFrame(struct videoStage *stage, struct videoFrame *frame) {
+    frame->work = depthmapPrepare(stage->dm, frame->pair->img0, frame->pair->img1,
+                                  frame->pair->w, frame->pair->h);
+    return (frame->work != NULL) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Stage 3: matching on the instance's threads. */
+static int matchFrame(struct videoStage *stage, struct videoFrame *frame) {
+    int error;
+
+    error = depthmapMatch(stage->dm, frame->work);
+    /* Input images are not needed anymore */
+    free(frame->pair->img0);
+    free(frame->pair->img1);
+    frame->pair->img0 = NULL;
+    frame->pair->img1 = NULL;
+
+    return error;
+}
+
+/* Stage 4: post-processing. */
+static int postFrame(struct videoStage *stage, struct videoFrame *frame) {
+    frame->pair->depthmap = depthmapFinish(stage->dm, frame->work);
+    frame->work = NULL;
+    if (frame->pair->depthmap != NULL)
+        stage->temporal += depthmapTimings(stage->dm)->temporal;
+    frame->pair->dw = frame->pair->w/stage->factor;
+    frame->pair->dh = frame->pair->h/stage->factor;
+
+    return (frame->pair->depthmap != NULL) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/* Stage 5: encoding, records latency from start of decoding. */
+static int encodeFrame(struct videoStage *stage, struct videoFrame *frame) {
+    char *name;
+    double *grown;
+    int error;
+
+    if (strcmp(stage->outPattern, "-") == 0) {
+        error = writeDepthmap("-", frame->pair->depthmap, frame->pair->dw,
+                              frame->pair->dh, stage->format);
+    }
+    else {
+        name = malloc(strlen(stage->outPattern)+32);
+        if (name == NULL)
+            return EXIT_FAILURE;
+        sprintf(name, stage->outPattern, frame->index);
+        error = writeDepthmap(name, frame->pair->depthmap, frame->pair->dw,
+                              frame->pair->dh, stage->format);
+        free(name);
+    }
+    if (error == EXIT_FAILURE)
+        return EXIT_FAILURE;
+
+    if (stage->done == stage->allocated) {
+        stage->allocated = stage->allocated ? stage->allocated*2 : 64;
+        grown = realloc(stage->latencies, sizeof(double)*stage->allocated);
+        if (grown == NULL)
+            return EXIT_FAILURE;
+        stage->latencies = grown;
+    }
+    stage->latencies[stage->done] = (doubleTime()-frame->start)*1000;
+
+    return EXIT_SUCCESS;
+}
+
+/* Runs stage->run for every frame of in, passing successful ones to out.
+ * The last stage has no out and frees its frames. */
+void *stageLoop(void *data) {
+    struct videoStage *stage = (struct videoStage *)data;
+    struct videoFrame *frame;
+    double time1;
+
+    while ((frame = queuePop(stage->in)) != NULL) {
+        time1 = doubleTime();
+        if (stage->run(stage, frame) == EXIT_FAILURE) {
+            fprintf(stderr, "Frame %d failed!\n", frame->index);
+            stage->failed++;
+            freeFrame(frame);
+        }
+        else {
+            stage->done++;
+            if (stage->out != NULL)
+                queuePush(stage->out, frame);
+            else
+                freeFrame(frame);
+        }
+        stage->busy += doubleTime()-time1;
+    }
+    if (stage->out != NULL)
+        queueClose(stage->out);
+
+    return NULL;
+}
+
+static int compareDoubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Nearest-rank percentile p (0-100] of n sorted values. */
+static double percentile(const double *sorted, int n, double p) {
+    int rank;
+
+    rank = (int)(p/100.0*n + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    if (rank > n)
+        rank = n;
+    return sorted[rank-1];
+}
+
+int runVideo(const char *source, const char *outPattern, outputFormat format,
+             const struct depthmapConfig *conf) {
+    const char *names[] = {"Decode", "Pyramid", "Match", "Post-process", "Encode"};
+    struct videoSource src;
+    struct depthmapConfig pipelined;
+    struct queue queues[4];
+    struct videoStage stages[5];
+    pthread_t threads[5];
+    char defaultPattern[32];
+    double time1, time2, wall;
+    int i, failed, frames;
+
+    if (outPattern == NULL) {
+        snprintf(defaultPattern, sizeof(defaultPattern), "depth_%%05d%s",
+                 outputExtension(format));
+        outPattern = defaultPattern;
+    }
+    else if (strcmp(outPattern, "-") != 0 && strchr(outPattern, '%') == NULL) {
+        fprintf(stderr, "Video output needs a pattern with the frame number (%%d)!\n");
+        return EXIT_FAILURE;
+    }
+
+    if (openSource(&src, source) == EXIT_FAILURE)
+        return EXIT_FAILURE;
+
+    /* Stage prints of concurrent frames would interleave */
+    pipelined = (*conf);
+    pipelined.format = outputDispFormat(format);
+    pipelined.verbose = 0;
+
+    memset(stages, 0, sizeof(stages));
+    stages[0].dm = depthmapCreate(&pipelined);
+    if (stages[0].dm == NULL) {
+        closeSource(&src);
+        return EXIT_FAILURE;
+    }
+    for (i = 0; i < 4; i++) {
+        if (queueInit(&queues[i], VIDEO_QUEUE_DEPTH) == EXIT_FAILURE) {
+            fprintf(stderr, "Memory allocation failed!\n");
+            while (i-- > 0)
+                queueDestroy(&queues[i]);
+            depthmapDestroy(stages[0].dm);
+            closeSource(&src);
+            return EXIT_FAILURE;
+        }
+    }
+    for (i = 0; i < 5; i++) {
+        stages[i].dm = stages[0].dm;
+        stages[i].in = (i > 0) ? &queues[i-1] : NULL;
+        stages[i].out = (i < 4) ? &queues[i] : NULL;
+        stages[i].source = &src;
+        stages[i].outPattern = outPattern;
+        stages[i].format = format;
+        stages[i].factor = conf->factor;
+    }
+    stages[1].run = pyramidFrame;
+    stages[2].run = matchFrame;
+    stages[3].run = postFrame;
+    stages[4].run = encodeFrame;
+
+    time1 = doubleTime();
+
+    pthread_create(&threads[0], NULL, decodeStage, &stages[0]);
+    pthread_create(&threads[1], NULL, stageLoop, &stages[1]);
+    pthread_create(&threads[3], NULL, stageLoop, &stages[3]);
+    pthread_create(&threads[4], NULL, stageLoop, &stages[4]);
+    /* Matching in the calling thread, like in batch mode */
+    stageLoop(&stages[2]);
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+    pthread_join(threads[3], NULL);
+    pthread_join(threads[4], NULL);
+
+    time2 = doubleTime();
+    wall = time2-time1;
+
+    depthmapDestroy(stages[0].dm);
+    for (i = 0; i < 4; i++)
+        queueDestroy(&queues[i]);
+    closeSource(&src);
+
+    failed = 0;
+    for (i = 0; i < 5; i++)
+        failed += stages[i].failed;
+    frames = stages[4].done;
+
+    printf("\nVideo: %d frames in %.3lf seconds, %.2lf fps.\n", frames, wall,
+           frames/wall);
+    if (frames > 0) {
+        qsort(stages[4].latencies, frames, sizeof(double), compareDoubles);
+        printf(" Latency p50:                   %6.1lf ms\n",
+               percentile(stages[4].latencies, frames, 50.0));
+        printf(" Latency p90:                   %6.1lf ms\n",
+               percentile(stages[4].latencies, frames, 90.0));
+        printf(" Latency p99:                   %6.1lf ms\n",
+               percentile(stages[4].latencies, frames, 99.0));
+        printf(" Latency max:                   %6.1lf ms\n",
+               stages[4].latencies[frames-1]);
+    }
+    if (conf->temporal > 0 && stages[3].done > 0)
+        printf(" Coarse pass skipped:           %5.1lf %% of frames\n",
+               100.0*stages[3].temporal/stages[3].done);
+    for (i = 0; i < 5; i++)
+        printf(" %-13s occupancy:        %5.1lf %%\n", names[i],
+               100.0*stages[i].busy/wall);
+    free(stages[4].latencies);
+    if (failed > 0)
+        fprintf(stderr, "%d frames failed.\n", failed);
+
+    return (failed > 0 || frames == 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,21 @@
+#ifndef VIDEO_H
+#define VIDEO_H
+
+#include "libdepthmap.h"
+#include "output.h"
+
+/* Processes consecutive stereo frames of source, which is either
+ * "<left>,<right>" printf-patterns of numbered png files (e.g.
+ * left_%05d.png,right_%05d.png, numbering starts from 0 or 1 and ends at the
+ * first missing frame) or "raw:<w>x<h>:<file>", a stream of 32-bit frames,
+ * left one before right one, "-" reading standard input.
+ * Depthmaps are saved with outPattern and the frame number, "-" writes them
+ * one after another to standard output.
+ * Decoding, pyramid building, matching, post-processing and encoding run as
+ * pipeline stages connected by bounded queues, with an instance of conf.
+ * Sustained fps and latency percentiles are printed at the end.
+ * Returns EXIT_FAILURE if any of the frames failed. */
+int runVideo(const char *source, const char *outPattern, outputFormat format,
+             const struct depthmapConfig *conf);
+
+#endif